@@ -41,6 +41,7 @@
 #include "mevent.h"
 #include "irq.h"
 #include "lpc.h"
+#include "snapshot.h"
 
 static pthread_mutex_t pm_lock = PTHREAD_MUTEX_INITIALIZER;
 static struct mevent *power_button;
@@ -324,3 +325,21 @@ sci_init(struct vmctx *ctx)
 	 */
 	pci_irq_use(SCI_INT);
 }
+
+/*
+ * Save or restore the PM1 event and control registers. The SCI level is
+ * recomputed from them on restore.
+ */
+int
+pm_snapshot(struct vmctx *ctx, struct snapshot_meta *meta)
+{
+	pthread_mutex_lock(&pm_lock);
+	SNAPSHOT_VAR(meta, pm1_enable);
+	SNAPSHOT_VAR(meta, pm1_status);
+	SNAPSHOT_VAR(meta, pm1_control);
+	if (meta->op == SNAPSHOT_RESTORE && !meta->error)
+		sci_update(ctx);
+	pthread_mutex_unlock(&pm_lock);
+
+	return meta->error ? -1 : 0;
+}
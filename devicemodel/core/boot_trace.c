@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "boot_trace.h"
+
+#define BOOT_TRACE_MAX		256
+#define BOOT_TRACE_NAMESZ	64
+
+struct boot_trace_span {
+	char name[BOOT_TRACE_NAMESZ];
+	uint64_t start;		/* ns since boot_trace_init() */
+	uint64_t end;		/* 0 while open */
+	int depth;
+	int tid;
+};
+
+static struct {
+	bool enabled;
+	char *path;		/* JSON report */
+	struct timespec t0;
+	uint64_t exec_ns;	/* process start to boot_trace_init() */
+	struct boot_trace_span spans[BOOT_TRACE_MAX];
+	int nr_spans;
+	bool dumped;
+	pthread_mutex_t mtx;
+} trace = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* nesting level of the calling thread */
+static __thread int trace_depth;
+
+static uint64_t
+boot_trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - trace.t0.tv_sec) * 1000000000ULL +
+		ts.tv_nsec - trace.t0.tv_nsec;
+}
+
+/*
+ * Time the process ran before main(): from its start time in
+ * /proc/self/stat, in clock ticks since host boot, to now.
+ */
+static uint64_t
+boot_trace_exec_time(void)
+{
+	unsigned long long start;
+	struct timespec now;
+	char buf[1024], *p;
+	long hz = sysconf(_SC_CLK_TCK);
+	FILE *f;
+	int i;
+
+	f = fopen("/proc/self/stat", "r");
+	if (!f)
+		return 0;
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (!p || hz <= 0)
+		return 0;
+
+	/* starttime is field 22, the comm field 2 may contain spaces */
+	p = strrchr(buf, ')');
+	for (i = 2; p && i < 22; i++)
+		p = strchr(p + 1, ' ');
+	if (!p || sscanf(p, "%llu", &start) != 1)
+		return 0;
+
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	start = start * 1000000000ULL / hz;
+	if ((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec < start)
+		return 0;
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec - start;
+}
+
+/*
+ * --boot_trace <file>
+ */
+int
+boot_trace_parse(const char *path)
+{
+	free(trace.path);
+	trace.path = strdup(path);
+	if (!trace.path)
+		return -1;
+
+	trace.enabled = true;
+	return 0;
+}
+
+void
+boot_trace_init(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &trace.t0);
+	if (trace.enabled)
+		trace.exec_ns = boot_trace_exec_time();
+}
+
+int
+boot_trace_begin(const char *fmt, ...)
+{
+	struct boot_trace_span *span;
+	va_list args;
+	int id;
+
+	if (!trace.enabled || trace.dumped)
+		return -1;
+
+	pthread_mutex_lock(&trace.mtx);
+	if (trace.nr_spans == BOOT_TRACE_MAX) {
+		pthread_mutex_unlock(&trace.mtx);
+		return -1;
+	}
+	id = trace.nr_spans++;
+	span = &trace.spans[id];
+
+	va_start(args, fmt);
+	vsnprintf(span->name, sizeof(span->name), fmt, args);
+	va_end(args);
+	span->depth = trace_depth++;
+	span->tid = syscall(SYS_gettid);
+	span->start = boot_trace_now();
+	pthread_mutex_unlock(&trace.mtx);
+
+	return id;
+}
+
+void
+boot_trace_end(int id)
+{
+	if (id < 0)
+		return;
+
+	pthread_mutex_lock(&trace.mtx);
+	trace.spans[id].end = boot_trace_now();
+	trace_depth--;
+	pthread_mutex_unlock(&trace.mtx);
+}
+
+static void
+boot_trace_json_str(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', f);
+		if ((unsigned char)*s >= 0x20)
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/*
+ * Called once the first vCPU runs: print the timeline and write it as
+ * JSON to the --boot_trace file. Later spans are not recorded.
+ */
+void
+boot_trace_dump(const char *vmname)
+{
+	struct boot_trace_span *span;
+	uint64_t total, dur;
+	FILE *f;
+	int i;
+
+	if (!trace.enabled || trace.dumped)
+		return;
+
+	pthread_mutex_lock(&trace.mtx);
+	trace.dumped = true;
+	total = boot_trace_now();
+
+	printf("boot trace: %s ready in %lu us (%lu us before main)\n",
+		vmname, total / 1000, trace.exec_ns / 1000);
+	printf("boot trace: %10s %10s  %s\n", "start us", "us", "phase");
+	for (i = 0; i < trace.nr_spans; i++) {
+		span = &trace.spans[i];
+		dur = (span->end ? span->end : total) - span->start;
+		printf("boot trace: %10lu %10lu  %*s%s\n", span->start / 1000,
+			dur / 1000, 2 * span->depth, "", span->name);
+	}
+
+	f = fopen(trace.path, "w");
+	if (!f) {
+		perror(trace.path);
+		pthread_mutex_unlock(&trace.mtx);
+		return;
+	}
+
+	fprintf(f, "{\n  \"vm\": ");
+	boot_trace_json_str(f, vmname);
+	fprintf(f, ",\n  \"pre_main_us\": %lu,\n  \"total_us\": %lu,\n"
+		"  \"spans\": [", trace.exec_ns / 1000, total / 1000);
+	for (i = 0; i < trace.nr_spans; i++) {
+		span = &trace.spans[i];
+		dur = (span->end ? span->end : total) - span->start;
+		fprintf(f, "%s\n    { \"name\": ", i ? "," : "");
+		boot_trace_json_str(f, span->name);
+		fprintf(f, ", \"start_us\": %lu, \"dur_us\": %lu, "
+			"\"depth\": %d, \"tid\": %d }", span->start / 1000,
+			dur / 1000, span->depth, span->tid);
+	}
+	fprintf(f, "\n  ]\n}\n");
+	fclose(f);
+	pthread_mutex_unlock(&trace.mtx);
+}
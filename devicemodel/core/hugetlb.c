@@ -34,8 +34,12 @@
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "vmmapi.h"
 
@@ -53,6 +57,13 @@
 #define PATH_HUGETLB_LV2 "/run/hugepage/acrn/huge_lv2/"
 #define OPT_HUGETLB_LV2 "pagesize=1G"
 
+/*
+ * Regions shared between VMs live on their own mount: every acrn-dm
+ * mounts a fresh instance over the paths above, so peers would not see
+ * each other's files there. This one is mounted once and left mounted.
+ */
+#define PATH_HUGETLB_SHM "/run/hugepage/acrn/shm/"
+
 #define SYS_PATH_LV1  "/sys/kernel/mm/hugepages/hugepages-2048kB/"
 #define SYS_PATH_LV2  "/sys/kernel/mm/hugepages/hugepages-1048576kB/"
 #define SYS_NR_HUGEPAGES  "nr_hugepages"
@@ -120,6 +131,52 @@ static void *ptr;
 static size_t total_size;
 static int hugetlb_lv_max;
 
+/*
+ * Pre-faulting: the hugetlbfs mappings are touched by a pool of threads,
+ * one chunk at a time, so that page allocation and zeroing is done before
+ * the guest starts. If NUMA nodes are set, either explicitly or from the
+ * pCPUs the vCPUs are pinned to, guest memory is split evenly among them
+ * in gpa order and each chunk prefers its node before it is touched.
+ */
+#define PREFAULT_CHUNK		(256 * MB)
+#define PREFAULT_MAX_THREADS	64
+#define PREFAULT_MAX_NODES	64
+
+struct prefault_region {
+	char *addr;
+	size_t len;
+	size_t pg_size;
+};
+
+static struct {
+	int threads;
+	int nr_nodes;
+	int nodes[PREFAULT_MAX_NODES];
+	bool explicit_node;
+
+	struct prefault_region regions[2 * HUGETLB_LV_MAX];
+	int nr_regions;
+	size_t total;		/* bytes in all regions */
+	size_t next;		/* next offset to hand out, across regions */
+	bool mbind_failed;
+	pthread_mutex_t mtx;
+} prefault = {
+	.threads = 1,
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Memory given back by the guest (see virtio_balloon.c) is released in
+ * blocks of the smallest huge page size: the block is removed from the
+ * EPT, which drops the VHM pin, and punched out of hugetlbfs. It is
+ * mapped again with a fresh page by hugetlb_populate() when the balloon
+ * deflates. Nothing faults a released block back in: neither guest
+ * accesses, which trap as MMIO, nor passthrough DMA or VBS-K backends may
+ * touch it before that.
+ */
+static uint64_t *released;	/* bitmap of released HUGETLB_LV1 pages */
+static pthread_mutex_t released_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 static int open_hugetlbfs(struct vmctx *ctx, int level)
 {
 	char uuid_str[48];
@@ -234,19 +291,190 @@ static int mmap_hugetlbfs(struct vmctx *ctx, int level, size_t len,
 
 	printf("mmap 0x%lx@%p\n", len, addr);
 
-	/* pre-allocate hugepages by touch them */
+	/* hugepages are pre-allocated by hugetlb_prefault() */
 	pagesz = hugetlb_priv[level].pg_size;
+	if (len > 0) {
+		i = prefault.nr_regions++;
+		prefault.regions[i].addr = addr;
+		prefault.regions[i].len = len;
+		prefault.regions[i].pg_size = pagesz;
+		prefault.total += len;
+	}
 
-	printf("touch %ld pages with pagesz 0x%lx\n", len/pagesz, pagesz);
+	return 0;
+}
 
-	for (i = 0; i < len/pagesz; i++) {
-		*(volatile char *)addr = *addr;
-		addr += pagesz;
+/* NUMA node of a host cpu, -1 if unknown */
+static int cpu_to_node(int cpu)
+{
+	char path[MAX_PATH_LEN];
+	struct dirent *entry;
+	DIR *dir;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((entry = readdir(dir))) {
+		if (sscanf(entry->d_name, "node%d", &node) == 1)
+			break;
+		node = -1;
+	}
+	closedir(dir);
+
+	return node;
+}
+
+static void prefault_add_node(int node)
+{
+	int i;
+
+	if (node < 0 || node >= PREFAULT_MAX_NODES)
+		return;
+
+	for (i = 0; i < prefault.nr_nodes; i++) {
+		if (prefault.nodes[i] == node)
+			return;
+	}
+	prefault.nodes[prefault.nr_nodes++] = node;
+}
+
+/*
+ * --prefault <threads>[,node=<n>]
+ */
+int hugetlb_parse_prefault(const char *opt)
+{
+	int threads, node;
+	const char *cp;
+
+	if (sscanf(opt, "%d", &threads) != 1 ||
+	    threads < 1 || threads > PREFAULT_MAX_THREADS) {
+		fprintf(stderr, "prefault threads should be 1 to %d\n",
+			PREFAULT_MAX_THREADS);
+		return -1;
+	}
+	prefault.threads = threads;
+
+	cp = strchr(opt, ',');
+	if (cp) {
+		if (sscanf(cp, ",node=%d", &node) != 1 ||
+		    node < 0 || node >= PREFAULT_MAX_NODES) {
+			fprintf(stderr, "invalid prefault node: %s\n", cp);
+			return -1;
+		}
+		prefault.nr_nodes = 0;
+		prefault_add_node(node);
+		prefault.explicit_node = true;
 	}
 
 	return 0;
 }
 
+/*
+ * Derive the nodes to place guest memory on from the pCPUs the vCPUs are
+ * pinned to, unless a node is given with --prefault.
+ */
+void hugetlb_set_prefault_cpus(const cpuset_t *cpus)
+{
+	int cpu;
+
+	if (prefault.explicit_node)
+		return;
+
+	prefault.nr_nodes = 0;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, cpus))
+			prefault_add_node(cpu_to_node(cpu));
+	}
+}
+
+/* Hand out the next chunk to touch, return false when all are done */
+static bool prefault_next_chunk(char **addr, size_t *len, size_t *pg_size,
+		int *node)
+{
+	struct prefault_region *r;
+	size_t off, base, chunk;
+
+	pthread_mutex_lock(&prefault.mtx);
+	off = prefault.next;
+	if (off >= prefault.total) {
+		pthread_mutex_unlock(&prefault.mtx);
+		return false;
+	}
+
+	base = 0;
+	r = &prefault.regions[0];
+	while (off >= base + r->len) {
+		base += r->len;
+		r++;
+	}
+
+	/* chunks never cross a region, so they stay page aligned */
+	chunk = PREFAULT_CHUNK > r->pg_size ? PREFAULT_CHUNK : r->pg_size;
+	if (chunk > base + r->len - off)
+		chunk = base + r->len - off;
+
+	*addr = r->addr + (off - base);
+	*len = chunk;
+	*pg_size = r->pg_size;
+	*node = prefault.nr_nodes ?
+		prefault.nodes[off / ((prefault.total + prefault.nr_nodes - 1) /
+			prefault.nr_nodes)] : -1;
+	prefault.next = off + chunk;
+	pthread_mutex_unlock(&prefault.mtx);
+
+	return true;
+}
+
+static void *prefault_thread(void *arg)
+{
+	unsigned long mask;
+	size_t len, pg_size, i;
+	char *addr;
+	int node;
+
+	while (prefault_next_chunk(&addr, &len, &pg_size, &node)) {
+		if (node >= 0) {
+			mask = 1UL << node;
+			if (syscall(__NR_mbind, addr, len, MPOL_PREFERRED,
+					&mask, PREFAULT_MAX_NODES + 1, 0) &&
+					!prefault.mbind_failed) {
+				prefault.mbind_failed = true;
+				perror("mbind guest memory");
+			}
+		}
+
+		for (i = 0; i < len; i += pg_size)
+			*(volatile char *)(addr + i) = *(addr + i);
+	}
+
+	return NULL;
+}
+
+/* pre-allocate hugepages by touching them */
+static void hugetlb_prefault(void)
+{
+	pthread_t tids[PREFAULT_MAX_THREADS];
+	int i, n;
+
+	printf("prefault 0x%lx with %d threads on %d nodes\n",
+		prefault.total, prefault.threads, prefault.nr_nodes);
+
+	for (n = 0; n < prefault.threads - 1; n++) {
+		if (pthread_create(&tids[n], NULL, prefault_thread, NULL))
+			break;
+		pthread_setname_np(tids[n], "prefault");
+	}
+
+	/* the caller takes its share, and all of it if threads are out */
+	prefault_thread(NULL);
+
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+}
+
 static int mmap_hugetlbfs_lowmem(struct vmctx *ctx)
 {
 	size_t len, offset, skip;
@@ -302,6 +530,225 @@ static int mmap_hugetlbfs_highmem(struct vmctx *ctx)
 	return 0;
 }
 
+/*
+ * HUGETLB_LV1 pages back the top of lowmem and of highmem, see
+ * mmap_hugetlbfs_lowmem(). Find the index of the first one of
+ * [gpa, gpa + len) if the whole range is backed by them.
+ */
+static bool hugetlb_lv1_index(struct vmctx *ctx, uint64_t gpa, size_t len,
+		size_t *idx)
+{
+	size_t pg_size = hugetlb_priv[HUGETLB_LV1].pg_size;
+	size_t low = hugetlb_priv[HUGETLB_LV1].lowmem;
+	size_t high = hugetlb_priv[HUGETLB_LV1].highmem;
+	uint64_t start;
+
+	if (((gpa | len) & (pg_size - 1)) || len == 0)
+		return false;
+
+	start = ctx->lowmem - low;
+	if (gpa >= start && gpa + len <= ctx->lowmem) {
+		*idx = (gpa - start) / pg_size;
+		return true;
+	}
+
+	start = 4 * GB + ctx->highmem - high;
+	if (high > 0 && gpa >= start && gpa + len <= 4 * GB + ctx->highmem) {
+		*idx = (low + gpa - start) / pg_size;
+		return true;
+	}
+
+	return false;
+}
+
+size_t hugetlb_page_size(void)
+{
+	return released ? hugetlb_priv[HUGETLB_LV1].pg_size : 0;
+}
+
+/*
+ * Release [gpa, gpa + len), aligned to hugetlb_page_size(). Fails if the
+ * range is not entirely backed by pages of that size.
+ */
+int hugetlb_release(struct vmctx *ctx, uint64_t gpa, size_t len)
+{
+	size_t pg_size = hugetlb_priv[HUGETLB_LV1].pg_size;
+	size_t idx, off;
+	uint64_t bit;
+	int ret = 0;
+
+	if (!released || !hugetlb_lv1_index(ctx, gpa, len, &idx))
+		return -1;
+
+	pthread_mutex_lock(&released_mtx);
+	for (off = 0; off < len; off += pg_size, idx++) {
+		bit = 1UL << (idx % 64);
+		if (released[idx / 64] & bit)
+			continue;
+
+		if (vm_unmap_memseg(ctx, pg_size, gpa + off) < 0) {
+			perror("hugetlb: unmap released memory");
+			ret = -1;
+			break;
+		}
+		if (madvise(ctx->baseaddr + gpa + off, pg_size,
+				MADV_REMOVE) < 0)
+			perror("hugetlb: punch released memory");
+		/* the page reads as zero from now on */
+		vm_snapshot_mark(ctx, gpa + off, pg_size);
+		released[idx / 64] |= bit;
+	}
+	pthread_mutex_unlock(&released_mtx);
+
+	return ret;
+}
+
+/*
+ * Map back the released pages overlapping [gpa, gpa + len). Returns the
+ * number of pages mapped, or -1 on error.
+ */
+int hugetlb_populate(struct vmctx *ctx, uint64_t gpa, size_t len)
+{
+	size_t pg_size = hugetlb_priv[HUGETLB_LV1].pg_size;
+	uint64_t end, bit;
+	size_t idx;
+	int n = 0;
+
+	if (!released || len == 0)
+		return 0;
+
+	end = ALIGN_UP(gpa + len, pg_size);
+	gpa = ALIGN_DOWN(gpa, pg_size);
+
+	pthread_mutex_lock(&released_mtx);
+	for (; gpa < end; gpa += pg_size) {
+		if (!hugetlb_lv1_index(ctx, gpa, pg_size, &idx))
+			continue;
+
+		bit = 1UL << (idx % 64);
+		if (!(released[idx / 64] & bit))
+			continue;
+
+		if (vm_map_memseg_vma(ctx, pg_size, gpa,
+				(uint64_t)(ctx->baseaddr + gpa), PROT_ALL) < 0) {
+			perror("hugetlb: map released memory");
+			n = -1;
+			break;
+		}
+		released[idx / 64] &= ~bit;
+		n++;
+	}
+	pthread_mutex_unlock(&released_mtx);
+
+	return n;
+}
+
+/*
+ * Describe guest RAM as the hugetlbfs files behind it, for backends in
+ * other processes that map it themselves. Returns the number of regions,
+ * or -1 if guest RAM is not on hugetlbfs or takes more than max regions.
+ */
+int hugetlb_mem_regions(struct vmctx *ctx, struct vm_mem_region *regs,
+		int max)
+{
+	uint64_t gpa;
+	size_t len;
+	int level, n = 0;
+
+	/* a clone's private copies are not in the files */
+	if (!released || ctx->cow_bitmap)
+		return -1;
+
+	/* the layout of mmap_hugetlbfs_lowmem() and _highmem() */
+	gpa = 0;
+	for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--) {
+		len = hugetlb_priv[level].lowmem;
+		if (len == 0)
+			continue;
+		if (n == max)
+			return -1;
+		regs[n].gpa = gpa;
+		regs[n].len = len;
+		regs[n].hva = ctx->baseaddr + gpa;
+		regs[n].fd = hugetlb_priv[level].fd;
+		regs[n].offset = 0;
+		gpa += len;
+		n++;
+	}
+
+	gpa = 4 * GB;
+	for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--) {
+		len = hugetlb_priv[level].highmem;
+		if (len == 0)
+			continue;
+		if (n == max)
+			return -1;
+		regs[n].gpa = gpa;
+		regs[n].len = len;
+		regs[n].hva = ctx->baseaddr + gpa;
+		regs[n].fd = hugetlb_priv[level].fd;
+		regs[n].offset = hugetlb_priv[level].lowmem;
+		gpa += len;
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Open the 2M hugetlbfs file backing the shared region name, creating it
+ * with len bytes if no other VM did. The file outlives the VM so that
+ * peers started later find the same pages; remove it to free them.
+ */
+int hugetlb_shm_open(const char *name, size_t len)
+{
+	char path[MAX_PATH_LEN];
+	struct statfs fs;
+	struct stat st;
+	int fd;
+
+	if (mkdir(PATH_HUGETLB_SHM, 0755) < 0 && errno != EEXIST) {
+		perror(PATH_HUGETLB_SHM);
+		return -1;
+	}
+	if (statfs(PATH_HUGETLB_SHM, &fs) < 0 ||
+		(fs.f_type != HUGETLBFS_MAGIC &&
+		mount("none", PATH_HUGETLB_SHM, "hugetlbfs", 0,
+			OPT_HUGETLB_LV1) < 0)) {
+		perror("hugetlb: mount shared memory");
+		return -1;
+	}
+
+	if (snprintf(path, sizeof(path), "%s%s", PATH_HUGETLB_SHM, name)
+			>= sizeof(path)) {
+		fprintf(stderr, "hugetlb: shared memory name %s too long\n",
+			name);
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	/* the first VM sizes it, the others must agree */
+	if (fstat(fd, &st) < 0 ||
+		(st.st_size == 0 && ftruncate(fd, len) < 0)) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	if (st.st_size != 0 && st.st_size != len) {
+		fprintf(stderr, "hugetlb: %s has %ld bytes, not %lu\n",
+			path, st.st_size, len);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
 static int create_hugetlb_dirs(int level)
 {
 	char tmp_path[MAX_PATH_LEN], *path;
@@ -588,10 +1035,10 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	bool has_gap;
 
 	/* for first time DM start UOS, hugetlbfs is already mounted by
-	 * check_hugetlb_support; but for reboot, here need re-mount
-	 * it as it already be umount by hugetlb_unsetup_memory
-	 * TODO: actually, correct reboot process should not change memory
-	 * layout, the setup_memory should be removed from reboot process
+	 * check_hugetlb_support; but when the VM is recreated, here need
+	 * re-mount it as it already be umount by hugetlb_unsetup_memory.
+	 * A guest reboot normally keeps the memory set up (vm_full_reset),
+	 * this is only the fallback path.
 	 */
 	for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++)
 		mount_hugetlbfs(level);
@@ -679,6 +1126,10 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	}
 	printf("mmap ptr 0x%p -> baseaddr 0x%p\n", ptr, ctx->baseaddr);
 
+	prefault.nr_regions = 0;
+	prefault.total = 0;
+	prefault.next = 0;
+
 	/* mmap lowmem */
 	if (mmap_hugetlbfs_lowmem(ctx) < 0)
 		goto err;
@@ -687,6 +1138,8 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	if (mmap_hugetlbfs_highmem(ctx) < 0)
 		goto err;
 
+	hugetlb_prefault();
+
 	/* dump hugepage really setup */
 	printf("\nreally setup hugepage with:\n");
 	for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++) {
@@ -696,6 +1149,14 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	}
 	printf("total_size 0x%lx\n\n", total_size);
 
+	released = calloc(howmany((hugetlb_priv[HUGETLB_LV1].lowmem +
+			hugetlb_priv[HUGETLB_LV1].highmem) /
+			hugetlb_priv[HUGETLB_LV1].pg_size, 64), sizeof(uint64_t));
+	if (!released) {
+		perror("alloc released bitmap");
+		goto err;
+	}
+
 	/* map ept for lowmem*/
 	if (vm_map_memseg_vma(ctx, ctx->lowmem, 0,
 		(uint64_t)ctx->baseaddr, PROT_ALL) < 0)
@@ -711,6 +1172,8 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	return 0;
 
 err:
+	free(released);
+	released = NULL;
 	if (ptr) {
 		munmap(ptr, total_size);
 		ptr = NULL;
@@ -726,6 +1189,9 @@ void hugetlb_unsetup_memory(struct vmctx *ctx)
 {
 	int level;
 
+	free(released);
+	released = NULL;
+
 	if (total_size > 0) {
 		munmap(ptr, total_size);
 		total_size = 0;
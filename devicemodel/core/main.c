@@ -61,6 +61,8 @@
 #include "ioc.h"
 #include "pm.h"
 #include "atomic.h"
+#include "snapshot.h"
+#include "boot_trace.h"
 
 #define GUEST_NIO_PORT		0x488	/* guest upcalls via i/o port */
 
@@ -96,6 +98,9 @@ static void vm_loop(struct vmctx *ctx);
 
 static int quit_vm_loop;
 
+/* vm_loop restarts the VM with vm_reset() instead of vm_run() */
+static int vm_reset_pending;
+
 static char vhm_request_page[4096] __attribute__ ((aligned(4096)));
 
 static struct vhm_request *vhm_req_buf =
@@ -129,7 +134,11 @@ usage(int code)
 		"Usage: %s [-abehuwxACHPSTWY] [-c vcpus] [-g <gdb port>] [-l <lpc>]\n"
 		"       %*s [-m mem] [-p vcpu:hostcpu] [-s <pci>] [-U uuid] \n"
 		"       %*s [--vsbl vsbl_file_name] [--part_info part_info_name]\n"
-		"       %*s [--enable_trusty] <vm>\n"
+		"       %*s [--enable_trusty] [--snapshot file] [--restore file]\n"
+		"       %*s [--prefault threads[,node=n]] [--template file]\n"
+		"       %*s [--clone file] [--verify_images]\n"
+		"       %*s [--boot_trace file]\n"
+		"       %*s <vm>\n"
 		"       -a: local apic is in xAPIC mode (deprecated)\n"
 		"       -A: create ACPI tables\n"
 		"       -b: enable bvmcons\n"
@@ -160,8 +169,21 @@ usage(int code)
 		"       --vsbl: vsbl file path\n"
 		"       --part_info: guest partition info file path\n"
 		"       --enable_trusty: enable trusty for guest\n"
-		"       --ptdev_no_reset: disable reset check for ptdev\n",
+		"       --ptdev_no_reset: disable reset check for ptdev\n"
+		"       --snapshot: save a VM snapshot to file on guest S3\n"
+		"       --restore: resume the VM from a snapshot file through\n"
+		"                  the S3 wakeup path, requires --vsbl\n"
+		"       --template: save a template for clones on guest S3\n"
+		"       --clone: resume the VM from a template, sharing its\n"
+		"                memory copy on write\n"
+		"       --verify_images: check the kernel, ramdisk, vsbl and\n"
+		"                partition blob against <image>.sha256\n"
+		"       --boot_trace: time the startup phases, report to file\n"
+		"       --prefault: allocate guest memory with a thread pool,\n"
+		"                   on node n or the nodes of the pinned cpus\n",
 		progname, (int)strlen(progname), "", (int)strlen(progname), "",
+		(int)strlen(progname), "", (int)strlen(progname), "",
+		(int)strlen(progname), "", (int)strlen(progname), "",
 		(int)strlen(progname), "");
 
 	exit(code);
@@ -249,6 +271,14 @@ start_thread(void *param)
 	return NULL;
 }
 
+static int
+start_cpu(struct vmctx *ctx)
+{
+	CPU_SET_ATOMIC(BSP, &cpumask);
+	return pthread_create(&mt_vmm_info[BSP].mt_thr, NULL,
+	    start_thread, &mt_vmm_info[BSP]);
+}
+
 static int
 add_cpu(struct vmctx *ctx, int guest_ncpus)
 {
@@ -268,10 +298,7 @@ add_cpu(struct vmctx *ctx, int guest_ncpus)
 		mt_vmm_info[i].mt_vcpu = i;
 	}
 
-	error = pthread_create(&mt_vmm_info[0].mt_thr, NULL,
-	    start_thread, &mt_vmm_info[0]);
-
-	return error;
+	return start_cpu(ctx);
 }
 
 static int
@@ -321,7 +348,7 @@ vmexit_mmio_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 	int err;
 
 	stats.vmexit_mmio_emul++;
-	err = emulate_mem(ctx, &vhm_req->reqs.mmio_request);
+	err = emulate_mem(ctx, *pvcpu, &vhm_req->reqs.mmio_request);
 
 	if (err) {
 		if (err == -ESRCH)
@@ -339,6 +366,23 @@ vmexit_mmio_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 	}
 }
 
+/*
+ * The hypervisor does not decode writes to read only guest RAM: it
+ * restarts them once we return, so the page must be writable by then.
+ */
+static void
+vmexit_wp(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
+{
+	uint64_t gpa = vhm_req->reqs.mmio_request.address;
+
+	if (vm_clone_fault(ctx, gpa) == 0)
+		return;
+
+	fprintf(stderr, "Unhandled write to read only memory 0x%lx\n", gpa);
+	vm_set_suspend_mode(VM_SUSPEND_POWEROFF);
+	mevent_notify();
+}
+
 static void
 vmexit_pci_emul(struct vmctx *ctx, struct vhm_request *vhm_req, int *pvcpu)
 {
@@ -378,6 +422,7 @@ static vmexit_handler_t handler[VM_EXITCODE_MAX] = {
 	[VM_EXITCODE_INOUT]  = vmexit_inout,
 	[VM_EXITCODE_MMIO_EMUL] = vmexit_mmio_emul,
 	[VM_EXITCODE_PCI_CFG] = vmexit_pci_emul,
+	[VM_EXITCODE_WP] = vmexit_wp,
 };
 
 static void
@@ -416,7 +461,7 @@ handle_vmexit(struct vmctx *ctx, struct vhm_request *vhm_req, int vcpu)
 static int
 vm_init_vdevs(struct vmctx *ctx)
 {
-	int ret;
+	int ret, trace;
 
 	init_mem();
 	init_inout();
@@ -428,7 +473,9 @@ vm_init_vdevs(struct vmctx *ctx)
 	 * We don't care ioc_init return value so far.
 	 * Will add return value check once ioc is full function.
 	 */
+	trace = boot_trace_begin("ioc");
 	ret = ioc_init(ctx);
+	boot_trace_end(trace);
 
 	ret = vrtc_init(ctx);
 	if (ret < 0)
@@ -441,7 +488,9 @@ vm_init_vdevs(struct vmctx *ctx)
 	if (ret < 0)
 		goto monitor_fail;
 
+	trace = boot_trace_begin("init pci");
 	ret = init_pci(ctx);
+	boot_trace_end(trace);
 	if (ret < 0)
 		goto pci_fail;
 
@@ -505,11 +554,25 @@ vm_reset_vdevs(struct vmctx *ctx)
 	}
 }
 
+/* Complete the requests left in flight by a paused VM */
 static void
-vm_system_reset(struct vmctx *ctx)
+vm_clear_ioreq(struct vmctx *ctx)
 {
-	int vcpu_id = 0;
+	int vcpu_id;
+
+	for (vcpu_id = 0; vcpu_id < 4; vcpu_id++) {
+		struct vhm_request *vhm_req;
+
+		vhm_req = &vhm_req_buf[vcpu_id];
+		if ((atomic_load(&vhm_req->processed) == REQ_STATE_PROCESSING) &&
+			(vhm_req->client == ctx->ioreq_client))
+			vm_notify_request_done(ctx, vcpu_id);
+	}
+}
 
+static void
+vm_system_reset(struct vmctx *ctx)
+{
 	/*
 	 * If we get system reset request, we don't want to exit the
 	 * vcpu_loop/vm_loop/mevent_loop. So we do:
@@ -522,14 +585,7 @@ vm_system_reset(struct vmctx *ctx)
 	 */
 
 	vm_pause(ctx);
-	for (vcpu_id = 0; vcpu_id < 4; vcpu_id++) {
-		struct vhm_request *vhm_req;
-
-		vhm_req = &vhm_req_buf[vcpu_id];
-		if ((atomic_load(&vhm_req->processed) == REQ_STATE_PROCESSING) &&
-			(vhm_req->client == ctx->ioreq_client))
-			vm_notify_request_done(ctx, vcpu_id);
-	}
+	vm_clear_ioreq(ctx);
 
 	vm_reset_vdevs(ctx);
 
@@ -541,29 +597,23 @@ vm_system_reset(struct vmctx *ctx)
 static void
 vm_suspend_resume(struct vmctx *ctx)
 {
-	int vcpu_id = 0;
-
 	/*
 	 * If we get warm reboot request, we don't want to exit the
 	 * vcpu_loop/vm_loop/mevent_loop. So we do:
 	 *   1. pause VM
 	 *   2. notify request done to reset ioreq state in vhm
 	 *   3. stop vm watchdog
-	 *   4. wait for resume signal
-	 *   5. reset vm watchdog
-	 *   6. hypercall restart vm
+	 *   4. save a snapshot if requested
+	 *   5. wait for resume signal
+	 *   6. reset vm watchdog
+	 *   7. hypercall restart vm
 	 */
 	vm_pause(ctx);
-	for (vcpu_id = 0; vcpu_id < 4; vcpu_id++) {
-		struct vhm_request *vhm_req;
-
-		vhm_req = &vhm_req_buf[vcpu_id];
-		if ((atomic_load(&vhm_req->processed) == REQ_STATE_PROCESSING) &&
-			(vhm_req->client == ctx->ioreq_client))
-			vm_notify_request_done(ctx, vcpu_id);
-	}
+	vm_clear_ioreq(ctx);
 
 	vm_stop_watchdog(ctx);
+	if (vm_snapshot_enabled())
+		vm_snapshot_save(ctx);
 	wait_for_resume(ctx);
 
 	pm_backto_wakeup(ctx);
@@ -571,6 +621,53 @@ vm_suspend_resume(struct vmctx *ctx)
 	vm_reset(ctx);
 }
 
+/*
+ * Full reset that keeps the VM: guest memory, its hugetlbfs backing and
+ * the EPT mappings stay in place, only the devices, the firmware tables
+ * and the boot images are set up again. The BSP thread then restarts the
+ * VM through vm_reset(), which resets the vCPUs in the hypervisor, once
+ * its ioreq client is attached. Called with the VM paused and vm_loop
+ * stopped.
+ *
+ * The hypervisor's reset keeps the secure world of a trusty guest, which
+ * would then fail to initialize it again on boot: such VMs are always
+ * destroyed and created again.
+ */
+static int
+vm_full_reset(struct vmctx *ctx, int mptgen)
+{
+	int error;
+
+	if (trusty_enabled)
+		return -1;
+
+	vm_reset_vdevs(ctx);
+
+	if (mptgen) {
+		error = mptable_build(ctx, guest_ncpus);
+		if (error)
+			return error;
+	}
+
+	error = smbios_build(ctx);
+	if (error)
+		return error;
+
+	error = acrn_sw_load(ctx);
+	if (error)
+		return error;
+
+	vm_set_suspend_mode(VM_SUSPEND_NONE);
+	vm_reset_pending = 1;
+	error = start_cpu(ctx);
+	if (error) {
+		vm_reset_pending = 0;
+		vm_set_suspend_mode(VM_SUSPEND_FULL_RESET);
+	}
+
+	return error;
+}
+
 static void
 vm_loop(struct vmctx *ctx)
 {
@@ -579,8 +676,13 @@ vm_loop(struct vmctx *ctx)
 	ctx->ioreq_client = vm_create_ioreq_client(ctx);
 	assert(ctx->ioreq_client > 0);
 
-	error = vm_run(ctx);
-	assert(error == 0);
+	if (vm_reset_pending) {
+		vm_reset_pending = 0;
+		vm_reset(ctx);
+	} else {
+		error = vm_run(ctx);
+		assert(error == 0);
+	}
 
 	while (1) {
 		int vcpu_id;
@@ -653,6 +755,13 @@ enum {
 	CMD_OPT_PART_INFO,
 	CMD_OPT_TRUSTY_ENABLE,
 	CMD_OPT_PTDEV_NO_RESET,
+	CMD_OPT_SNAPSHOT,
+	CMD_OPT_RESTORE,
+	CMD_OPT_PREFAULT,
+	CMD_OPT_TEMPLATE,
+	CMD_OPT_CLONE,
+	CMD_OPT_VERIFY_IMAGES,
+	CMD_OPT_BOOT_TRACE,
 };
 
 static struct option long_options[] = {
@@ -689,6 +798,14 @@ static struct option long_options[] = {
 					CMD_OPT_TRUSTY_ENABLE},
 	{"ptdev_no_reset",	no_argument,		0,
 		CMD_OPT_PTDEV_NO_RESET},
+	{"snapshot",		required_argument,	0, CMD_OPT_SNAPSHOT},
+	{"restore",		required_argument,	0, CMD_OPT_RESTORE},
+	{"prefault",		required_argument,	0, CMD_OPT_PREFAULT},
+	{"template",		required_argument,	0, CMD_OPT_TEMPLATE},
+	{"clone",		required_argument,	0, CMD_OPT_CLONE},
+	{"verify_images",	no_argument,		0,
+		CMD_OPT_VERIFY_IMAGES},
+	{"boot_trace",		required_argument,	0, CMD_OPT_BOOT_TRACE},
 	{0,			0,			0,  0  },
 };
 
@@ -697,6 +814,8 @@ main(int argc, char *argv[])
 {
 	int c, error, gdb_port, err;
 	int max_vcpus, mptgen, memflags;
+	int i, trace;
+	cpuset_t pcpus;
 	struct vmctx *ctx;
 	size_t memsize;
 	char *optstr;
@@ -715,6 +834,8 @@ main(int argc, char *argv[])
 	if (signal(SIGINT, sig_handler_term) == SIG_ERR)
 		fprintf(stderr, "cannot register handler for SIGINT\n");
 
+	boot_trace_init();
+
 	optstr = "abehuwxACHIPSWYvk:r:B:p:g:c:s:m:l:U:G:i:";
 	while ((c = getopt_long(argc, argv, optstr, long_options,
 			&option_idx)) != -1) {
@@ -847,6 +968,51 @@ main(int argc, char *argv[])
 		case CMD_OPT_PTDEV_NO_RESET:
 			ptdev_no_reset(true);
 			break;
+		case CMD_OPT_SNAPSHOT:
+			if (acrn_parse_snapshot(optarg) != 0) {
+				errx(EX_USAGE, "invalid snapshot param %s",
+					optarg);
+				exit(1);
+			}
+			break;
+		case CMD_OPT_RESTORE:
+			if (acrn_parse_restore(optarg) != 0) {
+				errx(EX_USAGE, "invalid restore param %s",
+					optarg);
+				exit(1);
+			}
+			break;
+		case CMD_OPT_TEMPLATE:
+			if (acrn_parse_template(optarg) != 0) {
+				errx(EX_USAGE, "invalid template param %s",
+					optarg);
+				exit(1);
+			}
+			break;
+		case CMD_OPT_CLONE:
+			if (acrn_parse_clone(optarg) != 0) {
+				errx(EX_USAGE, "invalid clone param %s",
+					optarg);
+				exit(1);
+			}
+			break;
+		case CMD_OPT_VERIFY_IMAGES:
+			sw_load_verify = 1;
+			break;
+		case CMD_OPT_BOOT_TRACE:
+			if (boot_trace_parse(optarg) != 0) {
+				errx(EX_USAGE, "invalid boot_trace param %s",
+					optarg);
+				exit(1);
+			}
+			break;
+		case CMD_OPT_PREFAULT:
+			if (hugetlb_parse_prefault(optarg) != 0) {
+				errx(EX_USAGE, "invalid prefault param %s",
+					optarg);
+				exit(1);
+			}
+			break;
 		case 'h':
 			usage(0);
 		default:
@@ -859,15 +1025,34 @@ main(int argc, char *argv[])
 	if (argc != 1)
 		usage(1);
 
+	/*
+	 * A restored guest resumes through the S3 wakeup path of the vsbl
+	 * in its memory image: a bzImage guest has no such path.
+	 */
+	if (vm_restore_requested() && vsbl_file_name == NULL)
+		errx(EX_USAGE, "--restore and --clone require --vsbl");
+
+	CPU_ZERO(&pcpus);
+	for (i = 0; i < VM_MAXCPU; i++) {
+		if (vcpumap[i] != NULL)
+			CPU_OR(&pcpus, &pcpus, vcpumap[i]);
+	}
+	hugetlb_set_prefault_cpus(&pcpus);
+
+	/* options are only known now, spans start here */
+	trace = boot_trace_begin("check hugetlb");
 	if (!check_hugetlb_support()) {
 		fprintf(stderr, "check_hugetlb_support failed\n");
 		exit(1);
 	}
+	boot_trace_end(trace);
 
 	vmname = argv[0];
 
 	for (;;) {
+		trace = boot_trace_begin("open vm");
 		ctx = do_open(vmname);
+		boot_trace_end(trace);
 
 		/* set IOReq buffer page */
 		error = vm_set_shared_io_page(ctx, (unsigned long)vhm_req_buf);
@@ -888,7 +1073,9 @@ main(int argc, char *argv[])
 		}
 
 		vm_set_memflags(ctx, memflags);
+		trace = boot_trace_begin("setup memory");
 		err = vm_setup_memory(ctx, memsize);
+		boot_trace_end(trace);
 		if (err) {
 			fprintf(stderr, "Unable to setup memory (%d)\n", errno);
 			goto fail;
@@ -904,14 +1091,25 @@ main(int argc, char *argv[])
 		if (gdb_port != 0)
 			fprintf(stderr, "dbgport not supported\n");
 
-		if (vm_init_vdevs(ctx) < 0) {
+		trace = boot_trace_begin("init vdevs");
+		error = vm_init_vdevs(ctx);
+		boot_trace_end(trace);
+		if (error < 0) {
 			fprintf(stderr, "Unable to init vdev (%d)\n", errno);
 			goto dev_fail;
 		}
 
+		if ((vm_snapshot_enabled() || vm_restore_requested()) &&
+		    pci_snapshot_check() != 0) {
+			fprintf(stderr, "snapshots are not supported with "
+				"this device configuration\n");
+			goto vm_fail;
+		}
+
 		/*
 		 * build the guest tables, MP etc.
 		 */
+		trace = boot_trace_begin("build tables");
 		if (mptgen) {
 			error = mptable_build(ctx, guest_ncpus);
 			if (error) {
@@ -928,8 +1126,20 @@ main(int argc, char *argv[])
 			if (error)
 				goto vm_fail;
 		}
+		boot_trace_end(trace);
 
-		error = acrn_sw_load(ctx);
+		/*
+		 * A restored guest resumes from S3 with its own memory image,
+		 * so there is no software to load.
+		 */
+		if (vm_restore_requested()) {
+			trace = boot_trace_begin("restore snapshot");
+			error = vm_snapshot_restore(ctx);
+		} else {
+			trace = boot_trace_begin("load software");
+			error = acrn_sw_load(ctx);
+		}
+		boot_trace_end(trace);
 		if (error)
 			goto vm_fail;
 
@@ -941,24 +1151,35 @@ main(int argc, char *argv[])
 		/*
 		 * Add CPU 0
 		 */
+		trace = boot_trace_begin("start vcpus");
 		error = add_cpu(ctx, guest_ncpus);
+		boot_trace_end(trace);
 		if (error)
 			goto vm_fail;
+		boot_trace_dump(vmname);
 
 		/* Make a copy for ctx */
 		_ctx = ctx;
 
 		/*
-		 * Head off to the main event dispatch loop
+		 * Head off to the main event dispatch loop, and back to it
+		 * after each full reset that could be done warm.
 		 */
-		mevent_dispatch();
+		do {
+			mevent_dispatch();
 
-		vm_pause(ctx);
-		delete_cpu(ctx, BSP);
+			vm_pause(ctx);
+			if (vm_get_suspend_mode() == VM_SUSPEND_FULL_RESET)
+				vm_clear_ioreq(ctx);
+			delete_cpu(ctx, BSP);
+		} while (vm_get_suspend_mode() == VM_SUSPEND_FULL_RESET &&
+				vm_full_reset(ctx, mptgen) == 0);
 
 		if (vm_get_suspend_mode() != VM_SUSPEND_FULL_RESET)
 			break;
 
+		if (!trusty_enabled)
+			fprintf(stderr, "warm reset failed, recreate the VM\n");
 		vm_deinit_vdevs(ctx);
 		mevent_deinit();
 		vm_unsetup_memory(ctx);
@@ -30,6 +30,12 @@
  * Memory ranges are represented with an RB tree. On insertion, the range
  * is checked for overlaps. On lookup, the key has the same base and limit
  * so it can be searched within the range.
+ *
+ * The trees are only used by writers, under mmio_mtx. Each update
+ * publishes a sorted, read-only snapshot of both trees which vCPU
+ * handlers search without taking any lock. Snapshots and ranges that
+ * got replaced are retired with the epoch of the update, and freed
+ * once no handler is still running in an older epoch.
  */
 
 #include <errno.h>
@@ -37,16 +43,20 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sys/queue.h>
 
 #include "vmm.h"
 #include "mem.h"
 #include "tree.h"
+#include "atomic.h"
 
 struct mmio_rb_range {
 	RB_ENTRY(mmio_rb_range)	mr_link;	/* RB tree links */
 	struct mem_range	mr_param;
 	uint64_t                mr_base;
 	uint64_t                mr_end;
+	uint64_t		mr_epoch;	/* epoch it was retired in */
+	SLIST_ENTRY(mmio_rb_range) mr_retired;
 };
 
 struct mmio_rb_tree;
@@ -55,13 +65,40 @@ RB_PROTOTYPE(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare);
 RB_HEAD(mmio_rb_tree, mmio_rb_range) mmio_rb_root, mmio_rb_fallback;
 
 /*
- * Per-VM cache. Since most accesses from a vCPU will be to
+ * Snapshot of both trees: nr_root ranges of mmio_rb_root followed by
+ * nr_fallback ranges of mmio_rb_fallback, each sorted by address.
+ */
+struct mmio_table {
+	uint64_t		gen;	/* epoch it was published in */
+	uint64_t		epoch;	/* epoch it was retired in */
+	SLIST_ENTRY(mmio_table)	retired;
+	int			nr_root;
+	int			nr_fallback;
+	struct mmio_rb_range	*ranges[];
+};
+
+/*
+ * Per-vCPU state. Since most accesses from a vCPU will be to
  * consecutive addresses in a range, it makes sense to cache the
- * result of a lookup.
+ * result of a lookup. The hint is only valid for the snapshot it was
+ * found in.
  */
-static struct mmio_rb_range	*mmio_hint;
+struct mmio_reader {
+	uint64_t		epoch;	/* epoch entered, 0 when idle */
+	uint64_t		hint_gen;
+	struct mmio_rb_range	*hint;
+} __attribute__((aligned(64)));
 
-static pthread_rwlock_t mmio_rwlock;
+static struct mmio_reader mmio_readers[VM_MAXCPU];
+
+static struct mmio_table *mmio_table;
+static uint64_t mmio_epoch = 1;
+static int mmio_nr_root, mmio_nr_fallback;
+
+static SLIST_HEAD(, mmio_table) mmio_retired_tables;
+static SLIST_HEAD(, mmio_rb_range) mmio_retired_ranges;
+
+static pthread_mutex_t mmio_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static int
 mmio_rb_range_compare(struct mmio_rb_range *a, struct mmio_rb_range *b)
@@ -118,17 +155,140 @@ mmio_rb_dump(struct mmio_rb_tree *rbt)
 {
 	struct mmio_rb_range *np;
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
+	pthread_mutex_lock(&mmio_mtx);
 	RB_FOREACH(np, mmio_rb_tree, rbt) {
 		printf(" %lx:%lx, %s\n", np->mr_base, np->mr_end,
 		       np->mr_param.name);
 	}
-	pthread_rwlock_unlock(&mmio_rwlock);
+	pthread_mutex_unlock(&mmio_mtx);
 }
 #endif
 
 RB_GENERATE(mmio_rb_tree, mmio_rb_range, mr_link, mmio_rb_range_compare);
 
+/*
+ * Binary search of addr in n sorted, non-overlapping ranges.
+ */
+static struct mmio_rb_range *
+mmio_table_lookup(struct mmio_rb_range **ranges, int n, uint64_t addr)
+{
+	struct mmio_rb_range *mrp;
+	int lo = 0, hi = n - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		mrp = ranges[mid];
+		if (addr < mrp->mr_base)
+			hi = mid - 1;
+		else if (addr > mrp->mr_end)
+			lo = mid + 1;
+		else
+			return mrp;
+	}
+
+	return NULL;
+}
+
+static struct mmio_table *
+mmio_table_alloc(int nr_ranges)
+{
+	return calloc(1, sizeof(struct mmio_table) +
+		      nr_ranges * sizeof(struct mmio_rb_range *));
+}
+
+/*
+ * Free what was retired before the epoch of every running handler.
+ * Called with mmio_mtx held.
+ */
+static void
+mmio_reclaim(void)
+{
+	struct mmio_table *tbl, *prev_tbl, *next_tbl;
+	struct mmio_rb_range *mrp, *prev_mrp, *next_mrp;
+	uint64_t oldest, epoch;
+	int i;
+
+	oldest = atomic_load(&mmio_epoch);
+	for (i = 0; i < VM_MAXCPU; i++) {
+		epoch = atomic_load(&mmio_readers[i].epoch);
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+
+	/*
+	 * Lists are kept newest first, so everything from the first entry
+	 * that is old enough on can go.
+	 */
+	prev_tbl = NULL;
+	SLIST_FOREACH(tbl, &mmio_retired_tables, retired) {
+		if (tbl->epoch <= oldest)
+			break;
+		prev_tbl = tbl;
+	}
+	if (prev_tbl != NULL)
+		SLIST_NEXT(prev_tbl, retired) = NULL;
+	else
+		SLIST_INIT(&mmio_retired_tables);
+	while (tbl != NULL) {
+		next_tbl = SLIST_NEXT(tbl, retired);
+		free(tbl);
+		tbl = next_tbl;
+	}
+
+	prev_mrp = NULL;
+	SLIST_FOREACH(mrp, &mmio_retired_ranges, mr_retired) {
+		if (mrp->mr_epoch <= oldest)
+			break;
+		prev_mrp = mrp;
+	}
+	if (prev_mrp != NULL)
+		SLIST_NEXT(prev_mrp, mr_retired) = NULL;
+	else
+		SLIST_INIT(&mmio_retired_ranges);
+	while (mrp != NULL) {
+		next_mrp = SLIST_NEXT(mrp, mr_retired);
+		free(mrp);
+		mrp = next_mrp;
+	}
+}
+
+/*
+ * Fill tbl (sized by the caller before changing the trees, so this
+ * can't fail) from both trees and make it the one handlers search.
+ * The previous snapshot and the removed range, if any, are retired.
+ * Called with mmio_mtx held.
+ */
+static void
+mmio_publish(struct mmio_table *tbl, struct mmio_rb_range *removed)
+{
+	struct mmio_table *old = mmio_table;
+	struct mmio_rb_range *np;
+	uint64_t epoch;
+	int n = 0;
+
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_root)
+		tbl->ranges[n++] = np;
+	tbl->nr_root = n;
+	RB_FOREACH(np, mmio_rb_tree, &mmio_rb_fallback)
+		tbl->ranges[n++] = np;
+	tbl->nr_fallback = n - tbl->nr_root;
+	tbl->gen = atomic_load(&mmio_epoch) + 1;
+
+	atomic_store(&mmio_table, tbl);
+	epoch = atomic_add_fetch(&mmio_epoch, 1);
+
+	if (old != NULL) {
+		old->epoch = epoch;
+		SLIST_INSERT_HEAD(&mmio_retired_tables, old, retired);
+	}
+	if (removed != NULL) {
+		removed->mr_epoch = epoch;
+		SLIST_INSERT_HEAD(&mmio_retired_ranges, removed, mr_retired);
+	}
+
+	mmio_reclaim();
+}
+
 __attribute__((unused))
 static int
 mem_read(void *ctx, int vcpu, uint64_t gpa, uint64_t *rval, int size, void *arg)
@@ -154,41 +314,57 @@ mem_write(void *ctx, int vcpu, uint64_t gpa, uint64_t wval, int size, void *arg)
 }
 
 int
-emulate_mem(struct vmctx *ctx, struct mmio_request *mmio_req)
+emulate_mem(struct vmctx *ctx, int vcpu, struct mmio_request *mmio_req)
 {
 	uint64_t paddr = mmio_req->address;
 	int size = mmio_req->size;
 	struct mmio_rb_range *entry = NULL;
+	struct mmio_reader *rd;
+	struct mmio_table *tbl;
 	int err;
 
-	pthread_rwlock_rdlock(&mmio_rwlock);
+	assert(vcpu >= 0 && vcpu < VM_MAXCPU);
+	rd = &mmio_readers[vcpu];
+
 	/*
-	 * First check the per-VM cache
+	 * Announce the epoch before looking at the snapshot, so that an
+	 * update racing with us can't free it while it's being used.
 	 */
-	if (mmio_hint && paddr >= mmio_hint->mr_base &&
-			paddr <= mmio_hint->mr_end)
-		entry = mmio_hint;
+	atomic_store(&rd->epoch, atomic_load(&mmio_epoch));
+	tbl = atomic_load(&mmio_table);
+
+	/*
+	 * First check the per-vCPU cache
+	 */
+	if (rd->hint && rd->hint_gen == tbl->gen &&
+			paddr >= rd->hint->mr_base &&
+			paddr <= rd->hint->mr_end)
+		entry = rd->hint;
 
 	if (entry == NULL) {
-		if (mmio_rb_lookup(&mmio_rb_root, paddr, &entry) == 0)
-			/* Update the per-VMU cache */
-			mmio_hint = entry;
-		else if (mmio_rb_lookup(&mmio_rb_fallback, paddr, &entry)) {
-			pthread_rwlock_unlock(&mmio_rwlock);
-			return -ESRCH;
+		entry = mmio_table_lookup(tbl->ranges, tbl->nr_root, paddr);
+		if (entry != NULL) {
+			/* Update the per-vCPU cache */
+			rd->hint = entry;
+			rd->hint_gen = tbl->gen;
+		} else {
+			entry = mmio_table_lookup(&tbl->ranges[tbl->nr_root],
+					tbl->nr_fallback, paddr);
+			if (entry == NULL) {
+				atomic_store(&rd->epoch, 0);
+				return -ESRCH;
+			}
 		}
 	}
 
-	assert(entry != NULL);
-
 	if (mmio_req->direction == REQUEST_READ)
-		err = mem_read(ctx, 0, paddr, (uint64_t *)&mmio_req->value,
+		err = mem_read(ctx, vcpu, paddr, (uint64_t *)&mmio_req->value,
 				size, &entry->mr_param);
 	else
-		err = mem_write(ctx, 0, paddr, mmio_req->value,
+		err = mem_write(ctx, vcpu, paddr, mmio_req->value,
 				size, &entry->mr_param);
 
-	pthread_rwlock_unlock(&mmio_rwlock);
+	atomic_store(&rd->epoch, 0);
 
 	return err;
 }
@@ -197,6 +373,8 @@ static int
 register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 {
 	struct mmio_rb_range *entry, *mrp;
+	struct mmio_table *tbl;
+	int *nr;
 	int err;
 
 	err = 0;
@@ -207,12 +385,23 @@ register_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 		mrp->mr_param = *memp;
 		mrp->mr_base = memp->base;
 		mrp->mr_end = memp->base + memp->size - 1;
-		pthread_rwlock_wrlock(&mmio_rwlock);
-		if (mmio_rb_lookup(rbt, memp->base, &entry) != 0)
+		nr = (rbt == &mmio_rb_root) ? &mmio_nr_root : &mmio_nr_fallback;
+		pthread_mutex_lock(&mmio_mtx);
+		tbl = mmio_table_alloc(mmio_nr_root + mmio_nr_fallback + 1);
+		if (tbl == NULL)
+			err = -1;
+		else if (mmio_rb_lookup(rbt, memp->base, &entry) != 0) {
 			err = mmio_rb_add(rbt, mrp);
-		pthread_rwlock_unlock(&mmio_rwlock);
-		if (err)
-			free(mrp);
+			if (err == 0) {
+				(*nr)++;
+				mmio_publish(tbl, NULL);
+				tbl = NULL;
+				mrp = NULL;
+			}
+		}
+		pthread_mutex_unlock(&mmio_mtx);
+		free(tbl);
+		free(mrp);
 	} else
 		err = -1;
 
@@ -231,66 +420,65 @@ register_mem_fallback(struct mem_range *memp)
 	return register_mem_int(&mmio_rb_fallback, memp);
 }
 
-int
-unregister_mem_fallback(struct mem_range *memp)
+static int
+unregister_mem_int(struct mmio_rb_tree *rbt, struct mem_range *memp)
 {
 	struct mem_range *mr;
 	struct mmio_rb_range *entry = NULL;
+	struct mmio_table *tbl;
+	int *nr;
 	int err;
 
-	pthread_rwlock_wrlock(&mmio_rwlock);
-	err = mmio_rb_lookup(&mmio_rb_fallback, memp->base, &entry);
+	nr = (rbt == &mmio_rb_root) ? &mmio_nr_root : &mmio_nr_fallback;
+	pthread_mutex_lock(&mmio_mtx);
+	err = mmio_rb_lookup(rbt, memp->base, &entry);
 	if (err == 0) {
 		mr = &entry->mr_param;
 		assert(mr->name == memp->name);
 		assert(mr->base == memp->base && mr->size == memp->size);
 		assert((mr->flags & MEM_F_IMMUTABLE) == 0);
-		RB_REMOVE(mmio_rb_tree, &mmio_rb_fallback, entry);
 
-		/* flush Per-VM cache */
-		if (mmio_hint == entry)
-			mmio_hint = NULL;
-	}
-	pthread_rwlock_unlock(&mmio_rwlock);
+		tbl = mmio_table_alloc(mmio_nr_root + mmio_nr_fallback - 1);
+		if (tbl != NULL) {
+			RB_REMOVE(mmio_rb_tree, rbt, entry);
+			(*nr)--;
 
-	if (entry)
-		free(entry);
+			/* handlers may still use it, it is freed later */
+			mmio_publish(tbl, entry);
+		} else
+			err = -1;
+	}
+	pthread_mutex_unlock(&mmio_mtx);
 
 	return err;
 }
 
 int
-unregister_mem(struct mem_range *memp)
+unregister_mem_fallback(struct mem_range *memp)
 {
-	struct mem_range *mr;
-	struct mmio_rb_range *entry = NULL;
-	int err;
-
-	pthread_rwlock_wrlock(&mmio_rwlock);
-	err = mmio_rb_lookup(&mmio_rb_root, memp->base, &entry);
-	if (err == 0) {
-		mr = &entry->mr_param;
-		assert(mr->name == memp->name);
-		assert(mr->base == memp->base && mr->size == memp->size);
-		assert((mr->flags & MEM_F_IMMUTABLE) == 0);
-		RB_REMOVE(mmio_rb_tree, &mmio_rb_root, entry);
-
-		/* flush Per-VM cache */
-		if (mmio_hint == entry)
-			mmio_hint = NULL;
-	}
-	pthread_rwlock_unlock(&mmio_rwlock);
-
-	if (entry)
-		free(entry);
+	return unregister_mem_int(&mmio_rb_fallback, memp);
+}
 
-	return err;
+int
+unregister_mem(struct mem_range *memp)
+{
+	return unregister_mem_int(&mmio_rb_root, memp);
 }
 
 void
 init_mem(void)
 {
+	struct mmio_table *tbl;
+
 	RB_INIT(&mmio_rb_root);
 	RB_INIT(&mmio_rb_fallback);
-	pthread_rwlock_init(&mmio_rwlock, NULL);
+	SLIST_INIT(&mmio_retired_tables);
+	SLIST_INIT(&mmio_retired_ranges);
+
+	/* start with an empty snapshot so handlers never see NULL */
+	tbl = mmio_table_alloc(0);
+	assert(tbl != NULL);
+	pthread_mutex_lock(&mmio_mtx);
+	mmio_publish(tbl, NULL);
+	pthread_mutex_unlock(&mmio_mtx);
 }
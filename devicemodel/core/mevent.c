@@ -29,16 +29,24 @@
 /*
  * Micro event library for FreeBSD, designed for a single i/o thread
  * using EPOLL, and having events be persistent by default.
+ *
+ * Besides the main loop run by mevent_dispatch(), devices with busy
+ * fds may create loops of their own with mevent_loop_create(); each
+ * of those is served by a dedicated thread so that it can't delay the
+ * events of other devices.
  */
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/queue.h>
+#include <sys/timerfd.h>
 #include <pthread.h>
 
 #include "mevent.h"
@@ -51,24 +59,37 @@
 #define	MEV_DISABLE	3
 #define	MEV_DEL_PENDING	4
 
-static int epoll_fd;
-static pthread_t mevent_tid;
-static int mevent_pipefd[2];
-static pthread_mutex_t mevent_lmutex = PTHREAD_MUTEX_INITIALIZER;
-
 struct mevent {
 	void	(*me_func)(int, enum ev_type, void *);
 	int	me_fd;
+	int	me_timid;	/* timer period in ms */
 	enum ev_type me_type;
 	void *me_param;
 	int	me_cq;
 	int	me_state;
 	int	me_closefd;
+	struct mevent_loop *me_loop;
 
 	LIST_ENTRY(mevent) me_list;
 };
 
+struct mevent_loop {
+	int		epoll_fd;
+	int		pipefd[2];
+	pthread_t	tid;
+	bool		stop;
+	char		name[16];
+
+	/* deleted events, freed by the loop once it is done with them */
+	LIST_HEAD(, mevent) del_head;
+	LIST_ENTRY(mevent_loop) ml_list;
+};
+
+static pthread_mutex_t mevent_lmutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mevent_loop main_loop = { .epoll_fd = -1 };
+
 static LIST_HEAD(listhead, mevent) global_head;
+static LIST_HEAD(, mevent_loop) loop_head;
 
 static void
 mevent_qlock(void)
@@ -97,22 +118,28 @@ mevent_pipe_read(int fd, enum ev_type type, void *param)
 	} while (status == MEVENT_MAX);
 }
 
-/*On error, -1 is returned, else return zero*/
-int
-mevent_notify(void)
+/*
+ * If calling from outside the loop thread, write a byte on the pipe to
+ * force it to exit the blocking epoll call.
+ */
+static int
+mevent_loop_notify(struct mevent_loop *loop)
 {
-	char c;
+	char c = 0;
 
-	/*
-	 * If calling from outside the i/o thread, write a byte on the
-	 * pipe to force the i/o thread to exit the blocking epoll call.
-	 */
-	if (mevent_pipefd[1] != 0 && pthread_self() != mevent_tid)
-		if (write(mevent_pipefd[1], &c, 1) <= 0)
+	if (loop->pipefd[1] > 0 && pthread_self() != loop->tid)
+		if (write(loop->pipefd[1], &c, 1) <= 0)
 			return -1;
 	return 0;
 }
 
+/*On error, -1 is returned, else return zero*/
+int
+mevent_notify(void)
+{
+	return mevent_loop_notify(&main_loop);
+}
+
 static int
 mevent_kq_filter(struct mevent *mevp)
 {
@@ -120,7 +147,11 @@ mevent_kq_filter(struct mevent *mevp)
 
 	retval = 0;
 
-	if (mevp->me_type == EVF_READ)
+	/* a disabled event stays registered, but reports nothing */
+	if (mevp->me_state == MEV_DISABLE)
+		return retval;
+
+	if (mevp->me_type == EVF_READ || mevp->me_type == EVF_TIMER)
 		retval = EPOLLIN;
 
 	if (mevp->me_type == EVF_WRITE)
@@ -128,125 +159,207 @@ mevent_kq_filter(struct mevent *mevp)
 	return retval;
 }
 
-static void
-mevent_destroy()
+/*
+ * Arm a periodic timer firing every msecs, or disarm it if msecs is 0.
+ */
+static int
+mevent_timer_arm(int fd, int msecs)
 {
-	struct mevent *mevp, *tmpp;
-	struct epoll_event ee;
-
-	mevent_qlock();
-
-	list_foreach_safe(mevp, &global_head, me_list, tmpp) {
-		LIST_REMOVE(mevp, me_list);
-		ee.events = mevent_kq_filter(mevp);
-		ee.data.ptr = mevp;
-		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, mevp->me_fd, &ee);
-
-		if ((mevp->me_type == EVF_READ ||
-			mevp->me_type == EVF_WRITE)
-			&& mevp->me_fd != STDIN_FILENO)
-			close(mevp->me_fd);
-
-		free(mevp);
-	}
+	struct itimerspec its;
 
-	mevent_qunlock();
+	its.it_interval.tv_sec = msecs / 1000;
+	its.it_interval.tv_nsec = (msecs % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	return timerfd_settime(fd, 0, &its, NULL);
 }
 
 static void
 mevent_handle(struct epoll_event *kev, int numev)
 {
 	int i;
+	uint64_t expired;
 	struct mevent *mevp;
 
 	for (i = 0; i < numev; i++) {
 		mevp = kev[i].data.ptr;
 		/* XXX check for EV_ERROR ? */
 
+		/* may have changed since this batch was fetched */
+		if (mevp->me_state == MEV_DISABLE ||
+		    mevp->me_state == MEV_DEL_PENDING)
+			continue;
+
+		if (mevp->me_type == EVF_TIMER &&
+		    read(mevp->me_fd, &expired, sizeof(expired)) < 0)
+			continue;
+
 		(*mevp->me_func)(mevp->me_fd, mevp->me_type, mevp->me_param);
 	}
 }
 
+static void
+mevent_free_deleted(struct mevent_loop *loop)
+{
+	struct mevent *mevp;
+
+	mevent_qlock();
+	while ((mevp = LIST_FIRST(&loop->del_head)) != NULL) {
+		LIST_REMOVE(mevp, me_list);
+		free(mevp);
+	}
+	mevent_qunlock();
+}
+
+/*
+ * For timers tfd is the period in milliseconds; the timer fd created
+ * for it is what the callback gets as its fd argument.
+ */
 struct mevent *
-mevent_add(int tfd, enum ev_type type,
-	   void (*func)(int, enum ev_type, void *), void *param)
+mevent_add_on(struct mevent_loop *loop, int tfd, enum ev_type type,
+	      void (*func)(int, enum ev_type, void *), void *param)
 {
-	int ret;
+	int ret, fd;
 	struct epoll_event ee;
 	struct mevent *lp, *mevp;
 
 	if (tfd < 0 || func == NULL)
 		return NULL;
 
-	if (type == EVF_TIMER)
-		return NULL;
-
-	mevent_qlock();
-	/* Verify that the fd/type tuple is not present in the list */
-	LIST_FOREACH(lp, &global_head, me_list) {
-		if (lp->me_fd == tfd && lp->me_type == type) {
-			mevent_qunlock();
-			return lp;
+	if (loop == NULL)
+		loop = &main_loop;
+
+	if (type == EVF_TIMER) {
+		if (tfd == 0)
+			return NULL;
+		fd = timerfd_create(CLOCK_MONOTONIC,
+				    TFD_NONBLOCK | TFD_CLOEXEC);
+		if (fd < 0)
+			return NULL;
+		if (mevent_timer_arm(fd, tfd) < 0) {
+			close(fd);
+			return NULL;
+		}
+	} else {
+		fd = tfd;
+		mevent_qlock();
+		/* Verify that the fd/type tuple is not present in the list */
+		LIST_FOREACH(lp, &global_head, me_list) {
+			if (lp->me_fd == tfd && lp->me_type == type) {
+				mevent_qunlock();
+				return lp;
+			}
 		}
+		mevent_qunlock();
 	}
-	mevent_qunlock();
 
 	/*
 	 * Allocate an entry, populate it, and add it to the list.
 	 */
 	mevp = calloc(1, sizeof(struct mevent));
 	if (mevp == NULL)
-		return NULL;
+		goto fail;
 
-	mevp->me_fd = tfd;
+	mevp->me_fd = fd;
+	mevp->me_timid = (type == EVF_TIMER) ? tfd : 0;
 	mevp->me_type = type;
 	mevp->me_func = func;
 	mevp->me_param = param;
+	mevp->me_state = MEV_ENABLE;
+	mevp->me_loop = loop;
 
 	ee.events = mevent_kq_filter(mevp);
 	ee.data.ptr = mevp;
-	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
+	mevent_qlock();
+	ret = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
 	if (ret == 0) {
-		mevent_qlock();
 		LIST_INSERT_HEAD(&global_head, mevp, me_list);
 		mevent_qunlock();
 
 		return mevp;
+	}
+	mevent_qunlock();
+	free(mevp);
+
+fail:
+	if (type == EVF_TIMER)
+		close(fd);
+	return NULL;
+}
+
+struct mevent *
+mevent_add(int tfd, enum ev_type type,
+	   void (*func)(int, enum ev_type, void *), void *param)
+{
+	return mevent_add_on(NULL, tfd, type, func, param);
+}
+
+/*
+ * An event being dispatched by its loop when it gets disabled may
+ * still run its callback once.
+ */
+static int
+mevent_update(struct mevent *evp, int newstate)
+{
+	struct epoll_event ee;
+	int ret = 0;
+
+	if (evp == NULL)
+		return -1;
+
+	mevent_qlock();
+	if (evp->me_state == newstate || evp->me_state == MEV_DEL_PENDING)
+		goto out;
+
+	evp->me_state = newstate;
+	if (evp->me_type == EVF_TIMER) {
+		ret = mevent_timer_arm(evp->me_fd,
+			newstate == MEV_ENABLE ? evp->me_timid : 0);
 	} else {
-		free(mevp);
-		return NULL;
+		ee.events = mevent_kq_filter(evp);
+		ee.data.ptr = evp;
+		ret = epoll_ctl(evp->me_loop->epoll_fd, EPOLL_CTL_MOD,
+				evp->me_fd, &ee);
 	}
+out:
+	mevent_qunlock();
+	return ret;
 }
 
 int
 mevent_enable(struct mevent *evp)
 {
-	return 0;
+	return mevent_update(evp, MEV_ENABLE);
 }
 
 int
 mevent_disable(struct mevent *evp)
 {
-	return 0;
+	return mevent_update(evp, MEV_DISABLE);
 }
 
 static int
 mevent_delete_event(struct mevent *evp, int closefd)
 {
+	struct mevent_loop *loop = evp->me_loop;
 	struct epoll_event ee;
 
 	mevent_qlock();
 	LIST_REMOVE(evp, me_list);
-	mevent_qunlock();
 
 	ee.events = mevent_kq_filter(evp);
 	ee.data.ptr = evp;
-	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, evp->me_fd, &ee);
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, evp->me_fd, &ee);
 
-	if (closefd)
+	if (closefd || evp->me_type == EVF_TIMER)
 		close(evp->me_fd);
 
-	free(evp);
+	/*
+	 * The loop may be in the middle of a batch of events that still
+	 * points to this one, so let it free the entry afterwards.
+	 */
+	evp->me_state = MEV_DEL_PENDING;
+	LIST_INSERT_HEAD(&loop->del_head, evp, me_list);
+	mevent_qunlock();
 	return 0;
 }
 
@@ -262,66 +375,209 @@ mevent_delete_close(struct mevent *evp)
 	return mevent_delete_event(evp, 1);
 }
 
+static int
+mevent_loop_init(struct mevent_loop *loop, const char *name)
+{
+	loop->epoll_fd = epoll_create1(0);
+	if (loop->epoll_fd < 0)
+		return -1;
+
+	/*
+	 * Open the pipe that will be used for other threads to force
+	 * the blocking epoll call to exit by writing to it.
+	 */
+	if (pipe2(loop->pipefd, O_NONBLOCK) < 0) {
+		perror("pipe");
+		close(loop->epoll_fd);
+		loop->epoll_fd = -1;
+		return -1;
+	}
+
+	LIST_INIT(&loop->del_head);
+	strncpy(loop->name, name, sizeof(loop->name) - 1);
+
+	/*
+	 * Add internal event handler for the pipe write fd
+	 */
+	if (mevent_add_on(loop, loop->pipefd[0], EVF_READ,
+			  mevent_pipe_read, NULL) == NULL) {
+		close(loop->pipefd[0]);
+		close(loop->pipefd[1]);
+		close(loop->epoll_fd);
+		loop->epoll_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Drop the events left on a loop whose thread is gone, then the loop's
+ * own descriptors.
+ */
+static void
+mevent_loop_fini(struct mevent_loop *loop)
+{
+	struct mevent *mevp, *tmpp;
+
+	if (loop->epoll_fd < 0)
+		return;
+
+	mevent_free_deleted(loop);
+
+	mevent_qlock();
+	list_foreach_safe(mevp, &global_head, me_list, tmpp) {
+		if (mevp->me_loop != loop)
+			continue;
+
+		LIST_REMOVE(mevp, me_list);
+		epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, mevp->me_fd, NULL);
+
+		if (((mevp->me_type == EVF_READ ||
+			mevp->me_type == EVF_WRITE)
+			&& mevp->me_fd != STDIN_FILENO) ||
+			mevp->me_type == EVF_TIMER)
+			close(mevp->me_fd);
+
+		free(mevp);
+	}
+	mevent_qunlock();
+
+	close(loop->pipefd[1]);
+	close(loop->epoll_fd);
+	loop->epoll_fd = -1;
+}
+
+static void *
+mevent_loop_thread(void *param)
+{
+	struct mevent_loop *loop = param;
+	struct epoll_event eventlist[MEVENT_MAX];
+	int ret;
+
+	while (!loop->stop) {
+		ret = epoll_wait(loop->epoll_fd, eventlist, MEVENT_MAX, -1);
+		if (ret == -1 && errno != EINTR)
+			perror("Error return from epoll_wait");
+
+		mevent_handle(eventlist, ret);
+		mevent_free_deleted(loop);
+	}
+
+	return NULL;
+}
+
+struct mevent_loop *
+mevent_loop_create(const char *name)
+{
+	struct mevent_loop *loop;
+
+	loop = calloc(1, sizeof(struct mevent_loop));
+	if (loop == NULL)
+		return NULL;
+
+	if (mevent_loop_init(loop, name) < 0) {
+		free(loop);
+		return NULL;
+	}
+
+	if (pthread_create(&loop->tid, NULL, mevent_loop_thread, loop)) {
+		mevent_loop_fini(loop);
+		free(loop);
+		return NULL;
+	}
+	pthread_setname_np(loop->tid, loop->name);
+
+	mevent_qlock();
+	LIST_INSERT_HEAD(&loop_head, loop, ml_list);
+	mevent_qunlock();
+
+	return loop;
+}
+
+static void
+mevent_loop_stop(struct mevent_loop *loop)
+{
+	loop->stop = true;
+	mevent_loop_notify(loop);
+	pthread_join(loop->tid, NULL);
+}
+
+/*
+ * Events still registered on the loop are dropped and their fds closed,
+ * callers are expected to delete their own events first.
+ */
+void
+mevent_loop_destroy(struct mevent_loop *loop)
+{
+	if (loop == NULL || loop == &main_loop)
+		return;
+
+	mevent_qlock();
+	LIST_REMOVE(loop, ml_list);
+	mevent_qunlock();
+
+	mevent_loop_stop(loop);
+	mevent_loop_fini(loop);
+	free(loop);
+}
+
 static void
 mevent_set_name(void)
 {
-	pthread_setname_np(mevent_tid, "mevent");
+	pthread_setname_np(main_loop.tid, "mevent");
 }
 
 int
 mevent_init(void)
 {
-	epoll_fd = epoll_create1(0);
-	assert(epoll_fd >= 0);
+	int ret;
 
-	if (epoll_fd >= 0)
-		return 0;
-	else
-		return -1;
+	ret = mevent_loop_init(&main_loop, "mevent");
+	assert(ret == 0);
+
+	return ret;
 }
 
 void
 mevent_deinit(void)
 {
-	mevent_destroy();
-	close(epoll_fd);
+	struct mevent_loop *loop;
+
+	mevent_qlock();
+	while ((loop = LIST_FIRST(&loop_head)) != NULL) {
+		LIST_REMOVE(loop, ml_list);
+		mevent_qunlock();
+
+		mevent_loop_stop(loop);
+		mevent_loop_fini(loop);
+		free(loop);
+
+		mevent_qlock();
+	}
+	mevent_qunlock();
+
+	mevent_loop_fini(&main_loop);
+	memset(&main_loop, 0, sizeof(main_loop));
+	main_loop.epoll_fd = -1;
 }
 
 void
 mevent_dispatch(void)
 {
 	struct epoll_event eventlist[MEVENT_MAX];
-
-	struct mevent *pipev;
 	int ret;
 
-	mevent_tid = pthread_self();
+	main_loop.tid = pthread_self();
 	mevent_set_name();
 
-	/*
-	 * Open the pipe that will be used for other threads to force
-	 * the blocking kqueue call to exit by writing to it. Set the
-	 * descriptor to non-blocking.
-	 */
-	ret = pipe(mevent_pipefd);
-	if (ret < 0) {
-		perror("pipe");
-		exit(0);
-	}
-
-	/*
-	 * Add internal event handler for the pipe write fd
-	 */
-	pipev = mevent_add(mevent_pipefd[0], EVF_READ, mevent_pipe_read, NULL);
-	assert(pipev != NULL);
-
 	for (;;) {
 		int suspend_mode;
 
 		/*
 		 * Block awaiting events
 		 */
-		ret = epoll_wait(epoll_fd, eventlist, MEVENT_MAX, -1);
+		ret = epoll_wait(main_loop.epoll_fd, eventlist, MEVENT_MAX, -1);
 		if (ret == -1 && errno != EINTR)
 			perror("Error return from epoll_wait");
 
@@ -329,6 +585,7 @@ mevent_dispatch(void)
 		 * Handle reported events
 		 */
 		mevent_handle(eventlist, ret);
+		mevent_free_deleted(&main_loop);
 
 		suspend_mode = vm_get_suspend_mode();
 
@@ -20,6 +20,8 @@
 #include "monitor.h"
 #include "acrn_mngr.h"
 #include "pm.h"
+#include "block_if.h"
+#include "virtio_balloon.h"
 
 /* helpers */
 /* Check if @path is a directory, and create if not exist */
@@ -206,6 +208,44 @@ static void handle_query(struct mngr_msg *msg, int client_fd, void *param)
 	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
 }
 
+static void handle_blkstats(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+	char path[128];
+	char disk[sizeof(msg->data.dm_blkstats.disk) + 1] = {};
+	FILE *f;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	memcpy(disk, msg->data.dm_blkstats.disk, sizeof(disk) - 1);
+	snprintf(path, sizeof(path), DM_BLKSTATS_PATH, vmname);
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		ack.data.err = -1;
+	} else {
+		ack.data.err = blockif_dump_stats(f, disk,
+					msg->data.dm_blkstats.reset);
+		fclose(f);
+	}
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
+static void handle_balloon(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+	ack.data.err = virtio_balloon_request(msg->data.dm_balloon.mb);
+
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
 static struct monitor_vm_ops pmc_ops = {
 	.stop       = NULL,
 	.resume     = vm_monitor_resume,
@@ -247,6 +287,8 @@ int monitor_init(struct vmctx *ctx)
 	ret += mngr_add_handler(monitor_fd, DM_PAUSE, handle_pause, NULL);
 	ret += mngr_add_handler(monitor_fd, DM_CONTINUE, handle_continue, NULL);
 	ret += mngr_add_handler(monitor_fd, DM_QUERY, handle_query, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_BLKSTATS, handle_blkstats, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_BALLOON, handle_balloon, NULL);
 
 	if (ret) {
 		fprintf(stderr, "%s %d\r\n", __FUNCTION__, __LINE__);
@@ -0,0 +1,920 @@
+/*
+ * Copyright (C) <2018> Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <limits.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "vmmapi.h"
+#include "dm.h"
+#include "acpi.h"
+#include "pci_core.h"
+#include "sw_load.h"
+#include "snapshot.h"
+#include "atomic.h"
+#include "rtc.h"
+#include "atkbdc.h"
+
+#define SNAPSHOT_PAGE_SHIFT	12
+#define SNAPSHOT_PAGE_SIZE	(1UL << SNAPSHOT_PAGE_SHIFT)
+
+static char *snapshot_path;
+static char *restore_path;
+
+/* save templates rather than incremental snapshots */
+static bool snapshot_template;
+
+/* clone: template mapped as guest memory */
+static char *clone_path;
+static int clone_fd = -1;
+static char *clone_base;
+static size_t clone_size;
+static pthread_mutex_t clone_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * An incremental save appends the pages written since the previous one:
+ * the ones logged by the hypervisor for the guest, and the ones the DM
+ * handed out pointers to (ctx->snapshot_dirty, see vm_snapshot_mark()).
+ * tracking is set while both logs cover the image stored in
+ * snapshot_path; otherwise the next save writes a full image.
+ */
+static bool tracking;
+static uint32_t generation;
+
+/* guest memory is written outside of both logs, see vm_snapshot_untracked() */
+static bool untracked;
+
+static uint8_t zero_page[SNAPSHOT_PAGE_SIZE];
+
+int
+acrn_parse_snapshot(char *arg)
+{
+	if (strnlen(arg, PATH_MAX) == PATH_MAX)
+		return -1;
+
+	snapshot_path = strdup(arg);
+	return snapshot_path ? 0 : -1;
+}
+
+int
+acrn_parse_restore(char *arg)
+{
+	if (strnlen(arg, PATH_MAX) == PATH_MAX)
+		return -1;
+
+	restore_path = strdup(arg);
+	return restore_path ? 0 : -1;
+}
+
+int
+acrn_parse_template(char *arg)
+{
+	if (acrn_parse_snapshot(arg))
+		return -1;
+
+	snapshot_template = true;
+	return 0;
+}
+
+int
+acrn_parse_clone(char *arg)
+{
+	if (acrn_parse_restore(arg))
+		return -1;
+
+	clone_path = strdup(arg);
+	return clone_path ? 0 : -1;
+}
+
+bool
+vm_clone_requested(void)
+{
+	return clone_path != NULL;
+}
+
+bool
+vm_snapshot_enabled(void)
+{
+	return snapshot_path != NULL;
+}
+
+bool
+vm_restore_requested(void)
+{
+	return restore_path != NULL;
+}
+
+int
+snapshot_var(struct snapshot_meta *meta, void *data, size_t len)
+{
+	uint8_t *buf;
+	size_t size;
+
+	if (meta->error)
+		return -1;
+
+	if (meta->op == SNAPSHOT_SAVE) {
+		if (meta->off + len > meta->size) {
+			size = meta->size ? meta->size : SNAPSHOT_PAGE_SIZE;
+			while (meta->off + len > size)
+				size <<= 1;
+			buf = realloc(meta->buf, size);
+			if (buf == NULL) {
+				meta->error = -ENOMEM;
+				return -1;
+			}
+			meta->buf = buf;
+			meta->size = size;
+		}
+		memcpy(meta->buf + meta->off, data, len);
+	} else {
+		if (meta->off + len > meta->size) {
+			meta->error = -EINVAL;
+			return -1;
+		}
+		memcpy(data, meta->buf + meta->off, len);
+	}
+
+	meta->off += len;
+	return 0;
+}
+
+static size_t
+snapshot_npages(struct vmctx *ctx)
+{
+	return (ctx->lowmem + ctx->highmem) >> SNAPSHOT_PAGE_SHIFT;
+}
+
+static uint64_t
+snapshot_page_gpa(struct vmctx *ctx, size_t idx)
+{
+	uint64_t gpa = (uint64_t)idx << SNAPSHOT_PAGE_SHIFT;
+
+	if (gpa >= ctx->lowmem)
+		gpa += 4 * GB - ctx->lowmem;
+	return gpa;
+}
+
+static bool
+snapshot_gpa_valid(struct vmctx *ctx, uint64_t gpa, uint64_t len)
+{
+	if (gpa + len < gpa)
+		return false;
+	if (gpa + len <= ctx->lowmem)
+		return true;
+	return (gpa >= 4 * GB && gpa + len <= 4 * GB + ctx->highmem);
+}
+
+static int
+snapshot_write(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+snapshot_write_section(int fd, uint32_t type, const void *buf, size_t len)
+{
+	struct snapshot_section sec;
+
+	sec.type = type;
+	sec.id = generation;
+	sec.len = len;
+	if (snapshot_write(fd, &sec, sizeof(sec)))
+		return -1;
+	return snapshot_write(fd, buf, len);
+}
+
+/*
+ * Write one memory extent. The data is padded to a page boundary in the
+ * file, so restore can copy straight out of a mapping of the file.
+ */
+static int
+snapshot_write_extent(struct vmctx *ctx, int fd, off_t *off, uint64_t gpa,
+		      uint64_t npages, bool zero)
+{
+	struct snapshot_section sec;
+	struct snapshot_mem_extent ext;
+	size_t hdr, pad, data;
+
+	hdr = sizeof(sec) + sizeof(ext);
+	pad = (SNAPSHOT_PAGE_SIZE - ((*off + hdr) & (SNAPSHOT_PAGE_SIZE - 1))) &
+		(SNAPSHOT_PAGE_SIZE - 1);
+	data = zero ? 0 : npages << SNAPSHOT_PAGE_SHIFT;
+
+	sec.type = SNAPSHOT_SEC_MEM;
+	sec.id = generation;
+	sec.len = sizeof(ext) + pad + data;
+	ext.gpa = gpa;
+	ext.npages = npages;
+	ext.flags = zero ? SNAPSHOT_MEM_ZERO : 0;
+
+	if (snapshot_write(fd, &sec, sizeof(sec)) ||
+	    snapshot_write(fd, &ext, sizeof(ext)) ||
+	    snapshot_write(fd, zero_page, pad) ||
+	    snapshot_write(fd, ctx->baseaddr + gpa, data))
+		return -1;
+
+	*off += hdr + pad + data;
+	return 0;
+}
+
+/*
+ * Bit of the page at @gpa in the dirty bitmaps. The highmem pages start
+ * on a new word, so the hypervisor can copy its bitmap of each segment
+ * in place.
+ */
+static size_t
+snapshot_dirty_bit(struct vmctx *ctx, uint64_t gpa)
+{
+	if (gpa >= 4 * GB)
+		return roundup2(ctx->lowmem >> SNAPSHOT_PAGE_SHIFT, 64) +
+			((gpa - 4 * GB) >> SNAPSHOT_PAGE_SHIFT);
+	return gpa >> SNAPSHOT_PAGE_SHIFT;
+}
+
+static size_t
+snapshot_dirty_words(struct vmctx *ctx)
+{
+	return howmany(ctx->lowmem >> SNAPSHOT_PAGE_SHIFT, 64) +
+		howmany(ctx->highmem >> SNAPSHOT_PAGE_SHIFT, 64);
+}
+
+/*
+ * Start logging the pages written from now on, and return the bitmap of
+ * the ones written since the previous call, to be freed by the caller.
+ * NULL means they are unknown and the image must be full. The VM must be
+ * paused.
+ */
+static uint64_t *
+snapshot_track(struct vmctx *ctx)
+{
+	size_t i, nwords, highword;
+	uint64_t *dirty = NULL, bits;
+
+	if (untracked) {
+		/* the saves are full, nothing to log */
+		if (tracking)
+			vm_set_dirty_log(ctx, false);
+		tracking = false;
+		return NULL;
+	}
+
+	nwords = snapshot_dirty_words(ctx);
+	highword = howmany(ctx->lowmem >> SNAPSHOT_PAGE_SHIFT, 64);
+
+	if (tracking) {
+		dirty = calloc(nwords, sizeof(uint64_t));
+		if (dirty != NULL &&
+		    ((ctx->lowmem > 0 &&
+		      vm_get_dirty_log(ctx, 0, ctx->lowmem, dirty)) ||
+		     (ctx->highmem > 0 &&
+		      vm_get_dirty_log(ctx, 4 * GB, ctx->highmem,
+				       dirty + highword)))) {
+			free(dirty);
+			dirty = NULL;
+		}
+	}
+	tracking = false;
+
+	if (ctx->snapshot_dirty == NULL) {
+		ctx->snapshot_dirty = calloc(nwords, sizeof(uint64_t));
+		if (ctx->snapshot_dirty == NULL) {
+			free(dirty);
+			return NULL;
+		}
+	}
+
+	/* start over with all the pages clean */
+	if (dirty == NULL) {
+		vm_set_dirty_log(ctx, false);
+		if (vm_set_dirty_log(ctx, true)) {
+			perror("snapshot: dirty log");
+			return NULL;
+		}
+	}
+
+	for (i = 0; i < nwords; i++) {
+		bits = atomic_xchg(&ctx->snapshot_dirty[i], 0);
+		if (dirty != NULL)
+			dirty[i] |= bits;
+	}
+
+	tracking = true;
+	return dirty;
+}
+
+/*
+ * Stream the pages set in @dirty, or all the non-zero pages when @dirty
+ * is NULL, merging neighbours of the same kind into one extent.
+ */
+static int
+snapshot_save_memory(struct vmctx *ctx, int fd, off_t *off,
+		     const uint64_t *dirty)
+{
+	size_t i, bit, npages, lowpages, start = 0, run = 0;
+	bool changed, zero = false, run_zero = false;
+	uint64_t gpa;
+
+	npages = snapshot_npages(ctx);
+	lowpages = ctx->lowmem >> SNAPSHOT_PAGE_SHIFT;
+
+	for (i = 0; i < npages; i++) {
+		gpa = snapshot_page_gpa(ctx, i);
+		if (dirty != NULL) {
+			bit = snapshot_dirty_bit(ctx, gpa);
+			changed = (dirty[bit / 64] & (1UL << (bit % 64))) != 0;
+		} else
+			changed = true;
+
+		if (changed) {
+			zero = !memcmp(ctx->baseaddr + gpa, zero_page,
+				       SNAPSHOT_PAGE_SIZE);
+			if (dirty == NULL && zero)
+				changed = false;
+		}
+
+		/* a run ends at a clean page, at a change of kind or at the
+		 * lowmem/highmem boundary
+		 */
+		if (run > 0 && (!changed || zero != run_zero || i == lowpages)) {
+			if (snapshot_write_extent(ctx, fd, off,
+				snapshot_page_gpa(ctx, start), run, run_zero))
+				return -1;
+			run = 0;
+		}
+
+		if (!changed)
+			continue;
+
+		if (run == 0) {
+			start = i;
+			run_zero = zero;
+		}
+		run++;
+	}
+
+	if (run > 0)
+		return snapshot_write_extent(ctx, fd, off,
+			snapshot_page_gpa(ctx, start), run, run_zero);
+	return 0;
+}
+
+/*
+ * Write guest RAM as one extent per segment with every page in place, so
+ * clones can map it. Zero pages are left as holes in the file.
+ */
+static int
+snapshot_save_flat(struct vmctx *ctx, int fd, off_t *off)
+{
+	struct snapshot_section sec;
+	struct snapshot_mem_extent ext;
+	uint64_t gpa[2] = { 0, 4 * GB };
+	size_t len[2] = { ctx->lowmem, ctx->highmem };
+	size_t hdr, pad, i;
+	char *page;
+	int seg;
+
+	for (seg = 0; seg < 2; seg++) {
+		if (len[seg] == 0)
+			continue;
+
+		hdr = sizeof(sec) + sizeof(ext);
+		pad = (SNAPSHOT_PAGE_SIZE - ((*off + hdr) &
+			(SNAPSHOT_PAGE_SIZE - 1))) & (SNAPSHOT_PAGE_SIZE - 1);
+
+		sec.type = SNAPSHOT_SEC_MEM;
+		sec.id = generation;
+		sec.len = sizeof(ext) + pad + len[seg];
+		ext.gpa = gpa[seg];
+		ext.npages = len[seg] >> SNAPSHOT_PAGE_SHIFT;
+		ext.flags = 0;
+
+		if (snapshot_write(fd, &sec, sizeof(sec)) ||
+		    snapshot_write(fd, &ext, sizeof(ext)) ||
+		    snapshot_write(fd, zero_page, pad))
+			return -1;
+		*off += hdr + pad;
+
+		for (i = 0; i < len[seg]; i += SNAPSHOT_PAGE_SIZE) {
+			page = ctx->baseaddr + gpa[seg] + i;
+			if (!memcmp(page, zero_page, SNAPSHOT_PAGE_SIZE))
+				continue;
+			if (pwrite(fd, page, SNAPSHOT_PAGE_SIZE, *off + i) !=
+					SNAPSHOT_PAGE_SIZE)
+				return -1;
+		}
+
+		*off += len[seg];
+		if (lseek(fd, *off, SEEK_SET) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* the platform devices outside the PCI tree, in the PM section */
+static int
+snapshot_platform(struct vmctx *ctx, struct snapshot_meta *meta)
+{
+	if (pm_snapshot(ctx, meta) ||
+	    vrtc_snapshot(ctx->vrtc, meta) ||
+	    atkbdc_snapshot(ctx->atkbdc_base, meta))
+		return -1;
+	return 0;
+}
+
+/*
+ * Append a snapshot generation to snapshot_path. The first save of a
+ * session writes the header and a full image; later ones only the pages
+ * written since, see snapshot_track(). The VM must be paused.
+ *
+ * A full image is written to a new file renamed over snapshot_path once
+ * complete: clones may have the old template mapped, and truncating it
+ * under them would make their guest memory fault.
+ */
+int
+vm_snapshot_save(struct vmctx *ctx)
+{
+	struct snapshot_header hdr;
+	struct snapshot_meta meta;
+	uint64_t *dirty = NULL;
+	char tmp_path[PATH_MAX];
+	bool full;
+	off_t off;
+	int fd = -1, ret = -1;
+
+	bzero(&meta, sizeof(meta));
+	meta.op = SNAPSHOT_SAVE;
+
+	/* templates are always full, and never saved to incrementally */
+	if (!snapshot_template)
+		dirty = snapshot_track(ctx);
+	full = (dirty == NULL);
+
+	if (full)
+		generation = 0;
+	else
+		generation++;
+
+	if (!full)
+		fd = open(snapshot_path, O_RDWR);
+	else if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp",
+			snapshot_path) >= sizeof(tmp_path))
+		errno = ENAMETOOLONG;
+	else
+		fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		goto out;
+
+	if (full) {
+		bzero(&hdr, sizeof(hdr));
+		memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+		hdr.version = SNAPSHOT_VERSION;
+		hdr.ncpus = guest_ncpus;
+		hdr.lowmem = ctx->lowmem;
+		hdr.highmem = ctx->highmem;
+		if (snapshot_write(fd, &hdr, sizeof(hdr)))
+			goto out;
+		off = sizeof(hdr);
+	} else {
+		off = lseek(fd, 0, SEEK_END);
+		if (off <= 0)
+			goto out;
+	}
+
+	if (snapshot_template ? snapshot_save_flat(ctx, fd, &off) :
+	    snapshot_save_memory(ctx, fd, &off, dirty))
+		goto out;
+
+	if (pci_snapshot(ctx, &meta) ||
+	    snapshot_write_section(fd, SNAPSHOT_SEC_DEV, meta.buf, meta.off))
+		goto out;
+
+	meta.off = 0;
+	if (snapshot_platform(ctx, &meta) ||
+	    snapshot_write_section(fd, SNAPSHOT_SEC_PM, meta.buf, meta.off))
+		goto out;
+
+	if (snapshot_write_section(fd, SNAPSHOT_SEC_END, NULL, 0) || fsync(fd))
+		goto out;
+	if (full && rename(tmp_path, snapshot_path))
+		goto out;
+
+	printf("snapshot: saved generation %u to %s\n", generation,
+		snapshot_path);
+	ret = 0;
+
+out:
+	if (ret) {
+		fprintf(stderr, "snapshot: failed to save %s: %s\n",
+			snapshot_path, strerror(errno));
+		/* the file is in an unknown state, start over next time */
+		tracking = false;
+		if (full && fd >= 0)
+			unlink(tmp_path);
+	}
+	if (fd >= 0)
+		close(fd);
+	free(dirty);
+	free(meta.buf);
+	return ret;
+}
+
+static int
+snapshot_restore_extent(struct vmctx *ctx, uint8_t *map, size_t off,
+			const struct snapshot_section *sec)
+{
+	const struct snapshot_mem_extent *ext;
+	size_t data, end;
+	uint64_t len;
+
+	if (sec->len < sizeof(*ext))
+		return -1;
+
+	ext = (const struct snapshot_mem_extent *)(map + off + sizeof(*sec));
+	if (ext->npages > (UINT64_MAX >> SNAPSHOT_PAGE_SHIFT))
+		return -1;
+	len = ext->npages << SNAPSHOT_PAGE_SHIFT;
+	if (!snapshot_gpa_valid(ctx, ext->gpa, len))
+		return -1;
+
+	if (ext->flags & SNAPSHOT_MEM_ZERO) {
+		memset(ctx->baseaddr + ext->gpa, 0, len);
+		return 0;
+	}
+
+	data = roundup2(off + sizeof(*sec) + sizeof(*ext), SNAPSHOT_PAGE_SIZE);
+	end = off + sizeof(*sec) + sec->len;
+	if (data > end || end - data != len)
+		return -1;
+
+	memcpy(ctx->baseaddr + ext->gpa, map + data, len);
+	return 0;
+}
+
+static int
+snapshot_restore_meta(struct vmctx *ctx, uint8_t *map, size_t off,
+		      int (*fn)(struct vmctx *, struct snapshot_meta *))
+{
+	struct snapshot_section *sec = (struct snapshot_section *)(map + off);
+	struct snapshot_meta meta;
+
+	bzero(&meta, sizeof(meta));
+	meta.op = SNAPSHOT_RESTORE;
+	meta.buf = map + off + sizeof(*sec);
+	meta.size = sec->len;
+
+	return fn(ctx, &meta);
+}
+
+/*
+ * Load the last complete generation of restore_path into the freshly set
+ * up VM instead of booting it. The VM then starts as if waking from S3.
+ */
+int
+vm_snapshot_restore(struct vmctx *ctx)
+{
+	struct snapshot_header *hdr;
+	struct snapshot_section *sec;
+	struct stat st;
+	size_t off, next, end = 0, size = 0;
+	size_t dev_off = 0, pm_off = 0, last_dev = 0, last_pm = 0;
+	uint32_t last_gen = 0;
+	uint8_t *map = MAP_FAILED;
+	int fd, ret = -1;
+
+	fd = open(restore_path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(restore_path);
+		goto out;
+	}
+
+	size = st.st_size;
+	if (size < sizeof(*hdr))
+		goto bad;
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("snapshot: mmap");
+		goto out;
+	}
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	hdr = (struct snapshot_header *)map;
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != SNAPSHOT_VERSION)
+		goto bad;
+	if (hdr->ncpus != guest_ncpus || hdr->lowmem != ctx->lowmem ||
+	    hdr->highmem != ctx->highmem) {
+		fprintf(stderr, "snapshot: %s was taken with a different VM "
+			"configuration\n", restore_path);
+		goto out;
+	}
+
+	/* a save interrupted half way leaves a generation without END */
+	for (off = sizeof(*hdr); off + sizeof(*sec) <= size; off = next) {
+		sec = (struct snapshot_section *)(map + off);
+		if (sec->len > size - off - sizeof(*sec))
+			break;
+		next = off + sizeof(*sec) + sec->len;
+
+		if (sec->type == SNAPSHOT_SEC_DEV)
+			dev_off = off;
+		else if (sec->type == SNAPSHOT_SEC_PM)
+			pm_off = off;
+		else if (sec->type == SNAPSHOT_SEC_END) {
+			end = next;
+			last_dev = dev_off;
+			last_pm = pm_off;
+			last_gen = sec->id;
+		}
+	}
+	if (end == 0 || last_dev == 0 || last_pm == 0)
+		goto bad;
+
+	/* a clone already has the template memory mapped */
+	for (off = sizeof(*hdr); off < end && !clone_path; off = next) {
+		sec = (struct snapshot_section *)(map + off);
+		next = off + sizeof(*sec) + sec->len;
+		if (sec->type == SNAPSHOT_SEC_MEM &&
+		    snapshot_restore_extent(ctx, map, off, sec))
+			goto bad;
+	}
+
+	/*
+	 * Saving back to the same file continues its generations: drop a
+	 * trailing incomplete one, and log the pages written from now on,
+	 * including the rings the devices map again below.
+	 */
+	if (snapshot_path && !snapshot_template &&
+	    !strcmp(snapshot_path, restore_path) &&
+	    truncate(snapshot_path, end) == 0) {
+		free(snapshot_track(ctx));
+		generation = last_gen;
+	}
+
+	if (snapshot_restore_meta(ctx, map, last_dev, pci_snapshot) ||
+	    snapshot_restore_meta(ctx, map, last_pm, snapshot_platform))
+		goto bad;
+	pm_backto_wakeup(ctx);
+
+	printf("snapshot: restored generation %u from %s\n", last_gen,
+		restore_path);
+
+	/* a reboot of the restored guest boots it normally */
+	free(restore_path);
+	restore_path = NULL;
+	ret = 0;
+	goto out;
+
+bad:
+	fprintf(stderr, "snapshot: %s is not a valid snapshot\n",
+		restore_path);
+out:
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/*
+ * The DM may write [gpa, gpa + len) of guest memory, which the hypervisor
+ * does not log: have the next incremental save write it. Called by
+ * vm_gpa2hva() for every translation, and by the devices for the guest
+ * memory they keep pointers to.
+ */
+void
+vm_snapshot_mark(struct vmctx *ctx, uint64_t gpa, size_t len)
+{
+	uint64_t pg, last, mask, *word;
+	size_t bit;
+
+	if (ctx->snapshot_dirty == NULL ||
+	    !snapshot_gpa_valid(ctx, gpa, len ? len : 1))
+		return;
+
+	last = (gpa + (len ? len : 1) - 1) >> SNAPSHOT_PAGE_SHIFT;
+	for (pg = gpa >> SNAPSHOT_PAGE_SHIFT; pg <= last; pg++) {
+		bit = snapshot_dirty_bit(ctx, pg << SNAPSHOT_PAGE_SHIFT);
+		word = &ctx->snapshot_dirty[bit / 64];
+		mask = 1UL << (bit % 64);
+		if ((atomic_load(word) & mask) == 0)
+			atomic_or_fetch(word, mask);
+	}
+}
+
+/*
+ * A backend outside acrn-dm (VBS-K, vhost-user) writes guest memory,
+ * which neither the hypervisor nor vm_snapshot_mark() see: all the saves
+ * from now on write a full image.
+ */
+void
+vm_snapshot_untracked(void)
+{
+	if (!untracked && snapshot_path && !snapshot_template)
+		printf("snapshot: a backend writes guest memory outside "
+			"acrn-dm, snapshots are full images\n");
+	untracked = true;
+}
+
+static size_t
+clone_page_idx(struct vmctx *ctx, uint64_t gpa)
+{
+	if (gpa >= 4 * GB)
+		gpa -= 4 * GB - ctx->lowmem;
+	return gpa >> SNAPSHOT_PAGE_SHIFT;
+}
+
+/*
+ * Map the memory of the template clone_path as guest memory instead of
+ * allocating it from hugetlbfs. The layout of the template replaces the
+ * one derived from the memory size.
+ */
+int
+vm_clone_setup_memory(struct vmctx *ctx)
+{
+	struct snapshot_header hdr;
+	struct snapshot_section sec;
+	struct snapshot_mem_extent ext;
+	size_t len, data, npages;
+	off_t off;
+	char *addr;
+	int nsegs = 0;
+
+	clone_fd = open(clone_path, O_RDONLY);
+	if (clone_fd < 0) {
+		perror(clone_path);
+		return -1;
+	}
+
+	if (pread(clone_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != SNAPSHOT_VERSION ||
+	    hdr.lowmem > 4 * GB || (hdr.lowmem & (SNAPSHOT_PAGE_SIZE - 1)) ||
+	    (hdr.highmem & (SNAPSHOT_PAGE_SIZE - 1)))
+		goto bad;
+
+	ctx->lowmem = hdr.lowmem;
+	ctx->highmem = hdr.highmem;
+	clone_size = hdr.highmem ? 4 * GB + hdr.highmem : hdr.lowmem;
+	clone_base = mmap(NULL, clone_size, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (clone_base == MAP_FAILED) {
+		clone_base = NULL;
+		perror("clone: mmap");
+		goto err;
+	}
+	ctx->baseaddr = clone_base;
+
+	/* a template starts with the extents of lowmem and highmem */
+	for (off = sizeof(hdr);
+	     pread(clone_fd, &sec, sizeof(sec), off) == sizeof(sec) &&
+	     sec.type == SNAPSHOT_SEC_MEM;
+	     off += sizeof(sec) + sec.len) {
+		if (sec.len < sizeof(ext) || pread(clone_fd, &ext, sizeof(ext),
+				off + sizeof(sec)) != sizeof(ext))
+			goto bad;
+
+		len = ext.npages << SNAPSHOT_PAGE_SHIFT;
+		data = roundup2(off + sizeof(sec) + sizeof(ext),
+			SNAPSHOT_PAGE_SIZE);
+		if ((ext.flags & SNAPSHOT_MEM_ZERO) ||
+		    data + len != off + sizeof(sec) + sec.len ||
+		    !((ext.gpa == 0 && len == ctx->lowmem) ||
+		      (ext.gpa == 4 * GB && len == ctx->highmem)))
+			goto bad;
+
+		addr = mmap(clone_base + ext.gpa, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, clone_fd, data);
+		if (addr == MAP_FAILED) {
+			perror("clone: mmap template");
+			goto err;
+		}
+
+		/* writable once a page has been copied, see vm_clone_cow() */
+		if (vm_map_memseg_vma(ctx, len, ext.gpa, (uint64_t)addr,
+				PROT_READ | PROT_EXEC) < 0) {
+			perror("clone: map guest memory");
+			goto err;
+		}
+		nsegs++;
+	}
+	if (nsegs != (ctx->highmem ? 2 : 1))
+		goto bad;
+
+	npages = (ctx->lowmem + ctx->highmem) >> SNAPSHOT_PAGE_SHIFT;
+	ctx->cow_bitmap = calloc(howmany(npages, 64), sizeof(uint64_t));
+	if (ctx->cow_bitmap == NULL)
+		goto err;
+
+	printf("clone: guest memory 0x%lx/0x%lx mapped from %s\n",
+		ctx->lowmem, ctx->highmem, clone_path);
+	return 0;
+
+bad:
+	fprintf(stderr, "clone: %s is not a valid template\n", clone_path);
+err:
+	vm_clone_unsetup_memory(ctx);
+	return -1;
+}
+
+void
+vm_clone_unsetup_memory(struct vmctx *ctx)
+{
+	if (clone_base) {
+		munmap(clone_base, clone_size);
+		clone_base = NULL;
+	}
+	if (clone_fd >= 0) {
+		close(clone_fd);
+		clone_fd = -1;
+	}
+	free(ctx->cow_bitmap);
+	ctx->cow_bitmap = NULL;
+}
+
+/*
+ * Give the pages of [gpa, gpa + len) their private copy before they are
+ * accessed through our mapping, and map the copies writable for the guest.
+ * Pages are left shared when only the guest reads them.
+ *
+ * The copy is mapped over the template page, which the hypervisor replaces
+ * in place: the guest never finds the page missing from the EPT.
+ */
+int
+vm_clone_cow(struct vmctx *ctx, uint64_t gpa, size_t len)
+{
+	volatile uint8_t *p;
+	uint64_t pg, last, bit, *word;
+	size_t idx;
+	int ret = 0;
+
+	last = (gpa + (len ? len : 1) - 1) >> SNAPSHOT_PAGE_SHIFT;
+	for (pg = gpa >> SNAPSHOT_PAGE_SHIFT; pg <= last && !ret; pg++) {
+		idx = clone_page_idx(ctx, pg << SNAPSHOT_PAGE_SHIFT);
+		word = &ctx->cow_bitmap[idx / 64];
+		bit = 1UL << (idx % 64);
+		if (atomic_load(word) & bit)
+			continue;
+
+		pthread_mutex_lock(&clone_mtx);
+		if ((*word & bit) == 0) {
+			/* the kernel copies the page on this write */
+			p = (volatile uint8_t *)ctx->baseaddr +
+				(pg << SNAPSHOT_PAGE_SHIFT);
+			*p = *p;
+
+			if (vm_map_memseg_vma(ctx, SNAPSHOT_PAGE_SIZE,
+					pg << SNAPSHOT_PAGE_SHIFT,
+					(uint64_t)p, PROT_ALL) < 0) {
+				perror("clone: remap guest page");
+				ret = -1;
+			} else
+				atomic_or_fetch(word, bit);
+		}
+		pthread_mutex_unlock(&clone_mtx);
+	}
+
+	return ret;
+}
+
+/*
+ * A guest write to clone memory the EPT maps read only. The hypervisor
+ * does not emulate it: it restarts the write once this returns, and the
+ * page is writable by then.
+ */
+int
+vm_clone_fault(struct vmctx *ctx, uint64_t gpa)
+{
+	if (ctx->cow_bitmap == NULL || !snapshot_gpa_valid(ctx, gpa, 1))
+		return -1;
+
+	return vm_clone_cow(ctx, gpa, 1);
+}
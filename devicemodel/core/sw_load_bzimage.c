@@ -29,6 +29,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "vmmapi.h"
 #include "sw_load.h"
@@ -48,7 +50,7 @@
  * +-----------------------------------------------------+
  * | ...                                                 |
  * +-----------------------------------------------------+
- * | offset: lowmem - 4MB (ramdisk image)                |
+ * | offset: lowmem - 4MB or below (ramdisk image)       |
  * +-----------------------------------------------------+
  * | offset: lowmem - 8K (bootargs)                      |
  * +-----------------------------------------------------+
@@ -58,7 +60,9 @@
  * +-----------------------------------------------------+
  */
 
-/* Check default e820 table in sw_load_common.c for info about ctx->lowmem */
+/* Check default e820 table in sw_load_common.c for info about ctx->lowmem.
+ * Ramdisks larger than 4MB - 8K are loaded lower, see acrn_prepare_images().
+ */
 #define RAMDISK_LOAD_OFF(ctx)	(ctx->lowmem - 4*MB)
 #define BOOTARGS_LOAD_OFF(ctx)	(ctx->lowmem - 8*KB)
 #define KERNEL_ENTRY_OFF(ctx)	(ctx->lowmem - 6*KB)
@@ -93,8 +97,8 @@ static char ramdisk_path[STR_LEN];
 static char kernel_path[STR_LEN];
 static int with_ramdisk;
 static int with_kernel;
-static int ramdisk_size;
-static int kernel_size;
+static size_t ramdisk_size;
+static uint64_t ramdisk_addr;
 
 static int
 acrn_get_bzimage_setup_size(struct vmctx *ctx)
@@ -161,82 +165,85 @@ acrn_parse_ramdisk(char *arg)
 		return -1;
 }
 
+/*
+ * Memory the kernel needs from its load address to decompress: init_size
+ * of the setup header, or just the image size before boot protocol 2.10.
+ */
+static size_t
+acrn_kernel_mem_size(size_t size)
+{
+	uint32_t magic = 0, init_size = 0;
+	uint16_t version = 0;
+	int fd;
+
+	fd = open(kernel_path, O_RDONLY);
+	if (fd < 0)
+		return size;
+
+	if (pread(fd, &magic, sizeof(magic), 0x202) == sizeof(magic) &&
+	    magic == 0x53726448 &&	/* "HdrS" */
+	    pread(fd, &version, sizeof(version), 0x206) == sizeof(version) &&
+	    version >= 0x20a &&
+	    pread(fd, &init_size, sizeof(init_size), 0x260) ==
+			sizeof(init_size) &&
+	    init_size > size)
+		size = init_size;
+
+	close(fd);
+	return size;
+}
+
+/*
+ * Load the kernel and the ramdisk in parallel. The ramdisk ends below the
+ * bootargs; a large one moves down from lowmem - 4MB, as long as it stays
+ * clear of the memory the kernel decompresses into.
+ */
 static int
-acrn_prepare_ramdisk(struct vmctx *ctx)
+acrn_prepare_images(struct vmctx *ctx)
 {
-	FILE *fp;
-	int len, read;
+	struct sw_load_image img[2];
+	size_t kernel_mem = 0;
+	int n = 0;
 
-	fp = fopen(ramdisk_path, "r");
-	if (fp == NULL) {
-		printf("SW_LOAD ERR: could not open ramdisk file %s\n",
-				ramdisk_path);
-		return -1;
-	}
+	memset(img, 0, sizeof(img));
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
-	if (len > (BOOTARGS_LOAD_OFF(ctx) - RAMDISK_LOAD_OFF(ctx))) {
-		printf("SW_LOAD ERR: the size of ramdisk file is too big"
-				" file len=0x%x, limit is 0x%lx\n", len,
-				BOOTARGS_LOAD_OFF(ctx) - RAMDISK_LOAD_OFF(ctx));
-		fclose(fp);
-		return -1;
-	}
-	ramdisk_size = len;
-
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + RAMDISK_LOAD_OFF(ctx),
-			sizeof(char), len, fp);
-	if (read < len) {
-		printf("SW_LOAD ERR: could not read the whole ramdisk file,"
-				" file len=%d, read %d\n", len, read);
-		fclose(fp);
-		return -1;
+	if (with_kernel) {
+		img[n].name = "kernel";
+		img[n].path = kernel_path;
+		img[n].gpa = KERNEL_LOAD_OFF(ctx);
+		if (acrn_image_size(kernel_path, &img[n].size))
+			return -1;
+		kernel_mem = acrn_kernel_mem_size(img[n].size);
+		n++;
 	}
-	fclose(fp);
-	printf("SW_LOAD: ramdisk %s size %d copied to guest 0x%lx\n",
-			ramdisk_path, ramdisk_size, RAMDISK_LOAD_OFF(ctx));
-
-	return 0;
-}
 
-static int
-acrn_prepare_kernel(struct vmctx *ctx)
-{
-	FILE *fp;
-	int len, read;
+	ramdisk_addr = RAMDISK_LOAD_OFF(ctx);
+	if (with_ramdisk) {
+		img[n].name = "ramdisk";
+		img[n].path = ramdisk_path;
+		if (acrn_image_size(ramdisk_path, &img[n].size))
+			return -1;
+		ramdisk_size = img[n].size;
 
-	fp = fopen(kernel_path, "r");
-	if (fp == NULL) {
-		printf("SW_LOAD ERR: could not open kernel file %s\n",
-				kernel_path);
-		return -1;
+		if (ramdisk_size >
+				BOOTARGS_LOAD_OFF(ctx) - KERNEL_LOAD_OFF(ctx)) {
+			printf("SW_LOAD ERR: the size of ramdisk file is too big"
+				" file len=0x%lx\n", ramdisk_size);
+			return -1;
+		}
+		if (ramdisk_size > BOOTARGS_LOAD_OFF(ctx) - ramdisk_addr)
+			ramdisk_addr = ALIGN_DOWN(BOOTARGS_LOAD_OFF(ctx) -
+					ramdisk_size, 2 * MB);
+		img[n].gpa = ramdisk_addr;
+		n++;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
-	if ((len + KERNEL_LOAD_OFF(ctx)) > RAMDISK_LOAD_OFF(ctx)) {
+	if (KERNEL_LOAD_OFF(ctx) + kernel_mem > ramdisk_addr) {
 		printf("SW_LOAD ERR: need big system memory to fit image\n");
-		fclose(fp);
 		return -1;
 	}
-	kernel_size = len;
-
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + KERNEL_LOAD_OFF(ctx),
-			sizeof(char), len, fp);
-	if (read < len) {
-		printf("SW_LOAD ERR: could not read the whole kernel file,"
-				" file len=%d, read %d\n", len, read);
-		fclose(fp);
-		return -1;
-	}
-	fclose(fp);
-	printf("SW_LOAD: kernel %s size %d copied to guest 0x%lx\n",
-			kernel_path, kernel_size, KERNEL_LOAD_OFF(ctx));
 
-	return 0;
+	return acrn_load_images(ctx, img, n);
 }
 
 static int
@@ -255,8 +262,7 @@ acrn_prepare_zeropage(struct vmctx *ctx, int setup_size)
 
 	if (with_ramdisk) {
 		/*Copy ramdisk load_addr and size in zeropage header structure*/
-		zeropage->hdr.ramdisk_addr = (uint32_t)
-			((uint64_t)RAMDISK_LOAD_OFF(ctx));
+		zeropage->hdr.ramdisk_addr = (uint32_t)ramdisk_addr;
 		zeropage->hdr.ramdisk_size = (uint32_t)ramdisk_size;
 
 		printf("SW_LOAD: build zeropage for ramdisk addr: 0x%x,"
@@ -294,19 +300,14 @@ acrn_sw_load_bzimage(struct vmctx *ctx)
 				BOOTARGS_LOAD_OFF(ctx));
 	}
 
-	if (with_ramdisk) {
-		ret = acrn_prepare_ramdisk(ctx);
-		if (ret)
-			return ret;
-	}
+	ret = acrn_prepare_images(ctx);
+	if (ret)
+		return ret;
 
 	if (with_kernel) {
 		uint64_t *kernel_entry_addr =
 			(uint64_t *)(ctx->baseaddr + KERNEL_ENTRY_OFF(ctx));
 
-		ret = acrn_prepare_kernel(ctx);
-		if (ret)
-			return ret;
 		setup_size = acrn_get_bzimage_setup_size(ctx);
 		if (setup_size <= 0)
 			return -1;
@@ -29,14 +29,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
 
 #include "vmmapi.h"
 #include "sw_load.h"
 #include "dm.h"
+#include "boot_trace.h"
 
 int with_bootargs;
 static char bootargs[STR_LEN];
 
+/* check images against the sha256sum in <image>.sha256 */
+int sw_load_verify;
+
 /*
  * Default e820 mem map:
  *
@@ -129,6 +140,209 @@ check_image(char *path)
 	return 0;
 }
 
+int
+acrn_image_size(const char *path, size_t *size)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "SW_LOAD ERR: could not stat image %s\n",
+				path);
+		return -1;
+	}
+
+	*size = st.st_size;
+	return 0;
+}
+
+/*
+ * Image loading: files are read straight into guest memory in large
+ * chunks, with O_DIRECT when the destination is block aligned, so big
+ * images load at disk speed without going through the page cache. All
+ * the images of a loader are read in parallel.
+ */
+#define SW_LOAD_CHUNK	(8 * MB)
+#define SW_LOAD_ALIGN	(4 * KB)
+
+static int
+sw_load_set_direct(int fd, bool direct)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		return -1;
+	flags = direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+	return fcntl(fd, F_SETFL, flags);
+}
+
+static int
+sw_load_check_digest(struct sw_load_image *img, const unsigned char *md,
+		unsigned int len)
+{
+	char path[STR_LEN + 8], expected[2 * EVP_MAX_MD_SIZE + 1];
+	char digest[2 * EVP_MAX_MD_SIZE + 1];
+	unsigned int i;
+	FILE *fp;
+	int ret;
+
+	for (i = 0; i < len; i++)
+		sprintf(digest + 2 * i, "%02x", md[i]);
+
+	snprintf(path, sizeof(path), "%s.sha256", img->path);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "SW_LOAD ERR: no checksum %s\n", path);
+		return -1;
+	}
+	ret = fscanf(fp, "%128s", expected);
+	fclose(fp);
+
+	if (ret != 1 || strcasecmp(expected, digest)) {
+		fprintf(stderr, "SW_LOAD ERR: %s checksum mismatch\n",
+				img->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+sw_load_image(struct sw_load_image *img)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len;
+	EVP_MD_CTX *mdctx = NULL;
+	struct timespec start, end;
+	size_t off = 0, aligned, len;
+	bool direct;
+	ssize_t n;
+	char *dst;
+	int fd, ret = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	dst = vm_map_gpa(img->ctx, img->gpa, img->size);
+	if (dst == NULL) {
+		fprintf(stderr, "SW_LOAD ERR: %s does not fit at 0x%lx\n",
+				img->path, img->gpa);
+		return -1;
+	}
+
+	/* O_DIRECT for the whole blocks, the tail goes through the cache */
+	direct = ((uintptr_t)dst & (SW_LOAD_ALIGN - 1)) == 0;
+	aligned = ALIGN_DOWN(img->size, SW_LOAD_ALIGN);
+	fd = open(img->path, O_RDONLY | (direct ? O_DIRECT : 0));
+	if (fd < 0 && direct) {
+		direct = false;
+		fd = open(img->path, O_RDONLY);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "SW_LOAD ERR: could not open %s\n", img->path);
+		return -1;
+	}
+	img->direct = direct;
+
+	if (sw_load_verify) {
+		mdctx = EVP_MD_CTX_create();
+		if (mdctx == NULL ||
+		    !EVP_DigestInit_ex(mdctx, EVP_sha256(), NULL))
+			goto out;
+	}
+
+	while (off < img->size) {
+		if (direct && off == aligned) {
+			sw_load_set_direct(fd, false);
+			direct = false;
+		}
+
+		len = MIN(SW_LOAD_CHUNK, (direct ? aligned : img->size) - off);
+		n = pread(fd, dst + off, len, off);
+		if (n < 0 && errno == EINVAL && direct) {
+			/* the file system does not do O_DIRECT */
+			sw_load_set_direct(fd, false);
+			direct = img->direct = false;
+			continue;
+		}
+		if (n <= 0) {
+			fprintf(stderr, "SW_LOAD ERR: could not read the whole "
+				"file %s, size %ld, read %ld\n",
+				img->path, img->size, off);
+			goto out;
+		}
+
+		/* hash while the chunk is still in the cache */
+		if (mdctx && !EVP_DigestUpdate(mdctx, dst + off, n))
+			goto out;
+		off += n;
+	}
+
+	if (mdctx) {
+		if (!EVP_DigestFinal_ex(mdctx, md, &md_len) ||
+		    sw_load_check_digest(img, md, md_len))
+			goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	img->ms = (end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_nsec - start.tv_nsec) / 1000000;
+	ret = 0;
+
+out:
+	if (mdctx)
+		EVP_MD_CTX_destroy(mdctx);
+	close(fd);
+	return ret;
+}
+
+static void *
+sw_load_image_thread(void *arg)
+{
+	struct sw_load_image *img = arg;
+	int trace;
+
+	trace = boot_trace_begin("load %s", img->name);
+	img->err = sw_load_image(img);
+	boot_trace_end(trace);
+	return NULL;
+}
+
+/*
+ * Load img[0..n) into guest memory, one thread per image. The sizes
+ * must have been set with acrn_image_size().
+ */
+int
+acrn_load_images(struct vmctx *ctx, struct sw_load_image *img, int n)
+{
+	pthread_t tids[n];
+	bool started[n];
+	int i, ret = 0;
+
+	for (i = 0; i < n; i++) {
+		img[i].ctx = ctx;
+		img[i].err = -1;
+		started[i] = n > 1 && pthread_create(&tids[i], NULL,
+				sw_load_image_thread, &img[i]) == 0;
+		if (!started[i])
+			sw_load_image_thread(&img[i]);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (started[i])
+			pthread_join(tids[i], NULL);
+		if (img[i].err) {
+			ret = -1;
+			continue;
+		}
+		printf("SW_LOAD: %s %s size %ld copied to guest 0x%lx "
+			"in %ld ms%s%s\n", img[i].name, img[i].path,
+			img[i].size, img[i].gpa, img[i].ms,
+			img[i].direct ? ", direct" : "",
+			sw_load_verify ? ", verified" : "");
+	}
+
+	return ret;
+}
+
 /* Assumption:
  * the range [start, start + size] belongs to one entry of e820 table
  */
@@ -220,6 +434,15 @@ acrn_create_e820_table(struct vmctx *ctx, struct e820_entry *e820)
 int
 acrn_sw_load(struct vmctx *ctx)
 {
+	/*
+	 * The loaders write guest memory through ctx->baseaddr, so a clone
+	 * which boots afresh stops sharing its lowmem with the template, and
+	 * the next incremental snapshot saves all of it.
+	 */
+	if (ctx->cow_bitmap && vm_clone_cow(ctx, 0, ctx->lowmem))
+		return -1;
+	vm_snapshot_mark(ctx, 0, ctx->lowmem);
+
 	if (vsbl_file_name)
 		return acrn_sw_load_vsbl(ctx);
 	else
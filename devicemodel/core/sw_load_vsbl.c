@@ -104,11 +104,11 @@ struct vsbl_para {
 };
 
 static char guest_part_info_path[STR_LEN];
-static int guest_part_info_size;
+static size_t guest_part_info_size;
 static bool with_guest_part_info;
 
 static char vsbl_path[STR_LEN];
-static int vsbl_size;
+static size_t vsbl_size;
 
 static int boot_blk_bdf;
 
@@ -138,48 +138,6 @@ acrn_parse_guest_part_info(char *arg)
 		return -1;
 }
 
-static int
-acrn_prepare_guest_part_info(struct vmctx *ctx)
-{
-	FILE *fp;
-	int len, read;
-
-	fp = fopen(guest_part_info_path, "r");
-	if (fp == NULL) {
-		fprintf(stderr,
-			"SW_LOAD ERR: could not open partition blob %s\n",
-			guest_part_info_path);
-		return -1;
-	}
-
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
-	if ((len + GUEST_PART_INFO_OFF(ctx)) > BOOTARGS_OFF(ctx)) {
-		fprintf(stderr,
-			"SW_LOAD ERR: too large partition blob\n");
-		fclose(fp);
-		return -1;
-	}
-
-	guest_part_info_size = len;
-
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + GUEST_PART_INFO_OFF(ctx),
-		sizeof(char), len, fp);
-	if (read < len) {
-		fprintf(stderr,
-			"SW_LOAD ERR: could not read whole partition blob\n");
-		fclose(fp);
-		return -1;
-	}
-	fclose(fp);
-	printf("SW_LOAD: partition blob %s size %d copy to guest 0x%lx\n",
-		guest_part_info_path, guest_part_info_size,
-		GUEST_PART_INFO_OFF(ctx));
-
-	return 0;
-}
-
 int
 acrn_parse_vsbl(char *arg)
 {
@@ -198,45 +156,46 @@ acrn_parse_vsbl(char *arg)
 		return -1;
 }
 
+/* Load the vsbl and the partition blob in parallel */
 static int
-acrn_prepare_vsbl(struct vmctx *ctx)
+acrn_prepare_images(struct vmctx *ctx)
 {
-	FILE *fp;
-	int len, read;
+	struct sw_load_image img[2];
+	int n = 0;
 
-	fp = fopen(vsbl_path, "r");
-	if (fp == NULL) {
-		fprintf(stderr,
-			"SW_LOAD ERR: could not open vsbl file: %s\n",
-			vsbl_path);
-		return -1;
-	}
+	memset(img, 0, sizeof(img));
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
-	if (len > (8*MB)) {
+	if (acrn_image_size(vsbl_path, &vsbl_size))
+		return -1;
+	if (vsbl_size > (8*MB)) {
 		fprintf(stderr,
 			"SW_LOAD ERR: too large vsbl file\n");
-		fclose(fp);
 		return -1;
 	}
+	img[n].name = "vsbl";
+	img[n].path = vsbl_path;
+	img[n].gpa = VSBL_TOP(ctx) - vsbl_size;
+	img[n].size = vsbl_size;
+	n++;
 
-	vsbl_size = len;
-
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + VSBL_TOP(ctx) - vsbl_size,
-		sizeof(char), len, fp);
-	if (read < len) {
-		fprintf(stderr,
-			"SW_LOAD ERR: could not read whole partition blob\n");
-		fclose(fp);
-		return -1;
+	if (with_guest_part_info) {
+		if (acrn_image_size(guest_part_info_path,
+				&guest_part_info_size))
+			return -1;
+		if ((guest_part_info_size + GUEST_PART_INFO_OFF(ctx)) >
+				BOOTARGS_OFF(ctx)) {
+			fprintf(stderr,
+				"SW_LOAD ERR: too large partition blob\n");
+			return -1;
+		}
+		img[n].name = "partition blob";
+		img[n].path = guest_part_info_path;
+		img[n].gpa = GUEST_PART_INFO_OFF(ctx);
+		img[n].size = guest_part_info_size;
+		n++;
 	}
-	fclose(fp);
-	printf("SW_LOAD: partition blob %s size %d copy to guest 0x%lx\n",
-		vsbl_path, vsbl_size, VSBL_TOP(ctx) - vsbl_size);
 
-	return 0;
+	return acrn_load_images(ctx, img, n);
 }
 
 int
@@ -273,10 +232,11 @@ acrn_sw_load_vsbl(struct vmctx *ctx)
 		vsbl_para->bootargs_address = 0;
 	}
 
+	ret = acrn_prepare_images(ctx);
+	if (ret)
+		return ret;
+
 	if (with_guest_part_info) {
-		ret = acrn_prepare_guest_part_info(ctx);
-		if (ret)
-			return ret;
 		vsbl_para->guest_part_info_address = GUEST_PART_INFO_OFF(ctx);
 		vsbl_para->guest_part_info_size = guest_part_info_size;
 	} else {
@@ -284,10 +244,6 @@ acrn_sw_load_vsbl(struct vmctx *ctx)
 		vsbl_para->guest_part_info_size = 0;
 	}
 
-	ret = acrn_prepare_vsbl(ctx);
-	if (ret)
-		return ret;
-
 	vsbl_para->vsbl_address = VSBL_TOP(ctx) - vsbl_size;
 	vsbl_para->vsbl_size = vsbl_size;
 
@@ -44,6 +44,7 @@
 #include "mevent.h"
 
 #include "dm.h"
+#include "snapshot.h"
 
 #define MAP_NOCORE 0
 #define MAP_ALIGNED_SUPER 0
@@ -318,9 +319,49 @@ vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	return ioctl(ctx->fd, IC_SET_MEMSEG, &memmap);
 }
 
+int
+vm_unmap_memseg(struct vmctx *ctx, size_t len, vm_paddr_t gpa)
+{
+	struct vm_memmap memmap;
+
+	bzero(&memmap, sizeof(struct vm_memmap));
+	memmap.type = VM_MEMMAP_SYSMEM;
+	memmap.len = len;
+	memmap.gpa = gpa;
+	return ioctl(ctx->fd, IC_UNSET_MEMSEG, &memmap);
+}
+
+/*
+ * Record where guest RAM ended up in our address space, for
+ * vm_gpa2hva(). Segments are kept in guest physical address order.
+ */
+static void
+vm_setup_gpa_segs(struct vmctx *ctx)
+{
+	struct vm_gpa_seg *seg = ctx->gpa_segs;
+
+	if (ctx->lowmem > 0) {
+		seg->gpa = 0;
+		seg->end = ctx->lowmem;
+		seg->hva = ctx->baseaddr;
+		seg++;
+	}
+
+	if (ctx->highmem > 0) {
+		seg->gpa = 4*GB;
+		seg->end = 4*GB + ctx->highmem;
+		seg->hva = ctx->baseaddr + 4*GB;
+		seg++;
+	}
+
+	ctx->nr_gpa_segs = seg - ctx->gpa_segs;
+}
+
 int
 vm_setup_memory(struct vmctx *ctx, size_t memsize)
 {
+	int error;
+
 	/*
 	 * If 'memsize' cannot fit entirely in the 'lowmem' segment then
 	 * create another 'highmem' segment above 4GB for the remainder.
@@ -333,13 +374,26 @@ vm_setup_memory(struct vmctx *ctx, size_t memsize)
 		ctx->highmem = 0;
 	}
 
-	return hugetlb_setup_memory(ctx);
+	if (vm_clone_requested())
+		error = vm_clone_setup_memory(ctx);
+	else
+		error = hugetlb_setup_memory(ctx);
+	if (error == 0)
+		vm_setup_gpa_segs(ctx);
+
+	return error;
 }
 
 void
 vm_unsetup_memory(struct vmctx *ctx)
 {
-	hugetlb_unsetup_memory(ctx);
+	ctx->nr_gpa_segs = 0;
+	free(ctx->snapshot_dirty);
+	ctx->snapshot_dirty = NULL;
+	if (ctx->cow_bitmap != NULL)
+		vm_clone_unsetup_memory(ctx);
+	else
+		hugetlb_unsetup_memory(ctx);
 }
 
 /*
@@ -352,23 +406,7 @@ vm_unsetup_memory(struct vmctx *ctx)
 void *
 vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
 {
-
-	if (ctx->lowmem > 0) {
-		if (gaddr < ctx->lowmem && len <= ctx->lowmem &&
-		    gaddr + len <= ctx->lowmem)
-			return (ctx->baseaddr + gaddr);
-	}
-
-	if (ctx->highmem > 0) {
-		if (gaddr >= 4*GB) {
-			if (gaddr < 4*GB + ctx->highmem &&
-			    len <= ctx->highmem &&
-			    gaddr + len <= 4*GB + ctx->highmem)
-				return (ctx->baseaddr + gaddr);
-		}
-	}
-
-	return NULL;
+	return vm_gpa2hva(ctx, gaddr, len);
 }
 
 size_t
@@ -456,6 +494,31 @@ vm_lapic_msi(struct vmctx *ctx, uint64_t addr, uint64_t msg)
 	return ioctl(ctx->fd, IC_INJECT_MSI, &msi);
 }
 
+int
+vm_assign_irqfd(struct vmctx *ctx, int fd, uint64_t addr, uint64_t msg)
+{
+	struct ic_irqfd irqfd;
+
+	bzero(&irqfd, sizeof(irqfd));
+	irqfd.fd = fd;
+	irqfd.msi.msi_addr = addr;
+	irqfd.msi.msi_data = msg;
+
+	return ioctl(ctx->fd, IC_SET_IRQFD, &irqfd);
+}
+
+int
+vm_deassign_irqfd(struct vmctx *ctx, int fd)
+{
+	struct ic_irqfd irqfd;
+
+	bzero(&irqfd, sizeof(irqfd));
+	irqfd.fd = fd;
+	irqfd.flags = IRQFD_DEASSIGN;
+
+	return ioctl(ctx->fd, IC_SET_IRQFD, &irqfd);
+}
+
 int
 vm_ioapic_assert_irq(struct vmctx *ctx, int irq)
 {
@@ -511,6 +574,57 @@ vm_isa_pulse_irq(struct vmctx *ctx, int atpic_irq, int ioapic_irq)
 	return vm_isa_irq(ctx, atpic_irq, ioapic_irq, IC_PULSE_IRQLINE);
 }
 
+int
+vm_ioapic_notify_irq(struct vmctx *ctx, int irq)
+{
+	struct acrn_irqline ioapic_irq;
+
+	bzero(&ioapic_irq, sizeof(ioapic_irq));
+	ioapic_irq.intr_type = ACRN_INTR_TYPE_IOAPIC;
+	ioapic_irq.ioapic_irq = irq;
+
+	return ioctl(ctx->fd, IC_NOTIFY_IRQLINE, &ioapic_irq);
+}
+
+int
+vm_set_irqline_page(struct vmctx *ctx, struct acrn_irqline_page *page)
+{
+	struct acrn_set_irqline_page lp;
+
+	bzero(&lp, sizeof(lp));
+	lp.page = (uint64_t)page;
+
+	return ioctl(ctx->fd, IC_SET_IRQLINE_PAGE, &lp);
+}
+
+int
+vm_assign_doorbell(struct vmctx *ctx, uint64_t addr, uint32_t len,
+		uint32_t flags, uint64_t data, int fd)
+{
+	struct ic_doorbell db;
+
+	bzero(&db, sizeof(db));
+	db.addr = addr;
+	db.len = len;
+	db.flags = flags;
+	db.data = data;
+	db.fd = fd;
+
+	return ioctl(ctx->fd, IC_SET_DOORBELL, &db);
+}
+
+int
+vm_deassign_doorbell(struct vmctx *ctx, int fd)
+{
+	struct ic_doorbell db;
+
+	bzero(&db, sizeof(db));
+	db.flags = ACRN_DOORBELL_DEASSIGN;
+	db.fd = fd;
+
+	return ioctl(ctx->fd, IC_SET_DOORBELL, &db);
+}
+
 int
 vm_assign_ptdev(struct vmctx *ctx, int bus, int slot, int func)
 {
@@ -635,3 +749,43 @@ vm_get_cpu_state(struct vmctx *ctx, void *state_buf)
 {
 	return ioctl(ctx->fd, IC_PM_GET_CPU_STATE, state_buf);
 }
+
+/*
+ * Log the pages written by the guest in all of its memory. All the
+ * pages are clean once logging is enabled.
+ */
+int
+vm_set_dirty_log(struct vmctx *ctx, bool enable)
+{
+	struct ic_dirty_log_ctrl ctrl;
+
+	bzero(&ctrl, sizeof(ctrl));
+	if (enable) {
+		ctrl.op = DIRTY_LOG_ENABLE;
+		if (ctx->highmem > 0)
+			ctrl.size = 4*GB + ctx->highmem;
+		else
+			ctrl.size = ctx->lowmem;
+	} else
+		ctrl.op = DIRTY_LOG_DISABLE;
+
+	return ioctl(ctx->fd, IC_SET_DIRTY_LOG, &ctrl);
+}
+
+/*
+ * Fetch the dirty bitmap of [gpa, gpa + size), one bit per page, and
+ * clean the pages reported dirty. gpa must be aligned to 64 pages.
+ */
+int
+vm_get_dirty_log(struct vmctx *ctx, vm_paddr_t gpa, size_t size,
+		uint64_t *bitmap)
+{
+	struct ic_dirty_log log;
+
+	bzero(&log, sizeof(log));
+	log.gpa = gpa;
+	log.size = size;
+	log.bitmap = (uint64_t)bitmap;
+
+	return ioctl(ctx->fd, IC_GET_DIRTY_LOG, &log);
+}
@@ -40,6 +40,7 @@
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "dm.h"
@@ -63,6 +64,14 @@
 #define BLOCKIF_NUMTHR	8
 #define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
 
+/*
+ * Sequential reads or writes are merged into one vectored operation of up
+ * to merge= KB (BLOCKIF_MERGE_DEF by default, 0 disables merging) and
+ * BLOCKIF_MERGE_IOV segments.
+ */
+#define BLOCKIF_MERGE_DEF	256
+#define BLOCKIF_MERGE_IOV	256
+
 /*
  * Debug printf
  */
@@ -92,6 +101,47 @@ struct blockif_elem {
 	enum blockstat	     status;
 	pthread_t            tid;
 	off_t		     block;
+	struct blockif_elem *mnext;	/* next request merged into this one */
+
+	/* accounting, the request itself may be gone on completion */
+	ssize_t		     bytes;
+	int		     err;
+	int		     bounced;
+	uint64_t	     t_submit;
+	uint64_t	     t_start;
+	uint64_t	     t_done;
+};
+
+/*
+ * Log2 histograms: bucket 0 counts zero values, bucket i counts values in
+ * [2^(i-1), 2^i). Latencies are kept in us, sizes in 512 byte sectors.
+ */
+#define BLOCKIF_HIST_SZ	24
+
+struct blockif_opstat {
+	uint64_t	ops;
+	uint64_t	errs;
+	uint64_t	bytes;
+	uint64_t	wait_ns;	/* submit -> start, time spent queued */
+	uint64_t	svc_ns;		/* start -> done, backing store time */
+	uint64_t	wait_max_ns;
+	uint64_t	svc_max_ns;
+	uint64_t	wait_hist[BLOCKIF_HIST_SZ];
+	uint64_t	svc_hist[BLOCKIF_HIST_SZ];
+	uint64_t	size_hist[BLOCKIF_HIST_SZ];
+};
+
+struct blockif_stats {
+	struct blockif_opstat	op[BOP_DELETE + 1];
+	uint64_t	depth_hist[BLOCKIF_HIST_SZ];	/* in-flight on submit */
+	int		inflight_max;
+	int		busy_max;
+	uint64_t	blocked;	/* serialized behind an overlapping req */
+	uint64_t	merged;		/* merged into an earlier request */
+	uint64_t	bounced;	/* copied through the bounce buffer */
+	uint64_t	rejected;	/* queue full */
+	uint64_t	cancelled;	/* cancelled before being started */
+	uint64_t	t_reset;
 };
 
 struct blockif_ctxt {
@@ -109,9 +159,20 @@ struct blockif_ctxt {
 	int			psectsz;
 	int			psectoff;
 	int			closing;
+	struct blockif_sched	*sched;
+	off_t			last_off;	/* end of the last dispatch */
+	ssize_t			merge_max;
 	pthread_t		btid[BLOCKIF_NUMTHR];
 	pthread_mutex_t		mtx;
 	pthread_cond_t		cond;
+	char			ident[16];
+	char			*path;
+	LIST_ENTRY(blockif_ctxt) list;
+
+	/* Statistics, protected by mtx */
+	int			inflight;
+	int			busy;		/* worker threads doing i/o */
+	struct blockif_stats	stats;
 
 	/* Request elements and free/pending/busy queues */
 	TAILQ_HEAD(, blockif_elem) freeq;
@@ -120,6 +181,15 @@ struct blockif_ctxt {
 	struct blockif_elem	reqs[BLOCKIF_MAXREQ];
 };
 
+/*
+ * Dispatch policy: pick the next pending request to be started, or NULL if
+ * there is none. Called with bc->mtx held.
+ */
+struct blockif_sched {
+	const char		*name;
+	struct blockif_elem	*(*pick)(struct blockif_ctxt *bc);
+};
+
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
 
 struct blockif_sig_elem {
@@ -131,6 +201,73 @@ struct blockif_sig_elem {
 
 static struct blockif_sig_elem *blockif_bse_head;
 
+static LIST_HEAD(, blockif_ctxt) blockif_list;
+static pthread_mutex_t blockif_list_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static const char * const blockop_name[] = {
+	[BOP_READ]	= "read",
+	[BOP_WRITE]	= "write",
+	[BOP_FLUSH]	= "flush",
+	[BOP_DELETE]	= "delete",
+};
+
+static inline uint64_t
+blockif_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline void
+blockif_hist_add(uint64_t *hist, uint64_t val)
+{
+	int i;
+
+	i = val ? 64 - __builtin_clzl(val) : 0;
+	if (i >= BLOCKIF_HIST_SZ)
+		i = BLOCKIF_HIST_SZ - 1;
+	hist[i]++;
+}
+
+/* Account a request leaving the queues, called with bc->mtx held */
+static void
+blockif_stats_done(struct blockif_ctxt *bc, struct blockif_elem *be)
+{
+	struct blockif_stats *st = &bc->stats;
+	struct blockif_opstat *os;
+	uint64_t wait, svc;
+
+	bc->inflight--;
+	if (be->status != BST_DONE) {
+		st->cancelled++;
+		return;
+	}
+
+	os = &st->op[be->op];
+	wait = be->t_start - be->t_submit;
+	svc = be->t_done - be->t_start;
+
+	os->ops++;
+	if (be->err)
+		os->errs++;
+	else
+		os->bytes += be->bytes;
+	os->wait_ns += wait;
+	os->svc_ns += svc;
+	if (wait > os->wait_max_ns)
+		os->wait_max_ns = wait;
+	if (svc > os->svc_max_ns)
+		os->svc_max_ns = svc;
+	blockif_hist_add(os->wait_hist, wait / 1000);
+	blockif_hist_add(os->svc_hist, svc / 1000);
+	if (be->op != BOP_FLUSH)
+		blockif_hist_add(os->size_hist, be->bytes >> 9);
+	if (be->bounced)
+		st->bounced++;
+}
+
 static int
 blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
@@ -152,11 +289,16 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		off = breq->offset;
 		for (i = 0; i < breq->iovcnt; i++)
 			off += breq->iov[i].iov_len;
+		be->bytes = breq->resid;
 		break;
 	default:
 		/* off = OFF_MAX; */
 		off = 1 << (sizeof(off_t) - 1);
+		be->bytes = 0;
 	}
+	be->err = 0;
+	be->bounced = 0;
+	be->t_submit = blockif_now();
 	be->block = off;
 	TAILQ_FOREACH(tbe, &bc->pendq, link) {
 		if (tbe->block == breq->offset)
@@ -170,14 +312,22 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	}
 	if (tbe == NULL)
 		be->status = BST_PEND;
-	else
+	else {
 		be->status = BST_BLOCK;
+		bc->stats.blocked++;
+	}
 	TAILQ_INSERT_TAIL(&bc->pendq, be, link);
+
+	bc->inflight++;
+	if (bc->inflight > bc->stats.inflight_max)
+		bc->stats.inflight_max = bc->inflight;
+	blockif_hist_add(bc->stats.depth_hist, bc->inflight);
 	return (be->status == BST_PEND);
 }
 
-static int
-blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
+/* Submission order, the original behavior */
+static struct blockif_elem *
+blockif_pick_fifo(struct blockif_ctxt *bc)
 {
 	struct blockif_elem *be;
 
@@ -186,12 +336,121 @@ blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
 			break;
 		assert(be->status == BST_BLOCK);
 	}
-	if (be == NULL)
-		return 0;
+	return be;
+}
+
+/*
+ * One way elevator: the lowest offset at or above the end of the previous
+ * dispatch, wrapping around to the lowest offset. Requests queued after a
+ * flush are not considered until the flush has been started.
+ */
+static struct blockif_elem *
+blockif_pick_elevator(struct blockif_ctxt *bc)
+{
+	struct blockif_elem *be, *fwd, *low;
+	off_t off;
+
+	fwd = low = NULL;
+	TAILQ_FOREACH(be, &bc->pendq, link) {
+		if (be->op == BOP_FLUSH) {
+			if (fwd == NULL && low == NULL &&
+			    be->status == BST_PEND)
+				return be;
+			break;
+		}
+		if (be->status != BST_PEND)
+			continue;
+		off = be->req->offset;
+		if (off >= bc->last_off &&
+		    (fwd == NULL || off < fwd->req->offset))
+			fwd = be;
+		if (low == NULL || off < low->req->offset)
+			low = be;
+	}
+	return fwd ? fwd : low;
+}
+
+static struct blockif_sched blockif_scheds[] = {
+	{ "fifo",	blockif_pick_fifo },
+	{ "elevator",	blockif_pick_elevator },
+};
+
+static void
+blockif_start(struct blockif_ctxt *bc, struct blockif_elem *be, pthread_t t)
+{
 	TAILQ_REMOVE(&bc->pendq, be, link);
 	be->status = BST_BUSY;
 	be->tid = t;
+	be->t_start = blockif_now();
 	TAILQ_INSERT_TAIL(&bc->busyq, be, link);
+}
+
+/*
+ * Chain the pending requests that continue @head back to back, so they are
+ * issued as a single preadv/pwritev. A candidate is the first queued request
+ * starting where the chain ends; it is taken only if it does the same
+ * operation and no other request in flight ends at its start. Queue order
+ * is kept across flushes.
+ */
+static void
+blockif_merge(struct blockif_ctxt *bc, struct blockif_elem *head, pthread_t t)
+{
+	struct blockif_elem *tail, *tbe, *dep;
+	ssize_t bytes;
+	int iovcnt;
+
+	if (head->op != BOP_READ && head->op != BOP_WRITE)
+		return;
+	if (head->op == BOP_WRITE && bc->rdonly)
+		return;
+
+	tail = head;
+	bytes = head->bytes;
+	iovcnt = head->req->iovcnt;
+	for (;;) {
+		TAILQ_FOREACH(tbe, &bc->pendq, link) {
+			if (tbe->op == BOP_FLUSH)
+				return;
+			if (tbe->req->offset == tail->block)
+				break;
+		}
+		if (tbe == NULL || tbe->op != head->op)
+			return;
+		if (bytes + tbe->bytes > bc->merge_max ||
+		    iovcnt + tbe->req->iovcnt > BLOCKIF_MERGE_IOV)
+			return;
+		TAILQ_FOREACH(dep, &bc->busyq, link) {
+			if (dep != tail && dep->block == tbe->req->offset)
+				return;
+		}
+
+		blockif_start(bc, tbe, t);
+		tail->mnext = tbe;
+		tail = tbe;
+		bytes += tbe->bytes;
+		iovcnt += tbe->req->iovcnt;
+		bc->last_off = tbe->block;
+		bc->stats.merged++;
+	}
+}
+
+static int
+blockif_dequeue(struct blockif_ctxt *bc, pthread_t t, struct blockif_elem **bep)
+{
+	struct blockif_elem *be;
+
+	be = bc->sched->pick(bc);
+	if (be == NULL)
+		return 0;
+	blockif_start(bc, be, t);
+	if (be->op != BOP_FLUSH)
+		bc->last_off = be->block;
+	if (bc->merge_max > 0 && !bc->isgeom)
+		blockif_merge(bc, be, t);
+
+	bc->busy++;
+	if (bc->busy > bc->stats.busy_max)
+		bc->stats.busy_max = bc->busy;
 	*bep = be;
 	return 1;
 }
@@ -201,6 +460,7 @@ blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 {
 	struct blockif_elem *tbe;
 
+	blockif_stats_done(bc, be);
 	if (be->status == BST_DONE || be->status == BST_BUSY)
 		TAILQ_REMOVE(&bc->busyq, be, link);
 	else
@@ -226,6 +486,8 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 	br = be->req;
 	if (br->iovcnt <= 1)
 		buf = NULL;
+	be->bounced = (buf != NULL &&
+		       (be->op == BOP_READ || be->op == BOP_WRITE));
 	err = 0;
 	switch (be->op) {
 	case BOP_READ:
@@ -332,16 +594,63 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 		break;
 	}
 
+	be->err = err;
+	be->t_done = blockif_now();
 	be->status = BST_DONE;
 
 	(*br->callback)(br, err);
 }
 
+/* Issue a chain of merged reads or writes, then complete each request */
+static void
+blockif_proc_merged(struct blockif_ctxt *bc, struct blockif_elem *head,
+		    struct iovec *iov)
+{
+	struct blockif_elem *be;
+	struct blockif_req *br;
+	ssize_t len, clen;
+	uint64_t now;
+	int iovcnt, err;
+
+	iovcnt = 0;
+	for (be = head; be != NULL; be = be->mnext) {
+		br = be->req;
+		memcpy(&iov[iovcnt], br->iov, br->iovcnt * sizeof(*iov));
+		iovcnt += br->iovcnt;
+	}
+
+	err = 0;
+	if (head->op == BOP_READ)
+		len = preadv(bc->fd, iov, iovcnt,
+			     head->req->offset + bc->sub_file_start_lba);
+	else
+		len = pwritev(bc->fd, iov, iovcnt,
+			      head->req->offset + bc->sub_file_start_lba);
+	if (len < 0) {
+		err = errno;
+		len = 0;
+	}
+
+	now = blockif_now();
+	for (be = head; be != NULL; be = be->mnext) {
+		br = be->req;
+		clen = MIN(len, br->resid);
+		br->resid -= clen;
+		len -= clen;
+
+		be->err = err;
+		be->t_done = now;
+		be->status = BST_DONE;
+		(*br->callback)(br, err);
+	}
+}
+
 static void *
 blockif_thr(void *arg)
 {
 	struct blockif_ctxt *bc;
-	struct blockif_elem *be;
+	struct blockif_elem *be, *next;
+	struct iovec iov[BLOCKIF_MERGE_IOV];
 	pthread_t t;
 	uint8_t *buf;
 
@@ -356,9 +665,18 @@ blockif_thr(void *arg)
 	for (;;) {
 		while (blockif_dequeue(bc, t, &be)) {
 			pthread_mutex_unlock(&bc->mtx);
-			blockif_proc(bc, be, buf);
+			if (be->mnext)
+				blockif_proc_merged(bc, be, iov);
+			else
+				blockif_proc(bc, be, buf);
 			pthread_mutex_lock(&bc->mtx);
-			blockif_complete(bc, be);
+			do {
+				next = be->mnext;
+				be->mnext = NULL;
+				blockif_complete(bc, be);
+				be = next;
+			} while (be);
+			bc->busy--;
 		}
 		/* Check ctxt status here to see if exit requested */
 		if (bc->closing)
@@ -466,6 +784,8 @@ blockif_open(const char *optstr, const char *ident)
 	off_t size, psectsz, psectoff;
 	int extra, fd, i, sectsz;
 	int nocache, sync, ro, candelete, geom, ssopt, pssopt;
+	int merge;
+	struct blockif_sched *sched;
 	long sz;
 	long long b;
 	int err_code = -1;
@@ -480,6 +800,8 @@ blockif_open(const char *optstr, const char *ident)
 	sync = 0;
 	ro = 0;
 	sub_file_assign = 0;
+	merge = BLOCKIF_MERGE_DEF;
+	sched = &blockif_scheds[0];
 
 	/*
 	 * The first element in the optstring is always a pathname.
@@ -507,7 +829,21 @@ blockif_open(const char *optstr, const char *ident)
 		else if (sscanf(cp, "range=%ld/%ld", &sub_file_start_lba,
 				&sub_file_size) == 2)
 			sub_file_assign = 1;
-		else {
+		else if (sscanf(cp, "merge=%d", &merge) == 1 && merge >= 0)
+			;
+		else if (!strncmp(cp, "sched=", strlen("sched="))) {
+			for (i = 0; i < ARRAY_SIZE(blockif_scheds); i++) {
+				if (!strcmp(cp + strlen("sched="),
+					    blockif_scheds[i].name))
+					break;
+			}
+			if (i == ARRAY_SIZE(blockif_scheds)) {
+				fprintf(stderr, "Invalid scheduler \"%s\"\n",
+					cp);
+				goto err;
+			}
+			sched = &blockif_scheds[i];
+		} else {
 			fprintf(stderr, "Invalid device option \"%s\"\n", cp);
 			goto err;
 		}
@@ -648,6 +984,11 @@ blockif_open(const char *optstr, const char *ident)
 	bc->sectsz = sectsz;
 	bc->psectsz = psectsz;
 	bc->psectoff = psectoff;
+	bc->sched = sched;
+	bc->merge_max = (ssize_t)merge * 1024;
+	bc->path = nopt;
+	snprintf(bc->ident, sizeof(bc->ident), "%s", ident);
+	bc->stats.t_reset = blockif_now();
 	pthread_mutex_init(&bc->mtx, NULL);
 	pthread_cond_init(&bc->cond, NULL);
 	TAILQ_INIT(&bc->freeq);
@@ -664,10 +1005,15 @@ blockif_open(const char *optstr, const char *ident)
 		pthread_setname_np(bc->btid[i], tname);
 	}
 
+	pthread_mutex_lock(&blockif_list_mtx);
+	LIST_INSERT_HEAD(&blockif_list, bc, list);
+	pthread_mutex_unlock(&blockif_list_mtx);
+
 	return bc;
 err:
 	if (fd >= 0)
 		close(fd);
+	free(nopt);
 	return NULL;
 }
 
@@ -695,6 +1041,7 @@ blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		 * exceeded.
 		 */
 		err = E2BIG;
+		bc->stats.rejected++;
 	}
 	pthread_mutex_unlock(&bc->mtx);
 
@@ -815,6 +1162,10 @@ blockif_close(struct blockif_ctxt *bc)
 	assert(bc->magic == BLOCKIF_SIG);
 	sub_file_unlock(bc);
 
+	pthread_mutex_lock(&blockif_list_mtx);
+	LIST_REMOVE(bc, list);
+	pthread_mutex_unlock(&blockif_list_mtx);
+
 	/*
 	 * Stop the block i/o thread
 	 */
@@ -832,6 +1183,7 @@ blockif_close(struct blockif_ctxt *bc)
 	 */
 	bc->magic = 0;
 	close(bc->fd);
+	free(bc->path);
 	free(bc);
 
 	return 0;
@@ -931,3 +1283,110 @@ blockif_candelete(struct blockif_ctxt *bc)
 	assert(bc->magic == BLOCKIF_SIG);
 	return bc->candelete;
 }
+
+/*
+ * The file backing the device, for backends that access it directly.
+ * @start returns the offset of the device within the file.
+ */
+int
+blockif_fd(struct blockif_ctxt *bc, off_t *start)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+	*start = bc->sub_file_start_lba;
+	return bc->fd;
+}
+
+static void
+blockif_print_hist(FILE *f, const char *name, const uint64_t *hist)
+{
+	int i;
+
+	fprintf(f, "    %-8s", name);
+	for (i = 0; i < BLOCKIF_HIST_SZ; i++) {
+		if (!hist[i])
+			continue;
+		/* label each bucket with its exclusive upper bound */
+		fprintf(f, " <%lu:%lu", 1UL << i, hist[i]);
+	}
+	fprintf(f, "\n");
+}
+
+static void
+blockif_print_stats(FILE *f, struct blockif_ctxt *bc, int inflight, int busy,
+		    struct blockif_stats *st)
+{
+	struct blockif_opstat *os;
+	int i;
+
+	fprintf(f, "disk %s %s\n", bc->ident, bc->path);
+	fprintf(f, "  period %lu ms\n",
+		(blockif_now() - st->t_reset) / 1000000);
+	fprintf(f, "  inflight %d max %d, busy threads %d/%d max %d\n",
+		inflight, st->inflight_max, busy, BLOCKIF_NUMTHR,
+		st->busy_max);
+	fprintf(f, "  sched %s merge %ld KB\n", bc->sched->name,
+		bc->merge_max / 1024);
+	fprintf(f, "  blocked %lu merged %lu bounced %lu rejected %lu"
+		" cancelled %lu\n", st->blocked, st->merged, st->bounced,
+		st->rejected, st->cancelled);
+	blockif_print_hist(f, "depth", st->depth_hist);
+
+	for (i = 0; i <= BOP_DELETE; i++) {
+		os = &st->op[i];
+		if (!os->ops)
+			continue;
+		fprintf(f, "  %s ops %lu errs %lu bytes %lu\n",
+			blockop_name[i], os->ops, os->errs, os->bytes);
+		fprintf(f, "    wait avg %lu us max %lu us,"
+			" service avg %lu us max %lu us\n",
+			os->wait_ns / os->ops / 1000, os->wait_max_ns / 1000,
+			os->svc_ns / os->ops / 1000, os->svc_max_ns / 1000);
+		blockif_print_hist(f, "wait_us", os->wait_hist);
+		blockif_print_hist(f, "svc_us", os->svc_hist);
+		if (i != BOP_FLUSH)
+			blockif_print_hist(f, "sectors", os->size_hist);
+	}
+}
+
+/*
+ * Write the statistics of the disk named @ident, or of all disks if @ident
+ * is NULL or empty, to @f. The counters are restarted if @reset is set.
+ * Return the number of disks reported.
+ */
+int
+blockif_dump_stats(FILE *f, const char *ident, int reset)
+{
+	struct blockif_ctxt *bc;
+	struct blockif_stats *st;
+	int inflight, busy, n;
+
+	st = malloc(sizeof(*st));
+	if (!st)
+		return -1;
+
+	n = 0;
+	pthread_mutex_lock(&blockif_list_mtx);
+	LIST_FOREACH(bc, &blockif_list, list) {
+		if (ident && ident[0] && strcmp(ident, bc->ident))
+			continue;
+
+		pthread_mutex_lock(&bc->mtx);
+		*st = bc->stats;
+		inflight = bc->inflight;
+		busy = bc->busy;
+		if (reset) {
+			memset(&bc->stats, 0, sizeof(bc->stats));
+			bc->stats.inflight_max = bc->inflight;
+			bc->stats.busy_max = bc->busy;
+			bc->stats.t_reset = blockif_now();
+		}
+		pthread_mutex_unlock(&bc->mtx);
+
+		blockif_print_stats(f, bc, inflight, busy, st);
+		n++;
+	}
+	pthread_mutex_unlock(&blockif_list_mtx);
+
+	free(st);
+	return n;
+}
@@ -37,6 +37,7 @@
 #include <openssl/md5.h>
 
 #include "dm.h"
+#include "vmmapi.h"
 #include "pci_core.h"
 #include "ahci.h"
 #include "block_if.h"
@@ -613,7 +614,7 @@ ahci_build_iov(struct ahci_port *p, struct ahci_ioreq *aior,
 		dbcsz -= skip;
 		if (dbcsz > left)
 			dbcsz = left;
-		breq->iov[j].iov_base = paddr_guest2host(ahci_ctx(p->ahci_dev),
+		breq->iov[j].iov_base = vm_gpa2hva(ahci_ctx(p->ahci_dev),
 		    prdt->dba + skip, dbcsz);
 		breq->iov[j].iov_len = dbcsz;
 		todo += dbcsz;
@@ -782,7 +783,7 @@ read_prdt(struct ahci_port *p, int slot, uint8_t *cfis,
 		int sublen;
 
 		dbcsz = (prdt->dbc & DBCMASK) + 1;
-		ptr = paddr_guest2host(ahci_ctx(p->ahci_dev), prdt->dba, dbcsz);
+		ptr = vm_gpa2hva(ahci_ctx(p->ahci_dev), prdt->dba, dbcsz);
 		sublen = MIN(len, dbcsz);
 		memcpy(to, ptr, sublen);
 		len -= sublen;
@@ -897,7 +898,7 @@ write_prdt(struct ahci_port *p, int slot, uint8_t *cfis,
 		int sublen;
 
 		dbcsz = (prdt->dbc & DBCMASK) + 1;
-		ptr = paddr_guest2host(ahci_ctx(p->ahci_dev), prdt->dba, dbcsz);
+		ptr = vm_gpa2hva(ahci_ctx(p->ahci_dev), prdt->dba, dbcsz);
 		sublen = MIN(len, dbcsz);
 		memcpy(ptr, from, sublen);
 		len -= sublen;
@@ -2453,7 +2454,8 @@ struct pci_vdev_ops pci_ops_ahci = {
 	.class_name	= "ahci",
 	.vdev_init	= pci_ahci_hd_init,
 	.vdev_barwrite	= pci_ahci_write,
-	.vdev_barread	= pci_ahci_read
+	.vdev_barread	= pci_ahci_read,
+	.vdev_parallel_init = true
 };
 DEFINE_PCI_DEVTYPE(pci_ops_ahci);
 
@@ -2461,7 +2463,8 @@ struct pci_vdev_ops pci_ops_ahci_hd = {
 	.class_name	= "ahci-hd",
 	.vdev_init	= pci_ahci_hd_init,
 	.vdev_barwrite	= pci_ahci_write,
-	.vdev_barread	= pci_ahci_read
+	.vdev_barread	= pci_ahci_read,
+	.vdev_parallel_init = true
 };
 DEFINE_PCI_DEVTYPE(pci_ops_ahci_hd);
 
@@ -2469,6 +2472,7 @@ struct pci_vdev_ops pci_ops_ahci_cd = {
 	.class_name	= "ahci-cd",
 	.vdev_init	= pci_ahci_atapi_init,
 	.vdev_barwrite	= pci_ahci_write,
-	.vdev_barread	= pci_ahci_read
+	.vdev_barread	= pci_ahci_read,
+	.vdev_parallel_init = true
 };
 DEFINE_PCI_DEVTYPE(pci_ops_ahci_cd);
@@ -34,6 +34,8 @@
 #include <strings.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "vmmapi.h"
 #include "acpi.h"
@@ -44,6 +46,9 @@
 #include "irq.h"
 #include "lpc.h"
 #include "sw_load.h"
+#include "snapshot.h"
+#include "boot_trace.h"
+#include "atomic.h"
 
 #define CONF1_ADDR_PORT    0x0cf8
 #define CONF1_DATA_PORT    0x0cfc
@@ -59,6 +64,12 @@ struct funcinfo {
 	char	*fi_param;
 	char	*fi_param_saved; /* save for reboot */
 	struct pci_vdev *fi_devi;
+
+	/* parallel vdev_init, see pci_emul_init_parallel() */
+	struct pci_vdev *fi_init_devi;
+	pthread_t fi_init_tid;
+	bool	fi_init_thread;
+	int	fi_init_err;
 };
 
 struct intxinfo {
@@ -102,6 +113,12 @@ SYSRES_MEM(PCI_EMUL_ECFG_BASE, PCI_EMUL_ECFG_SIZE);
 static struct pci_vdev_ops *pci_emul_finddev(char *name);
 static void pci_lintr_route(struct pci_vdev *dev);
 static void pci_lintr_update(struct pci_vdev *dev);
+static void pci_msix_irqfd_release(struct pci_vdev *dev);
+static void pci_msix_mask_update(struct pci_vdev *dev, int index);
+static uint64_t pci_msix_pba_read(struct pci_vdev *dev, uint64_t offset,
+				  int size);
+static int pci_msix_irqfd_bind(struct pci_vdev *dev, int index,
+			       struct msix_table_entry *mte);
 static void pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot,
 		      int func, int coff, int bytes, uint32_t *val);
 
@@ -291,6 +308,19 @@ pci_emul_msix_twrite(struct pci_vdev *dev, uint64_t offset, int size,
 	else
 		*((uint64_t *)dest) = value;
 
+	/*
+	 * Vectors may be raised through their irqfd by a kernel backend,
+	 * which does not go through pci_generate_msix(): rebind now.
+	 */
+	if (msix_entry_offset < offsetof(struct msix_table_entry,
+					 vector_control)) {
+		if (dev->msix.irqfds != NULL &&
+		    dev->msix.irqfds[tab_index].fd >= 0)
+			pci_msix_irqfd_bind(dev, tab_index,
+					    dev->msix.table + tab_index);
+	} else
+		pci_msix_mask_update(dev, tab_index);
+
 	return 0;
 }
 
@@ -330,8 +360,8 @@ pci_emul_msix_tread(struct pci_vdev *dev, uint64_t offset, int size)
 		else
 			retval = *((uint64_t *)dest);
 	} else if (pci_valid_pba_offset(dev, offset)) {
-		/* return 0 for PBA access */
-		retval = 0;
+		retval = pci_msix_pba_read(dev, offset - dev->msix.pba_offset,
+					   size);
 	}
 
 	return retval;
@@ -473,6 +503,9 @@ modify_bar_registration(struct pci_vdev *dev, int idx, int registration)
 			error = register_inout(&iop);
 		} else
 			error = unregister_inout(&iop);
+		if (dev->dev_ops->vdev_bar_decode)
+			(*dev->dev_ops->vdev_bar_decode)(dev->vmctx, dev, idx,
+				registration);
 		break;
 	case PCIBAR_MEM32:
 	case PCIBAR_MEM64:
@@ -488,6 +521,9 @@ modify_bar_registration(struct pci_vdev *dev, int idx, int registration)
 			error = register_mem(&mr);
 		} else
 			error = unregister_mem(&mr);
+		if (dev->dev_ops->vdev_bar_decode)
+			(*dev->dev_ops->vdev_bar_decode)(dev->vmctx, dev, idx,
+				registration);
 		break;
 	default:
 		error = EINVAL;
@@ -576,9 +612,20 @@ pci_emul_alloc_pbar(struct pci_vdev *pdi, int idx, uint64_t hostbase,
 {
 	int error;
 	uint64_t *baseptr, limit, addr, mask, lobits, bar;
+	struct pcibar_req *req;
 
 	assert(idx >= 0 && idx <= PCI_BARMAX);
 
+	if (pdi->deferred.active) {
+		assert(pdi->deferred.nr_bars <= PCI_BARMAX);
+		req = &pdi->deferred.bars[pdi->deferred.nr_bars++];
+		req->idx = idx;
+		req->type = type;
+		req->size = size;
+		req->hostbase = hostbase;
+		return 0;
+	}
+
 	if ((size & (size - 1)) != 0)
 		size = 1UL << flsl(size);	/* round up to a power of 2 */
 
@@ -772,17 +819,16 @@ pci_emul_finddev(char *name)
 	return NULL;
 }
 
-static int
-pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
-	      int func, struct funcinfo *fi)
+static struct pci_vdev *
+pci_emul_alloc_vdev(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus,
+		    int slot, int func, struct funcinfo *fi)
 {
 	struct pci_vdev *pdi;
-	int err;
 
 	pdi = calloc(1, sizeof(struct pci_vdev));
 	if (!pdi) {
 		fprintf(stderr, "%s: calloc returns NULL\n", __func__);
-		return -1;
+		return NULL;
 	}
 
 	pdi->vmctx = ctx;
@@ -808,15 +854,174 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		fi->fi_param = strdup(fi->fi_param_saved);
 	else
 		fi->fi_param = NULL;
-	err = (*ops->vdev_init)(ctx, pdi, fi->fi_param);
-	if (err == 0)
-		fi->fi_devi = pdi;
-	else
+
+	return pdi;
+}
+
+static int
+pci_emul_vdev_init(struct pci_vdev *pdi, struct funcinfo *fi)
+{
+	struct pci_vdev_ops *ops = pdi->dev_ops;
+	int err, trace;
+
+	trace = boot_trace_begin("%x:%x.%x %s", pdi->bus, pdi->slot,
+			pdi->func, ops->class_name);
+	err = (*ops->vdev_init)(pdi->vmctx, pdi, fi->fi_param);
+	boot_trace_end(trace);
+
+	return err;
+}
+
+static int
+pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
+	      int func, struct funcinfo *fi)
+{
+	struct pci_vdev *pdi;
+	int err;
+
+	pdi = pci_emul_alloc_vdev(ctx, ops, bus, slot, func, fi);
+	if (!pdi)
+		return -1;
+
+	err = pci_emul_vdev_init(pdi, fi);
+	if (err) {
 		free(pdi);
+		return err;
+	}
+
+	fi->fi_devi = pdi;
+	if (ops->vdev_bars_ready)
+		err = (*ops->vdev_bars_ready)(ctx, pdi);
 
 	return err;
 }
 
+static void *
+pci_emul_init_thread(void *arg)
+{
+	struct funcinfo *fi = arg;
+
+	fi->fi_init_err = pci_emul_vdev_init(fi->fi_init_devi, fi);
+	return NULL;
+}
+
+/*
+ * Start vdev_init of every device that allows it on a thread of its own.
+ * Passthrough functions and disks spend most of their init waiting on
+ * device resets and backing files, so they come up side by side while
+ * init_pci() brings up the rest in order.
+ */
+static void
+pci_emul_init_parallel(struct vmctx *ctx)
+{
+	struct pci_vdev_ops *ops;
+	struct pci_vdev *pdi;
+	struct businfo *bi;
+	struct funcinfo *fi;
+	int bus, slot, func;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &bi->slotinfo[slot].si_funcs[func];
+				if (fi->fi_name == NULL)
+					continue;
+				ops = pci_emul_finddev(fi->fi_name);
+				assert(ops != NULL);
+				if (!ops->vdev_parallel_init)
+					continue;
+
+				pdi = pci_emul_alloc_vdev(ctx, ops, bus, slot,
+						func, fi);
+				if (!pdi)
+					continue;
+				pdi->deferred.active = true;
+				fi->fi_init_devi = pdi;
+				fi->fi_init_thread = pthread_create(
+					&fi->fi_init_tid, NULL,
+					pci_emul_init_thread, fi) == 0;
+				if (!fi->fi_init_thread)
+					pci_emul_init_thread(fi);
+			}
+		}
+	}
+}
+
+/*
+ * Wait for a parallel vdev_init and grant the BARs and INTx pin it asked
+ * for, in the order it asked. Called at the device's turn in the
+ * bus/slot/func walk, this allocates exactly what a serial init would.
+ */
+static int
+pci_emul_init_finish(struct vmctx *ctx, struct funcinfo *fi)
+{
+	struct pci_vdev *pdi = fi->fi_init_devi;
+	struct pcibar_req *req;
+	int i, err;
+
+	if (fi->fi_init_thread)
+		pthread_join(fi->fi_init_tid, NULL);
+	fi->fi_init_devi = NULL;
+	if (fi->fi_init_err) {
+		free(pdi);
+		return fi->fi_init_err;
+	}
+
+	fi->fi_devi = pdi;
+	pdi->deferred.active = false;
+	for (i = 0; i < pdi->deferred.nr_bars; i++) {
+		req = &pdi->deferred.bars[i];
+		err = pci_emul_alloc_pbar(pdi, req->idx, req->hostbase,
+				req->type, req->size);
+		if (err) {
+			fprintf(stderr, "%s: no room for BAR %d\n",
+				pdi->name, req->idx);
+			return err;
+		}
+	}
+	if (pdi->deferred.lintr)
+		pci_lintr_request(pdi);
+
+	if (pdi->dev_ops->vdev_bars_ready)
+		return (*pdi->dev_ops->vdev_bars_ready)(ctx, pdi);
+	return 0;
+}
+
+/* Reap the parallel inits left over when init_pci() fails */
+static void
+pci_emul_init_abort(void)
+{
+	struct businfo *bi;
+	struct funcinfo *fi;
+	int bus, slot, func;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &bi->slotinfo[slot].si_funcs[func];
+				if (fi->fi_init_devi == NULL)
+					continue;
+				if (fi->fi_init_thread)
+					pthread_join(fi->fi_init_tid, NULL);
+				/* initialized, but without any BAR */
+				if (fi->fi_init_err == 0)
+					fi->fi_devi = fi->fi_init_devi;
+				else
+					free(fi->fi_init_devi);
+				fi->fi_init_devi = NULL;
+			}
+		}
+	}
+}
+
 static void
 pci_emul_deinit(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		int func, struct funcinfo *fi)
@@ -827,6 +1032,10 @@ pci_emul_deinit(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 		free(fi->fi_param);
 
 	if (fi->fi_devi) {
+		/* freed by vdev_deinit, keep vdev_bar_decode off it */
+		fi->fi_devi->arg = NULL;
+		pci_msix_irqfd_release(fi->fi_devi);
+		free(fi->fi_devi->msix.pba);
 		pci_lintr_release(fi->fi_devi);
 		pci_emul_free_bars(fi->fi_devi);
 		free(fi->fi_devi);
@@ -900,6 +1109,34 @@ pci_msix_table_init(struct pci_vdev *dev, int table_entries)
 	/* set mask bit of vector control register */
 	for (i = 0; i < table_entries; i++)
 		dev->msix.table[i].vector_control |= PCIM_MSIX_VCTRL_MASK;
+
+	dev->msix.pba = calloc(1, PBA_SIZE(table_entries));
+	assert(dev->msix.pba != NULL);
+
+	dev->msix.irqfds = calloc(table_entries, sizeof(struct msix_irqfd));
+	assert(dev->msix.irqfds != NULL);
+	for (i = 0; i < table_entries; i++)
+		dev->msix.irqfds[i].fd = -1;
+	pthread_mutex_init(&dev->msix.irqfd_mtx, NULL);
+}
+
+static void
+pci_msix_irqfd_release(struct pci_vdev *dev)
+{
+	int i;
+
+	if (dev->msix.irqfds == NULL)
+		return;
+
+	for (i = 0; i < dev->msix.table_count; i++) {
+		if (dev->msix.irqfds[i].fd < 0)
+			continue;
+		vm_deassign_irqfd(dev->vmctx, dev->msix.irqfds[i].fd);
+		close(dev->msix.irqfds[i].fd);
+	}
+	free(dev->msix.irqfds);
+	dev->msix.irqfds = NULL;
+	pthread_mutex_destroy(&dev->msix.irqfd_mtx);
 }
 
 int
@@ -940,7 +1177,7 @@ msixcap_cfgwrite(struct pci_vdev *dev, int capoff, int offset,
 		 int bytes, uint32_t val)
 {
 	uint16_t msgctrl, rwmask;
-	int off;
+	int off, i, fmask = -1;
 
 	off = offset - capoff;
 	/* Message Control Register */
@@ -948,6 +1185,7 @@ msixcap_cfgwrite(struct pci_vdev *dev, int capoff, int offset,
 		rwmask = PCIM_MSIXCTRL_MSIX_ENABLE |
 			PCIM_MSIXCTRL_FUNCTION_MASK;
 		msgctrl = pci_get_cfgdata16(dev, offset);
+		fmask = msgctrl & PCIM_MSIXCTRL_FUNCTION_MASK;
 		msgctrl &= ~rwmask;
 		msgctrl |= val & rwmask;
 		val = msgctrl;
@@ -958,6 +1196,11 @@ msixcap_cfgwrite(struct pci_vdev *dev, int capoff, int offset,
 	}
 
 	CFGWRITE(dev, offset, val, bytes);
+
+	if (fmask >= 0 && fmask != dev->msix.function_mask) {
+		for (i = 0; i < dev->msix.table_count; i++)
+			pci_msix_mask_update(dev, i);
+	}
 }
 
 void
@@ -1158,6 +1401,14 @@ init_pci(struct vmctx *ctx)
 
 	create_gsi_sharing_groups();
 
+	/*
+	 * Devices that can init in parallel start first; everything else is
+	 * initialized below in bus/slot/func order as before. A parallel
+	 * device has its BARs allocated when the walk reaches it, after its
+	 * init completed, so BAR allocation stays deterministic.
+	 */
+	pci_emul_init_parallel(ctx);
+
 	for (bus = 0; bus < MAXBUSES; bus++) {
 		bi = pci_businfo[bus];
 		if (bi == NULL)
@@ -1176,12 +1427,18 @@ init_pci(struct vmctx *ctx)
 				fi = &si->si_funcs[func];
 				if (fi->fi_name == NULL)
 					continue;
-				ops = pci_emul_finddev(fi->fi_name);
-				assert(ops != NULL);
-				error = pci_emul_init(ctx, ops, bus, slot,
-				    func, fi);
-				if (error)
+				if (fi->fi_init_devi) {
+					error = pci_emul_init_finish(ctx, fi);
+				} else {
+					ops = pci_emul_finddev(fi->fi_name);
+					assert(ops != NULL);
+					error = pci_emul_init(ctx, ops, bus,
+					    slot, func, fi);
+				}
+				if (error) {
+					pci_emul_init_abort();
 					return error;
+				}
 			}
 		}
 
@@ -1318,6 +1575,198 @@ deinit_pci(struct vmctx *ctx)
 	}
 }
 
+/*
+ * Register (or unregister) all BARs whose address space decoding is
+ * enabled in the command register.
+ */
+static void
+pci_emul_modify_decoded_bars(struct pci_vdev *dev, int registration)
+{
+	int i;
+
+	for (i = 0; i <= PCI_BARMAX; i++) {
+		switch (dev->bar[i].type) {
+		case PCIBAR_IO:
+			if (porten(dev))
+				modify_bar_registration(dev, i, registration);
+			break;
+		case PCIBAR_MEM32:
+		case PCIBAR_MEM64:
+			if (memen(dev))
+				modify_bar_registration(dev, i, registration);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static int
+pci_emul_snapshot(struct vmctx *ctx, struct pci_vdev *dev,
+		  struct snapshot_meta *meta)
+{
+	uint32_t bdf, saved_bdf;
+	enum lintr_stat lintr_state;
+	int i, error;
+
+	bdf = (dev->bus << 8) | (dev->slot << 3) | dev->func;
+	saved_bdf = bdf;
+	if (SNAPSHOT_VAR(meta, saved_bdf))
+		return -1;
+	if (saved_bdf != bdf) {
+		fprintf(stderr, "snapshot: pci %x:%x.%x does not match saved "
+			"device %x\n", dev->bus, dev->slot, dev->func,
+			saved_bdf);
+		return -1;
+	}
+
+	/*
+	 * The guest may have moved the BARs, so drop the current
+	 * registrations before loading config space and register the
+	 * restored addresses afterwards.
+	 */
+	if (meta->op == SNAPSHOT_RESTORE)
+		pci_emul_modify_decoded_bars(dev, 0);
+
+	SNAPSHOT_BUF(meta, dev->cfgdata, sizeof(dev->cfgdata));
+	for (i = 0; i <= PCI_BARMAX; i++)
+		SNAPSHOT_VAR(meta, dev->bar[i].addr);
+
+	if (meta->op == SNAPSHOT_RESTORE)
+		pci_emul_modify_decoded_bars(dev, 1);
+
+	SNAPSHOT_VAR(meta, dev->msi.enabled);
+	SNAPSHOT_VAR(meta, dev->msi.addr);
+	SNAPSHOT_VAR(meta, dev->msi.msg_data);
+	SNAPSHOT_VAR(meta, dev->msix.enabled);
+	SNAPSHOT_VAR(meta, dev->msix.function_mask);
+	if (dev->msix.table != NULL)
+		SNAPSHOT_BUF(meta, dev->msix.table,
+			dev->msix.table_count * MSIX_TABLE_ENTRY_SIZE);
+	if (dev->msix.pba != NULL)
+		SNAPSHOT_BUF(meta, dev->msix.pba,
+			PBA_SIZE(dev->msix.table_count));
+
+	lintr_state = dev->lintr.state;
+	SNAPSHOT_VAR(meta, lintr_state);
+	if (meta->error)
+		return -1;
+
+	/*
+	 * The interrupt controllers come back reset, so re-raise a line
+	 * that was asserted when the snapshot was taken.
+	 */
+	if (meta->op == SNAPSHOT_RESTORE && dev->lintr.pin > 0) {
+		pci_lintr_deassert(dev);
+		if (lintr_state != IDLE)
+			pci_lintr_assert(dev);
+	}
+
+	error = 0;
+	if (dev->dev_ops->vdev_snapshot)
+		error = dev->dev_ops->vdev_snapshot(ctx, dev, meta);
+
+	return (error || meta->error) ? -1 : 0;
+}
+
+/*
+ * Devices without a vdev_snapshot hook, and devices which own physical
+ * resources (vdev_phys_access), cannot be snapshotted.
+ */
+static int
+pci_emul_snapshot_check(struct pci_vdev *dev)
+{
+	if (dev->dev_ops->vdev_phys_access) {
+		fprintf(stderr, "snapshot: %s owns physical resources\n",
+			dev->name);
+		return -1;
+	}
+
+	if (!dev->dev_ops->vdev_snapshot) {
+		fprintf(stderr, "snapshot: %s does not support snapshots\n",
+			dev->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Report every device which would make pci_snapshot() fail, so that a VM
+ * configured for snapshots is refused at startup rather than on its
+ * first S3.
+ */
+int
+pci_snapshot_check(void)
+{
+	struct businfo *bi;
+	struct slotinfo *si;
+	struct funcinfo *fi;
+	int bus, slot, func;
+	int error = 0;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			si = &bi->slotinfo[slot];
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &si->si_funcs[func];
+				if (fi->fi_name == NULL || fi->fi_devi == NULL)
+					continue;
+
+				if (pci_emul_snapshot_check(fi->fi_devi))
+					error = -1;
+			}
+		}
+	}
+
+	return error;
+}
+
+/*
+ * Save or restore the generic PCI state (config space, BARs, MSI/MSI-X
+ * and INTx) of every emulated device, followed by the device private
+ * state from its vdev_snapshot hook.
+ */
+int
+pci_snapshot(struct vmctx *ctx, struct snapshot_meta *meta)
+{
+	struct businfo *bi;
+	struct slotinfo *si;
+	struct funcinfo *fi;
+	struct pci_vdev *dev;
+	int bus, slot, func;
+	int error;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			si = &bi->slotinfo[slot];
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &si->si_funcs[func];
+				dev = fi->fi_devi;
+				if (fi->fi_name == NULL || dev == NULL)
+					continue;
+
+				if (pci_emul_snapshot_check(dev))
+					return -1;
+
+				error = pci_emul_snapshot(ctx, dev, meta);
+				if (error)
+					return error;
+			}
+		}
+	}
+
+	return 0;
+}
+
 static void
 pci_apic_prt_entry(int bus, int slot, int pin, int pirq_pin, int ioapic_irq,
 		   void *arg)
@@ -1553,25 +2002,194 @@ pci_msix_enabled(struct pci_vdev *dev)
 	return (dev->msix.enabled && !dev->msi.enabled);
 }
 
+/* Is MSI-X vector @index masked, by itself or by the function mask? */
+static bool
+pci_msix_masked(struct pci_vdev *dev, int index)
+{
+	return dev->msix.function_mask ||
+		(dev->msix.table[index].vector_control & PCIM_MSIX_VCTRL_MASK);
+}
+
+/* Cleared once the VHM turns out not to support irqfds */
+static bool msix_irqfd_supported = true;
+
+/*
+ * Bind the eventfd of MSI-X vector @index to the message currently
+ * programmed in its table entry, or unbind it while the vector is
+ * masked. The eventfd itself is never replaced while the device lives,
+ * so threads raising the vector concurrently may keep writing to it
+ * without holding irqfd_mtx.
+ */
+static int
+pci_msix_irqfd_bind(struct pci_vdev *dev, int index,
+		    struct msix_table_entry *mte)
+{
+	struct msix_irqfd *irqfd = &dev->msix.irqfds[index];
+	bool masked;
+	int fd, ret = -1;
+
+	pthread_mutex_lock(&dev->msix.irqfd_mtx);
+	masked = pci_msix_masked(dev, index);
+	if (irqfd->fd >= 0 && !masked && irqfd->addr == mte->addr &&
+	    irqfd->msg_data == mte->msg_data) {
+		/* rebound by another thread in the meantime */
+		ret = 0;
+		goto done;
+	}
+
+	if (irqfd->fd < 0) {
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fd < 0)
+			goto done;
+		irqfd->fd = fd;
+	} else
+		vm_deassign_irqfd(dev->vmctx, irqfd->fd);
+
+	/* never match a stale binding if the new one fails */
+	irqfd->addr = 0;
+	irqfd->msg_data = 0;
+	if (masked) {
+		/* see pci_msix_mask_update() */
+		ret = 0;
+		goto done;
+	}
+	if (vm_assign_irqfd(dev->vmctx, irqfd->fd, mte->addr,
+			    mte->msg_data) < 0) {
+		if (errno == ENOTTY)
+			msix_irqfd_supported = false;
+		goto done;
+	}
+
+	irqfd->addr = mte->addr;
+	irqfd->msg_data = mte->msg_data;
+	ret = 0;
+done:
+	pthread_mutex_unlock(&dev->msix.irqfd_mtx);
+	return ret;
+}
+
+static void
+pci_msix_pba_set(struct pci_vdev *dev, int index)
+{
+	atomic_fetch_or(&dev->msix.pba[index / 64], 1UL << (index % 64));
+}
+
+static bool
+pci_msix_pba_clear(struct pci_vdev *dev, int index)
+{
+	uint64_t bit = 1UL << (index % 64);
+
+	return (atomic_fetch_and(&dev->msix.pba[index / 64], ~bit) & bit) != 0;
+}
+
+/*
+ * Signals a backend raised through the irqfd of a masked vector wait in
+ * the eventfd, which the hypervisor no longer reads: latch them into the
+ * PBA.
+ */
+static void
+pci_msix_irqfd_latch(struct pci_vdev *dev, int index)
+{
+	uint64_t cnt;
+
+	if (dev->msix.irqfds != NULL && dev->msix.irqfds[index].fd >= 0 &&
+	    eventfd_read(dev->msix.irqfds[index].fd, &cnt) == 0)
+		pci_msix_pba_set(dev, index);
+}
+
+/*
+ * The mask of MSI-X vector @index may have changed. A masked vector is
+ * unbound from its irqfd and what is raised meanwhile is latched into
+ * the PBA, then delivered once the vector is unmasked.
+ */
+static void
+pci_msix_mask_update(struct pci_vdev *dev, int index)
+{
+	if (dev->msix.pba == NULL)
+		return;
+
+	pci_msix_irqfd_latch(dev, index);
+	if (dev->msix.irqfds != NULL && dev->msix.irqfds[index].fd >= 0)
+		pci_msix_irqfd_bind(dev, index, &dev->msix.table[index]);
+
+	if (!pci_msix_masked(dev, index) && pci_msix_pba_clear(dev, index))
+		pci_generate_msix(dev, index);
+}
+
+static uint64_t
+pci_msix_pba_read(struct pci_vdev *dev, uint64_t offset, int size)
+{
+	uint64_t val = 0;
+	int i;
+
+	if (dev->msix.pba == NULL)
+		return 0;
+
+	for (i = 0; i < dev->msix.table_count; i++) {
+		if (pci_msix_masked(dev, i))
+			pci_msix_irqfd_latch(dev, i);
+	}
+
+	memcpy(&val, (char *)dev->msix.pba + offset, size);
+	return val;
+}
+
+/*
+ * Return the eventfd raising MSI-X vector @index, for backends that
+ * interrupt the guest from outside the device model. The binding follows
+ * later changes of the table entry, see pci_emul_msix_twrite().
+ */
+int
+pci_msix_irqfd(struct pci_vdev *dev, int index)
+{
+	if (!msix_irqfd_supported || dev->msix.irqfds == NULL ||
+	    index < 0 || index >= dev->msix.table_count)
+		return -1;
+
+	if (pci_msix_irqfd_bind(dev, index, &dev->msix.table[index]) < 0)
+		return -1;
+
+	return dev->msix.irqfds[index].fd;
+}
+
+/*
+ * Raise MSI-X vector @index. The message is delivered through the
+ * vector's irqfd when possible: that is a single eventfd write that
+ * needs no hypercall from the calling thread, and signals racing with
+ * an injection in flight are merged by the VHM. Rebinding only happens
+ * when the guest reprograms the table entry.
+ */
 void
 pci_generate_msix(struct pci_vdev *dev, int index)
 {
 	struct msix_table_entry *mte;
+	struct msix_irqfd *irqfd;
 
 	if (!pci_msix_enabled(dev))
 		return;
 
-	if (dev->msix.function_mask)
+	if (index >= dev->msix.table_count)
 		return;
 
-	if (index >= dev->msix.table_count)
+	if (pci_msix_masked(dev, index)) {
+		if (dev->msix.pba != NULL)
+			pci_msix_pba_set(dev, index);
 		return;
+	}
 
 	mte = &dev->msix.table[index];
-	if ((mte->vector_control & PCIM_MSIX_VCTRL_MASK) == 0) {
-		/* XXX Set PBA bit if interrupt is disabled */
-		vm_lapic_msi(dev->vmctx, mte->addr, mte->msg_data);
+	if (msix_irqfd_supported && dev->msix.irqfds != NULL) {
+		irqfd = &dev->msix.irqfds[index];
+		if (irqfd->fd >= 0 && irqfd->addr == mte->addr &&
+		    irqfd->msg_data == mte->msg_data &&
+		    eventfd_write(irqfd->fd, 1) == 0)
+			return;
+		if (pci_msix_irqfd_bind(dev, index, mte) == 0 &&
+		    eventfd_write(irqfd->fd, 1) == 0)
+			return;
 	}
+
+	vm_lapic_msi(dev->vmctx, mte->addr, mte->msg_data);
 }
 
 void
@@ -1600,6 +2218,11 @@ pci_lintr_request(struct pci_vdev *dev)
 	struct slotinfo *si;
 	int bestpin, bestcount, pin;
 
+	if (dev->deferred.active) {
+		dev->deferred.lintr = true;
+		return;
+	}
+
 	bi = pci_businfo[dev->bus];
 	assert(bi != NULL);
 
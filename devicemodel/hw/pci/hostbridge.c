@@ -53,14 +53,24 @@ pci_amd_hostbridge_init(struct vmctx *ctx, struct pci_vdev *pi, char *opts)
 	return 0;
 }
 
+/* all the state is in config space, which the PCI core saves */
+static int
+pci_hostbridge_snapshot(struct vmctx *ctx, struct pci_vdev *pi,
+			struct snapshot_meta *meta)
+{
+	return 0;
+}
+
 struct pci_vdev_ops pci_ops_amd_hostbridge = {
 	.class_name	= "amd_hostbridge",
 	.vdev_init	= pci_amd_hostbridge_init,
+	.vdev_snapshot	= pci_hostbridge_snapshot,
 };
 DEFINE_PCI_DEVTYPE(pci_ops_amd_hostbridge);
 
 struct pci_vdev_ops pci_ops_hostbridge = {
 	.class_name	= "hostbridge",
 	.vdev_init	= pci_hostbridge_init,
+	.vdev_snapshot	= pci_hostbridge_snapshot,
 };
 DEFINE_PCI_DEVTYPE(pci_ops_hostbridge);
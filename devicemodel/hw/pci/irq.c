@@ -31,12 +31,14 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "types.h"
 #include "acpi.h"
 #include "vmmapi.h"
 #include "pci_core.h"
 #include "lpc.h"
+#include "atomic.h"
 
 /*
  * Implement an 8 pin PCI interrupt router compatible with the router
@@ -64,6 +66,61 @@ static struct pirq {
 static u_char irq_counts[16];
 static int pirq_cold = 1;
 
+/*
+ * IOAPIC line levels shared with the hypervisor. Deasserting a line is a
+ * plain store and asserting one only needs a hypercall if the pin is not
+ * already waiting for EOI; the hypervisor re-delivers the interrupt at EOI
+ * while the level stays set. Lines may be shared, hence the counts.
+ */
+static char irqline_page_buf[4096] __attribute__ ((aligned(4096)));
+static struct acrn_irqline_page *irqline_page;
+static int irqline_count[ACRN_IRQLINE_PAGE_PINS];
+static pthread_mutex_t irqline_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+ioapic_line_assert(struct vmctx *ctx, int irq)
+{
+	uint64_t mask;
+	int idx;
+
+	if (irqline_page == NULL || irq < 0 || irq >= ACRN_IRQLINE_PAGE_PINS) {
+		vm_ioapic_assert_irq(ctx, irq);
+		return;
+	}
+
+	idx = irq / 64;
+	mask = 1UL << (irq % 64);
+	pthread_mutex_lock(&irqline_lock);
+	if (irqline_count[irq]++ == 0) {
+		/*
+		 * The locked update orders the level store before the
+		 * in_service load, pairing with the hypervisor clearing
+		 * in_service before it samples the level at EOI.
+		 */
+		atomic_fetch_or(&irqline_page->level[idx], mask);
+		if ((atomic_load(&irqline_page->in_service[idx]) & mask) == 0)
+			vm_ioapic_notify_irq(ctx, irq);
+	}
+	pthread_mutex_unlock(&irqline_lock);
+}
+
+static void
+ioapic_line_deassert(struct vmctx *ctx, int irq)
+{
+	uint64_t mask;
+
+	if (irqline_page == NULL || irq < 0 || irq >= ACRN_IRQLINE_PAGE_PINS) {
+		vm_ioapic_deassert_irq(ctx, irq);
+		return;
+	}
+
+	mask = 1UL << (irq % 64);
+	pthread_mutex_lock(&irqline_lock);
+	if (irqline_count[irq] > 0 && --irqline_count[irq] == 0)
+		atomic_fetch_and(&irqline_page->level[irq / 64], ~mask);
+	pthread_mutex_unlock(&irqline_lock);
+}
+
 /*
  * Returns true if this pin is enabled with a valid IRQ.  Setting the
  * register to a reserved IRQ causes interrupts to not be asserted as
@@ -137,11 +194,23 @@ pci_irq_init(struct vmctx *ctx)
 		else
 			irq_counts[i] = IRQ_DISABLED;
 	}
+
+	/* Without hypervisor support keep using the irqline hypercalls. */
+	memset(irqline_count, 0, sizeof(irqline_count));
+	memset(irqline_page_buf, 0, sizeof(irqline_page_buf));
+	if (vm_set_irqline_page(ctx,
+		(struct acrn_irqline_page *)irqline_page_buf) == 0)
+		irqline_page = (struct acrn_irqline_page *)irqline_page_buf;
 }
 
 void pci_irq_deinit(struct vmctx *ctx)
 {
 	pirq_cold = 1;
+
+	if (irqline_page) {
+		vm_set_irqline_page(ctx, NULL);
+		irqline_page = NULL;
+	}
 }
 
 void
@@ -162,7 +231,7 @@ pci_irq_assert(struct pci_vdev *dev)
 		}
 		pthread_mutex_unlock(&pirq->lock);
 	}
-	vm_ioapic_assert_irq(dev->vmctx, dev->lintr.ioapic_irq);
+	ioapic_line_assert(dev->vmctx, dev->lintr.ioapic_irq);
 }
 
 void
@@ -183,7 +252,7 @@ pci_irq_deassert(struct pci_vdev *dev)
 		}
 		pthread_mutex_unlock(&pirq->lock);
 	}
-	vm_ioapic_deassert_irq(dev->vmctx, dev->lintr.ioapic_irq);
+	ioapic_line_deassert(dev->vmctx, dev->lintr.ioapic_irq);
 }
 
 int
@@ -0,0 +1,468 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Inter-VM shared memory, register compatible with the ivshmem device of
+ * QEMU so that its guest drivers work unchanged.
+ *
+ * usage: -s <slot>,ivshmem,name=<region>,size=<MB>,id=<peer id>
+ *	     [,vectors=<n>]
+ *
+ * Every VM given the same region name maps the same 2M huge pages,
+ * straight into its EPT behind BAR2. A guest rings a peer by writing
+ * (<peer id> << 16 | <vector>) to the doorbell register; the DM sends it
+ * as a datagram to the socket of the DM running that peer, which raises
+ * MSI-X <vector> in its guest, or INTx if MSI-X is off.
+ *
+ * BAR0: registers, BAR1: MSI-X table and PBA, BAR2: shared memory.
+ */
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "vmmapi.h"
+#include "pci_core.h"
+#include "mevent.h"
+
+#define IVSHMEM_VENDOR_ID	0x1af4
+#define IVSHMEM_DEVICE_ID	0x1110
+
+#define IVSHMEM_REG_BAR		0
+#define IVSHMEM_MSIX_BAR	1
+#define IVSHMEM_MEM_BAR		2
+
+#define IVSHMEM_REG_SIZE	256
+#define IVSHMEM_INTR_MASK	0x00
+#define IVSHMEM_INTR_STATUS	0x04
+#define IVSHMEM_IV_POSITION	0x08
+#define IVSHMEM_DOORBELL	0x0c
+
+#define IVSHMEM_MAX_VECTORS	64
+#define IVSHMEM_MAX_PEER	0xffff
+
+#define IVSHMEM_SOCK_DIR	"/run/acrn/ivshmem/"
+
+struct ivshmem {
+	struct pci_vdev *dev;
+	char *name;
+	size_t size;
+	int id;
+	int vectors;
+
+	int fd;			/* hugetlbfs file of the region */
+	void *mem;
+	uint64_t mapped_gpa;	/* where BAR2 is in the EPT */
+	bool mapped;
+
+	int sock;		/* doorbells from the peers */
+	char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct mevent *evp;
+	struct mevent_loop *loop;
+
+	pthread_mutex_t mtx;	/* registers */
+	uint32_t intr_mask;
+	uint32_t intr_status;
+};
+
+static int
+ivshmem_sock_path(struct ivshmem *ivs, int id, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	return snprintf(addr->sun_path, sizeof(addr->sun_path), "%s%s.%d",
+		IVSHMEM_SOCK_DIR, ivs->name, id) >= sizeof(addr->sun_path) ?
+		-1 : 0;
+}
+
+/* raise a doorbell in our guest */
+static void
+ivshmem_intr(struct ivshmem *ivs, int vector)
+{
+	if (pci_msix_enabled(ivs->dev)) {
+		if (vector < ivs->vectors)
+			pci_generate_msix(ivs->dev, vector);
+		return;
+	}
+
+	pthread_mutex_lock(&ivs->mtx);
+	ivs->intr_status |= 1;
+	if (ivs->intr_mask & ivs->intr_status)
+		pci_lintr_assert(ivs->dev);
+	pthread_mutex_unlock(&ivs->mtx);
+}
+
+static void
+ivshmem_sock_read(int fd, enum ev_type t, void *arg)
+{
+	struct ivshmem *ivs = arg;
+	uint16_t vector;
+
+	while (recv(fd, &vector, sizeof(vector), 0) == sizeof(vector))
+		ivshmem_intr(ivs, vector);
+}
+
+/* ring a peer: its DM may not run yet or any more, then nobody hears */
+static void
+ivshmem_doorbell(struct ivshmem *ivs, uint32_t val)
+{
+	struct sockaddr_un addr;
+	uint16_t vector = val & 0xffff;
+	int peer = val >> 16;
+
+	if (peer == ivs->id) {
+		ivshmem_intr(ivs, vector);
+		return;
+	}
+
+	if (ivshmem_sock_path(ivs, peer, &addr) < 0)
+		return;
+	sendto(ivs->sock, &vector, sizeof(vector), MSG_DONTWAIT,
+		(struct sockaddr *)&addr, sizeof(addr));
+}
+
+static void
+ivshmem_reg_write(struct ivshmem *ivs, uint64_t offset, uint64_t value)
+{
+	switch (offset) {
+	case IVSHMEM_INTR_MASK:
+		pthread_mutex_lock(&ivs->mtx);
+		ivs->intr_mask = value;
+		if (!pci_msix_enabled(ivs->dev)) {
+			if (ivs->intr_mask & ivs->intr_status)
+				pci_lintr_assert(ivs->dev);
+			else
+				pci_lintr_deassert(ivs->dev);
+		}
+		pthread_mutex_unlock(&ivs->mtx);
+		break;
+	case IVSHMEM_DOORBELL:
+		ivshmem_doorbell(ivs, value);
+		break;
+	default:
+		break;
+	}
+}
+
+static uint64_t
+ivshmem_reg_read(struct ivshmem *ivs, uint64_t offset)
+{
+	uint64_t value = 0;
+
+	switch (offset) {
+	case IVSHMEM_INTR_MASK:
+		value = ivs->intr_mask;
+		break;
+	case IVSHMEM_INTR_STATUS:
+		/* read to clear */
+		pthread_mutex_lock(&ivs->mtx);
+		value = ivs->intr_status;
+		ivs->intr_status = 0;
+		if (!pci_msix_enabled(ivs->dev))
+			pci_lintr_deassert(ivs->dev);
+		pthread_mutex_unlock(&ivs->mtx);
+		break;
+	case IVSHMEM_IV_POSITION:
+		value = ivs->id;
+		break;
+	default:
+		break;
+	}
+
+	return value;
+}
+
+static void
+ivshmem_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev, int baridx,
+	      uint64_t offset, int size, uint64_t value)
+{
+	struct ivshmem *ivs = dev->arg;
+
+	if (baridx == pci_msix_table_bar(dev) ||
+	    baridx == pci_msix_pba_bar(dev)) {
+		pci_emul_msix_twrite(dev, offset, size, value);
+		return;
+	}
+
+	/* the memory BAR traps only while it is not in the EPT */
+	if (baridx == IVSHMEM_MEM_BAR) {
+		if (offset + size <= ivs->size)
+			memcpy((char *)ivs->mem + offset, &value, size);
+		return;
+	}
+
+	if (baridx == IVSHMEM_REG_BAR && size == 4)
+		ivshmem_reg_write(ivs, offset, value);
+}
+
+static uint64_t
+ivshmem_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev, int baridx,
+	     uint64_t offset, int size)
+{
+	struct ivshmem *ivs = dev->arg;
+	uint64_t value = 0;
+
+	if (baridx == pci_msix_table_bar(dev) ||
+	    baridx == pci_msix_pba_bar(dev))
+		return pci_emul_msix_tread(dev, offset, size);
+
+	if (baridx == IVSHMEM_MEM_BAR) {
+		if (offset + size <= ivs->size)
+			memcpy(&value, (char *)ivs->mem + offset, size);
+		return value;
+	}
+
+	if (baridx == IVSHMEM_REG_BAR && size == 4)
+		value = ivshmem_reg_read(ivs, offset);
+
+	return value;
+}
+
+/*
+ * Map the region where the guest put BAR2, unless that is over guest RAM:
+ * a broken or hostile guest would otherwise leave holes in its memory
+ * when the BAR moves again.
+ */
+static void
+ivshmem_bar_decode(struct vmctx *ctx, struct pci_vdev *dev, int baridx,
+		   bool enable)
+{
+	struct ivshmem *ivs = dev->arg;
+	uint64_t gpa = dev->bar[IVSHMEM_MEM_BAR].addr;
+
+	if (!ivs || baridx != IVSHMEM_MEM_BAR)
+		return;
+
+	if (ivs->mapped) {
+		if (vm_unmap_memseg(ctx, ivs->size, ivs->mapped_gpa) < 0)
+			perror("ivshmem: unmap shared memory");
+		ivs->mapped = false;
+	}
+
+	if (!enable || gpa < ctx->lowmem ||
+	    (gpa < 4 * GB + ctx->highmem && gpa + ivs->size > 4 * GB))
+		return;
+
+	if (vm_map_memseg_vma(ctx, ivs->size, gpa, (uint64_t)ivs->mem,
+			PROT_READ | PROT_WRITE) < 0) {
+		perror("ivshmem: map shared memory");
+		return;
+	}
+	ivs->mapped_gpa = gpa;
+	ivs->mapped = true;
+}
+
+static int
+ivshmem_parse(struct ivshmem *ivs, char *opts)
+{
+	char *opt, *name = NULL;
+	long mb = 0, id = -1, vectors = 1;
+
+	while (opts && (opt = strsep(&opts, ",")) != NULL) {
+		if (!strncmp(opt, "name=", 5))
+			name = opt + 5;
+		else if (!strncmp(opt, "size=", 5))
+			mb = strtol(opt + 5, NULL, 0);
+		else if (!strncmp(opt, "id=", 3))
+			id = strtol(opt + 3, NULL, 0);
+		else if (!strncmp(opt, "vectors=", 8))
+			vectors = strtol(opt + 8, NULL, 0);
+		else
+			fprintf(stderr, "ivshmem: unknown option %s\n", opt);
+	}
+
+	/* the name is a file name, both of the region and of the sockets */
+	if (!name || !*name || *name == '.' || strchr(name, '/')) {
+		fprintf(stderr, "ivshmem: name=<region> is required\n");
+		return -1;
+	}
+	/* a BAR is a power of 2, hugetlbfs files a multiple of 2M */
+	if (mb < 2 || mb > 64 * 1024 || (mb & (mb - 1))) {
+		fprintf(stderr, "ivshmem: size=<MB> must be a power of 2, "
+			"at least 2\n");
+		return -1;
+	}
+	if (id < 0 || id > IVSHMEM_MAX_PEER) {
+		fprintf(stderr, "ivshmem: id=<0 .. %d> is required\n",
+			IVSHMEM_MAX_PEER);
+		return -1;
+	}
+	if (vectors < 1 || vectors > IVSHMEM_MAX_VECTORS) {
+		fprintf(stderr, "ivshmem: vectors=<1 .. %d>\n",
+			IVSHMEM_MAX_VECTORS);
+		return -1;
+	}
+
+	ivs->name = strdup(name);
+	ivs->size = mb * MB;
+	ivs->id = id;
+	ivs->vectors = vectors;
+	return ivs->name ? 0 : -1;
+}
+
+static int
+ivshmem_sock_open(struct ivshmem *ivs)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if ((mkdir("/run/acrn", 0755) < 0 && errno != EEXIST) ||
+	    (mkdir(IVSHMEM_SOCK_DIR, 0755) < 0 && errno != EEXIST)) {
+		perror(IVSHMEM_SOCK_DIR);
+		return -1;
+	}
+
+	if (ivshmem_sock_path(ivs, ivs->id, &addr) < 0) {
+		fprintf(stderr, "ivshmem: name %s too long\n", ivs->name);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("ivshmem: socket");
+		return -1;
+	}
+
+	unlink(addr.sun_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror(addr.sun_path);
+		close(fd);
+		return -1;
+	}
+
+	/* ivshmem_sock_path() checked that it fits */
+	memcpy(ivs->sock_path, addr.sun_path, sizeof(ivs->sock_path));
+	ivs->sock = fd;
+	return 0;
+}
+
+static void
+ivshmem_free(struct ivshmem *ivs)
+{
+	if (ivs->evp)
+		mevent_delete(ivs->evp);
+	mevent_loop_destroy(ivs->loop);
+	if (ivs->sock >= 0) {
+		close(ivs->sock);
+		unlink(ivs->sock_path);
+	}
+	if (ivs->mem)
+		munmap(ivs->mem, ivs->size);
+	if (ivs->fd >= 0)
+		close(ivs->fd);
+	pthread_mutex_destroy(&ivs->mtx);
+	free(ivs->name);
+	free(ivs);
+}
+
+static int
+ivshmem_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct ivshmem *ivs;
+	char name[16];
+	void *mem;
+
+	ivs = calloc(1, sizeof(struct ivshmem));
+	if (!ivs) {
+		fprintf(stderr, "ivshmem: calloc returns NULL\n");
+		return -1;
+	}
+
+	ivs->dev = dev;
+	ivs->fd = -1;
+	ivs->sock = -1;
+	pthread_mutex_init(&ivs->mtx, NULL);
+
+	if (ivshmem_parse(ivs, opts) < 0)
+		goto fail;
+
+	ivs->fd = hugetlb_shm_open(ivs->name, ivs->size);
+	if (ivs->fd < 0)
+		goto fail;
+
+	/* populated now: the hypervisor maps present pages only */
+	mem = mmap(NULL, ivs->size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ivs->fd, 0);
+	if (mem == MAP_FAILED) {
+		perror("ivshmem: mmap shared memory");
+		goto fail;
+	}
+	ivs->mem = mem;
+
+	if (ivshmem_sock_open(ivs) < 0)
+		goto fail;
+
+	snprintf(name, sizeof(name), "ivshmem-%d:%d", dev->slot, dev->func);
+	ivs->loop = mevent_loop_create(name);
+	if (!ivs->loop)
+		goto fail;
+	ivs->evp = mevent_add_on(ivs->loop, ivs->sock, EVF_READ,
+			ivshmem_sock_read, ivs);
+	if (!ivs->evp)
+		goto fail;
+
+	pci_set_cfgdata16(dev, PCIR_VENDOR, IVSHMEM_VENDOR_ID);
+	pci_set_cfgdata16(dev, PCIR_DEVICE, IVSHMEM_DEVICE_ID);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, IVSHMEM_VENDOR_ID);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, IVSHMEM_DEVICE_ID);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_MEMORY);
+	pci_set_cfgdata8(dev, PCIR_SUBCLASS, PCIS_MEMORY_RAM);
+
+	/* BAR2 is mapped by ivshmem_bar_decode() as soon as it is placed */
+	dev->arg = ivs;
+	if (pci_emul_alloc_bar(dev, IVSHMEM_REG_BAR, PCIBAR_MEM32,
+			IVSHMEM_REG_SIZE) ||
+	    pci_emul_add_msixcap(dev, ivs->vectors, IVSHMEM_MSIX_BAR) ||
+	    pci_emul_alloc_bar(dev, IVSHMEM_MEM_BAR, PCIBAR_MEM64,
+			ivs->size)) {
+		fprintf(stderr, "ivshmem: failed to allocate BARs\n");
+		goto fail;
+	}
+	pci_lintr_request(dev);
+
+	return 0;
+
+fail:
+	if (ivs->mapped)
+		vm_unmap_memseg(ctx, ivs->size, ivs->mapped_gpa);
+	dev->arg = NULL;
+	ivshmem_free(ivs);
+	return -1;
+}
+
+static void
+ivshmem_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct ivshmem *ivs = dev->arg;
+
+	if (!ivs)
+		return;
+
+	/* the BARs are released after, see ivshmem_bar_decode() */
+	if (ivs->mapped)
+		vm_unmap_memseg(ctx, ivs->size, ivs->mapped_gpa);
+	dev->arg = NULL;
+	ivshmem_free(ivs);
+}
+
+struct pci_vdev_ops pci_ops_ivshmem = {
+	.class_name		= "ivshmem",
+	.vdev_init		= ivshmem_init,
+	.vdev_deinit		= ivshmem_deinit,
+	.vdev_barwrite		= ivshmem_write,
+	.vdev_barread		= ivshmem_read,
+	.vdev_bar_decode	= ivshmem_bar_decode,
+};
+DEFINE_PCI_DEVTYPE(pci_ops_ivshmem);
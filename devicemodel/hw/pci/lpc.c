@@ -40,6 +40,7 @@
 #include "irq.h"
 #include "lpc.h"
 #include "uart_core.h"
+#include "snapshot.h"
 
 #define	IO_ICU1		0x20
 #define	IO_ICU2		0xA0
@@ -389,6 +390,32 @@ pci_lpc_cfgwrite(struct vmctx *ctx, int vcpu, struct pci_vdev *pi,
 	return -1;
 }
 
+/*
+ * Save or restore the COM ports. The PIRQ routing registers are restored
+ * with the config space by the PCI core: route the pins again.
+ */
+static int
+pci_lpc_snapshot(struct vmctx *ctx, struct pci_vdev *pi,
+		 struct snapshot_meta *meta)
+{
+	int unit, pin;
+
+	for (unit = 0; unit < LPC_UART_NUM; unit++) {
+		if (lpc_uart_vdev[unit].uart == NULL)
+			continue;
+		if (uart_snapshot(lpc_uart_vdev[unit].uart, meta) != 0)
+			return -1;
+	}
+
+	if (meta->op != SNAPSHOT_RESTORE)
+		return 0;
+
+	for (pin = 1; pin <= 8; pin++)
+		pirq_write(ctx, pin, pci_get_cfgdata8(pi,
+			pin <= 4 ? 0x60 + pin - 1 : 0x68 + pin - 5));
+	return 0;
+}
+
 static void
 pci_lpc_write(struct vmctx *ctx, int vcpu, struct pci_vdev *pi,
 	      int baridx, uint64_t offset, int size, uint64_t value)
@@ -485,6 +512,7 @@ struct pci_vdev_ops pci_ops_lpc = {
 	.vdev_write_dsdt	= pci_lpc_write_dsdt,
 	.vdev_cfgwrite		= pci_lpc_cfgwrite,
 	.vdev_barwrite		= pci_lpc_write,
-	.vdev_barread		= pci_lpc_read
+	.vdev_barread		= pci_lpc_read,
+	.vdev_snapshot		= pci_lpc_snapshot
 };
 DEFINE_PCI_DEVTYPE(pci_ops_lpc);
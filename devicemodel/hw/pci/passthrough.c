@@ -768,25 +768,14 @@ cfginitbar(struct vmctx *ctx, struct passthru_dev *ptdev)
 		if (size == 0)
 			continue;
 
-		/* Allocate the BAR in the guest I/O or MMIO space */
+		/*
+		 * Allocate the BAR in the guest I/O or MMIO space, it is
+		 * mapped by passthru_map_bars() once it has an address.
+		 */
 		error = pci_emul_alloc_pbar(dev, i, base, bartype, size);
 		if (error)
 			return -1;
 
-		/* The MSI-X table needs special handling */
-		if (i == pci_msix_table_bar(dev)) {
-			error = init_msix_table(ctx, ptdev, base);
-			if (error)
-				return -1;
-		} else if (bartype != PCIBAR_IO) {
-			/* Map the physical BAR in the guest MMIO space */
-			error = vm_map_ptdev_mmio(ctx, ptdev->sel.bus,
-				ptdev->sel.dev, ptdev->sel.func,
-				dev->bar[i].addr, dev->bar[i].size, base);
-			if (error)
-				return -1;
-		}
-
 		/*
 		 * 64-bit BAR takes up two slots so skip the next one.
 		 */
@@ -864,6 +853,38 @@ cfginit(struct vmctx *ctx, struct passthru_dev *ptdev, int bus,
 		return irq_type;
 }
 
+/* Map the physical BARs at the guest addresses allocated for them */
+static int
+passthru_map_bars(struct vmctx *ctx, struct pci_vdev *dev)
+{
+	struct passthru_dev *ptdev = dev->arg;
+	int i, error;
+
+	for (i = 0; i <= PCI_BARMAX; i++) {
+		if (ptdev->bar[i].size == 0)
+			continue;
+
+		/* The MSI-X table needs special handling */
+		if (i == pci_msix_table_bar(dev))
+			error = init_msix_table(ctx, ptdev,
+				ptdev->bar[i].addr);
+		else if (ptdev->bar[i].type != PCIBAR_IO)
+			error = vm_map_ptdev_mmio(ctx, ptdev->sel.bus,
+				ptdev->sel.dev, ptdev->sel.func,
+				dev->bar[i].addr, dev->bar[i].size,
+				ptdev->bar[i].addr);
+		else
+			error = 0;
+
+		if (error) {
+			warnx("failed to map BARs for PCI %x/%x/%x",
+			    ptdev->sel.bus, ptdev->sel.dev, ptdev->sel.func);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /*
  * convert the error code of pci_system_init in libpciaccess to DM standard
  *
@@ -1961,5 +1982,7 @@ struct pci_vdev_ops passthru = {
 	.vdev_barread		= passthru_read,
 	.vdev_phys_access	= passthru_bind_irq,
 	.vdev_write_dsdt	= passthru_write_dsdt,
+	.vdev_bars_ready	= passthru_map_bars,
+	.vdev_parallel_init	= true,
 };
 DEFINE_PCI_DEVTYPE(passthru);
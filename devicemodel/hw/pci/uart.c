@@ -106,6 +106,13 @@ pci_uart_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	return 0;
 }
 
+static int
+pci_uart_snapshot(struct vmctx *ctx, struct pci_vdev *dev,
+		  struct snapshot_meta *meta)
+{
+	return uart_snapshot(dev->arg, meta);
+}
+
 static void
 pci_uart_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -123,6 +130,7 @@ struct pci_vdev_ops pci_ops_com = {
 	.vdev_init	= pci_uart_init,
 	.vdev_deinit	= pci_uart_deinit,
 	.vdev_barwrite	= pci_uart_write,
-	.vdev_barread	= pci_uart_read
+	.vdev_barread	= pci_uart_read,
+	.vdev_snapshot	= pci_uart_snapshot
 };
 DEFINE_PCI_DEVTYPE(pci_ops_com);
@@ -0,0 +1,521 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/* vhost-user client, see vhost_user.h */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vhost_user.h"
+#include "snapshot.h"
+
+static int vhost_user_debug;
+#define DPRINTF(params) do { if (vhost_user_debug) printf params; } while (0)
+#define WPRINTF(params) (printf params)
+
+#define VHOST_USER_GET_FEATURES			1
+#define VHOST_USER_SET_FEATURES			2
+#define VHOST_USER_SET_OWNER			3
+#define VHOST_USER_SET_MEM_TABLE		5
+#define VHOST_USER_SET_VRING_NUM		8
+#define VHOST_USER_SET_VRING_ADDR		9
+#define VHOST_USER_SET_VRING_BASE		10
+#define VHOST_USER_GET_VRING_BASE		11
+#define VHOST_USER_SET_VRING_KICK		12
+#define VHOST_USER_SET_VRING_CALL		13
+#define VHOST_USER_GET_PROTOCOL_FEATURES	15
+#define VHOST_USER_SET_PROTOCOL_FEATURES	16
+#define VHOST_USER_SET_VRING_ENABLE		18
+#define VHOST_USER_GET_CONFIG			24
+
+#define VHOST_USER_VERSION		0x1
+#define VHOST_USER_REPLY		0x4
+#define VHOST_USER_NEED_REPLY		0x8
+
+/* a virtio feature bit the backend offers, never offered to the guest */
+#define VHOST_USER_F_PROTOCOL_FEATURES	(1UL << 30)
+
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK	(1UL << 3)
+#define VHOST_USER_PROTOCOL_F_CONFIG	(1UL << 9)
+#define VHOST_USER_PROTOCOL_FEATURES \
+	(VHOST_USER_PROTOCOL_F_REPLY_ACK | VHOST_USER_PROTOCOL_F_CONFIG)
+
+#define VHOST_USER_MAX_REGIONS		8
+#define VHOST_USER_CONFIG_MAX		256
+
+struct vhost_user_vring_state {
+	uint32_t index;
+	uint32_t num;
+} __attribute__((packed));
+
+/* host virtual addresses of acrn-dm, translated by the regions */
+struct vhost_user_vring_addr {
+	uint32_t index;
+	uint32_t flags;
+	uint64_t desc;
+	uint64_t used;
+	uint64_t avail;
+	uint64_t log;
+} __attribute__((packed));
+
+struct vhost_user_mem_region {
+	uint64_t gpa;
+	uint64_t size;
+	uint64_t uaddr;
+	uint64_t offset;	/* of gpa in the fd passed along */
+} __attribute__((packed));
+
+struct vhost_user_mem {
+	uint32_t nregions;
+	uint32_t padding;
+	struct vhost_user_mem_region regions[VHOST_USER_MAX_REGIONS];
+} __attribute__((packed));
+
+struct vhost_user_config {
+	uint32_t offset;
+	uint32_t size;
+	uint32_t flags;
+	uint8_t payload[VHOST_USER_CONFIG_MAX];
+} __attribute__((packed));
+
+struct vhost_user_msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;		/* of the payload */
+	union {
+		uint64_t u64;
+		struct vhost_user_vring_state state;
+		struct vhost_user_vring_addr addr;
+		struct vhost_user_mem mem;
+		struct vhost_user_config config;
+	} payload;
+} __attribute__((packed));
+
+#define VHOST_USER_HDR_SIZE	offsetof(struct vhost_user_msg, payload)
+
+static int
+vhost_user_send(struct vhost_user *vu, struct vhost_user_msg *msg,
+		int *fds, int nfds)
+{
+	char control[CMSG_SPACE(VHOST_USER_MAX_REGIONS * sizeof(int))];
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t n;
+
+	iov.iov_base = msg;
+	iov.iov_len = VHOST_USER_HDR_SIZE + msg->size;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (nfds > 0) {
+		memset(control, 0, sizeof(control));
+		mh.msg_control = control;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	/* a backend gone away must not take acrn-dm down with SIGPIPE */
+	do {
+		n = sendmsg(vu->fd, &mh, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+
+	if (n != iov.iov_len) {
+		perror("vhost_user: send");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+vhost_user_recv_all(struct vhost_user *vu, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(vu->fd, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+vhost_user_recv(struct vhost_user *vu, struct vhost_user_msg *msg)
+{
+	if (vhost_user_recv_all(vu, msg, VHOST_USER_HDR_SIZE) < 0 ||
+	    msg->size > sizeof(msg->payload) ||
+	    vhost_user_recv_all(vu, &msg->payload, msg->size) < 0) {
+		WPRINTF(("vhost_user: backend closed the connection\n"));
+		return -1;
+	}
+
+	if (msg->flags != (VHOST_USER_REPLY | VHOST_USER_VERSION)) {
+		WPRINTF(("vhost_user: bad reply flags 0x%x\n", msg->flags));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Send a request. Requests with a reply wait for it in reply, the others
+ * wait for the ack of the backend if it sends them.
+ */
+static int
+vhost_user_request(struct vhost_user *vu, uint32_t request,
+		   const void *payload, uint32_t size, int *fds, int nfds,
+		   void *reply, uint32_t reply_size)
+{
+	struct vhost_user_msg msg;
+	bool ack;
+
+	memset(&msg, 0, VHOST_USER_HDR_SIZE);
+	msg.request = request;
+	msg.flags = VHOST_USER_VERSION;
+	msg.size = size;
+	if (size > 0)
+		memcpy(&msg.payload, payload, size);
+
+	ack = !reply &&
+	      (vu->protocol_features & VHOST_USER_PROTOCOL_F_REPLY_ACK);
+	if (ack)
+		msg.flags |= VHOST_USER_NEED_REPLY;
+
+	DPRINTF(("vhost_user: request %u, %u bytes, %d fds\n", request,
+		 size, nfds));
+	if (vhost_user_send(vu, &msg, fds, nfds) < 0)
+		return -1;
+	if (!reply && !ack)
+		return 0;
+
+	if (vhost_user_recv(vu, &msg) < 0)
+		return -1;
+	if (msg.request != request ||
+	    msg.size != (ack ? sizeof(uint64_t) : reply_size)) {
+		WPRINTF(("vhost_user: bad reply to request %u\n", request));
+		return -1;
+	}
+
+	if (ack) {
+		if (msg.payload.u64 != 0) {
+			WPRINTF(("vhost_user: request %u failed\n", request));
+			return -1;
+		}
+		return 0;
+	}
+
+	memcpy(reply, &msg.payload, reply_size);
+	return 0;
+}
+
+static int
+vhost_user_set_u64(struct vhost_user *vu, uint32_t request, uint64_t val,
+		   int fd)
+{
+	return vhost_user_request(vu, request, &val, sizeof(val),
+				  &fd, fd >= 0 ? 1 : 0, NULL, 0);
+}
+
+static int
+vhost_user_set_state(struct vhost_user *vu, uint32_t request,
+		     uint32_t index, uint32_t num)
+{
+	struct vhost_user_vring_state state;
+
+	state.index = index;
+	state.num = num;
+	return vhost_user_request(vu, request, &state, sizeof(state),
+				  NULL, 0, NULL, 0);
+}
+
+int
+vhost_user_open(struct vhost_user *vu, const char *path)
+{
+	struct sockaddr_un addr;
+	uint64_t features;
+	int fd;
+
+	vu->fd = -1;
+	vu->started = false;
+	vu->features = 0;
+	vu->protocol_features = 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		WPRINTF(("vhost_user: socket path %s too long\n", path));
+		return -1;
+	}
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("vhost_user: socket");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	vu->fd = fd;
+
+	if (vhost_user_request(vu, VHOST_USER_SET_OWNER, NULL, 0, NULL, 0,
+			       NULL, 0) < 0 ||
+	    vhost_user_request(vu, VHOST_USER_GET_FEATURES, NULL, 0, NULL, 0,
+			       &vu->features, sizeof(vu->features)) < 0)
+		goto fail;
+
+	if (vu->features & VHOST_USER_F_PROTOCOL_FEATURES) {
+		if (vhost_user_request(vu, VHOST_USER_GET_PROTOCOL_FEATURES,
+				NULL, 0, NULL, 0,
+				&features, sizeof(features)) < 0)
+			goto fail;
+		features &= VHOST_USER_PROTOCOL_FEATURES;
+		if (vhost_user_set_u64(vu, VHOST_USER_SET_PROTOCOL_FEATURES,
+				features, -1) < 0)
+			goto fail;
+		vu->protocol_features = features;
+	}
+
+	DPRINTF(("vhost_user: %s features 0x%lx protocol 0x%lx\n", path,
+		 vu->features, vu->protocol_features));
+	return 0;
+
+fail:
+	WPRINTF(("vhost_user: %s: handshake failed\n", path));
+	vhost_user_close(vu);
+	return -1;
+}
+
+void
+vhost_user_close(struct vhost_user *vu)
+{
+	if (vu->fd >= 0) {
+		close(vu->fd);
+		vu->fd = -1;
+	}
+}
+
+struct virtio_ops *
+vhost_user_ops(struct vhost_user *vu, const struct virtio_ops *ops,
+	       uint64_t dev_caps)
+{
+	vu->ops = *ops;
+	/* the backend is set up with split rings only */
+	vu->ops.hv_caps &= (vu->features | dev_caps) &
+		~(VHOST_USER_F_PROTOCOL_FEATURES | VIRTIO_F_RING_PACKED);
+	return &vu->ops;
+}
+
+int
+vhost_user_get_config(struct vhost_user *vu, void *config, uint32_t size)
+{
+	struct vhost_user_config cfg;
+	uint32_t len = offsetof(struct vhost_user_config, payload) + size;
+
+	if (!(vu->protocol_features & VHOST_USER_PROTOCOL_F_CONFIG) ||
+	    size > VHOST_USER_CONFIG_MAX) {
+		WPRINTF(("vhost_user: backend has no config space\n"));
+		return -1;
+	}
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.size = size;
+	if (vhost_user_request(vu, VHOST_USER_GET_CONFIG, &cfg, len, NULL, 0,
+			       &cfg, len) < 0)
+		return -1;
+
+	memcpy(config, cfg.payload, size);
+	return 0;
+}
+
+static int
+vhost_user_set_mem_table(struct vhost_user *vu, struct vmctx *ctx)
+{
+	struct vm_mem_region regs[VHOST_USER_MAX_REGIONS];
+	struct vhost_user_mem mem;
+	int fds[VHOST_USER_MAX_REGIONS];
+	int i, n;
+
+	n = hugetlb_mem_regions(ctx, regs, VHOST_USER_MAX_REGIONS);
+	if (n <= 0) {
+		WPRINTF(("vhost_user: guest memory is not on hugetlbfs\n"));
+		return -1;
+	}
+
+	memset(&mem, 0, sizeof(mem));
+	mem.nregions = n;
+	for (i = 0; i < n; i++) {
+		mem.regions[i].gpa = regs[i].gpa;
+		mem.regions[i].size = regs[i].len;
+		mem.regions[i].uaddr = (uint64_t)regs[i].hva;
+		mem.regions[i].offset = regs[i].offset;
+		fds[i] = regs[i].fd;
+	}
+
+	return vhost_user_request(vu, VHOST_USER_SET_MEM_TABLE, &mem,
+			offsetof(struct vhost_user_mem, regions) +
+			n * sizeof(struct vhost_user_mem_region),
+			fds, n, NULL, 0);
+}
+
+static int
+vhost_user_start_vq(struct vhost_user *vu, struct virtio_base *base,
+		    struct virtio_vq_info *vq, bool enable)
+{
+	struct vmctx *ctx = base->dev->vmctx;
+	struct vhost_user_vring_addr addr;
+	uint64_t desc, avail, used;
+	int call_fd;
+
+	if (vhost_user_set_state(vu, VHOST_USER_SET_VRING_NUM, vq->num,
+				 vq->qsize) < 0 ||
+	    vhost_user_set_state(vu, VHOST_USER_SET_VRING_BASE, vq->num,
+				 vq->last_avail) < 0)
+		return -1;
+
+	virtio_vq_ring_gpa(vq, &desc, &avail, &used);
+	memset(&addr, 0, sizeof(addr));
+	addr.index = vq->num;
+	addr.desc = (uint64_t)vm_map_gpa(ctx, desc,
+			vq->qsize * sizeof(struct virtio_desc));
+	addr.avail = (uint64_t)vm_map_gpa(ctx, avail,
+			(3 + vq->qsize) * sizeof(uint16_t));
+	addr.used = (uint64_t)vm_map_gpa(ctx, used,
+			3 * sizeof(uint16_t) +
+			vq->qsize * sizeof(struct virtio_used));
+	if (!addr.desc || !addr.avail || !addr.used) {
+		WPRINTF(("vhost_user: queue %d is not in guest RAM\n",
+			 vq->num));
+		return -1;
+	}
+	if (vhost_user_request(vu, VHOST_USER_SET_VRING_ADDR, &addr,
+			       sizeof(addr), NULL, 0, NULL, 0) < 0)
+		return -1;
+
+	call_fd = pci_msix_irqfd(base->dev, vq->msix_idx);
+	if (call_fd < 0 || virtio_vq_kick_assign(base, vq) < 0) {
+		WPRINTF(("vhost_user: queue %d eventfds failed\n", vq->num));
+		return -1;
+	}
+
+	/* without protocol features the kick fd starts the ring */
+	if (vhost_user_set_u64(vu, VHOST_USER_SET_VRING_CALL, vq->num,
+			       call_fd) < 0 ||
+	    vhost_user_set_u64(vu, VHOST_USER_SET_VRING_KICK, vq->num,
+			       vq->kick_fd) < 0)
+		return -1;
+
+	if (enable && vhost_user_set_state(vu, VHOST_USER_SET_VRING_ENABLE,
+					   vq->num, 1) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Hand the ready queues to the backend. On failure nothing is left
+ * running in the backend.
+ */
+int
+vhost_user_start(struct vhost_user *vu, struct virtio_base *base)
+{
+	struct virtio_vq_info *vq;
+	uint64_t features;
+	int i;
+
+	if (vu->fd < 0 || vu->started)
+		return vu->started ? 0 : -1;
+
+	if (!pci_msix_enabled(base->dev) ||
+	    (base->negotiated_caps & VIRTIO_F_RING_PACKED)) {
+		/* INTx can't be raised through an eventfd */
+		WPRINTF(("vhost_user: %s needs MSI-X and split rings\n",
+			 base->vops->name));
+		return -1;
+	}
+
+	features = base->negotiated_caps & vu->features;
+	if (vu->features & VHOST_USER_F_PROTOCOL_FEATURES)
+		features |= VHOST_USER_F_PROTOCOL_FEATURES;
+
+	vu->started = true;
+	if (vhost_user_set_u64(vu, VHOST_USER_SET_FEATURES, features,
+			       -1) < 0 ||
+	    vhost_user_set_mem_table(vu, base->dev->vmctx) < 0)
+		goto fail;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		if (!vq_ring_ready(vq))
+			continue;
+		if (vhost_user_start_vq(vu, base, vq,
+				features & VHOST_USER_F_PROTOCOL_FEATURES) < 0)
+			goto fail;
+	}
+
+	/* the backend writes guest memory where acrn-dm can't log it */
+	vm_snapshot_untracked();
+	return 0;
+
+fail:
+	WPRINTF(("vhost_user: %s start failed\n", base->vops->name));
+	vhost_user_stop(vu, base);
+	return -1;
+}
+
+/*
+ * Take the queues back from the backend. GET_VRING_BASE stops a ring; the
+ * state it returns is dropped, as the rings are reset as well.
+ */
+void
+vhost_user_stop(struct vhost_user *vu, struct virtio_base *base)
+{
+	struct vhost_user_vring_state state;
+	struct virtio_vq_info *vq;
+	int i;
+
+	if (!vu->started)
+		return;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		if (vq->kick_fd < 0)
+			continue;
+
+		if (vu->features & VHOST_USER_F_PROTOCOL_FEATURES)
+			vhost_user_set_state(vu, VHOST_USER_SET_VRING_ENABLE,
+					     i, 0);
+		state.index = i;
+		state.num = 0;
+		vhost_user_request(vu, VHOST_USER_GET_VRING_BASE, &state,
+				   sizeof(state), NULL, 0,
+				   &state, sizeof(state));
+		virtio_vq_kick_release(base, vq);
+	}
+	vu->started = false;
+}
@@ -26,12 +26,19 @@
 
 #include <sys/uio.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include "dm.h"
+#include "vmmapi.h"
+#include "mevent.h"
 #include "pci_core.h"
 #include "virtio.h"
+#include "snapshot.h"
 
 /*
  * Functions for dealing with generalized "virtual devices" as
@@ -66,9 +73,225 @@ virtio_linkup(struct virtio_base *base, struct virtio_ops *vops,
 	for (i = 0; i < vops->nvq; i++) {
 		queues[i].base = base;
 		queues[i].num = i;
+		queues[i].kick_fd = -1;
 	}
 }
 
+/*
+ * Doorbell kicks arrive here on the mevent thread, with the vCPU that
+ * wrote the notify register already resumed by the hypervisor.
+ */
+static void
+virtio_doorbell_handler(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vq_info *vq = arg;
+	struct virtio_base *base = vq->base;
+	struct virtio_ops *vops = base->vops;
+	uint64_t cnt;
+
+	if (read(fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return;
+
+	VIRTIO_BASE_LOCK(base);
+	/* the queue may have been reset while the kick was in flight */
+	if (vq->kick_mevp && vq_ring_ready(vq)) {
+		if (vq->notify)
+			(*vq->notify)(DEV_STRUCT(base), vq);
+		else if (vops->qnotify)
+			(*vops->qnotify)(DEV_STRUCT(base), vq);
+	}
+	VIRTIO_BASE_UNLOCK(base);
+}
+
+/* Is BAR @idx decoding guest accesses, unless it is @skip? */
+static bool
+virtio_bar_decoding(struct pci_vdev *dev, int idx, int skip)
+{
+	uint16_t cmd = pci_get_cfgdata16(dev, PCIR_COMMAND);
+
+	if (idx == skip)
+		return false;
+	if (dev->bar[idx].type == PCIBAR_IO)
+		return (cmd & PCIM_CMD_PORTEN) != 0;
+	return (cmd & PCIM_CMD_MEMEN) != 0;
+}
+
+/*
+ * Register the notify register of queue @vq in every layout the driver
+ * may use to kick it, at the current address of each decoding BAR but
+ * @skip. Returns 0 if at least one doorbell is registered.
+ */
+static int
+virtio_doorbell_assign(struct virtio_base *base, struct virtio_vq_info *vq,
+		       int skip)
+{
+	struct pci_vdev *dev = base->dev;
+	struct vmctx *ctx = dev->vmctx;
+	struct pcibar *bar;
+	int n = 0;
+
+	if ((base->negotiated_caps & VIRTIO_F_VERSION_1) == 0) {
+		bar = &dev->bar[base->legacy_pio_bar_idx];
+		if (bar->type == PCIBAR_IO &&
+		    virtio_bar_decoding(dev, base->legacy_pio_bar_idx, skip) &&
+		    vm_assign_doorbell(ctx, bar->addr + VIRTIO_CR_QNOTIFY, 2,
+			ACRN_DOORBELL_PIO | ACRN_DOORBELL_DATAMATCH,
+			vq->num, vq->kick_fd) == 0)
+			n++;
+		return n ? 0 : -1;
+	}
+
+	if (base->modern_pio_bar_idx == VIRTIO_MODERN_PIO_BAR_IDX &&
+	    virtio_bar_decoding(dev, base->modern_pio_bar_idx, skip)) {
+		bar = &dev->bar[base->modern_pio_bar_idx];
+		if (vm_assign_doorbell(ctx, bar->addr, 0,
+			ACRN_DOORBELL_PIO | ACRN_DOORBELL_DATAMATCH,
+			vq->num, vq->kick_fd) == 0)
+			n++;
+	}
+
+	if (base->modern_mmio_bar_idx == VIRTIO_MODERN_MMIO_BAR_IDX &&
+	    virtio_bar_decoding(dev, base->modern_mmio_bar_idx, skip)) {
+		bar = &dev->bar[base->modern_mmio_bar_idx];
+		if (vm_assign_doorbell(ctx, bar->addr +
+			VIRTIO_CAP_NOTIFY_OFFSET +
+			vq->num * VIRTIO_MODERN_NOTIFY_OFF_MULT, 0, 0, 0,
+			vq->kick_fd) == 0)
+			n++;
+	}
+
+	return n ? 0 : -1;
+}
+
+/*
+ * Create the kick eventfd of @vq and bind the queue's notify register to
+ * it. Kicks from layouts the hypervisor could not register still trap to
+ * the device's notify callback, which then has to forward them.
+ */
+int
+virtio_vq_kick_assign(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	if (vq->kick_fd >= 0)
+		return 0;
+
+	vq->kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (vq->kick_fd < 0)
+		return -1;
+
+	if (virtio_doorbell_assign(base, vq, -1) < 0) {
+		close(vq->kick_fd);
+		vq->kick_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+virtio_vq_kick_release(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	if (vq->kick_fd < 0)
+		return;
+
+	vm_deassign_doorbell(base->dev->vmctx, vq->kick_fd);
+	if (vq->kick_mevp) {
+		/* closes kick_fd once the mevent thread drops it */
+		mevent_delete_close(vq->kick_mevp);
+		vq->kick_mevp = NULL;
+	} else
+		close(vq->kick_fd);
+	vq->kick_fd = -1;
+}
+
+/*
+ * A BAR of the device starts or stops decoding at its current address.
+ * The doorbells of the queues whose kicks go through an eventfd, ours,
+ * VBS-K's or a vhost-user backend's, follow it; kicks the hypervisor
+ * no longer signals trap to the notify callback, which forwards them.
+ */
+void
+virtio_pci_bar_decode(struct vmctx *ctx, struct pci_vdev *dev, int baridx,
+		      bool enable)
+{
+	struct virtio_base *base = dev->arg;
+	struct virtio_vq_info *vq;
+	int i;
+
+	if (!base)
+		return;
+
+	VIRTIO_BASE_LOCK(base);
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		if (vq->kick_fd < 0)
+			continue;
+		vm_deassign_doorbell(ctx, vq->kick_fd);
+		virtio_doorbell_assign(base, vq, enable ? -1 : baridx);
+	}
+	VIRTIO_BASE_UNLOCK(base);
+}
+
+void
+virtio_vq_ring_gpa(struct virtio_vq_info *vq, uint64_t *desc,
+		   uint64_t *avail, uint64_t *used)
+{
+	if (vq->enabled) {
+		*desc = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
+		*avail = (((uint64_t)vq->gpa_avail[1]) << 32) |
+			vq->gpa_avail[0];
+		*used = (((uint64_t)vq->gpa_used[1]) << 32) | vq->gpa_used[0];
+		return;
+	}
+
+	/* legacy layout, see virtio_vq_init() */
+	*desc = (uint64_t)vq->pfn << VRING_PAGE_BITS;
+	*avail = *desc + vq->qsize * sizeof(struct virtio_desc);
+	*used = roundup2(*avail + (2 + vq->qsize + 1) * sizeof(uint16_t),
+			 VRING_ALIGN);
+}
+
+/*
+ * Called when the driver sets DRIVER_OK: route kicks of every ready queue
+ * through an eventfd. Queues that fail keep using trapped notify writes,
+ * which stay fully functional, so errors are not fatal.
+ */
+static void
+virtio_doorbell_setup(struct virtio_base *base)
+{
+	struct virtio_vq_info *vq;
+	int i;
+
+	if ((base->flags & VIRTIO_DOORBELL) == 0)
+		return;
+
+	for (i = 0; i < base->vops->nvq; i++) {
+		vq = &base->queues[i];
+		/* skip queues whose kicks are already routed elsewhere */
+		if (vq->kick_fd >= 0 || !vq_ring_ready(vq))
+			continue;
+
+		if (virtio_vq_kick_assign(base, vq) < 0)
+			continue;
+
+		vq->kick_mevp = mevent_add(vq->kick_fd, EVF_READ,
+				virtio_doorbell_handler, vq);
+		if (!vq->kick_mevp) {
+			fprintf(stderr, "%s: queue %d doorbell mevent failed\r\n",
+				base->vops->name, i);
+			virtio_vq_kick_release(base, vq);
+		}
+	}
+}
+
+static void
+virtio_doorbell_teardown(struct virtio_base *base)
+{
+	int i;
+
+	for (i = 0; i < base->vops->nvq; i++)
+		virtio_vq_kick_release(base, &base->queues[i]);
+}
+
 /*
  * Reset device (device-wide).  This erases all queues, i.e.,
  * all the queues become invalid (though we don't wipe out the
@@ -87,6 +310,8 @@ virtio_reset_dev(struct virtio_base *base)
 /* if (base->mtx) */
 /* assert(pthread_mutex_isowned_np(base->mtx)); */
 
+	virtio_doorbell_teardown(base);
+
 	nvq = base->vops->nvq;
 	for (vq = base->queues, i = 0; i < nvq; vq++, i++) {
 		vq->flags = 0;
@@ -101,6 +326,7 @@ virtio_reset_dev(struct virtio_base *base)
 		vq->gpa_used[0] = 0;
 		vq->gpa_used[1] = 0;
 		vq->enabled = 0;
+		vq->used_pending = 0;
 	}
 	base->negotiated_caps = 0;
 	base->curq = 0;
@@ -114,6 +340,22 @@ virtio_reset_dev(struct virtio_base *base)
 	base->config_generation = 0;
 }
 
+/*
+ * Free what the queues allocated while the device ran, for the device
+ * deinit once the device is reset and no request is in flight.
+ */
+void
+virtio_free_queues(struct virtio_base *base)
+{
+	struct virtio_vq_info *vq;
+	int i;
+
+	for (vq = base->queues, i = 0; i < base->vops->nvq; vq++, i++) {
+		free(vq->chain_ndesc);
+		vq->chain_ndesc = NULL;
+	}
+}
+
 /*
  * Set I/O BAR (usually 0) to map PCI config registers.
  */
@@ -216,6 +458,60 @@ virtio_vq_init(struct virtio_base *base, uint32_t pfn)
 	vq->save_used = 0;
 }
 
+/*
+ * Packed flavour of virtio_vq_enable(): the desc, avail and used
+ * addresses programmed by the guest are those of the descriptor ring,
+ * the driver area and the device area.
+ */
+static void
+virtio_vq_enable_packed(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	uint16_t qsz = vq->qsize;
+	uint16_t *ndesc;
+	uint64_t phys;
+	size_t size;
+	char *vb;
+
+	/*
+	 * Used descriptors are written back by buffer id, so remember how
+	 * many slots each buffer took. The array is kept across resets as
+	 * completions of requests in flight may still look it up.
+	 */
+	ndesc = realloc(vq->chain_ndesc, qsz * sizeof(uint16_t));
+	if (!ndesc) {
+		fprintf(stderr, "%s: queue %d: no memory for packed ring\r\n",
+			base->vops->name, base->curq);
+		return;
+	}
+	memset(ndesc, 0, qsz * sizeof(uint16_t));
+	vq->chain_ndesc = ndesc;
+
+	/* descriptor ring */
+	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
+	size = qsz * sizeof(struct vring_packed_desc);
+	vb = paddr_guest2host(base->dev->vmctx, phys, size);
+	vq->pdesc = (struct vring_packed_desc *)vb;
+
+	/* driver area */
+	phys = (((uint64_t)vq->gpa_avail[1]) << 32) | vq->gpa_avail[0];
+	size = sizeof(struct vring_packed_event);
+	vb = paddr_guest2host(base->dev->vmctx, phys, size);
+	vq->driver_event = (struct vring_packed_event *)vb;
+
+	/* device area */
+	phys = (((uint64_t)vq->gpa_used[1]) << 32) | vq->gpa_used[0];
+	vb = paddr_guest2host(base->dev->vmctx, phys, size);
+	vq->device_event = (struct vring_packed_event *)vb;
+
+	/* Both wrap counters start out as 1. */
+	vq->flags = VQ_ALLOC | VQ_PACKED | VQ_AVAIL_WRAP | VQ_USED_WRAP;
+	vq->last_avail = 0;
+	vq->save_used = 0;
+	vq->used_pending = 0;
+
+	vq->enabled = true;
+}
+
 /*
  * Initialize the currently-selected virtio queue (base->curq).
  * The guest just gave us the gpa of desc array, avail ring and
@@ -234,6 +530,11 @@ virtio_vq_enable(struct virtio_base *base)
 	vq = &base->queues[base->curq];
 	qsz = vq->qsize;
 
+	if (base->negotiated_caps & VIRTIO_F_RING_PACKED) {
+		virtio_vq_enable_packed(base, vq);
+		return;
+	}
+
 	/* descriptors */
 	phys = (((uint64_t)vq->gpa_desc[1]) << 32) | vq->gpa_desc[0];
 	size = qsz * sizeof(struct virtio_desc);
@@ -271,13 +572,126 @@ _vq_record(int i, volatile struct virtio_desc *vd, struct vmctx *ctx,
 
 	if (i >= n_iov)
 		return;
-	iov[i].iov_base = paddr_guest2host(ctx, vd->addr, vd->len);
+	iov[i].iov_base = vm_gpa2hva(ctx, vd->addr, vd->len);
 	iov[i].iov_len = vd->len;
 	if (flags != NULL)
 		flags[i] = vd->flags;
 }
 #define	VQ_MAX_DESCRIPTORS	512	/* see below */
 
+/*
+ * Packed ring counterpart of _vq_record(). The ring descriptor has
+ * already been copied out of guest memory by the caller.
+ */
+static inline void
+_vq_record_packed(int i, const struct vring_packed_desc *vd,
+		  struct vmctx *ctx, struct iovec *iov, int n_iov,
+		  uint16_t *flags)
+{
+	if (i >= n_iov)
+		return;
+	iov[i].iov_base = vm_gpa2hva(ctx, vd->addr, vd->len);
+	iov[i].iov_len = vd->len;
+	if (flags != NULL)
+		flags[i] = vd->flags & (VRING_DESC_F_NEXT | VRING_DESC_F_WRITE);
+}
+
+/*
+ * vq_getchain() for packed rings.
+ *
+ * The driver makes the head of a buffer available last, so once the
+ * head is seen as available a single read barrier covers the whole
+ * run of descriptors, and each of them is fetched from the ring once
+ * instead of field by field.
+ */
+static int
+vq_getchain_packed(struct virtio_vq_info *vq, uint16_t *pidx,
+		   struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	struct vring_packed_desc vd, *vindir;
+	struct virtio_base *base;
+	struct vmctx *ctx;
+	const char *name;
+	u_int idx, ndesc, n_indir, j;
+	bool wrap;
+	int i;
+
+	if (!vq_has_descs(vq))
+		return 0;
+	rmb();
+
+	base = vq->base;
+	name = base->vops->name;
+	ctx = base->dev->vmctx;
+	idx = vq->last_avail;
+	wrap = (vq->flags & VQ_AVAIL_WRAP) != 0;
+
+	for (i = 0, ndesc = 0; ; ) {
+		vd = vq->pdesc[idx];
+		ndesc++;
+		if (++idx == vq->qsize) {
+			idx = 0;
+			wrap = !wrap;
+		}
+
+		if ((vd.flags & VRING_DESC_F_INDIRECT) == 0) {
+			_vq_record_packed(i, &vd, ctx, iov, n_iov, flags);
+			i++;
+		} else if ((base->vops->hv_caps &
+		    VIRTIO_RING_F_INDIRECT_DESC) == 0) {
+			fprintf(stderr,
+			    "%s: descriptor has forbidden INDIRECT flag, "
+			    "driver confused?\r\n",
+			    name);
+			return -1;
+		} else {
+			/* an indirect table is a buffer on its own */
+			n_indir = vd.len / sizeof(struct vring_packed_desc);
+			if ((vd.len % sizeof(struct vring_packed_desc)) ||
+			    n_indir == 0 || ndesc != 1 ||
+			    (vd.flags & VRING_DESC_F_NEXT) ||
+			    n_indir > VQ_MAX_DESCRIPTORS) {
+				fprintf(stderr,
+				    "%s: invalid indirect desc len 0x%x, "
+				    "driver confused?\r\n",
+				    name, (u_int)vd.len);
+				return -1;
+			}
+			vindir = vm_gpa2hva(ctx, vd.addr, vd.len);
+			for (j = 0; j < n_indir; j++, i++)
+				_vq_record_packed(i, &vindir[j], ctx, iov,
+				    n_iov, flags);
+		}
+
+		if ((vd.flags & VRING_DESC_F_NEXT) == 0)
+			break;
+		if (ndesc >= vq->qsize || i > VQ_MAX_DESCRIPTORS) {
+			fprintf(stderr,
+			    "%s: descriptor loop? count > %d - "
+			    "driver confused?\r\n",
+			    name, i);
+			return -1;
+		}
+	}
+
+	/* the buffer id sits in the last descriptor of the buffer */
+	if (vd.id >= vq->qsize) {
+		fprintf(stderr,
+		    "%s: invalid buffer (id %u), driver confused?\r\n",
+		    name, (u_int)vd.id);
+		return -1;
+	}
+
+	*pidx = vd.id;
+	vq->chain_ndesc[vd.id] = ndesc;
+	vq->last_avail = idx;
+	if (wrap)
+		vq->flags |= VQ_AVAIL_WRAP;
+	else
+		vq->flags &= ~VQ_AVAIL_WRAP;
+	return i;
+}
+
 /*
  * Examine the chain of descriptors starting at the "next one" to
  * make sure that they describe a sensible request.  If so, return
@@ -330,6 +744,9 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 	struct virtio_base *base;
 	const char *name;
 
+	if (vq->flags & VQ_PACKED)
+		return vq_getchain_packed(vq, pidx, iov, n_iov, flags);
+
 	base = vq->base;
 	name = base->vops->name;
 
@@ -397,7 +814,7 @@ vq_getchain(struct virtio_vq_info *vq, uint16_t *pidx,
 				    name, (u_int)vdir->len);
 				return -1;
 			}
-			vindir = paddr_guest2host(ctx,
+			vindir = vm_gpa2hva(ctx,
 			    vdir->addr, vdir->len);
 			/*
 			 * Indirects start at the 0th, then follow
@@ -450,7 +867,68 @@ loopy:
 void
 vq_retchain(struct virtio_vq_info *vq)
 {
-	vq->last_avail--;
+	uint16_t last, ndesc;
+
+	if ((vq->flags & VQ_PACKED) == 0) {
+		vq->last_avail--;
+		return;
+	}
+
+	/*
+	 * The guest doesn't touch descriptors it made available, so the
+	 * id of the chain is still in its last slot. This holds as long
+	 * as no chain fetched before it is still in flight, which is the
+	 * case for all callers of vq_retchain().
+	 */
+	last = (vq->last_avail ? vq->last_avail : vq->qsize) - 1;
+	ndesc = vq->chain_ndesc[vq->pdesc[last].id % vq->qsize];
+	if (vq->last_avail < ndesc) {
+		vq->last_avail += vq->qsize;
+		vq->flags ^= VQ_AVAIL_WRAP;
+	}
+	vq->last_avail -= ndesc;
+}
+
+/*
+ * Return chains of a packed ring: write a single used descriptor per
+ * buffer at the next used slot and skip the slots it took. The flags
+ * of the first descriptor are written last, as that is what hands the
+ * whole batch over to the guest.
+ */
+static void
+vq_relchains_packed(struct virtio_vq_info *vq,
+		    struct virtio_vq_chain *chains, int nchains)
+{
+	volatile struct vring_packed_desc *vd;
+	uint16_t flags, head_flags = 0, head, ndesc;
+	int i;
+
+	head = vq->save_used;
+	for (i = 0; i < nchains; i++) {
+		ndesc = vq->chain_ndesc[chains[i].idx];
+		vd = &vq->pdesc[vq->save_used];
+		vd->id = chains[i].idx;
+		vd->len = chains[i].len;
+		flags = 0;
+		if (vq->flags & VQ_USED_WRAP)
+			flags = VRING_PACKED_DESC_F_AVAIL |
+				VRING_PACKED_DESC_F_USED;
+		if (chains[i].len)
+			flags |= VRING_DESC_F_WRITE;
+		if (i == 0)
+			head_flags = flags;
+		else
+			vd->flags = flags;
+
+		vq->save_used += ndesc;
+		if (vq->save_used >= vq->qsize) {
+			vq->save_used -= vq->qsize;
+			vq->flags ^= VQ_USED_WRAP;
+		}
+		vq->used_pending += ndesc;
+	}
+	wmb();
+	vq->pdesc[head].flags = head_flags;
 }
 
 /*
@@ -466,6 +944,7 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	uint16_t uidx, mask;
 	volatile struct vring_used *vuh;
 	volatile struct virtio_used *vue;
+	struct virtio_vq_chain chain;
 
 	/*
 	 * Notes:
@@ -477,6 +956,13 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	 * (I apologize for the two fields named idx; the
 	 * virtio spec calls the one that vue points to, "id"...)
 	 */
+	if (vq->flags & VQ_PACKED) {
+		chain.idx = idx;
+		chain.len = iolen;
+		vq_relchains_packed(vq, &chain, 1);
+		return;
+	}
+
 	mask = vq->qsize - 1;
 	vuh = vq->used;
 
@@ -487,6 +973,112 @@ vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen)
 	vuh->idx = uidx;
 }
 
+/*
+ * Fetch a batch of chains. For split rings the number of available
+ * chains is read once for the whole batch.
+ */
+int
+vq_getchains_batch(struct virtio_vq_info *vq, struct virtio_vq_chain *chains,
+		   int nchains, struct iovec *iov, int n_iov, uint16_t *flags)
+{
+	uint16_t navail;
+	int i, n;
+
+	if (!vq_ring_ready(vq))
+		return 0;
+
+	if ((vq->flags & VQ_PACKED) == 0) {
+		navail = vq->avail->idx - vq->last_avail;
+		if (navail < nchains)
+			nchains = navail;
+	}
+
+	for (i = 0; i < nchains; i++) {
+		chains[i].iov = &iov[i * n_iov];
+		chains[i].flags = flags ? &flags[i * n_iov] : NULL;
+		chains[i].len = 0;
+		n = vq_getchain(vq, &chains[i].idx, chains[i].iov, n_iov,
+				chains[i].flags);
+		if (n <= 0)
+			return (n < 0 && i == 0) ? -1 : i;
+		chains[i].n = n;
+	}
+
+	return i;
+}
+
+/*
+ * Return a batch of chains. For split rings the used entries are all
+ * written before used->idx is updated once.
+ */
+void
+vq_relchains_batch(struct virtio_vq_info *vq, struct virtio_vq_chain *chains,
+		   int nchains)
+{
+	volatile struct vring_used *vuh;
+	volatile struct virtio_used *vue;
+	uint16_t uidx, mask;
+	int i;
+
+	if (nchains <= 0)
+		return;
+
+	if (vq->flags & VQ_PACKED) {
+		vq_relchains_packed(vq, chains, nchains);
+		return;
+	}
+
+	mask = vq->qsize - 1;
+	vuh = vq->used;
+	uidx = vuh->idx;
+	for (i = 0; i < nchains; i++) {
+		vue = &vuh->ring[uidx++ & mask];
+		vue->idx = chains[i].idx;
+		vue->tlen = chains[i].len;
+	}
+	wmb();
+	vuh->idx = uidx;
+}
+
+/*
+ * vq_endchains() for packed rings. The event offset in the driver
+ * area is a slot plus a wrap counter, so it is turned into a position
+ * relative to the current lap before doing the usual comparison.
+ */
+static void
+vq_endchains_packed(struct virtio_vq_info *vq, int used_all_avail)
+{
+	struct virtio_base *base = vq->base;
+	uint16_t event_idx, new_idx, old_idx, off_wrap;
+	bool wrap;
+	int intr;
+
+	new_idx = vq->save_used;
+	old_idx = new_idx - vq->used_pending;
+	vq->used_pending = 0;
+
+	/* order used descriptor writes against the driver area read */
+	mb();
+	if (used_all_avail &&
+	    (base->negotiated_caps & VIRTIO_F_NOTIFY_ON_EMPTY))
+		intr = 1;
+	else if (vq->driver_event->flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		intr = 0;
+	else if (vq->driver_event->flags == VRING_PACKED_EVENT_FLAG_DESC &&
+	    (base->negotiated_caps & VIRTIO_RING_F_EVENT_IDX)) {
+		off_wrap = vq->driver_event->off_wrap;
+		event_idx = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+		wrap = (off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != 0;
+		if (wrap != ((vq->flags & VQ_USED_WRAP) != 0))
+			event_idx -= vq->qsize;
+		intr = (uint16_t)(new_idx - event_idx - 1) <
+			(uint16_t)(new_idx - old_idx);
+	} else
+		intr = new_idx != old_idx;
+	if (intr)
+		vq_interrupt(base, vq);
+}
+
 /*
  * Driver has finished processing "available" chains and calling
  * vq_relchain on each one.  If driver used all the available
@@ -519,6 +1111,11 @@ vq_endchains(struct virtio_vq_info *vq, int used_all_avail)
 	 * entire avail was processed, we need to interrupt always.
 	 */
 	base = vq->base;
+	if (vq->flags & VQ_PACKED) {
+		vq_endchains_packed(vq, used_all_avail);
+		return;
+	}
+
 	old_idx = vq->save_used;
 	vq->save_used = new_idx = vq->used->idx;
 	if (used_all_avail &&
@@ -853,6 +1450,8 @@ bad:
 			(*vops->set_status)(DEV_STRUCT(base), value);
 		if (value == 0)
 			(*vops->reset)(DEV_STRUCT(base));
+		else if (value & VIRTIO_CR_STATUS_DRIVER_OK)
+			virtio_doorbell_setup(base);
 		break;
 	case VIRTIO_CR_CFGVEC:
 		base->msix_cfg_idx = value;
@@ -1255,6 +1854,8 @@ virtio_common_cfg_write(struct pci_vdev *dev, uint64_t offset, int size,
 			(*vops->set_status)(DEV_STRUCT(base), value);
 		if (base->status == 0)
 			(*vops->reset)(DEV_STRUCT(base));
+		else if (base->status & VIRTIO_CR_STATUS_DRIVER_OK)
+			virtio_doorbell_setup(base);
 		break;
 	case VIRTIO_COMMON_Q_SELECT:
 		/*
@@ -1768,3 +2369,87 @@ virtio_pci_modern_cfgwrite(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 
 	return -1;
 }
+
+/*
+ * The ring pointers are kept across saves: have the next incremental
+ * save write the parts of the rings the device writes through them.
+ */
+static void
+virtio_vq_snapshot_mark(struct virtio_base *base, struct virtio_vq_info *vq)
+{
+	struct vmctx *ctx = base->dev->vmctx;
+	uint64_t desc, avail, used;
+
+	virtio_vq_ring_gpa(vq, &desc, &avail, &used);
+	if (vq->flags & VQ_PACKED) {
+		vm_snapshot_mark(ctx, desc,
+			vq->qsize * sizeof(struct vring_packed_desc));
+		vm_snapshot_mark(ctx, used, sizeof(struct vring_packed_event));
+	} else
+		vm_snapshot_mark(ctx, used, 3 * sizeof(uint16_t) +
+			vq->qsize * sizeof(struct virtio_used));
+}
+
+/*
+ * Save or restore the virtio transport state: negotiated features,
+ * status and the per-queue ring configuration and indices. Ring pointers
+ * are recomputed from the restored guest addresses.
+ */
+int
+virtio_pci_snapshot(struct vmctx *ctx, struct pci_vdev *dev,
+		    struct snapshot_meta *meta)
+{
+	struct virtio_base *base = dev->arg;
+	struct virtio_vq_info *vq;
+	uint16_t flags, last_avail, save_used;
+	int i, curq, nvq;
+
+	VIRTIO_BASE_LOCK(base);
+	SNAPSHOT_VAR(meta, base->negotiated_caps);
+	SNAPSHOT_VAR(meta, base->curq);
+	SNAPSHOT_VAR(meta, base->status);
+	SNAPSHOT_VAR(meta, base->isr);
+	SNAPSHOT_VAR(meta, base->msix_cfg_idx);
+	SNAPSHOT_VAR(meta, base->config_generation);
+	SNAPSHOT_VAR(meta, base->device_feature_select);
+	SNAPSHOT_VAR(meta, base->driver_feature_select);
+
+	curq = base->curq;
+	nvq = base->vops->nvq;
+	for (vq = base->queues, i = 0; i < nvq; vq++, i++) {
+		SNAPSHOT_VAR(meta, vq->qsize);
+		SNAPSHOT_VAR(meta, vq->flags);
+		SNAPSHOT_VAR(meta, vq->last_avail);
+		SNAPSHOT_VAR(meta, vq->save_used);
+		SNAPSHOT_VAR(meta, vq->msix_idx);
+		SNAPSHOT_VAR(meta, vq->pfn);
+		SNAPSHOT_BUF(meta, vq->gpa_desc, sizeof(vq->gpa_desc));
+		SNAPSHOT_BUF(meta, vq->gpa_avail, sizeof(vq->gpa_avail));
+		SNAPSHOT_BUF(meta, vq->gpa_used, sizeof(vq->gpa_used));
+		SNAPSHOT_VAR(meta, vq->enabled);
+		if (meta->op == SNAPSHOT_SAVE && (vq->flags & VQ_ALLOC))
+			virtio_vq_snapshot_mark(base, vq);
+		if (meta->op != SNAPSHOT_RESTORE || meta->error ||
+		    !(vq->flags & VQ_ALLOC))
+			continue;
+
+		flags = vq->flags;
+		last_avail = vq->last_avail;
+		save_used = vq->save_used;
+		base->curq = i;
+		if (vq->enabled)
+			virtio_vq_enable(base);
+		else
+			virtio_vq_init(base, vq->pfn);
+		vq->flags = flags;
+		vq->last_avail = last_avail;
+		vq->save_used = save_used;
+	}
+	base->curq = curq;
+	if (meta->op == SNAPSHOT_RESTORE && !meta->error &&
+	    (base->status & VIRTIO_CR_STATUS_DRIVER_OK))
+		virtio_doorbell_setup(base);
+	VIRTIO_BASE_UNLOCK(base);
+
+	return meta->error ? -1 : 0;
+}
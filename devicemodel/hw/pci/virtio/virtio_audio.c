@@ -379,7 +379,8 @@ struct pci_vdev_ops pci_ops_virtio_audio = {
 	.vdev_init	= virtio_audio_init,
 	.vdev_deinit	= virtio_audio_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_bar_decode = virtio_pci_bar_decode
 };
 
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_audio);
@@ -0,0 +1,404 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * virtio memory balloon
+ *
+ * The guest puts pages in the balloon on the inflate queue and takes them
+ * back on the deflate queue, to follow the target size set through the
+ * monitor (acrnctl balloon).
+ *
+ * Guest memory is given back to the host in blocks of the smallest huge
+ * page size, see hugetlb_release(), once all the 4K pages of a block are
+ * in the balloon. A released block is mapped again when one of its pages
+ * is deflated, before the guest uses it.
+ *
+ * Free page reporting is not offered: the guest reuses reported memory
+ * without telling us, and nothing maps a released block back on such an
+ * access. Neither the guest, whose accesses could only be emulated, nor
+ * passthrough devices and VBS-K backends, which lose the memory with its
+ * EPT mapping, can fault it back in. For the same reason memory is only
+ * released when the guest promises to deflate pages before using them.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "virtio_balloon.h"
+#include "vmmapi.h"
+
+#define VIRTIO_BALLOON_RINGSZ	128
+#define VIRTIO_BALLOON_MAXSEGS	32
+
+/* feature bits */
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST	(1 << 0)
+
+#define VIRTIO_BALLOON_S_HOSTCAPS	VIRTIO_BALLOON_F_MUST_TELL_HOST
+
+/* the inflate and deflate queues carry 32 bit 4K page frame numbers */
+#define VIRTIO_BALLOON_PFN_SHIFT	12
+#define VIRTIO_BALLOON_PAGES_PER_MB	(1 << (20 - VIRTIO_BALLOON_PFN_SHIFT))
+
+enum {
+	VIRTIO_BALLOON_INFLATEQ,
+	VIRTIO_BALLOON_DEFLATEQ,
+	VIRTIO_BALLOON_MAXQ
+};
+
+struct virtio_balloon_config {
+	uint32_t num_pages;		/* target, set by us */
+	uint32_t actual;		/* balloon size, set by the guest */
+	uint32_t free_page_hint_cmd_id;
+	uint32_t poison_val;
+} __attribute__((packed));
+
+/*
+ * Per-device struct
+ */
+struct virtio_balloon {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VIRTIO_BALLOON_MAXQ];
+	pthread_mutex_t mtx;
+	struct virtio_balloon_config config;
+	struct vmctx *ctx;
+
+	uint64_t *pages;	/* bitmap of the 4K pages in the balloon */
+	uint16_t *counts;	/* per block: its pages in the balloon */
+	size_t npages;
+	size_t block_pages;	/* 4K pages per block, 0 if none released */
+
+	uint64_t released;	/* blocks released */
+};
+
+/* the monitor talks to the only balloon of the VM */
+static struct virtio_balloon *balloon;
+
+static int virtio_balloon_debug;
+#define DPRINTF(params) do { if (virtio_balloon_debug) printf params; } \
+	while (0)
+#define WPRINTF(params) (printf params)
+
+static void virtio_balloon_reset(void *);
+static void virtio_balloon_notify(void *, struct virtio_vq_info *);
+static int virtio_balloon_cfgread(void *, int, int, uint32_t *);
+static int virtio_balloon_cfgwrite(void *, int, int, uint32_t);
+
+static struct virtio_ops virtio_balloon_ops = {
+	"virtio_balloon",		/* our name */
+	VIRTIO_BALLOON_MAXQ,		/* we support 2 virtqueues */
+	sizeof(struct virtio_balloon_config), /* config reg size */
+	virtio_balloon_reset,		/* reset */
+	virtio_balloon_notify,		/* device-wide qnotify */
+	virtio_balloon_cfgread,		/* read virtio config */
+	virtio_balloon_cfgwrite,	/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+	VIRTIO_BALLOON_S_HOSTCAPS,	/* our capabilities */
+};
+
+/* guest RAM is indexed in 4K pages, highmem following lowmem */
+static int
+virtio_balloon_page_idx(struct virtio_balloon *vbal, uint64_t gpa,
+			size_t *idx)
+{
+	struct vmctx *ctx = vbal->ctx;
+
+	if (gpa < ctx->lowmem)
+		*idx = gpa >> VIRTIO_BALLOON_PFN_SHIFT;
+	else if (gpa >= 4 * GB && gpa < 4 * GB + ctx->highmem)
+		*idx = (gpa - 4 * GB + ctx->lowmem) >> VIRTIO_BALLOON_PFN_SHIFT;
+	else
+		return -1;
+
+	return 0;
+}
+
+static uint64_t
+virtio_balloon_page_gpa(struct virtio_balloon *vbal, size_t idx)
+{
+	uint64_t gpa = (uint64_t)idx << VIRTIO_BALLOON_PFN_SHIFT;
+
+	if (gpa >= vbal->ctx->lowmem)
+		gpa += 4 * GB - vbal->ctx->lowmem;
+	return gpa;
+}
+
+static void
+virtio_balloon_inflate(struct virtio_balloon *vbal, uint32_t pfn)
+{
+	uint64_t bit;
+	size_t idx, blk;
+
+	if (virtio_balloon_page_idx(vbal,
+			(uint64_t)pfn << VIRTIO_BALLOON_PFN_SHIFT, &idx)) {
+		WPRINTF(("virtio_balloon: bad pfn 0x%x\n", pfn));
+		return;
+	}
+
+	bit = 1UL << (idx % 64);
+	if (vbal->pages[idx / 64] & bit)
+		return;
+	vbal->pages[idx / 64] |= bit;
+
+	if (vbal->block_pages == 0 || !(vbal->base.negotiated_caps &
+			VIRTIO_BALLOON_F_MUST_TELL_HOST))
+		return;
+
+	blk = idx / vbal->block_pages;
+	if (++vbal->counts[blk] == vbal->block_pages &&
+	    hugetlb_release(vbal->ctx, virtio_balloon_page_gpa(vbal,
+			blk * vbal->block_pages),
+			vbal->block_pages << VIRTIO_BALLOON_PFN_SHIFT) == 0)
+		vbal->released++;
+}
+
+static void
+virtio_balloon_deflate(struct virtio_balloon *vbal, uint32_t pfn)
+{
+	uint64_t gpa = (uint64_t)pfn << VIRTIO_BALLOON_PFN_SHIFT;
+	uint64_t bit;
+	size_t idx;
+
+	if (virtio_balloon_page_idx(vbal, gpa, &idx)) {
+		WPRINTF(("virtio_balloon: bad pfn 0x%x\n", pfn));
+		return;
+	}
+
+	bit = 1UL << (idx % 64);
+	if (!(vbal->pages[idx / 64] & bit))
+		return;
+	vbal->pages[idx / 64] &= ~bit;
+
+	if (vbal->block_pages == 0)
+		return;
+
+	vbal->counts[idx / vbal->block_pages]--;
+	/* the guest uses the page as soon as we return it */
+	hugetlb_populate(vbal->ctx, gpa, 1UL << VIRTIO_BALLOON_PFN_SHIFT);
+}
+
+static void
+virtio_balloon_notify(void *base, struct virtio_vq_info *vq)
+{
+	struct virtio_balloon *vbal = base;
+	struct iovec iov[VIRTIO_BALLOON_MAXSEGS];
+	uint32_t *pfns;
+	uint16_t idx;
+	int n, i;
+	size_t j;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_BALLOON_MAXSEGS, NULL);
+		if (n < 0)
+			break;
+		if (n > VIRTIO_BALLOON_MAXSEGS)
+			n = VIRTIO_BALLOON_MAXSEGS;
+
+		pthread_mutex_lock(&vbal->mtx);
+		for (i = 0; i < n; i++) {
+			pfns = iov[i].iov_base;
+			for (j = 0; j < iov[i].iov_len / sizeof(*pfns); j++) {
+				if (vq->num == VIRTIO_BALLOON_INFLATEQ)
+					virtio_balloon_inflate(vbal, pfns[j]);
+				else
+					virtio_balloon_deflate(vbal, pfns[j]);
+			}
+		}
+		pthread_mutex_unlock(&vbal->mtx);
+
+		vq_relchain(vq, idx, 0);
+	}
+	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
+}
+
+static int
+virtio_balloon_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_balloon *vbal = vdev;
+
+	if (offset + size > sizeof(vbal->config))
+		return -1;
+
+	pthread_mutex_lock(&vbal->mtx);
+	memcpy(retval, (uint8_t *)&vbal->config + offset, size);
+	pthread_mutex_unlock(&vbal->mtx);
+	return 0;
+}
+
+static int
+virtio_balloon_cfgwrite(void *vdev, int offset, int size, uint32_t val)
+{
+	struct virtio_balloon *vbal = vdev;
+
+	/* only the balloon size is written by the guest */
+	if (offset != offsetof(struct virtio_balloon_config, actual) ||
+	    size != sizeof(vbal->config.actual))
+		return -1;
+
+	pthread_mutex_lock(&vbal->mtx);
+	vbal->config.actual = val;
+	pthread_mutex_unlock(&vbal->mtx);
+	return 0;
+}
+
+/* empty the balloon and map back everything released */
+static void
+virtio_balloon_empty(struct virtio_balloon *vbal)
+{
+	struct vmctx *ctx = vbal->ctx;
+
+	memset(vbal->pages, 0, howmany(vbal->npages, 64) * sizeof(uint64_t));
+	if (vbal->counts)
+		memset(vbal->counts, 0, vbal->npages / vbal->block_pages *
+			sizeof(uint16_t));
+	vbal->config.actual = 0;
+
+	hugetlb_populate(ctx, 0, ctx->lowmem);
+	if (ctx->highmem > 0)
+		hugetlb_populate(ctx, 4 * GB, ctx->highmem);
+}
+
+static void
+virtio_balloon_reset(void *base)
+{
+	struct virtio_balloon *vbal = base;
+
+	DPRINTF(("virtio_balloon: device reset requested !\n"));
+	virtio_reset_dev(&vbal->base);
+
+	pthread_mutex_lock(&vbal->mtx);
+	virtio_balloon_empty(vbal);
+	pthread_mutex_unlock(&vbal->mtx);
+}
+
+int
+virtio_balloon_request(int mb)
+{
+	struct virtio_balloon *vbal = balloon;
+	int size;
+
+	if (vbal == NULL)
+		return -1;
+
+	pthread_mutex_lock(&vbal->mtx);
+	if (mb >= 0)
+		vbal->config.num_pages = (uint32_t)mb *
+			VIRTIO_BALLOON_PAGES_PER_MB;
+	size = vbal->config.actual / VIRTIO_BALLOON_PAGES_PER_MB;
+	DPRINTF(("virtio_balloon: target %u pages, actual %u, released %lu "
+		"blocks\n", vbal->config.num_pages, vbal->config.actual,
+		vbal->released));
+	pthread_mutex_unlock(&vbal->mtx);
+
+	if (mb >= 0)
+		virtio_config_changed(&vbal->base);
+
+	return size;
+}
+
+static int
+virtio_balloon_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *vbal;
+	size_t pg_size;
+	int i;
+
+	if (balloon) {
+		WPRINTF(("virtio_balloon: only one balloon per VM\n"));
+		return -1;
+	}
+
+	vbal = calloc(1, sizeof(struct virtio_balloon));
+	if (!vbal) {
+		WPRINTF(("virtio_balloon: calloc returns NULL\n"));
+		return -1;
+	}
+
+	vbal->ctx = ctx;
+	vbal->npages = (ctx->lowmem + ctx->highmem) >> VIRTIO_BALLOON_PFN_SHIFT;
+	vbal->pages = calloc(howmany(vbal->npages, 64), sizeof(uint64_t));
+	if (!vbal->pages)
+		goto fail;
+
+	/* without hugetlbfs backing the balloon only keeps account */
+	pg_size = hugetlb_page_size();
+	if (pg_size) {
+		vbal->block_pages = pg_size >> VIRTIO_BALLOON_PFN_SHIFT;
+		vbal->counts = calloc(vbal->npages / vbal->block_pages,
+			sizeof(uint16_t));
+		if (!vbal->counts)
+			goto fail;
+	} else
+		WPRINTF(("virtio_balloon: guest memory cannot be released\n"));
+
+	pthread_mutex_init(&vbal->mtx, NULL);
+
+	virtio_linkup(&vbal->base, &virtio_balloon_ops, vbal, dev,
+		      vbal->queues);
+
+	for (i = 0; i < VIRTIO_BALLOON_MAXQ; i++)
+		vbal->queues[i].qsize = VIRTIO_BALLOON_RINGSZ;
+
+	/* initialize config space */
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_MEMORY);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&vbal->base, virtio_uses_msix())) {
+		pthread_mutex_destroy(&vbal->mtx);
+		goto fail;
+	}
+
+	virtio_set_io_bar(&vbal->base, 0);
+
+	balloon = vbal;
+	return 0;
+
+fail:
+	free(vbal->counts);
+	free(vbal->pages);
+	free(vbal);
+	return -1;
+}
+
+static void
+virtio_balloon_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *vbal = dev->arg;
+
+	if (vbal == NULL)
+		return;
+
+	balloon = NULL;
+	pthread_mutex_lock(&vbal->mtx);
+	virtio_balloon_empty(vbal);
+	pthread_mutex_unlock(&vbal->mtx);
+	pthread_mutex_destroy(&vbal->mtx);
+
+	free(vbal->counts);
+	free(vbal->pages);
+	free(vbal);
+}
+
+struct pci_vdev_ops pci_ops_virtio_balloon = {
+	.class_name	= "virtio-balloon",
+	.vdev_init	= virtio_balloon_init,
+	.vdev_deinit	= virtio_balloon_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read,
+	.vdev_snapshot	= virtio_pci_snapshot
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_balloon);
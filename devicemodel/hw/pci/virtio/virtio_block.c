@@ -33,14 +33,20 @@
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <openssl/md5.h>
 
 #include "dm.h"
 #include "pci_core.h"
 #include "virtio.h"
+#include "virtio_kernel.h"
+#include "vhost_user.h"
 #include "block_if.h"
 
 #define VIRTIO_BLK_RINGSZ	64
+#define VIRTIO_BLK_BATCH	16	/* chains fetched per ring pass */
 
 #define VIRTIO_BLK_S_OK	0
 #define VIRTIO_BLK_S_IOERR	1
@@ -126,12 +132,19 @@ struct virtio_blk {
 	struct blockif_ctxt *bc;
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
 	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
+	/* VBS-K variables */
+	struct {
+		enum VBS_K_STATUS status;
+		int fd;
+	} vbs_k;
+	struct vhost_user vhost;	/* fd < 0 if not used */
 };
 
 static void virtio_blk_reset(void *);
 static void virtio_blk_notify(void *, struct virtio_vq_info *);
 static int virtio_blk_cfgread(void *, int, int, uint32_t *);
 static int virtio_blk_cfgwrite(void *, int, int, uint32_t);
+static void virtio_blk_set_status(void *, uint64_t);
 
 static struct virtio_ops virtio_blk_ops = {
 	"virtio_blk",		/* our name */
@@ -142,7 +155,7 @@ static struct virtio_ops virtio_blk_ops = {
 	virtio_blk_cfgread,	/* read PCI config */
 	virtio_blk_cfgwrite,	/* write PCI config */
 	NULL,			/* apply negotiated features */
-	NULL,			/* called on guest set status */
+	virtio_blk_set_status,	/* called on guest set status */
 	VIRTIO_BLK_S_HOSTCAPS,	/* our capabilities */
 };
 
@@ -152,9 +165,52 @@ virtio_blk_reset(void *vdev)
 	struct virtio_blk *blk = vdev;
 
 	DPRINTF(("virtio_blk: device reset requested !\n"));
+	vhost_user_stop(&blk->vhost, &blk->base);
+	if (blk->vbs_k.status == VIRTIO_DEV_STARTED) {
+		DPRINTF(("virtio_blk: VBS-K reset requested!\n"));
+		vbs_kernel_stop_base(blk->vbs_k.fd, &blk->base);
+	}
+	if (blk->vbs_k.status == VIRTIO_DEV_STARTED ||
+	    blk->vbs_k.status == VIRTIO_DEV_START_FAILED)
+		blk->vbs_k.status = VIRTIO_DEV_INIT_SUCCESS;
 	virtio_reset_dev(&blk->base);
 }
 
+/*
+ * With VBS-K the requests are served in the kernel straight from the
+ * backing file; blockif stays open only to keep the image locked.
+ */
+static void
+virtio_blk_set_status(void *vdev, uint64_t status)
+{
+	struct virtio_blk *blk = vdev;
+	struct vbs_backend backend;
+	off_t start;
+
+	if (blk->vhost.fd >= 0) {
+		if (status & VIRTIO_CR_STATUS_DRIVER_OK)
+			vhost_user_start(&blk->vhost, &blk->base);
+		return;
+	}
+
+	if (blk->vbs_k.status != VIRTIO_DEV_INIT_SUCCESS ||
+	    !(status & VIRTIO_CR_STATUS_DRIVER_OK))
+		return;
+
+	memset(&backend, 0, sizeof(backend));
+	backend.fd = blockif_fd(blk->bc, &start);
+	backend.offset = start;
+	backend.size = blockif_size(blk->bc);
+	if (blockif_is_ro(blk->bc))
+		backend.flags |= VBS_BACKEND_RDONLY;
+
+	if (vbs_kernel_start_base(blk->vbs_k.fd, &blk->base, &backend) < 0) {
+		WPRINTF(("virtio_blk: VBS-K start failed, using VBS-U\n"));
+		blk->vbs_k.status = VIRTIO_DEV_START_FAILED;
+	} else
+		blk->vbs_k.status = VIRTIO_DEV_STARTED;
+}
+
 static void
 virtio_blk_done(struct blockif_req *br, int err)
 {
@@ -180,7 +236,7 @@ virtio_blk_done(struct blockif_req *br, int err)
 }
 
 static void
-virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
+virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_chain *chain)
 {
 	struct virtio_blk_hdr *vbh;
 	struct virtio_blk_ioreq *io;
@@ -188,14 +244,15 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	int err;
 	ssize_t iolen;
 	int writeop, type;
-	struct iovec iov[BLOCKIF_IOV_MAX + 2];
-	uint16_t idx, flags[BLOCKIF_IOV_MAX + 2];
+	struct iovec *iov = chain->iov;
+	uint16_t *flags = chain->flags;
 
-	n = vq_getchain(vq, &idx, iov, BLOCKIF_IOV_MAX + 2, flags);
+	n = chain->n;
 
 	/*
 	 * The first descriptor will be the read-only fixed header,
-	 * and the last is for status (hence +2 above and below).
+	 * and the last is for status (hence +2 in virtio_blk_notify()
+	 * and below).
 	 * The remaining iov's are the actual data I/O vectors.
 	 *
 	 * XXX - note - this fails on crash dump, which does a
@@ -203,7 +260,7 @@ virtio_blk_proc(struct virtio_blk *blk, struct virtio_vq_info *vq)
 	 */
 	assert(n >= 2 && n <= BLOCKIF_IOV_MAX + 2);
 
-	io = &blk->ios[idx];
+	io = &blk->ios[chain->idx];
 	assert((flags[0] & VRING_DESC_F_WRITE) == 0);
 	assert(iov[0].iov_len == sizeof(struct virtio_blk_hdr));
 	vbh = iov[0].iov_base;
@@ -269,9 +326,33 @@ static void
 virtio_blk_notify(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_blk *blk = vdev;
+	struct iovec iov[VIRTIO_BLK_BATCH][BLOCKIF_IOV_MAX + 2];
+	uint16_t flags[VIRTIO_BLK_BATCH][BLOCKIF_IOV_MAX + 2];
+	struct virtio_vq_chain chains[VIRTIO_BLK_BATCH];
+	int i, n;
+
+	/* a kick the hypervisor could not route, pass it on to the backend */
+	if (blk->vbs_k.status == VIRTIO_DEV_STARTED || blk->vhost.started) {
+		eventfd_write(vq->kick_fd, 1);
+		return;
+	}
+	/* no disk here, the vhost-user backend failed to start */
+	if (!blk->bc)
+		return;
 
-	while (vq_has_descs(vq))
-		virtio_blk_proc(blk, vq);
+	/*
+	 * Harvest chains a batch at a time. The first descriptor of each
+	 * is the header and the last the status, hence +2 below.
+	 */
+	for (;;) {
+		n = vq_getchains_batch(vq, chains, VIRTIO_BLK_BATCH, iov[0],
+				       BLOCKIF_IOV_MAX + 2, flags[0]);
+		assert(n >= 0);
+		if (n == 0)
+			break;
+		for (i = 0; i < n; i++)
+			virtio_blk_proc(blk, &chains[i]);
+	}
 }
 
 static int
@@ -286,6 +367,8 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	int i, sectsz, sts, sto;
 	pthread_mutexattr_t attr;
 	int rc;
+	char *kopt, *vhost_path = NULL;
+	enum VBS_K_STATUS kstat = VIRTIO_DEV_INITIAL;
 
 	if (opts == NULL) {
 		printf("virtio-block: backing device required\n");
@@ -293,18 +376,43 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	}
 
 	/*
-	 * The supplied backing file has to exist
+	 * "kernel=on" asks for the VBS-K data path, the remaining options
+	 * belong to the backing file.
 	 */
-	snprintf(bident, sizeof(bident), "%d:%d", dev->slot, dev->func);
-	bctxt = blockif_open(opts, bident);
-	if (bctxt == NULL) {
-		perror("Could not open backing file");
-		return -1;
+	kopt = strstr(opts, ",kernel=on");
+	if (kopt != NULL) {
+		kstat = VIRTIO_DEV_PRE_INIT;
+		memmove(kopt, kopt + strlen(",kernel=on"),
+			strlen(kopt + strlen(",kernel=on")) + 1);
 	}
 
-	size = blockif_size(bctxt);
-	sectsz = blockif_sectsz(bctxt);
-	blockif_psectsz(bctxt, &sts, &sto);
+	/*
+	 * "vhost-user=<socket>" hands the requests to a backend process,
+	 * which owns the disk and provides the config space.
+	 */
+	if (!strncmp(opts, "vhost-user=", 11)) {
+		vhost_path = opts + 11;
+		kstat = VIRTIO_DEV_INITIAL;
+		bctxt = NULL;
+		size = 0;
+		sectsz = DEV_BSIZE;
+		sts = sto = 0;
+	} else {
+		/*
+		 * The supplied backing file has to exist
+		 */
+		snprintf(bident, sizeof(bident), "%d:%d", dev->slot,
+			 dev->func);
+		bctxt = blockif_open(opts, bident);
+		if (bctxt == NULL) {
+			perror("Could not open backing file");
+			return -1;
+		}
+
+		size = blockif_size(bctxt);
+		sectsz = blockif_sectsz(bctxt);
+		blockif_psectsz(bctxt, &sts, &sto);
+	}
 
 	blk = calloc(1, sizeof(struct virtio_blk));
 	if (!blk) {
@@ -313,6 +421,21 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	}
 
 	blk->bc = bctxt;
+	blk->vhost.fd = -1;
+	if (vhost_path && vhost_user_open(&blk->vhost, vhost_path) < 0) {
+		free(blk);
+		return -1;
+	}
+	blk->vbs_k.fd = -1;
+	blk->vbs_k.status = kstat;
+	if (blk->vbs_k.status == VIRTIO_DEV_PRE_INIT) {
+		blk->vbs_k.fd = open("/dev/vbs_blk", O_RDWR);
+		if (blk->vbs_k.fd < 0) {
+			WPRINTF(("virtio_blk: VBS-K init failed, using VBS-U\n"));
+			blk->vbs_k.status = VIRTIO_DEV_INIT_FAILED;
+		} else
+			blk->vbs_k.status = VIRTIO_DEV_INIT_SUCCESS;
+	}
 	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
 		struct virtio_blk_ioreq *io = &blk->ios[i];
 
@@ -337,8 +460,11 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 					"error %d!\n", rc));
 
 	/* init virtio struct and virtqueues */
-	virtio_linkup(&blk->base, &virtio_blk_ops, blk, dev, &blk->vq);
+	virtio_linkup(&blk->base, blk->vhost.fd >= 0 ?
+		      vhost_user_ops(&blk->vhost, &virtio_blk_ops, 0) :
+		      &virtio_blk_ops, blk, dev, &blk->vq);
 	blk->base.mtx = &blk->mtx;
+	blk->base.flags |= VIRTIO_DOORBELL;
 
 	blk->vq.qsize = VIRTIO_BLK_RINGSZ;
 	/* blk->vq.vq_notify = we have no per-queue notify */
@@ -368,6 +494,12 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	blk->cfg.topology.min_io_size = 0;
 	blk->cfg.topology.opt_io_size = 0;
 	blk->cfg.writeback = 0;
+	if (vhost_path &&
+	    vhost_user_get_config(&blk->vhost, &blk->cfg, sizeof(blk->cfg))) {
+		vhost_user_close(&blk->vhost);
+		free(blk);
+		return -1;
+	}
 
 	/*
 	 * Should we move some of this into virtio.c?  Could
@@ -381,7 +513,11 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
 	if (virtio_interrupt_init(&blk->base, virtio_uses_msix())) {
-		blockif_close(blk->bc);
+		if (blk->vbs_k.fd >= 0)
+			close(blk->vbs_k.fd);
+		vhost_user_close(&blk->vhost);
+		if (blk->bc)
+			blockif_close(blk->bc);
 		free(blk);
 		return -1;
 	}
@@ -398,8 +534,15 @@ virtio_blk_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if (dev->arg) {
 		DPRINTF(("virtio_blk: deinit\n"));
 		blk = (struct virtio_blk *) dev->arg;
+		if (blk->vbs_k.status == VIRTIO_DEV_STARTED)
+			vbs_kernel_stop_base(blk->vbs_k.fd, &blk->base);
+		if (blk->vbs_k.fd >= 0)
+			close(blk->vbs_k.fd);
+		vhost_user_stop(&blk->vhost, &blk->base);
+		vhost_user_close(&blk->vhost);
 		bctxt = blk->bc;
-		blockif_close(bctxt);
+		if (bctxt)
+			blockif_close(bctxt);
 		free(blk);
 	}
 }
@@ -428,6 +571,9 @@ struct pci_vdev_ops pci_ops_virtio_blk = {
 	.vdev_init	= virtio_blk_init,
 	.vdev_deinit	= virtio_blk_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_bar_decode = virtio_pci_bar_decode,
+	.vdev_snapshot	= virtio_pci_snapshot,
+	.vdev_parallel_init = true
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_blk);
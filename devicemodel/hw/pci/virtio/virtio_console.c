@@ -410,7 +410,7 @@ virtio_console_notify_rx(void *vdev, struct virtio_vq_info *vq)
 
 	if (!port->rx_ready) {
 		port->rx_ready = 1;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_disable_notify(vq);
 	}
 }
 
@@ -837,6 +837,7 @@ virtio_console_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	virtio_linkup(&console->base, &virtio_console_ops, console, dev,
 		console->queues);
 	console->base.mtx = &console->mtx;
+	console->base.flags |= VIRTIO_DOORBELL;
 
 	for (i = 0; i < VIRTIO_CONSOLE_MAXQ; i++) {
 		console->queues[i].qsize = VIRTIO_CONSOLE_RINGSZ;
@@ -935,6 +936,7 @@ struct pci_vdev_ops pci_ops_virtio_console = {
 	.vdev_init	= virtio_console_init,
 	.vdev_deinit	= virtio_console_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_bar_decode = virtio_pci_bar_decode
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_console);
@@ -356,6 +356,7 @@ struct pci_vdev_ops pci_ops_virtio_hyper_dmabuf = {
 	.vdev_init	= virtio_hyper_dmabuf_init,
 	.vdev_deinit	= virtio_hyper_dmabuf_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_bar_decode = virtio_pci_bar_decode
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_hyper_dmabuf);
@@ -47,7 +47,7 @@ static int virtio_input_debug;
 /*
  * Host capabilities
  */
-#define VIRTIO_INPUT_S_HOSTCAPS		(VIRTIO_F_VERSION_1)
+#define VIRTIO_INPUT_S_HOSTCAPS		(VIRTIO_F_VERSION_1 | VIRTIO_F_RING_PACKED)
 
 enum virtio_input_config_select {
 	VIRTIO_INPUT_CFG_UNSET		= 0x00,
@@ -668,6 +668,7 @@ virtio_input_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	vi = (struct virtio_input *)dev->arg;
 	if (vi) {
+		virtio_free_queues(&vi->base);
 		pthread_mutex_destroy(&vi->mtx);
 		if (vi->event_queue)
 			free(vi->event_queue);
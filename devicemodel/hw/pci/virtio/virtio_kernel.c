@@ -8,8 +8,15 @@
 /* Routines to notify the VBS-K in kernel */
 
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
 #include "virtio_kernel.h"
+#include "vmmapi.h"
+#include "snapshot.h"
 
 static int virtio_kernel_debug;
 #define DPRINTF(params) do { if (virtio_kernel_debug) printf params; } while (0)
@@ -38,7 +45,7 @@ vbs_kernel_init(int fd)
 int
 vbs_kernel_reset(int fd)
 {
-	return VIRTIO_SUCCESS;
+	return ioctl(fd, VBS_K_RESET_DEV);
 }
 
 /*
@@ -69,12 +76,145 @@ vbs_kernel_start(int fd, struct vbs_dev_info *dev, struct vbs_vqs_info *vqs)
 		return ret;
 	}
 
+	/* the kernel writes guest memory where acrn-dm can't log it */
+	vm_snapshot_untracked();
 	return VIRTIO_SUCCESS;
 }
 
 int
 vbs_kernel_stop(int fd)
 {
+	struct vbs_backend backend;
+
 	DPRINTF(("%s\n", __func__));
+
+	/* detaching the backend stops the data path */
+	memset(&backend, 0, sizeof(backend));
+	backend.fd = -1;
+	return ioctl(fd, VBS_K_SET_BACKEND, &backend);
+}
+
+/*
+ * Hand the data path of a started virtio device to VBS-K: the ring
+ * layout of every ready queue, an eventfd signaled by the hypervisor on
+ * guest kicks and an eventfd raising the queue's MSI-X vector. acrn-dm
+ * keeps emulating config space and device status only.
+ *
+ * Called with the device lock held once the driver sets DRIVER_OK. On
+ * failure nothing is left registered and the device model can keep
+ * serving the queues itself.
+ */
+int
+vbs_kernel_start_base(int fd, struct virtio_base *base,
+		      const struct vbs_backend *backend)
+{
+	struct vbs_dev_info kdev;
+	struct vbs_vqs_info kvqs;
+	struct vbs_vq_ring ring;
+	struct virtio_vq_info *vq;
+	struct msix_table_entry *mte;
+	struct pci_vdev *dev = base->dev;
+	int i, nvq, ret;
+
+	nvq = base->vops->nvq;
+	if (nvq > VBS_MAX_VQ_CNT || !pci_msix_enabled(dev) ||
+	    (base->negotiated_caps & VIRTIO_F_RING_PACKED)) {
+		/*
+		 * INTx can't be raised through an eventfd, and VBS-K only
+		 * walks split rings.
+		 */
+		WPRINTF(("%s: %s can't be offloaded\n", __func__,
+			 base->vops->name));
+		return -VIRTIO_ERROR_START;
+	}
+
+	memset(&kdev, 0, sizeof(kdev));
+	strncpy(kdev.name, base->vops->name, VBS_NAME_LEN - 1);
+	kdev.vmid = dev->vmctx->vmid;
+	kdev.nvq = nvq;
+	kdev.negotiated_features = base->negotiated_caps;
+	kdev.pio_range_start = dev->bar[base->legacy_pio_bar_idx].addr +
+		VIRTIO_CR_QNOTIFY;
+	kdev.pio_range_len = 2;
+
+	memset(&kvqs, 0, sizeof(kvqs));
+	kvqs.nvq = nvq;
+	for (i = 0; i < nvq; i++) {
+		vq = &base->queues[i];
+		kvqs.vqs[i].qsize = vq->qsize;
+		kvqs.vqs[i].pfn = vq->pfn;
+		kvqs.vqs[i].msix_idx = vq->msix_idx;
+		if (vq->msix_idx < dev->msix.table_count) {
+			mte = &dev->msix.table[vq->msix_idx];
+			kvqs.vqs[i].msix_addr = mte->addr;
+			kvqs.vqs[i].msix_data = mte->msg_data;
+		}
+	}
+
+	ret = vbs_kernel_start(fd, &kdev, &kvqs);
+	if (ret < 0)
+		return ret;
+
+	ret = ioctl(fd, VBS_K_SET_FEATURES, &base->negotiated_caps);
+	if (ret < 0) {
+		WPRINTF(("%s: set features failed: %d\n", __func__, ret));
+		goto fail;
+	}
+
+	for (i = 0; i < nvq; i++) {
+		vq = &base->queues[i];
+		if (!vq_ring_ready(vq))
+			continue;
+
+		memset(&ring, 0, sizeof(ring));
+		ring.idx = i;
+		ring.qsize = vq->qsize;
+		ring.msix_idx = vq->msix_idx;
+		virtio_vq_ring_gpa(vq, &ring.desc_gpa, &ring.avail_gpa,
+				   &ring.used_gpa);
+		ring.call_fd = pci_msix_irqfd(dev, vq->msix_idx);
+		ret = virtio_vq_kick_assign(base, vq);
+		if (ring.call_fd < 0 || ret < 0) {
+			WPRINTF(("%s: queue %d eventfds failed\n",
+				 __func__, i));
+			ret = -VIRTIO_ERROR_START;
+			goto fail;
+		}
+		ring.kick_fd = vq->kick_fd;
+
+		ret = ioctl(fd, VBS_K_SET_VQ_RING, &ring);
+		if (ret < 0) {
+			WPRINTF(("%s: set queue %d failed: %d\n",
+				 __func__, i, ret));
+			goto fail;
+		}
+	}
+
+	ret = ioctl(fd, VBS_K_SET_BACKEND, backend);
+	if (ret < 0) {
+		WPRINTF(("%s: set backend failed: %d\n", __func__, ret));
+		goto fail;
+	}
+
 	return VIRTIO_SUCCESS;
+
+fail:
+	vbs_kernel_stop_base(fd, base);
+	return ret;
+}
+
+/*
+ * Take the data path back from VBS-K. The queue state in the kernel is
+ * dropped, so this is only used when the rings are reset as well.
+ */
+int
+vbs_kernel_stop_base(int fd, struct virtio_base *base)
+{
+	int i;
+
+	vbs_kernel_stop(fd);
+	for (i = 0; i < base->vops->nvq; i++)
+		virtio_vq_kick_release(base, &base->queues[i]);
+
+	return vbs_kernel_reset(fd);
 }
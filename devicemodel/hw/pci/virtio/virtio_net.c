@@ -39,16 +39,20 @@
 #include <assert.h>
 #include <openssl/md5.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "dm.h"
 #include "pci_core.h"
 #include "mevent.h"
 #include "virtio.h"
+#include "virtio_kernel.h"
+#include "vhost_user.h"
 #include "netmap_user.h"
 #include <linux/if_tun.h>
 
 #define VIRTIO_NET_RINGSZ	1024
 #define VIRTIO_NET_MAXSEGS	256
+#define VIRTIO_NET_TX_BATCH	16	/* chains sent per pass of the tx thread */
 
 /*
  * Host capabilities.  Note that we only offer a few of these.
@@ -125,6 +129,7 @@ struct virtio_net {
 	struct virtio_vq_info queues[VIRTIO_NET_MAXQ - 1];
 	pthread_mutex_t mtx;
 	struct mevent	*mevp;
+	struct mevent_loop *rx_loop;	/* serves mevp, NULL for the main loop */
 
 	int		tapfd;
 	struct nm_desc	*nmd;
@@ -150,6 +155,13 @@ struct virtio_net {
 	void (*virtio_net_rx)(struct virtio_net *net);
 	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
 			     int iovcnt, int len);
+
+	/* VBS-K variables */
+	struct {
+		enum VBS_K_STATUS status;
+		int fd;
+	} vbs_k;
+	struct vhost_user vhost;	/* fd < 0 if not used */
 };
 
 static void virtio_net_reset(void *vdev);
@@ -157,6 +169,8 @@ static void virtio_net_tx_stop(struct virtio_net *net);
 static int virtio_net_cfgread(void *vdev, int offset, int size, uint32_t *retval);
 static int virtio_net_cfgwrite(void *vdev, int offset, int size, uint32_t value);
 static void virtio_net_neg_features(void *vdev, uint64_t negotiated_features);
+static void virtio_net_set_status(void *vdev, uint64_t status);
+static void virtio_net_tap_reclaim(struct virtio_net *net);
 
 static struct virtio_ops virtio_net_ops = {
 	"vtnet",			/* our name */
@@ -167,7 +181,7 @@ static struct virtio_ops virtio_net_ops = {
 	virtio_net_cfgread,		/* read PCI config */
 	virtio_net_cfgwrite,		/* write PCI config */
 	virtio_net_neg_features,	/* apply negotiated features */
-	NULL,				/* called on guest set status */
+	virtio_net_set_status,		/* called on guest set status */
 	VIRTIO_NET_S_HOSTCAPS,		/* our capabilities */
 };
 
@@ -235,6 +249,16 @@ virtio_net_reset(void *vdev)
 	virtio_net_txwait(net);
 	virtio_net_rxwait(net);
 
+	vhost_user_stop(&net->vhost, &net->base);
+	if (net->vbs_k.status == VIRTIO_DEV_STARTED) {
+		DPRINTF(("vtnet: VBS-K reset requested!\n"));
+		vbs_kernel_stop_base(net->vbs_k.fd, &net->base);
+		virtio_net_tap_reclaim(net);
+	}
+	if (net->vbs_k.status == VIRTIO_DEV_STARTED ||
+	    net->vbs_k.status == VIRTIO_DEV_START_FAILED)
+		net->vbs_k.status = VIRTIO_DEV_INIT_SUCCESS;
+
 	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
@@ -627,42 +651,58 @@ virtio_net_ping_rxq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
 
+	/* a kick the hypervisor could not route, pass it on to the backend */
+	if (net->vbs_k.status == VIRTIO_DEV_STARTED || net->vhost.started) {
+		eventfd_write(vq->kick_fd, 1);
+		return;
+	}
+	if (net->vhost.fd >= 0)
+		return;
+
 	/*
 	 * A qnotify means that the rx process can now begin
 	 */
 	if (net->rx_ready == 0) {
 		net->rx_ready = 1;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_disable_notify(vq);
 	}
 }
 
 static void
 virtio_net_proctx(struct virtio_net *net, struct virtio_vq_info *vq)
 {
-	struct iovec iov[VIRTIO_NET_MAXSEGS + 1];
-	int i, n;
+	/* one spare iov per chain for the tap padding */
+	struct iovec iov[VIRTIO_NET_TX_BATCH][VIRTIO_NET_MAXSEGS + 1];
+	struct virtio_vq_chain chains[VIRTIO_NET_TX_BATCH];
+	int i, j, n, nchains;
 	int plen, tlen;
-	uint16_t idx;
 
 	/*
-	 * Obtain chain of descriptors.  The first one is
-	 * really the header descriptor, so we need to sum
+	 * Obtain a batch of descriptor chains.  The first one of each
+	 * chain is really the header descriptor, so we need to sum
 	 * up two lengths: packet length and transfer length.
 	 */
-	n = vq_getchain(vq, &idx, iov, VIRTIO_NET_MAXSEGS, NULL);
-	assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
-	plen = 0;
-	tlen = iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
-		tlen += iov[i].iov_len;
-	}
+	nchains = vq_getchains_batch(vq, chains, VIRTIO_NET_TX_BATCH, iov[0],
+				     VIRTIO_NET_MAXSEGS + 1, NULL);
+	assert(nchains >= 1);
+	for (j = 0; j < nchains; j++) {
+		n = chains[j].n;
+		assert(n >= 1 && n <= VIRTIO_NET_MAXSEGS);
+		plen = 0;
+		tlen = iov[j][0].iov_len;
+		for (i = 1; i < n; i++) {
+			plen += iov[j][i].iov_len;
+			tlen += iov[j][i].iov_len;
+		}
 
-	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	net->virtio_net_tx(net, &iov[1], n - 1, plen);
+		DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r",
+			 plen, n));
+		net->virtio_net_tx(net, &iov[j][1], n - 1, plen);
+		chains[j].len = tlen;
+	}
 
-	/* chain is processed, release it and set tlen */
-	vq_relchain(vq, idx, tlen);
+	/* chains are processed, release them and set tlen */
+	vq_relchains_batch(vq, chains, nchains);
 }
 
 static void
@@ -670,6 +710,13 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 {
 	struct virtio_net *net = vdev;
 
+	if (net->vbs_k.status == VIRTIO_DEV_STARTED || net->vhost.started) {
+		eventfd_write(vq->kick_fd, 1);
+		return;
+	}
+	if (net->vhost.fd >= 0)
+		return;
+
 	/*
 	 * Any ring entries to process?
 	 */
@@ -678,7 +725,7 @@ virtio_net_ping_txq(void *vdev, struct virtio_vq_info *vq)
 
 	/* Signal the tx thread for processing */
 	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	vq_disable_notify(vq);
 	if (net->tx_in_progress == 0)
 		pthread_cond_signal(&net->tx_cond);
 	pthread_mutex_unlock(&net->tx_mtx);
@@ -712,7 +759,7 @@ virtio_net_tx_thread(void *param)
 	for (;;) {
 		/* note - tx mutex is locked here */
 		while (net->resetting || !vq_has_descs(vq)) {
-			vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+			vq_enable_notify(vq);
 			/* memory barrier */
 			mb();
 			if (!net->resetting && vq_has_descs(vq))
@@ -727,7 +774,7 @@ virtio_net_tx_thread(void *param)
 				return NULL;
 			}
 		}
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+		vq_disable_notify(vq);
 		net->tx_in_progress = 1;
 		pthread_mutex_unlock(&net->tx_mtx);
 
@@ -812,6 +859,36 @@ virtio_net_tap_open(char *devname)
 	return tunfd;
 }
 
+/*
+ * Rx events get a loop thread of their own, so that a busy backend
+ * doesn't delay the events of other devices. If that fails they go to
+ * the main loop.
+ */
+static struct mevent *
+virtio_net_add_rx_event(struct virtio_net *net, int fd)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "vtnet-%d:%d rx", net->base.dev->slot,
+		 net->base.dev->func);
+	net->rx_loop = mevent_loop_create(name);
+	return mevent_add_on(net->rx_loop, fd, EVF_READ,
+			     virtio_net_rx_callback, net);
+}
+
+/*
+ * VBS-K reads the tap device while it runs: the rx event is deleted when
+ * the tap is handed over, and registered again when VBS-K gives it back.
+ */
+static void
+virtio_net_tap_reclaim(struct virtio_net *net)
+{
+	net->mevp = mevent_add_on(net->rx_loop, net->tapfd, EVF_READ,
+				  virtio_net_rx_callback, net);
+	if (net->mevp == NULL)
+		WPRINTF(("vtnet: could not register tap device again\n"));
+}
+
 static void
 virtio_net_tap_setup(struct virtio_net *net, char *devname)
 {
@@ -848,8 +925,7 @@ virtio_net_tap_setup(struct virtio_net *net, char *devname)
 		net->tapfd = -1;
 	}
 
-	net->mevp = mevent_add(net->tapfd, EVF_READ,
-			       virtio_net_rx_callback, net);
+	net->mevp = virtio_net_add_rx_event(net, net->tapfd);
 	if (net->mevp == NULL) {
 		WPRINTF(("Could not register event\n"));
 		close(net->tapfd);
@@ -869,8 +945,7 @@ virtio_net_netmap_setup(struct virtio_net *net, char *ifname)
 		return;
 	}
 
-	net->mevp = mevent_add(net->nmd->fd, EVF_READ,
-			       virtio_net_rx_callback, net);
+	net->mevp = virtio_net_add_rx_event(net, net->nmd->fd);
 	if (net->mevp == NULL) {
 		WPRINTF(("Could not register event\n"));
 		nm_close(net->nmd);
@@ -888,6 +963,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	struct virtio_net *net;
 	char *devname;
 	char *vtopts;
+	char *opt;
 	int mac_provided;
 	pthread_mutexattr_t attr;
 	int rc;
@@ -914,6 +990,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	virtio_linkup(&net->base, &virtio_net_ops, net, dev, net->queues);
 	net->base.mtx = &net->mtx;
+	net->base.flags |= VIRTIO_DOORBELL;
 
 	net->queues[VIRTIO_NET_RXQ].qsize = VIRTIO_NET_RINGSZ;
 	net->queues[VIRTIO_NET_RXQ].notify = virtio_net_ping_rxq;
@@ -931,6 +1008,9 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	mac_provided = 0;
 	net->tapfd = -1;
 	net->nmd = NULL;
+	net->vbs_k.fd = -1;
+	net->vbs_k.status = VIRTIO_DEV_INITIAL;
+	net->vhost.fd = -1;
 	if (opts != NULL) {
 		int err;
 
@@ -942,8 +1022,12 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 		(void) strsep(&vtopts, ",");
 
-		if (vtopts != NULL) {
-			err = virtio_net_parsemac(vtopts, net->config.mac);
+		while ((opt = strsep(&vtopts, ",")) != NULL) {
+			if (!strcmp(opt, "kernel=on")) {
+				net->vbs_k.status = VIRTIO_DEV_PRE_INIT;
+				continue;
+			}
+			err = virtio_net_parsemac(opt, net->config.mac);
 			if (err != 0) {
 				free(devname);
 				return err;
@@ -951,6 +1035,20 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 			mac_provided = 1;
 		}
 
+		/*
+		 * "vhost-user=<socket>": a backend process moves the
+		 * packets, acrn-dm keeps providing MAC and link status.
+		 */
+		if (strncmp(devname, "vhost-user=", 11) == 0) {
+			if (vhost_user_open(&net->vhost, devname + 11) < 0) {
+				free(devname);
+				free(net);
+				return -1;
+			}
+			net->base.vops = vhost_user_ops(&net->vhost,
+				&virtio_net_ops,
+				VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS);
+		}
 		if (strncmp(devname, "vale", 4) == 0)
 			virtio_net_netmap_setup(net, devname);
 		if (strncmp(devname, "tap", 3) == 0 ||
@@ -960,6 +1058,17 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		free(devname);
 	}
 
+	/* VBS-K moves packets straight between the rings and a tap device */
+	if (net->vbs_k.status == VIRTIO_DEV_PRE_INIT) {
+		if (net->tapfd >= 0)
+			net->vbs_k.fd = open("/dev/vbs_net", O_RDWR);
+		if (net->vbs_k.fd < 0) {
+			WPRINTF(("vtnet: VBS-K init failed, using VBS-U\n"));
+			net->vbs_k.status = VIRTIO_DEV_INIT_FAILED;
+		} else
+			net->vbs_k.status = VIRTIO_DEV_INIT_SUCCESS;
+	}
+
 	/*
 	 * The default MAC address is the standard NetApp OUI of 00-a0-98,
 	 * followed by an MD5 of the PCI slot/func number and dev name
@@ -989,7 +1098,7 @@ virtio_net_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	/* Link is up if we managed to open tap device or vale port. */
 	net->config.status = (opts == NULL || net->tapfd >= 0 ||
-			      net->nmd != NULL);
+			      net->nmd != NULL || net->vhost.fd >= 0);
 
 	/* use BAR 1 to map MSI-X table and PBA, if we're using MSI-X */
 	if (virtio_interrupt_init(&net->base, virtio_uses_msix())) {
@@ -1072,6 +1181,39 @@ virtio_net_neg_features(void *vdev, uint64_t negotiated_features)
 	}
 }
 
+static void
+virtio_net_set_status(void *vdev, uint64_t status)
+{
+	struct virtio_net *net = vdev;
+	struct vbs_backend backend;
+
+	if (net->vhost.fd >= 0) {
+		if (status & VIRTIO_CR_STATUS_DRIVER_OK)
+			vhost_user_start(&net->vhost, &net->base);
+		return;
+	}
+
+	if (net->vbs_k.status != VIRTIO_DEV_INIT_SUCCESS ||
+	    !(status & VIRTIO_CR_STATUS_DRIVER_OK))
+		return;
+
+	/* stop reading the tap device before VBS-K owns it */
+	if (net->mevp != NULL) {
+		mevent_delete(net->mevp);
+		net->mevp = NULL;
+	}
+	virtio_net_rxwait(net);
+
+	memset(&backend, 0, sizeof(backend));
+	backend.fd = net->tapfd;
+	if (vbs_kernel_start_base(net->vbs_k.fd, &net->base, &backend) < 0) {
+		WPRINTF(("vtnet: VBS-K start failed, using VBS-U\n"));
+		net->vbs_k.status = VIRTIO_DEV_START_FAILED;
+		virtio_net_tap_reclaim(net);
+	} else
+		net->vbs_k.status = VIRTIO_DEV_STARTED;
+}
+
 static void
 virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -1082,15 +1224,23 @@ virtio_net_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 		virtio_net_tx_stop(net);
 
+		if (net->vbs_k.status == VIRTIO_DEV_STARTED)
+			vbs_kernel_stop_base(net->vbs_k.fd, &net->base);
+		if (net->vbs_k.fd >= 0)
+			close(net->vbs_k.fd);
+		vhost_user_stop(&net->vhost, &net->base);
+		vhost_user_close(&net->vhost);
+
+		if (net->mevp != NULL)
+			mevent_delete(net->mevp);
+		mevent_loop_destroy(net->rx_loop);
+
 		if (net->tapfd >= 0) {
 			close(net->tapfd);
 			net->tapfd = -1;
 		} else
 			fprintf(stderr, "net->tapfd is -1!\n");
 
-		if (net->mevp != NULL)
-			mevent_delete(net->mevp);
-
 		free(net);
 
 		DPRINTF(("%s: done\n", __func__));
@@ -1103,6 +1253,8 @@ struct pci_vdev_ops pci_ops_virtio_net = {
 	.vdev_init	= virtio_net_init,
 	.vdev_deinit	= virtio_net_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_bar_decode = virtio_pci_bar_decode,
+	.vdev_snapshot	= virtio_pci_snapshot
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_net);
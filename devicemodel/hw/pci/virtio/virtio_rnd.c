@@ -483,6 +483,8 @@ struct pci_vdev_ops pci_ops_virtio_rnd = {
 	.vdev_init	= virtio_rnd_init,
 	.vdev_deinit	= virtio_rnd_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_bar_decode = virtio_pci_bar_decode,
+	.vdev_snapshot	= virtio_pci_snapshot
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_rnd);
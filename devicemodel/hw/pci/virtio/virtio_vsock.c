@@ -0,0 +1,1031 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * virtio vsock
+ *
+ * Stream connections between the guest and AF_UNIX sockets in the SOS:
+ *
+ * - an SOS application connects to <path> and writes "CONNECT <port>\n"
+ *   to reach port <port> of the guest. Once the guest accepts, the DM
+ *   answers "OK <host port>\n" and the socket carries the stream.
+ * - a guest connection to CID 2 port <port> is forwarded to a connection
+ *   to <path>_<port>, which an SOS application listens on.
+ *
+ * usage: -s <slot>,virtio-vsock,cid=<guest cid>,path=<socket path>
+ *
+ * The sockets are served by a loop thread of the device's own. Data is
+ * read from and written to them straight from the guest buffers, under
+ * the credit based flow control of the virtio vsock spec.
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "mevent.h"
+
+#define VIRTIO_VSOCK_RINGSZ	256
+#define VIRTIO_VSOCK_MAXSEGS	32
+
+#define VIRTIO_VSOCK_HOST_CID	2
+/* guest to host data buffered per connection, what we advertise */
+#define VIRTIO_VSOCK_BUF_ALLOC	(256 * 1024)
+/* first local port of the connections made from the SOS */
+#define VIRTIO_VSOCK_FIRST_PORT	(1U << 30)
+
+#define VIRTIO_VSOCK_S_HOSTCAPS	VIRTIO_F_VERSION_1
+
+#define VIRTIO_VSOCK_TYPE_STREAM	1
+
+enum {
+	VIRTIO_VSOCK_OP_INVALID,
+	VIRTIO_VSOCK_OP_REQUEST,
+	VIRTIO_VSOCK_OP_RESPONSE,
+	VIRTIO_VSOCK_OP_RST,
+	VIRTIO_VSOCK_OP_SHUTDOWN,
+	VIRTIO_VSOCK_OP_RW,
+	VIRTIO_VSOCK_OP_CREDIT_UPDATE,
+	VIRTIO_VSOCK_OP_CREDIT_REQUEST
+};
+
+#define VIRTIO_VSOCK_SHUTDOWN_RCV	(1 << 0)
+#define VIRTIO_VSOCK_SHUTDOWN_SEND	(1 << 1)
+#define VIRTIO_VSOCK_SHUTDOWN_BOTH	(VIRTIO_VSOCK_SHUTDOWN_RCV | \
+					 VIRTIO_VSOCK_SHUTDOWN_SEND)
+
+enum {
+	VIRTIO_VSOCK_RXQ,
+	VIRTIO_VSOCK_TXQ,
+	VIRTIO_VSOCK_EVENTQ,
+	VIRTIO_VSOCK_MAXQ
+};
+
+struct virtio_vsock_hdr {
+	uint64_t src_cid;
+	uint64_t dst_cid;
+	uint32_t src_port;
+	uint32_t dst_port;
+	uint32_t len;
+	uint16_t type;
+	uint16_t op;
+	uint32_t flags;
+	uint32_t buf_alloc;
+	uint32_t fwd_cnt;
+} __attribute__((packed));
+
+struct virtio_vsock_config {
+	uint64_t guest_cid;
+} __attribute__((packed));
+
+enum virtio_vsock_state {
+	VSOCK_FREE,
+	VSOCK_HANDSHAKE,	/* reading "CONNECT <port>" from the SOS */
+	VSOCK_CONNECTING,	/* REQUEST sent to the guest */
+	VSOCK_CONNECTED,
+	VSOCK_CLOSING		/* RST to send, then free */
+};
+
+/* control packets waiting for a rx buffer */
+#define VSOCK_PEND_REQUEST	(1 << 0)
+#define VSOCK_PEND_RESPONSE	(1 << 1)
+#define VSOCK_PEND_SHUTDOWN	(1 << 2)
+#define VSOCK_PEND_CREDIT	(1 << 3)
+#define VSOCK_PEND_RST		(1 << 4)
+
+struct virtio_vsock;
+
+struct virtio_vsock_conn {
+	struct virtio_vsock *vs;
+	LIST_ENTRY(virtio_vsock_conn) list;
+	enum virtio_vsock_state state;
+	int fd;
+	struct mevent *rd_evp;
+	struct mevent *wr_evp;	/* enabled while buf holds data */
+	uint32_t local_port;	/* SOS side */
+	uint32_t peer_port;	/* guest side */
+	int pending;		/* VSOCK_PEND_* */
+	bool readable;		/* fd has data the guest has not taken */
+	int peer_shutdown;	/* VIRTIO_VSOCK_SHUTDOWN_* from the guest */
+	char line[32];		/* handshake */
+	int line_len;
+
+	/* guest to host */
+	char *buf;		/* not written to fd yet */
+	size_t buf_len;
+	uint32_t fwd_cnt;	/* bytes written to fd */
+	uint32_t fwd_sent;	/* fwd_cnt the guest knows about */
+
+	/* host to guest */
+	uint32_t rx_cnt;	/* bytes sent to the guest */
+	uint32_t peer_buf_alloc;
+	uint32_t peer_fwd_cnt;
+};
+
+/*
+ * Per-device struct
+ */
+struct virtio_vsock {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VIRTIO_VSOCK_MAXQ];
+	pthread_mutex_t mtx;
+	struct virtio_vsock_config config;
+	char *path;
+	int listen_fd;
+	struct mevent *listen_evp;
+	struct mevent_loop *loop;
+	uint32_t next_port;
+
+	LIST_HEAD(, virtio_vsock_conn) conns;
+	/*
+	 * Closed connections are kept until the device goes away, so that
+	 * a callback of theirs still in flight on the loop thread finds a
+	 * valid one.
+	 */
+	LIST_HEAD(, virtio_vsock_conn) free_conns;
+};
+
+static int virtio_vsock_debug;
+#define DPRINTF(params) do { if (virtio_vsock_debug) printf params; } \
+	while (0)
+#define WPRINTF(params) (printf params)
+
+static void virtio_vsock_reset(void *);
+static int virtio_vsock_cfgread(void *, int, int, uint32_t *);
+
+static struct virtio_ops virtio_vsock_ops = {
+	"virtio_vsock",			/* our name */
+	VIRTIO_VSOCK_MAXQ,		/* we support 3 virtqueues */
+	sizeof(struct virtio_vsock_config), /* config reg size */
+	virtio_vsock_reset,		/* reset */
+	NULL,				/* device-wide qnotify */
+	virtio_vsock_cfgread,		/* read virtio config */
+	NULL,				/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+	VIRTIO_VSOCK_S_HOSTCAPS,	/* our capabilities */
+};
+
+static void virtio_vsock_rx(struct virtio_vsock *vs);
+static void virtio_vsock_conn_read(int fd, enum ev_type t, void *arg);
+static void virtio_vsock_conn_write(int fd, enum ev_type t, void *arg);
+
+/*
+ * Point dst at len bytes of the chain, starting off bytes in. Returns
+ * the number of segments, which may cover fewer than len bytes.
+ */
+static int
+virtio_vsock_iov_slice(struct iovec *src, int n, size_t off, size_t len,
+		       struct iovec *dst)
+{
+	int i, dn = 0;
+
+	for (i = 0; i < n && len > 0; i++) {
+		if (off >= src[i].iov_len) {
+			off -= src[i].iov_len;
+			continue;
+		}
+		dst[dn].iov_base = (char *)src[i].iov_base + off;
+		dst[dn].iov_len = MIN(src[i].iov_len - off, len);
+		len -= dst[dn].iov_len;
+		off = 0;
+		dn++;
+	}
+	return dn;
+}
+
+static size_t
+virtio_vsock_iov_copy(struct iovec *iov, int n, size_t off, void *buf,
+		      size_t len, bool to_iov)
+{
+	struct iovec seg[VIRTIO_VSOCK_MAXSEGS];
+	size_t done = 0;
+	int i, sn;
+
+	sn = virtio_vsock_iov_slice(iov, n, off, len, seg);
+	for (i = 0; i < sn; i++) {
+		if (to_iov)
+			memcpy(seg[i].iov_base, (char *)buf + done,
+				seg[i].iov_len);
+		else
+			memcpy((char *)buf + done, seg[i].iov_base,
+				seg[i].iov_len);
+		done += seg[i].iov_len;
+	}
+	return done;
+}
+
+static struct virtio_vsock_conn *
+virtio_vsock_conn_find(struct virtio_vsock *vs, uint32_t local_port,
+		       uint32_t peer_port)
+{
+	struct virtio_vsock_conn *conn;
+
+	LIST_FOREACH(conn, &vs->conns, list) {
+		if (conn->local_port == local_port &&
+		    conn->peer_port == peer_port)
+			return conn;
+	}
+	return NULL;
+}
+
+/* fd may be -1 for a connection that only carries a RST */
+static struct virtio_vsock_conn *
+virtio_vsock_conn_alloc(struct virtio_vsock *vs, int fd,
+			enum virtio_vsock_state state)
+{
+	struct virtio_vsock_conn *conn;
+
+	conn = LIST_FIRST(&vs->free_conns);
+	if (conn)
+		LIST_REMOVE(conn, list);
+	else {
+		conn = malloc(sizeof(*conn));
+		if (!conn)
+			return NULL;
+	}
+
+	memset(conn, 0, sizeof(*conn));
+	conn->vs = vs;
+	conn->fd = fd;
+	conn->state = state;
+	if (fd >= 0) {
+		conn->rd_evp = mevent_add_on(vs->loop, fd, EVF_READ,
+				virtio_vsock_conn_read, conn);
+		if (!conn->rd_evp) {
+			LIST_INSERT_HEAD(&vs->free_conns, conn, list);
+			return NULL;
+		}
+	}
+
+	LIST_INSERT_HEAD(&vs->conns, conn, list);
+	return conn;
+}
+
+static void
+virtio_vsock_conn_close_fd(struct virtio_vsock_conn *conn)
+{
+	if (conn->wr_evp)
+		mevent_delete(conn->wr_evp);
+	if (conn->rd_evp)
+		mevent_delete_close(conn->rd_evp);
+	else if (conn->fd >= 0)
+		close(conn->fd);
+	conn->wr_evp = NULL;
+	conn->rd_evp = NULL;
+	conn->fd = -1;
+	conn->readable = false;
+
+	free(conn->buf);
+	conn->buf = NULL;
+	conn->buf_len = 0;
+}
+
+static void
+virtio_vsock_conn_free(struct virtio_vsock_conn *conn)
+{
+	virtio_vsock_conn_close_fd(conn);
+	conn->state = VSOCK_FREE;
+	LIST_REMOVE(conn, list);
+	LIST_INSERT_HEAD(&conn->vs->free_conns, conn, list);
+}
+
+/* drop the SOS side and tell the guest */
+static void
+virtio_vsock_conn_reset(struct virtio_vsock_conn *conn)
+{
+	DPRINTF(("virtio_vsock: reset %u <-> %u\n", conn->local_port,
+		conn->peer_port));
+	virtio_vsock_conn_close_fd(conn);
+	conn->state = VSOCK_CLOSING;
+	conn->pending = VSOCK_PEND_RST;
+}
+
+/* RST a guest packet that belongs to no connection */
+static void
+virtio_vsock_send_rst(struct virtio_vsock *vs, struct virtio_vsock_hdr *hdr)
+{
+	struct virtio_vsock_conn *conn;
+
+	conn = virtio_vsock_conn_alloc(vs, -1, VSOCK_CLOSING);
+	if (!conn)
+		return;
+	conn->local_port = hdr->dst_port;
+	conn->peer_port = hdr->src_port;
+	conn->pending = VSOCK_PEND_RST;
+}
+
+static uint32_t
+virtio_vsock_alloc_port(struct virtio_vsock *vs)
+{
+	struct virtio_vsock_conn *conn;
+	uint32_t port;
+
+again:
+	port = vs->next_port++;
+	if (vs->next_port == 0)
+		vs->next_port = VIRTIO_VSOCK_FIRST_PORT;
+	LIST_FOREACH(conn, &vs->conns, list) {
+		if (conn->local_port == port)
+			goto again;
+	}
+	return port;
+}
+
+static void
+virtio_vsock_hdr_init(struct virtio_vsock_conn *conn,
+		      struct virtio_vsock_hdr *hdr, uint16_t op)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->src_cid = VIRTIO_VSOCK_HOST_CID;
+	hdr->dst_cid = conn->vs->config.guest_cid;
+	hdr->src_port = conn->local_port;
+	hdr->dst_port = conn->peer_port;
+	hdr->type = VIRTIO_VSOCK_TYPE_STREAM;
+	hdr->op = op;
+	hdr->buf_alloc = VIRTIO_VSOCK_BUF_ALLOC;
+	hdr->fwd_cnt = conn->fwd_cnt;
+	conn->fwd_sent = conn->fwd_cnt;
+}
+
+static uint32_t
+virtio_vsock_peer_credit(struct virtio_vsock_conn *conn)
+{
+	return conn->peer_buf_alloc - (conn->rx_cnt - conn->peer_fwd_cnt);
+}
+
+static bool
+virtio_vsock_rx_ready(struct virtio_vsock_conn *conn)
+{
+	if (conn->pending)
+		return true;
+	return conn->state == VSOCK_CONNECTED && conn->readable &&
+		virtio_vsock_peer_credit(conn) > 0;
+}
+
+/*
+ * Fill a guest rx buffer for conn: a pending control packet first, else
+ * data from the socket. Returns the length used, or -1 if the buffer was
+ * not used.
+ */
+static int
+virtio_vsock_rx_one(struct virtio_vsock_conn *conn, struct iovec *iov, int n)
+{
+	struct iovec data[VIRTIO_VSOCK_MAXSEGS];
+	struct virtio_vsock_hdr hdr;
+	ssize_t len;
+	int dn;
+
+	if (conn->pending & VSOCK_PEND_RST) {
+		virtio_vsock_hdr_init(conn, &hdr, VIRTIO_VSOCK_OP_RST);
+		virtio_vsock_conn_free(conn);
+	} else if (conn->pending & VSOCK_PEND_REQUEST) {
+		virtio_vsock_hdr_init(conn, &hdr, VIRTIO_VSOCK_OP_REQUEST);
+		conn->pending &= ~VSOCK_PEND_REQUEST;
+	} else if (conn->pending & VSOCK_PEND_RESPONSE) {
+		virtio_vsock_hdr_init(conn, &hdr, VIRTIO_VSOCK_OP_RESPONSE);
+		conn->pending &= ~VSOCK_PEND_RESPONSE;
+	} else if (conn->pending & VSOCK_PEND_SHUTDOWN) {
+		virtio_vsock_hdr_init(conn, &hdr, VIRTIO_VSOCK_OP_SHUTDOWN);
+		hdr.flags = VIRTIO_VSOCK_SHUTDOWN_BOTH;
+		conn->pending &= ~VSOCK_PEND_SHUTDOWN;
+	} else if (conn->pending & VSOCK_PEND_CREDIT) {
+		virtio_vsock_hdr_init(conn, &hdr,
+			VIRTIO_VSOCK_OP_CREDIT_UPDATE);
+		conn->pending &= ~VSOCK_PEND_CREDIT;
+	} else {
+		/* the payload goes right after the header */
+		dn = virtio_vsock_iov_slice(iov, n, sizeof(hdr),
+			virtio_vsock_peer_credit(conn), data);
+		if (dn == 0) {
+			WPRINTF(("virtio_vsock: rx buffer too small\n"));
+			return 0;
+		}
+
+		len = readv(conn->fd, data, dn);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				virtio_vsock_conn_reset(conn);
+				return -1;
+			}
+			/* drained, wait for more */
+			conn->readable = false;
+			mevent_enable(conn->rd_evp);
+			return -1;
+		}
+
+		if (len == 0) {
+			/* the SOS side is gone, the guest answers with RST */
+			conn->readable = false;
+			virtio_vsock_hdr_init(conn, &hdr,
+				VIRTIO_VSOCK_OP_SHUTDOWN);
+			hdr.flags = VIRTIO_VSOCK_SHUTDOWN_BOTH;
+		} else {
+			virtio_vsock_hdr_init(conn, &hdr, VIRTIO_VSOCK_OP_RW);
+			hdr.len = len;
+			conn->rx_cnt += len;
+		}
+	}
+
+	virtio_vsock_iov_copy(iov, n, 0, &hdr, sizeof(hdr), true);
+	return sizeof(hdr) + hdr.len;
+}
+
+/* Move what the connections have for the guest into its rx buffers */
+static void
+virtio_vsock_rx(struct virtio_vsock *vs)
+{
+	struct virtio_vq_info *vq = &vs->queues[VIRTIO_VSOCK_RXQ];
+	struct virtio_vsock_conn *conn, *tmp;
+	struct iovec iov[VIRTIO_VSOCK_MAXSEGS];
+	bool used = false;
+	uint16_t idx;
+	int n, len;
+
+	if (!vq_ring_ready(vq))
+		return;
+
+	list_foreach_safe(conn, &vs->conns, list, tmp) {
+		while (virtio_vsock_rx_ready(conn)) {
+			if (!vq_has_descs(vq))
+				goto done;
+			n = vq_getchain(vq, &idx, iov, VIRTIO_VSOCK_MAXSEGS,
+					NULL);
+			if (n <= 0)
+				goto done;
+			if (n > VIRTIO_VSOCK_MAXSEGS)
+				n = VIRTIO_VSOCK_MAXSEGS;
+
+			len = virtio_vsock_rx_one(conn, iov, n);
+			if (len < 0) {
+				vq_retchain(vq);
+				continue;
+			}
+			vq_relchain(vq, idx, len);
+			used = true;
+			/* RST sent, conn is on the free list now */
+			if (conn->state == VSOCK_FREE)
+				break;
+		}
+	}
+done:
+	if (used)
+		vq_endchains(vq, 0);
+}
+
+static void
+virtio_vsock_check_credit(struct virtio_vsock_conn *conn)
+{
+	if (conn->fwd_cnt - conn->fwd_sent >= VIRTIO_VSOCK_BUF_ALLOC / 2)
+		conn->pending |= VSOCK_PEND_CREDIT;
+}
+
+/* act on a guest shutdown once all it sent is written */
+static void
+virtio_vsock_check_shutdown(struct virtio_vsock_conn *conn)
+{
+	if (conn->buf_len)
+		return;
+
+	if (conn->peer_shutdown == VIRTIO_VSOCK_SHUTDOWN_BOTH)
+		virtio_vsock_conn_reset(conn);
+	else if (conn->peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_SEND)
+		shutdown(conn->fd, SHUT_WR);
+}
+
+static void
+virtio_vsock_flush(struct virtio_vsock_conn *conn)
+{
+	ssize_t len;
+
+	len = write(conn->fd, conn->buf, conn->buf_len);
+	if (len < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			virtio_vsock_conn_reset(conn);
+		return;
+	}
+
+	conn->buf_len -= len;
+	memmove(conn->buf, conn->buf + len, conn->buf_len);
+	conn->fwd_cnt += len;
+	virtio_vsock_check_credit(conn);
+	if (conn->buf_len == 0) {
+		mevent_disable(conn->wr_evp);
+		virtio_vsock_check_shutdown(conn);
+	}
+}
+
+/* write the payload of a guest RW packet to the socket */
+static int
+virtio_vsock_forward(struct virtio_vsock_conn *conn, struct iovec *iov,
+		     int n, uint32_t len)
+{
+	struct iovec data[VIRTIO_VSOCK_MAXSEGS];
+	ssize_t done = 0;
+	size_t rest = 0;
+	int i, dn;
+
+	dn = virtio_vsock_iov_slice(iov, n, sizeof(struct virtio_vsock_hdr),
+			len, data);
+	if (conn->buf_len == 0 && dn > 0) {
+		done = writev(conn->fd, data, dn);
+		if (done < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			done = 0;
+		}
+		conn->fwd_cnt += done;
+	}
+
+	for (i = 0; i < dn; i++)
+		rest += data[i].iov_len;
+	rest -= done;
+	if (rest > 0) {
+		/* the guest doesn't send beyond the credit we gave */
+		if (conn->buf_len + rest > VIRTIO_VSOCK_BUF_ALLOC)
+			return -1;
+		if (!conn->buf) {
+			conn->buf = malloc(VIRTIO_VSOCK_BUF_ALLOC);
+			if (!conn->buf)
+				return -1;
+		}
+		virtio_vsock_iov_copy(data, dn, done, conn->buf + conn->buf_len,
+				rest, false);
+		conn->buf_len += rest;
+
+		if (!conn->wr_evp) {
+			conn->wr_evp = mevent_add_on(conn->vs->loop, conn->fd,
+					EVF_WRITE, virtio_vsock_conn_write,
+					conn);
+			if (!conn->wr_evp)
+				return -1;
+		} else
+			mevent_enable(conn->wr_evp);
+	}
+
+	virtio_vsock_check_credit(conn);
+	return 0;
+}
+
+/* the guest connects to the SOS: <path>_<port> */
+static void
+virtio_vsock_connect(struct virtio_vsock *vs, struct virtio_vsock_hdr *hdr)
+{
+	struct virtio_vsock_conn *conn;
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u", vs->path,
+		hdr->dst_port);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr *)&addr,
+			sizeof(addr)) < 0) {
+		DPRINTF(("virtio_vsock: connect to %s failed: %s\n",
+			addr.sun_path, strerror(errno)));
+		close(fd);
+		fd = -1;
+	}
+
+	if (fd < 0) {
+		virtio_vsock_send_rst(vs, hdr);
+		return;
+	}
+
+	conn = virtio_vsock_conn_alloc(vs, fd, VSOCK_CONNECTED);
+	if (!conn) {
+		close(fd);
+		virtio_vsock_send_rst(vs, hdr);
+		return;
+	}
+	conn->local_port = hdr->dst_port;
+	conn->peer_port = hdr->src_port;
+	conn->peer_buf_alloc = hdr->buf_alloc;
+	conn->peer_fwd_cnt = hdr->fwd_cnt;
+	conn->pending = VSOCK_PEND_RESPONSE;
+}
+
+static void
+virtio_vsock_tx_one(struct virtio_vsock *vs, struct iovec *iov, int n)
+{
+	struct virtio_vsock_conn *conn;
+	struct virtio_vsock_hdr hdr;
+
+	if (virtio_vsock_iov_copy(iov, n, 0, &hdr, sizeof(hdr), false) !=
+	    sizeof(hdr)) {
+		WPRINTF(("virtio_vsock: short tx packet\n"));
+		return;
+	}
+
+	if (hdr.src_cid != vs->config.guest_cid ||
+	    hdr.dst_cid != VIRTIO_VSOCK_HOST_CID)
+		return;
+
+	conn = virtio_vsock_conn_find(vs, hdr.dst_port, hdr.src_port);
+	if (hdr.type != VIRTIO_VSOCK_TYPE_STREAM) {
+		if (conn)
+			virtio_vsock_conn_reset(conn);
+		else
+			virtio_vsock_send_rst(vs, &hdr);
+		return;
+	}
+
+	if (!conn) {
+		if (hdr.op == VIRTIO_VSOCK_OP_REQUEST)
+			virtio_vsock_connect(vs, &hdr);
+		else if (hdr.op != VIRTIO_VSOCK_OP_RST)
+			virtio_vsock_send_rst(vs, &hdr);
+		return;
+	}
+
+	/* a RST is on its way to the guest, which will not send more */
+	if (conn->state == VSOCK_CLOSING)
+		return;
+
+	conn->peer_buf_alloc = hdr.buf_alloc;
+	conn->peer_fwd_cnt = hdr.fwd_cnt;
+
+	switch (hdr.op) {
+	case VIRTIO_VSOCK_OP_RESPONSE:
+		if (conn->state != VSOCK_CONNECTING) {
+			virtio_vsock_conn_reset(conn);
+			break;
+		}
+		conn->state = VSOCK_CONNECTED;
+		if (dprintf(conn->fd, "OK %u\n", conn->local_port) < 0)
+			virtio_vsock_conn_reset(conn);
+		break;
+	case VIRTIO_VSOCK_OP_RW:
+		if (conn->state != VSOCK_CONNECTED ||
+		    (conn->peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_SEND) ||
+		    virtio_vsock_forward(conn, iov, n, hdr.len) < 0)
+			virtio_vsock_conn_reset(conn);
+		break;
+	case VIRTIO_VSOCK_OP_SHUTDOWN:
+		conn->peer_shutdown |= hdr.flags & VIRTIO_VSOCK_SHUTDOWN_BOTH;
+		virtio_vsock_check_shutdown(conn);
+		break;
+	case VIRTIO_VSOCK_OP_RST:
+		virtio_vsock_conn_free(conn);
+		break;
+	case VIRTIO_VSOCK_OP_CREDIT_REQUEST:
+		conn->pending |= VSOCK_PEND_CREDIT;
+		break;
+	case VIRTIO_VSOCK_OP_CREDIT_UPDATE:
+		/* taken above */
+		break;
+	default:
+		virtio_vsock_conn_reset(conn);
+		break;
+	}
+}
+
+static void
+virtio_vsock_notify_tx(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_vsock *vs = vdev;
+	struct iovec iov[VIRTIO_VSOCK_MAXSEGS];
+	uint16_t idx;
+	int n;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, VIRTIO_VSOCK_MAXSEGS, NULL);
+		if (n <= 0)
+			break;
+		if (n > VIRTIO_VSOCK_MAXSEGS)
+			n = VIRTIO_VSOCK_MAXSEGS;
+
+		virtio_vsock_tx_one(vs, iov, n);
+		vq_relchain(vq, idx, 0);
+	}
+	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
+
+	/* replies, and data the new credit lets through */
+	virtio_vsock_rx(vs);
+}
+
+static void
+virtio_vsock_notify_rx(void *vdev, struct virtio_vq_info *vq)
+{
+	virtio_vsock_rx(vdev);
+}
+
+/* "CONNECT <port>\n" from the SOS application */
+static void
+virtio_vsock_handshake(struct virtio_vsock_conn *conn)
+{
+	unsigned int port;
+	ssize_t len;
+	char c;
+
+	/* a byte at a time, the stream may follow right after the line */
+	while ((len = read(conn->fd, &c, 1)) == 1) {
+		if (c != '\n') {
+			if (conn->line_len == sizeof(conn->line) - 1)
+				goto fail;
+			conn->line[conn->line_len++] = c;
+			continue;
+		}
+
+		conn->line[conn->line_len] = '\0';
+		if (sscanf(conn->line, "CONNECT %u", &port) != 1)
+			goto fail;
+
+		conn->peer_port = port;
+		conn->local_port = virtio_vsock_alloc_port(conn->vs);
+		conn->state = VSOCK_CONNECTING;
+		conn->pending = VSOCK_PEND_REQUEST;
+		virtio_vsock_rx(conn->vs);
+		return;
+	}
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+fail:
+	DPRINTF(("virtio_vsock: bad handshake\n"));
+	virtio_vsock_conn_free(conn);
+}
+
+static void
+virtio_vsock_conn_read(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vsock_conn *conn = arg;
+	struct virtio_vsock *vs = conn->vs;
+
+	pthread_mutex_lock(&vs->mtx);
+	/* closed, and maybe reused, since the event fired */
+	if (conn->fd != fd || conn->rd_evp == NULL)
+		goto out;
+
+	if (conn->state == VSOCK_HANDSHAKE)
+		virtio_vsock_handshake(conn);
+	else {
+		/* the guest takes it as its rx buffers and credit allow */
+		conn->readable = true;
+		mevent_disable(conn->rd_evp);
+		virtio_vsock_rx(vs);
+	}
+out:
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static void
+virtio_vsock_conn_write(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vsock_conn *conn = arg;
+	struct virtio_vsock *vs = conn->vs;
+
+	pthread_mutex_lock(&vs->mtx);
+	if (conn->fd == fd && conn->buf_len > 0) {
+		virtio_vsock_flush(conn);
+		virtio_vsock_rx(vs);
+	}
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static void
+virtio_vsock_accept(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vsock *vs = arg;
+	int cfd;
+
+	cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (cfd < 0)
+		return;
+
+	pthread_mutex_lock(&vs->mtx);
+	if (!virtio_vsock_conn_alloc(vs, cfd, VSOCK_HANDSHAKE)) {
+		WPRINTF(("virtio_vsock: cannot take a new connection\n"));
+		close(cfd);
+	}
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static int
+virtio_vsock_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_vsock *vs = vdev;
+
+	if (offset + size > sizeof(vs->config))
+		return -1;
+
+	memcpy(retval, (uint8_t *)&vs->config + offset, size);
+	return 0;
+}
+
+/* drop all connections, the guest forgets about them on reset */
+static void
+virtio_vsock_close_all(struct virtio_vsock *vs)
+{
+	struct virtio_vsock_conn *conn;
+
+	while ((conn = LIST_FIRST(&vs->conns)) != NULL)
+		virtio_vsock_conn_free(conn);
+}
+
+static void
+virtio_vsock_reset(void *base)
+{
+	struct virtio_vsock *vs = base;
+
+	DPRINTF(("virtio_vsock: device reset requested !\n"));
+	virtio_vsock_close_all(vs);
+	virtio_reset_dev(&vs->base);
+}
+
+static int
+virtio_vsock_listen(struct virtio_vsock *vs)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, vs->path, sizeof(addr.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("virtio_vsock: socket");
+		return -1;
+	}
+
+	unlink(vs->path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 16) < 0) {
+		perror(vs->path);
+		close(fd);
+		return -1;
+	}
+
+	vs->listen_fd = fd;
+	return 0;
+}
+
+static int
+virtio_vsock_parse(struct virtio_vsock *vs, char *opts)
+{
+	unsigned long long cid = 0;
+	char *opt, *path = NULL;
+
+	while (opts && (opt = strsep(&opts, ",")) != NULL) {
+		if (!strncmp(opt, "cid=", 4))
+			cid = strtoull(opt + 4, NULL, 0);
+		else if (!strncmp(opt, "path=", 5))
+			path = opt + 5;
+		else
+			WPRINTF(("virtio_vsock: unknown option %s\n", opt));
+	}
+
+	/* 0-2 are reserved, the guest CID is a 32 bit value in practice */
+	if (cid <= VIRTIO_VSOCK_HOST_CID || cid > UINT32_MAX) {
+		WPRINTF(("virtio_vsock: cid=<3 .. 0xffffffff> is required\n"));
+		return -1;
+	}
+
+	/* room for the "_<port>" suffix of the guest connections */
+	if (!path || !*path || strlen(path) + 12 >
+			sizeof(((struct sockaddr_un *)0)->sun_path)) {
+		WPRINTF(("virtio_vsock: path=<socket path> is required\n"));
+		return -1;
+	}
+
+	vs->config.guest_cid = cid;
+	vs->path = strdup(path);
+	return vs->path ? 0 : -1;
+}
+
+static int
+virtio_vsock_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_vsock *vs;
+	pthread_mutexattr_t attr;
+	char name[16];
+	int i;
+
+	vs = calloc(1, sizeof(struct virtio_vsock));
+	if (!vs) {
+		WPRINTF(("virtio_vsock: calloc returns NULL\n"));
+		return -1;
+	}
+
+	vs->listen_fd = -1;
+	vs->next_port = VIRTIO_VSOCK_FIRST_PORT;
+	LIST_INIT(&vs->conns);
+	LIST_INIT(&vs->free_conns);
+
+	if (virtio_vsock_parse(vs, opts) < 0 || virtio_vsock_listen(vs) < 0)
+		goto fail;
+
+	/* the queue notify callbacks run with it held */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&vs->mtx, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	virtio_linkup(&vs->base, &virtio_vsock_ops, vs, dev, vs->queues);
+	vs->base.mtx = &vs->mtx;
+	vs->base.flags |= VIRTIO_DOORBELL;
+
+	for (i = 0; i < VIRTIO_VSOCK_MAXQ; i++)
+		vs->queues[i].qsize = VIRTIO_VSOCK_RINGSZ;
+	vs->queues[VIRTIO_VSOCK_RXQ].notify = virtio_vsock_notify_rx;
+	vs->queues[VIRTIO_VSOCK_TXQ].notify = virtio_vsock_notify_tx;
+	/* no transport events are sent, the event queue stays idle */
+
+	/* initialize config space, vsock has no transitional device ID */
+	pci_set_cfgdata16(dev, PCIR_DEVICE, 0x1040 + VIRTIO_TYPE_VSOCK);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_OTHER);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, 0x1040 + VIRTIO_TYPE_VSOCK);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&vs->base, virtio_uses_msix()))
+		goto fail_mtx;
+
+	if (virtio_set_modern_bar(&vs->base, true))
+		goto fail_mtx;
+
+	/* accept only once the device is fully set up */
+	snprintf(name, sizeof(name), "vsock-%d:%d", dev->slot, dev->func);
+	vs->loop = mevent_loop_create(name);
+	if (!vs->loop)
+		goto fail_mtx;
+	vs->listen_evp = mevent_add_on(vs->loop, vs->listen_fd, EVF_READ,
+			virtio_vsock_accept, vs);
+	if (!vs->listen_evp)
+		goto fail_mtx;
+
+	return 0;
+
+fail_mtx:
+	pthread_mutex_destroy(&vs->mtx);
+fail:
+	if (vs->listen_evp)
+		mevent_delete(vs->listen_evp);
+	mevent_loop_destroy(vs->loop);
+	if (vs->listen_fd >= 0) {
+		close(vs->listen_fd);
+		unlink(vs->path);
+	}
+	free(vs->path);
+	free(vs);
+	return -1;
+}
+
+static void
+virtio_vsock_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_vsock *vs = dev->arg;
+	struct virtio_vsock_conn *conn;
+
+	if (vs == NULL)
+		return;
+
+	pthread_mutex_lock(&vs->mtx);
+	virtio_vsock_close_all(vs);
+	mevent_delete_close(vs->listen_evp);
+	pthread_mutex_unlock(&vs->mtx);
+
+	/*
+	 * No callback runs past this. The loop closes the fds of what an
+	 * accept in flight may have added meanwhile.
+	 */
+	mevent_loop_destroy(vs->loop);
+	while ((conn = LIST_FIRST(&vs->conns)) != NULL ||
+	       (conn = LIST_FIRST(&vs->free_conns)) != NULL) {
+		LIST_REMOVE(conn, list);
+		free(conn->buf);
+		free(conn);
+	}
+
+	unlink(vs->path);
+	pthread_mutex_destroy(&vs->mtx);
+	free(vs->path);
+	free(vs);
+}
+
+struct pci_vdev_ops pci_ops_virtio_vsock = {
+	.class_name	= "virtio-vsock",
+	.vdev_init	= virtio_vsock_init,
+	.vdev_deinit	= virtio_vsock_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read,
+	.vdev_bar_decode = virtio_pci_bar_decode
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_vsock);
@@ -88,6 +88,7 @@
 #include "usbdi.h"
 #include "xhcireg.h"
 #include "dm.h"
+#include "vmmapi.h"
 #include "pci_core.h"
 #include "xhci.h"
 #include "usb_pmapper.h"
@@ -98,10 +99,10 @@
 #define	XHCI_MAX_SLOTS		64	/* min allowed by Windows drivers */
 
 /*
- * XHCI data structures can be up to 64k, but limit paddr_guest2host mapping
+ * XHCI data structures can be up to 64k, but limit XHCI_GADDR mapping
  * to 4k to avoid going over the guest physical memory barrier.
  */
-#define	XHCI_PADDR_SZ		4096	/* paddr_guest2host max size */
+#define	XHCI_PADDR_SZ		4096	/* XHCI_GADDR max size */
 #define	XHCI_ERST_MAX		0	/* max 2^entries event ring seg tbl */
 #define	XHCI_CAPLEN		(4*8)	/* offset of op register space */
 #define	XHCI_HCCPRAMS2		0x1C	/* offset of HCCPARAMS2 register */
@@ -382,7 +383,7 @@ struct pci_xhci_vdev {
 #define	XHCI_DEVINST_PTR(x, n)	((x)->devices[(n)])
 #define	XHCI_SLOTDEV_PTR(x, n)	((x)->slots[(n)])
 #define	XHCI_HALTED(xdev)	((xdev)->opregs.usbsts & XHCI_STS_HCH)
-#define	XHCI_GADDR(xdev, a)	paddr_guest2host((xdev)->dev->vmctx, (a), \
+#define	XHCI_GADDR(xdev, a)	vm_gpa2hva((xdev)->dev->vmctx, (a), \
 				XHCI_PADDR_SZ - ((a) & (XHCI_PADDR_SZ-1)))
 struct pci_xhci_option_elem {
 	char *parse_opt;
@@ -43,6 +43,7 @@
 #include "ps2mouse.h"
 #include "vmmapi.h"
 #include "mevent.h"
+#include "snapshot.h"
 
 static void
 atkbdc_assert_kbd_intr(struct atkbdc_base *base)
@@ -407,6 +408,36 @@ atkbdc_event(struct atkbdc_base *base, int iskbd)
 	pthread_mutex_unlock(&base->mtx);
 }
 
+/*
+ * Save or restore the controller registers and the keyboard output
+ * buffer. The keyboard and mouse themselves come back in their reset
+ * state, which the guest driver reprograms when it resumes.
+ */
+int
+atkbdc_snapshot(struct atkbdc_base *base, struct snapshot_meta *meta)
+{
+	pthread_mutex_lock(&base->mtx);
+	SNAPSHOT_VAR(meta, base->status);
+	SNAPSHOT_VAR(meta, base->outport);
+	SNAPSHOT_VAR(meta, base->ram);
+	SNAPSHOT_VAR(meta, base->curcmd);
+	SNAPSHOT_VAR(meta, base->ctrlbyte);
+	SNAPSHOT_VAR(meta, base->kbd.buffer);
+	SNAPSHOT_VAR(meta, base->kbd.brd);
+	SNAPSHOT_VAR(meta, base->kbd.bwr);
+	SNAPSHOT_VAR(meta, base->kbd.bcnt);
+	if (meta->op == SNAPSHOT_RESTORE && !meta->error &&
+	    (base->kbd.brd < 0 || base->kbd.brd >= FIFOSZ ||
+	     base->kbd.bwr < 0 || base->kbd.bwr >= FIFOSZ ||
+	     base->kbd.bcnt < 0 || base->kbd.bcnt > FIFOSZ)) {
+		base->kbd.brd = base->kbd.bwr = base->kbd.bcnt = 0;
+		meta->error = -EINVAL;
+	}
+	pthread_mutex_unlock(&base->mtx);
+
+	return meta->error ? -1 : 0;
+}
+
 void
 atkbdc_init(struct vmctx *ctx)
 {
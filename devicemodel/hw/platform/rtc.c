@@ -33,11 +33,13 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
 
 #include "vmmapi.h"
 #include "inout.h"
 #include "mc146818rtc.h"
 #include "rtc.h"
+#include "snapshot.h"
 
 /* #define DEBUG_RTC */
 #ifdef DEBUG_RTC
@@ -1094,6 +1096,42 @@ vrtc_reset(struct vrtc *vrtc)
 	pthread_mutex_unlock(&vrtc->mtx);
 }
 
+/*
+ * Save or restore the alarm, control and CMOS registers. The date and
+ * time keep following the host clock; the periodic timer is re-armed
+ * by replaying register A and B.
+ */
+int
+vrtc_snapshot(struct vrtc *vrtc, struct snapshot_meta *meta)
+{
+	struct rtcdev *rtc, saved;
+	u_int addr;
+
+	pthread_mutex_lock(&vrtc->mtx);
+	rtc = &vrtc->rtcdev;
+	saved = *rtc;
+	addr = vrtc->addr;
+	SNAPSHOT_VAR(meta, addr);
+	SNAPSHOT_VAR(meta, saved);
+	if (meta->op == SNAPSHOT_RESTORE && !meta->error) {
+		vrtc->addr = addr;
+		rtc->alarm_sec = saved.alarm_sec;
+		rtc->alarm_min = saved.alarm_min;
+		rtc->alarm_hour = saved.alarm_hour;
+		rtc->reg_d = saved.reg_d;
+		memcpy(rtc->nvram, saved.nvram, sizeof(rtc->nvram));
+		memcpy(rtc->nvram2, saved.nvram2, sizeof(rtc->nvram2));
+		vrtc_set_reg_a(vrtc, saved.reg_a);
+		if (vrtc_set_reg_b(vrtc, saved.reg_b) != 0)
+			meta->error = -EINVAL;
+		else
+			vrtc_set_reg_c(vrtc, saved.reg_c);
+	}
+	pthread_mutex_unlock(&vrtc->mtx);
+
+	return meta->error ? -1 : 0;
+}
+
 void
 vrtc_enable_localtime(int l_time)
 {
@@ -43,6 +43,7 @@
 #include "uart_core.h"
 #include "ns16550.h"
 #include "dm.h"
+#include "snapshot.h"
 
 #define	COM1_BASE	0x3F8
 #define COM1_IRQ	4
@@ -657,6 +658,34 @@ uart_deinit(struct uart_vdev *uart)
 	}
 }
 
+/*
+ * Save or restore the registers. Input the guest has not read yet is
+ * dropped: the FIFO comes back empty.
+ */
+int
+uart_snapshot(struct uart_vdev *uart, struct snapshot_meta *meta)
+{
+	pthread_mutex_lock(&uart->mtx);
+	SNAPSHOT_VAR(meta, uart->data);
+	SNAPSHOT_VAR(meta, uart->ier);
+	SNAPSHOT_VAR(meta, uart->lcr);
+	SNAPSHOT_VAR(meta, uart->mcr);
+	SNAPSHOT_VAR(meta, uart->lsr);
+	SNAPSHOT_VAR(meta, uart->msr);
+	SNAPSHOT_VAR(meta, uart->fcr);
+	SNAPSHOT_VAR(meta, uart->scr);
+	SNAPSHOT_VAR(meta, uart->dll);
+	SNAPSHOT_VAR(meta, uart->dlh);
+	SNAPSHOT_VAR(meta, uart->thre_int_pending);
+	if (meta->op == SNAPSHOT_RESTORE && !meta->error) {
+		rxfifo_reset(uart, (uart->fcr & FCR_ENABLE) ? FIFOSZ : 1);
+		uart_toggle_intr(uart);
+	}
+	pthread_mutex_unlock(&uart->mtx);
+
+	return meta->error ? -1 : 0;
+}
+
 static int
 uart_tty_backend(struct uart_vdev *uart, const char *opts)
 {
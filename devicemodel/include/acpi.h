@@ -48,6 +48,7 @@ uint32_t get_acpi_base(void);
 uint32_t get_acpi_table_length(void);
 
 struct vmctx;
+struct snapshot_meta;
 
 int	acpi_build(struct vmctx *ctx, int ncpu);
 void	dsdt_line(const char *fmt, ...);
@@ -59,5 +60,6 @@ void	dsdt_unindent(int levels);
 void	sci_init(struct vmctx *ctx);
 void	pm_write_dsdt(struct vmctx *ctx, int ncpu);
 void	pm_backto_wakeup(struct vmctx *ctx);
+int	pm_snapshot(struct vmctx *ctx, struct snapshot_meta *meta);
 
 #endif /* _ACPI_H_ */
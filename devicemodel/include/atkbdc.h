@@ -80,6 +80,7 @@
 #define	CTRL_CMD_FLAG		0x8000
 
 struct vmctx;
+struct snapshot_meta;
 
 struct kbd_dev {
 	bool	irq_active;
@@ -116,5 +117,6 @@ struct atkbdc_base {
 void atkbdc_init(struct vmctx *ctx);
 void atkbdc_deinit(struct vmctx *ctx);
 void atkbdc_event(struct atkbdc_base *base, int iskbd);
+int atkbdc_snapshot(struct atkbdc_base *base, struct snapshot_meta *meta);
 
 #endif /* _ATKBDC_H_ */
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Startup tracer: records how long each phase of acrn-dm startup takes,
+ * up to the start of the first vCPU. Spans nest per thread:
+ *
+ *	int id = boot_trace_begin("init pci");
+ *	...
+ *	boot_trace_end(id);
+ *
+ * Both are no-ops unless --boot_trace was given.
+ */
+
+#ifndef _BOOT_TRACE_H_
+#define _BOOT_TRACE_H_
+
+int boot_trace_parse(const char *path);
+void boot_trace_init(void);
+int boot_trace_begin(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+void boot_trace_end(int id);
+void boot_trace_dump(const char *vmname);
+
+#endif	/* _BOOT_TRACE_H_ */
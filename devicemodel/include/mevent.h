@@ -32,16 +32,23 @@
 enum ev_type {
 	EVF_READ,
 	EVF_WRITE,
-	EVF_TIMER,		/* Not supported yet */
+	EVF_TIMER,		/* periodic, fd argument is the period in ms */
 	EVF_SIGNAL		/* Not supported yet */
 };
 
 char *vmname;
 struct mevent;
+struct mevent_loop;
 
 struct mevent *mevent_add(int fd, enum ev_type type,
 			  void (*func)(int, enum ev_type, void *),
 			  void *param);
+struct mevent *mevent_add_on(struct mevent_loop *loop, int fd,
+			     enum ev_type type,
+			     void (*func)(int, enum ev_type, void *),
+			     void *param);
+struct mevent_loop *mevent_loop_create(const char *name);
+void	mevent_loop_destroy(struct mevent_loop *loop);
 int	mevent_enable(struct mevent *evp);
 int	mevent_disable(struct mevent *evp);
 int	mevent_delete(struct mevent *evp);
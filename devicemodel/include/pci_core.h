@@ -32,6 +32,7 @@
 #include <sys/queue.h>
 
 #include <assert.h>
+#include <stdbool.h>
 #include "types.h"
 #include "pcireg.h"
 
@@ -41,6 +42,7 @@
 struct vmctx;
 struct pci_vdev;
 struct memory_region;
+struct snapshot_meta;
 
 struct pci_vdev_ops {
 	char	*class_name;		/* Name of device class */
@@ -74,6 +76,29 @@ struct pci_vdev_ops {
 	uint64_t  (*vdev_barread)(struct vmctx *ctx, int vcpu,
 				struct pci_vdev *pi, int baridx,
 				uint64_t offset, int size);
+
+	/* save/restore device private state, see snapshot.h */
+	int	(*vdev_snapshot)(struct vmctx *ctx, struct pci_vdev *pi,
+				 struct snapshot_meta *meta);
+
+	/*
+	 * A BAR starts or stops decoding at its current address: moved by
+	 * the guest, or decoding toggled in the command register. For
+	 * devices that map host memory or doorbells straight behind a BAR.
+	 */
+	void	(*vdev_bar_decode)(struct vmctx *ctx, struct pci_vdev *pi,
+				   int baridx, bool enable);
+
+	/* the BARs allocated by vdev_init have their guest addresses */
+	int	(*vdev_bars_ready)(struct vmctx *ctx, struct pci_vdev *pi);
+
+	/*
+	 * vdev_init only touches its own device and may run on a thread of
+	 * its own, concurrently with other devices. Its BAR and INTx pin
+	 * requests are granted after it returns, so anything that needs a
+	 * BAR address goes in vdev_bars_ready.
+	 */
+	bool	vdev_parallel_init;
 };
 
 /*
@@ -96,6 +121,14 @@ struct pcibar {
 	uint64_t		addr;
 };
 
+/* BAR request queued by a parallel vdev_init, see init_pci() */
+struct pcibar_req {
+	int			idx;
+	enum pcibar_type	type;
+	uint64_t		size;
+	uint64_t		hostbase;
+};
+
 #define PI_NAMESZ	40
 
 struct msix_table_entry {
@@ -104,6 +137,13 @@ struct msix_table_entry {
 	uint32_t	vector_control;
 } __attribute__((packed));
 
+/* eventfd bound to a MSI-X vector, see pci_generate_msix() */
+struct msix_irqfd {
+	int		fd;		/* -1 until the vector is first raised */
+	uint64_t	addr;		/* message currently bound to fd */
+	uint32_t	msg_data;
+};
+
 /*
  * In case the structure is modified to hold extra information, use a define
  * for the size that should be emulated.
@@ -154,12 +194,22 @@ struct pci_vdev {
 		struct msix_table_entry *table;	/* allocated at runtime */
 		void	*pba_page;
 		int	pba_page_offset;
+		uint64_t *pba;		/* pending bits of emulated vectors */
+		struct msix_irqfd *irqfds;	/* one per table entry */
+		pthread_mutex_t	irqfd_mtx;	/* serializes irqfd rebinds */
 	} msix;
 
 	void	*arg;		/* devemu-private data */
 
 	uint8_t	cfgdata[PCI_REGMAX + 1];
 	struct pcibar bar[PCI_BARMAX + 1];
+
+	struct {
+		bool	active;		/* queue resource requests */
+		bool	lintr;		/* pci_lintr_request() was called */
+		int	nr_bars;
+		struct pcibar_req bars[PCI_BARMAX + 1];
+	} deferred;
 };
 
 struct gsi_dev {
@@ -235,6 +285,8 @@ typedef void (*pci_lintr_cb)(int b, int s, int pin, int pirq_pin,
 
 int	init_pci(struct vmctx *ctx);
 void	deinit_pci(struct vmctx *ctx);
+int	pci_snapshot(struct vmctx *ctx, struct snapshot_meta *meta);
+int	pci_snapshot_check(void);
 void	msicap_cfgwrite(struct pci_vdev *pi, int capoff, int offset,
 			int bytes, uint32_t val);
 void	msixcap_cfgwrite(struct pci_vdev *pi, int capoff, int offset,
@@ -254,6 +306,7 @@ int	pci_emul_add_msicap(struct pci_vdev *pi, int msgnum);
 int	pci_emul_add_pciecap(struct pci_vdev *pi, int pcie_device_type);
 void	pci_generate_msi(struct pci_vdev *pi, int msgnum);
 void	pci_generate_msix(struct pci_vdev *pi, int msgnum);
+int	pci_msix_irqfd(struct pci_vdev *pi, int msgnum);
 void	pci_lintr_assert(struct pci_vdev *pi);
 void	pci_lintr_deassert(struct pci_vdev *pi);
 void	pci_lintr_request(struct pci_vdev *pi);
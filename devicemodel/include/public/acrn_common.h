@@ -277,6 +277,69 @@ struct acrn_set_ioreq_buffer {
 	uint64_t req_buf;
 } __aligned(8);
 
+/** Maximum number of doorbells registered for one VM */
+#define ACRN_DOORBELL_MAX		64U
+
+/** Doorbell flag: the doorbell is an I/O port, otherwise an MMIO address */
+#define ACRN_DOORBELL_PIO		(1U << 0U)
+
+/** Doorbell flag: only match writes of acrn_doorbell.data */
+#define ACRN_DOORBELL_DATAMATCH		(1U << 1U)
+
+/** Doorbell flag: remove the doorbell with the given id */
+#define ACRN_DOORBELL_DEASSIGN		(1U << 2U)
+
+/**
+ * @brief Info to register a doorbell of a VM
+ *
+ * the parameter for HC_SET_DOORBELL hypercall. A guest write matching a
+ * registered doorbell is completed by the hypervisor without an I/O
+ * request: the bit of the doorbell id is set in the VM's
+ * struct acrn_doorbell_page and the VHM upcall is raised.
+ */
+struct acrn_doorbell {
+	/** guest physical address or I/O port of the doorbell */
+	uint64_t addr;
+
+	/** access width to match: 1, 2, 4 or 8, 0 for any width */
+	uint32_t len;
+
+	/** ACRN_DOORBELL_* flags */
+	uint32_t flags;
+
+	/** value to match with ACRN_DOORBELL_DATAMATCH */
+	uint64_t data;
+
+	/** doorbell id, bit number in struct acrn_doorbell_page */
+	uint32_t id;
+
+	/** reserved for alignment padding */
+	uint32_t reserved;
+} __aligned(8);
+
+/**
+ * @brief Doorbells rung by a VM, shared with the service OS
+ *
+ * The hypervisor sets the bit of a doorbell id with a locked operation
+ * when the doorbell is written; the service OS clears it when consuming it.
+ */
+struct acrn_doorbell_page {
+	/** one bit per doorbell id */
+	uint64_t pending[ACRN_DOORBELL_MAX / 64U];
+} __aligned(8);
+
+/**
+ * @brief Info to set up the doorbell page of a VM
+ *
+ * the parameter for HC_SET_DOORBELL_PAGE hypercall
+ */
+struct acrn_set_doorbell_page {
+	/** guest physical address of a page aligned struct acrn_doorbell_page,
+	 *  0 to stop doorbell delivery
+	 */
+	uint64_t page;
+} __aligned(8);
+
 /** Interrupt type for acrn_irqline: inject interrupt to IOAPIC */
 #define	ACRN_INTR_TYPE_ISA	0U
 
@@ -311,6 +374,40 @@ struct acrn_irqline {
 	uint32_t reserved1;
 } __aligned(8);
 
+/** Number of IOAPIC pins covered by struct acrn_irqline_page */
+#define ACRN_IRQLINE_PAGE_PINS	256U
+
+/**
+ * @brief IOAPIC line state shared between the device model and hypervisor
+ *
+ * Set up with HC_SET_IRQLINE_PAGE. The device model owns level: a set bit
+ * keeps the IOAPIC pin asserted. The hypervisor owns in_service: a set bit
+ * means an interrupt on the level-triggered pin was delivered and has not
+ * been EOIed yet. The hypervisor delivers the interrupt again at EOI while
+ * the level bit is set, so a line is deasserted by clearing its bit without
+ * a hypercall, and is asserted by setting its bit followed by
+ * HC_NOTIFY_IRQLINE only if the pin is not in service.
+ */
+struct acrn_irqline_page {
+	/** line levels, written by the device model */
+	uint64_t level[ACRN_IRQLINE_PAGE_PINS / 64U];
+
+	/** pins waiting for EOI, written by the hypervisor */
+	uint64_t in_service[ACRN_IRQLINE_PAGE_PINS / 64U];
+} __aligned(8);
+
+/**
+ * @brief Info to set up the shared IOAPIC line state of a VM
+ *
+ * the parameter for HC_SET_IRQLINE_PAGE hypercall
+ */
+struct acrn_set_irqline_page {
+	/** guest physical address of a page aligned struct acrn_irqline_page,
+	 *  0 to stop sharing the line state
+	 */
+	uint64_t page;
+} __aligned(8);
+
 /**
  * @brief Info to inject a MSI interrupt to VM
  *
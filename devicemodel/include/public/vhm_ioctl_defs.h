@@ -80,6 +80,9 @@
 #define IC_DEASSERT_IRQLINE            _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x01)
 #define IC_PULSE_IRQLINE               _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x02)
 #define IC_INJECT_MSI                  _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x03)
+#define IC_SET_IRQLINE_PAGE            _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x04)
+#define IC_NOTIFY_IRQLINE              _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x05)
+#define IC_SET_IRQFD                   _IC_ID(IC_ID, IC_ID_IRQ_BASE + 0x06)
 
 /* DM ioreq management */
 #define IC_ID_IOREQ_BASE                0x30UL
@@ -88,12 +91,16 @@
 #define IC_CREATE_IOREQ_CLIENT          _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x02)
 #define IC_ATTACH_IOREQ_CLIENT          _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x03)
 #define IC_DESTROY_IOREQ_CLIENT         _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x04)
+#define IC_SET_DOORBELL                 _IC_ID(IC_ID, IC_ID_IOREQ_BASE + 0x05)
 
 /* Guest memory management */
 #define IC_ID_MEM_BASE                  0x40UL
 /* IC_ALLOC_MEMSEG not used */
 #define IC_ALLOC_MEMSEG                 _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x00)
 #define IC_SET_MEMSEG                   _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x01)
+#define IC_SET_DIRTY_LOG                _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x02)
+#define IC_GET_DIRTY_LOG                _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x03)
+#define IC_UNSET_MEMSEG                 _IC_ID(IC_ID, IC_ID_MEM_BASE + 0x04)
 
 /* PCI assignment*/
 #define IC_ID_PCI_BASE                  0x50UL
@@ -140,6 +147,71 @@ struct vm_memmap {
 	uint32_t prot;	/* RWX */
 };
 
+/**
+ * struct ic_dirty_log_ctrl - start or stop dirty page logging
+ */
+struct ic_dirty_log_ctrl {
+#define DIRTY_LOG_DISABLE	0
+#define DIRTY_LOG_ENABLE	1
+	/** @op: DIRTY_LOG_ENABLE or DIRTY_LOG_DISABLE */
+	uint32_t op;
+	/** @reserved: reserved */
+	uint32_t reserved;
+	/** @size: size of the guest physical space logged from gpa 0 */
+	uint64_t size;
+};
+
+/**
+ * struct ic_dirty_log - fetch and clear the dirty page bitmap of a range
+ */
+struct ic_dirty_log {
+	/** @gpa: first guest physical address, aligned to 64 pages */
+	uint64_t gpa;
+	/** @size: size of the range, page aligned */
+	uint64_t size;
+	/** @bitmap: service OS user virtual address of the bitmap,
+	 * one bit per page
+	 */
+	uint64_t bitmap;
+};
+
+/**
+ * struct ic_doorbell - register or remove a doorbell backed by an eventfd
+ *
+ * A guest write matching the doorbell completes in the hypervisor without
+ * an I/O request, and the VHM signals @fd instead.
+ */
+struct ic_doorbell {
+	/** @addr: guest physical address or I/O port of the doorbell */
+	uint64_t addr;
+	/** @len: access width to match, 0 for any width */
+	uint32_t len;
+	/** @flags: ACRN_DOORBELL_* flags */
+	uint32_t flags;
+	/** @data: value to match with ACRN_DOORBELL_DATAMATCH */
+	uint64_t data;
+	/** @fd: eventfd signaled when the doorbell is written */
+	int32_t fd;
+	/** @reserved: reserved */
+	uint32_t reserved;
+};
+
+/**
+ * struct ic_irqfd - bind an eventfd to a MSI of the VM
+ *
+ * Each signal of @fd injects @msi. Signals raised before the VHM gets to
+ * inject the MSI are merged into one injection.
+ */
+struct ic_irqfd {
+#define IRQFD_DEASSIGN	0x01
+	/** @fd: eventfd to bind or unbind */
+	int32_t fd;
+	/** @flags: IRQFD_DEASSIGN to unbind @fd */
+	uint32_t flags;
+	/** @msi: MSI injected when @fd is signaled */
+	struct acrn_msi_entry msi;
+};
+
 /**
  * struct ic_ptdev_irq - pass thru device irq data structure
  */
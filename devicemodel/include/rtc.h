@@ -35,6 +35,7 @@
 
 struct vrtc;
 struct vmctx;
+struct snapshot_meta;
 
 int vrtc_init(struct vmctx *ctx);
 void vrtc_enable_localtime(int l_time);
@@ -42,6 +43,7 @@ void vrtc_deinit(struct vmctx *ctx);
 void vrtc_reset(struct vrtc *vrtc);
 time_t vrtc_get_time(struct vrtc *vrtc);
 int vrtc_set_time(struct vrtc *vrtc, time_t secs);
+int vrtc_snapshot(struct vrtc *vrtc, struct snapshot_meta *meta);
 int vrtc_nvram_read(struct vrtc *vrtc, int offset, uint8_t *retval);
 int vrtc_nvram_write(struct vrtc *vrtc, int offset, uint8_t value);
 int vrtc_addr_handler(struct vmctx *ctx, int vcpu, int in, int port,
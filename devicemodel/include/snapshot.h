@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) <2018> Intel Corporation
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * VM snapshot and restore.
+ *
+ * A snapshot is taken when the guest enters S3: all vCPUs are paused and
+ * the guest has parked its devices, so guest memory plus the device model
+ * state is a consistent image. Restoring it and starting the VM with the
+ * PM1 WAK_STS bit set lets the guest firmware take its normal S3 resume
+ * path, which reinitializes vCPU and interrupt controller state owned by
+ * the hypervisor.
+ *
+ * That state is not saved, so snapshots are only taken on guest S3 and
+ * only restored into a VM booted with the vsbl, whose wakeup path lives
+ * in the memory image. Every PCI device must implement vdev_snapshot;
+ * pci_snapshot_check() refuses other configurations at startup.
+ *
+ * File layout: a struct snapshot_header followed by a stream of sections.
+ * Each save appends one generation of sections terminated by
+ * SNAPSHOT_SEC_END; on restore later generations override earlier ones.
+ * Memory data is kept page aligned in the file so it can be mmap'd.
+ *
+ * The first generation holds all the non-zero pages. The later ones hold
+ * the pages the hypervisor dirty log reports as written by the guest,
+ * and the pages the DM translated with vm_gpa2hva() or keeps pointers to.
+ * Backends which write guest memory outside acrn-dm make all the saves
+ * full.
+ *
+ * A template is a snapshot holding a single generation whose memory is
+ * one extent per RAM segment, with all pages in place (zero ones as file
+ * holes). Clones map those extents MAP_PRIVATE as guest memory, so pages
+ * stay shared with the page cache until written. The EPT maps them read
+ * only; the first write from the guest (a REQ_WP request, which the
+ * hypervisor restarts instead of emulating) or from the DM (through
+ * vm_gpa2hva()) copies the page and maps the copy writable.
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SNAPSHOT_MAGIC		"ACRNSNAP"
+#define SNAPSHOT_VERSION	2U
+
+struct snapshot_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	ncpus;
+	uint64_t	lowmem;
+	uint64_t	highmem;
+} __attribute__((packed));
+
+#define SNAPSHOT_SEC_END	0U
+#define SNAPSHOT_SEC_MEM	1U
+#define SNAPSHOT_SEC_DEV	2U
+#define SNAPSHOT_SEC_PM		3U	/* PM1 registers, RTC, i8042 */
+
+struct snapshot_section {
+	uint32_t	type;
+	uint32_t	id;		/* generation number */
+	uint64_t	len;		/* payload length, excluding this header */
+} __attribute__((packed));
+
+/*
+ * Payload of a SNAPSHOT_SEC_MEM section: the extent descriptor, padding up
+ * to the next page boundary in the file, then npages of data unless the
+ * extent is SNAPSHOT_MEM_ZERO.
+ */
+#define SNAPSHOT_MEM_ZERO	(1U << 0)
+
+struct snapshot_mem_extent {
+	uint64_t	gpa;
+	uint64_t	npages;
+	uint64_t	flags;
+} __attribute__((packed));
+
+enum snapshot_op {
+	SNAPSHOT_SAVE,
+	SNAPSHOT_RESTORE,
+};
+
+/*
+ * Cursor over a serialized device state buffer. The buffer grows on save;
+ * on restore a read past its end sets error, and further accesses are
+ * ignored so callers may check it once after a group of fields.
+ */
+struct snapshot_meta {
+	enum snapshot_op op;
+	uint8_t		*buf;
+	size_t		size;
+	size_t		off;
+	int		error;
+};
+
+int snapshot_var(struct snapshot_meta *meta, void *data, size_t len);
+
+#define SNAPSHOT_VAR(meta, var)		snapshot_var((meta), &(var), sizeof(var))
+#define SNAPSHOT_BUF(meta, ptr, len)	snapshot_var((meta), (ptr), (len))
+
+struct vmctx;
+
+int acrn_parse_snapshot(char *arg);
+int acrn_parse_restore(char *arg);
+int acrn_parse_template(char *arg);
+int acrn_parse_clone(char *arg);
+bool vm_snapshot_enabled(void);
+bool vm_restore_requested(void);
+bool vm_clone_requested(void);
+int vm_snapshot_save(struct vmctx *ctx);
+int vm_snapshot_restore(struct vmctx *ctx);
+int vm_clone_setup_memory(struct vmctx *ctx);
+void vm_clone_unsetup_memory(struct vmctx *ctx);
+int vm_clone_fault(struct vmctx *ctx, uint64_t gpa);
+void vm_snapshot_untracked(void);
+
+#endif /* _SNAPSHOT_H_ */
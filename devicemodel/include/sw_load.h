@@ -58,6 +58,20 @@ struct e820_entry {
 
 extern const struct e820_entry e820_default_entries[NUM_E820_ENTRIES];
 extern int with_bootargs;
+extern int sw_load_verify;
+
+/* An image file to load at gpa, see acrn_load_images() */
+struct sw_load_image {
+	const char *name;	/* for messages */
+	const char *path;
+	uint64_t gpa;
+	size_t size;		/* from acrn_image_size() */
+
+	struct vmctx *ctx;
+	bool direct;		/* read with O_DIRECT */
+	long ms;		/* load time */
+	int err;
+};
 
 int acrn_parse_kernel(char *arg);
 int acrn_parse_ramdisk(char *arg);
@@ -69,6 +83,8 @@ char *get_bootargs(void);
 void vsbl_set_bdf(int bnum, int snum, int fnum);
 
 int check_image(char *path);
+int acrn_image_size(const char *path, size_t *size);
+int acrn_load_images(struct vmctx *ctx, struct sw_load_image *img, int n);
 uint32_t acrn_create_e820_table(struct vmctx *ctx, struct e820_entry *e820);
 int add_e820_entry(struct e820_entry *e820, int len, uint64_t start,
 	uint64_t size, uint32_t type);
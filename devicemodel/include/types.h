@@ -84,6 +84,9 @@ flsl(uint64_t mask)
 
 /* memory barrier */
 #define mb()    ({ asm volatile("mfence" ::: "memory"); (void)0; })
+/* x86 doesn't reorder loads with loads or stores with stores */
+#define rmb()   ({ asm volatile("" ::: "memory"); (void)0; })
+#define wmb()   ({ asm volatile("" ::: "memory"); (void)0; })
 
 static inline void
 do_cpuid(u_int ax, u_int *p)
@@ -38,10 +38,39 @@ struct vbs_dev_info {
 	uint64_t pio_range_len;	/* PIO bar address initialized by guest OS */
 };
 
+/*
+ * Ring layout and notification channels of one virtqueue, for backends
+ * that run the data path in the kernel. Guest kicks of the queue signal
+ * kick_fd; signaling call_fd injects the queue's MSI-X vector.
+ */
+struct vbs_vq_ring {
+	uint32_t idx;		/* virtqueue index */
+	uint16_t qsize;		/* size of this queue (a power of 2) */
+	uint16_t msix_idx;	/* MSI-X index, or VIRTIO_MSI_NO_VECTOR */
+	uint64_t desc_gpa;	/* guest physical address of descriptors */
+	uint64_t avail_gpa;	/* guest physical address of avail ring */
+	uint64_t used_gpa;	/* guest physical address of used ring */
+	int32_t kick_fd;	/* eventfd signaled on guest kicks */
+	int32_t call_fd;	/* eventfd raising the MSI-X vector */
+};
+
+/* File the kernel backend moves data to and from */
+struct vbs_backend {
+#define VBS_BACKEND_RDONLY	0x1
+	int32_t fd;		/* tap or disk image, -1 to detach */
+	uint32_t flags;
+	uint64_t offset;	/* start of the device in fd, in bytes */
+	uint64_t size;		/* size of the device, 0 if unbounded */
+};
+
 /* reuse vhost ioctl index */
 #define VBS_K_IOCTL	0xAF
 
 #define VBS_K_SET_DEV _IOW(VBS_K_IOCTL, 0x00, struct vbs_dev_info)
 #define VBS_K_SET_VQ _IOW(VBS_K_IOCTL, 0x01, struct vbs_vqs_info)
+#define VBS_K_SET_VQ_RING _IOW(VBS_K_IOCTL, 0x02, struct vbs_vq_ring)
+#define VBS_K_SET_FEATURES _IOW(VBS_K_IOCTL, 0x03, uint64_t)
+#define VBS_K_SET_BACKEND _IOW(VBS_K_IOCTL, 0x04, struct vbs_backend)
+#define VBS_K_RESET_DEV _IO(VBS_K_IOCTL, 0x05)
 
 #endif /* _VBS_COMMON_IF_H_ */
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * vhost-user client: hands the data path of a virtio device to a backend
+ * process over a Unix socket, the way VBS-K hands it to the kernel. The
+ * backend maps guest RAM from the hugetlbfs files of the VM, is kicked
+ * through the queue doorbell eventfds and raises the queue MSI-X vectors
+ * through their irqfds. acrn-dm keeps emulating config space and device
+ * status only.
+ */
+
+#ifndef _VHOST_USER_H_
+#define _VHOST_USER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "virtio.h"
+
+struct vhost_user {
+	int fd;			/* connection to the backend, -1 if none */
+	bool started;		/* the backend serves the rings */
+	uint64_t features;	/* virtio features of the backend */
+	uint64_t protocol_features;
+	struct virtio_ops ops;	/* see vhost_user_ops() */
+};
+
+int vhost_user_open(struct vhost_user *vu, const char *path);
+void vhost_user_close(struct vhost_user *vu);
+
+/*
+ * Copy of the device ops offering the guest only what the backend
+ * supports, apart from the features in dev_caps that acrn-dm implements
+ * itself in config space.
+ */
+struct virtio_ops *vhost_user_ops(struct vhost_user *vu,
+				  const struct virtio_ops *ops,
+				  uint64_t dev_caps);
+
+/* read the device config space from the backend */
+int vhost_user_get_config(struct vhost_user *vu, void *config,
+			  uint32_t size);
+
+/* called with the device lock held, on DRIVER_OK and on reset */
+int vhost_user_start(struct vhost_user *vu, struct virtio_base *base);
+void vhost_user_stop(struct vhost_user *vu, struct virtio_base *base);
+
+#endif	/* _VHOST_USER_H_ */
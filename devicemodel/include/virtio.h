@@ -171,6 +171,44 @@ struct vring_used {
 /*	uint16_t	avail_event;	-- after N ring entries */
 } __attribute__((packed));
 
+/*
+ * Packed virtqueue layout (VIRTIO_F_RING_PACKED, virtio 1.1).
+ *
+ * A packed queue replaces the three split rings by a single ring of
+ * <N> descriptors which the driver makes available and the device
+ * marks used in place, plus two 4-byte event suppression structures:
+ * the "driver area", written by the driver, and the "device area",
+ * written by the device.  A buffer is a run of consecutive descriptors
+ * linked by VRING_DESC_F_NEXT; the device writes back a single used
+ * descriptor per buffer and skips as many slots as the buffer took.
+ *
+ * Ownership of a slot is encoded by the AVAIL and USED flag bits
+ * relative to a wrap counter that each side flips whenever its index
+ * wraps around the end of the ring: a descriptor is available when
+ * AVAIL matches the driver's wrap counter and USED does not, and it is
+ * used when both match the device's wrap counter.
+ */
+#define VRING_PACKED_DESC_F_AVAIL	(1 << 7)
+#define VRING_PACKED_DESC_F_USED	(1 << 15)
+
+struct vring_packed_desc {
+	uint64_t	addr;	/* guest physical address */
+	uint32_t	len;	/* length of scatter/gather seg */
+	uint16_t	id;	/* buffer id */
+	uint16_t	flags;	/* VRING_DESC_F_* and VRING_PACKED_DESC_F_* */
+} __attribute__((packed));
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE	0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE	0x1
+#define VRING_PACKED_EVENT_FLAG_DESC	0x2	/* needs EVENT_IDX */
+
+#define VRING_PACKED_EVENT_F_WRAP_CTR	15
+
+struct vring_packed_event {
+	uint16_t	off_wrap;	/* descriptor offset, wrap counter */
+	uint16_t	flags;		/* VRING_PACKED_EVENT_FLAG_* */
+} __attribute__((packed));
+
 /*
  * The address of any given virtual queue is determined by a single
  * Page Frame Number register.  The guest writes the PFN into the
@@ -216,6 +254,7 @@ struct vring_used {
 #define	VIRTIO_TYPE_SCSI	8
 #define	VIRTIO_TYPE_9P		9
 #define	VIRTIO_TYPE_INPUT	18
+#define	VIRTIO_TYPE_VSOCK	19
 
 /*
  * ACRN virtio device types
@@ -237,6 +276,7 @@ struct vring_used {
 #define	VIRTIO_VENDOR		0x1AF4
 #define	VIRTIO_DEV_NET		0x1000
 #define	VIRTIO_DEV_BLOCK	0x1001
+#define	VIRTIO_DEV_BALLOON	0x1002
 #define	VIRTIO_DEV_CONSOLE	0x1003
 #define	VIRTIO_DEV_RANDOM	0x1005
 
@@ -317,6 +357,9 @@ struct vring_used {
 /* v1.0 compliant. */
 #define VIRTIO_F_VERSION_1		(1UL << 32)
 
+/* Packed virtqueue layout, only offered with VIRTIO_F_VERSION_1. */
+#define VIRTIO_F_RING_PACKED		(1UL << 34)
+
 /* From section 2.3, "Virtqueue Configuration", of the virtio specification */
 /**
  * @brief Calculate size of a virtual ring, this interface is only valid for
@@ -345,6 +388,7 @@ vring_size(u_int qsz)
 struct vmctx;
 struct pci_vdev;
 struct virtio_vq_info;
+struct mevent;
 
 /*
  * A virtual device, with some number (possibly 0) of virtual
@@ -375,10 +419,16 @@ struct virtio_vq_info;
  *
  * The BROKED flag ("this thing done gone and broked") is for future
  * use.
+ *
+ * The DOORBELL flag makes the generic layer register the queue notify
+ * addresses with the hypervisor once the driver is ready, so that kicks
+ * are delivered through an eventfd on the mevent thread instead of a
+ * trapped write that pauses the vCPU until it is emulated.
  */
 #define	VIRTIO_USE_MSIX		0x01
 #define	VIRTIO_EVENT_IDX	0x02	/* use the event-index values */
 #define	VIRTIO_BROKED		0x08	/* ??? */
+#define	VIRTIO_DOORBELL		0x10	/* kick queues through eventfds */
 
 /*
  * virtio pci device bar layout
@@ -557,6 +607,9 @@ struct virtio_ops {
 
 #define	VQ_ALLOC	0x01	/* set once we have a pfn */
 #define	VQ_BROKED	0x02	/* ??? */
+#define	VQ_PACKED	0x04	/* packed layout, see vring_packed_desc */
+#define	VQ_AVAIL_WRAP	0x08	/* packed: driver ring wrap counter */
+#define	VQ_USED_WRAP	0x10	/* packed: device ring wrap counter */
 /**
  * @brief Virtqueue data structure
  *
@@ -575,6 +628,11 @@ struct virtio_ops {
  * keep a pointer to each one.  The event indices are similarly
  * (but more easily) computable, and this time we'll compute them:
  * they're just XX_ring[N].
+ *
+ * For packed queues last_avail and save_used are the next descriptor
+ * slots the device consumes and writes back respectively, and their
+ * wrap counters live in flags, so that saving and restoring the queue
+ * state works the same for both layouts.
  */
 struct virtio_vq_info {
 	uint16_t qsize;		/**< size of this queue (a power of 2) */
@@ -599,10 +657,35 @@ struct virtio_vq_info {
 	volatile struct vring_used *used;
 				/**< the "used" ring */
 
+	volatile struct vring_packed_desc *pdesc;
+				/**< packed descriptor ring */
+	volatile struct vring_packed_event *driver_event;
+				/**< packed driver event suppression */
+	volatile struct vring_packed_event *device_event;
+				/**< packed device event suppression */
+	uint16_t used_pending;	/**< packed: slots used since vq_endchains */
+	uint16_t *chain_ndesc;	/**< packed: slots taken per buffer id */
+
 	uint32_t gpa_desc[2];	/**< gpa of descriptors */
 	uint32_t gpa_avail[2];	/**< gpa of avail_ring */
 	uint32_t gpa_used[2];	/**< gpa of used_ring */
 	bool enabled;		/**< whether the virtqueue is enabled */
+	int kick_fd;		/**< eventfd signaled on doorbell writes */
+	struct mevent *kick_mevp;
+				/**< mevent of kick_fd, NULL if not used */
+};
+
+/**
+ * @brief A request chain handled as part of a batch
+ *
+ * See vq_getchains_batch() and vq_relchains_batch().
+ */
+struct virtio_vq_chain {
+	uint16_t idx;		/**< chain head, as returned by vq_getchain() */
+	int n;			/**< number of descriptors in the chain */
+	struct iovec *iov;	/**< first iovec of the chain */
+	uint16_t *flags;	/**< flags of the first descriptor, or NULL */
+	uint32_t len;		/**< bytes written, set before release */
 };
 
 /* as noted above, these are sort of backwards, name-wise */
@@ -636,8 +719,58 @@ vq_ring_ready(struct virtio_vq_info *vq)
 static inline int
 vq_has_descs(struct virtio_vq_info *vq)
 {
-	return (vq_ring_ready(vq) && vq->last_avail !=
-	    vq->avail->idx);
+	uint16_t flags;
+	bool wrap;
+
+	if (!vq_ring_ready(vq))
+		return 0;
+
+	if (vq->flags & VQ_PACKED) {
+		flags = vq->pdesc[vq->last_avail].flags;
+		wrap = (vq->flags & VQ_AVAIL_WRAP) != 0;
+		return (((flags & VRING_PACKED_DESC_F_AVAIL) != 0) == wrap &&
+		    ((flags & VRING_PACKED_DESC_F_USED) != 0) != wrap);
+	}
+
+	return vq->last_avail != vq->avail->idx;
+}
+
+/**
+ * @brief Ask the guest not to notify on new available descriptors.
+ *
+ * Used while the device is polling the queue anyway. This is only a
+ * hint, the guest may still notify.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return None
+ */
+static inline void
+vq_disable_notify(struct virtio_vq_info *vq)
+{
+	if (vq->flags & VQ_PACKED)
+		vq->device_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+	else
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
+/**
+ * @brief Ask the guest to notify on new available descriptors again.
+ *
+ * Callers must re-check vq_has_descs() after a memory barrier, since
+ * the guest may have added descriptors before it saw the change.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return None
+ */
+static inline void
+vq_enable_notify(struct virtio_vq_info *vq)
+{
+	if (vq->flags & VQ_PACKED)
+		vq->device_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	else
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
 }
 
 /**
@@ -749,6 +882,18 @@ int virtio_intr_init(struct virtio_base *vb, int barnum, int use_msix);
  */
 void virtio_reset_dev(struct virtio_base *vb);
 
+/**
+ * @brief Free the memory the virtqueues allocated while running.
+ *
+ * To be called by the deinit of devices offering packed rings, once
+ * the device is reset and no request is in flight.
+ *
+ * @param vb Pointer to struct virtio_base.
+ *
+ * @return N/A
+ */
+void virtio_free_queues(struct virtio_base *vb);
+
 /**
  * @brief Set I/O BAR (usually 0) to map PCI config registers.
  *
@@ -797,6 +942,43 @@ void vq_retchain(struct virtio_vq_info *vq);
  */
 void vq_relchain(struct virtio_vq_info *vq, uint16_t idx, uint32_t iolen);
 
+/**
+ * @brief Fetch up to nchains request chains in one go.
+ *
+ * Chain i is placed at iov[i * n_iov] (and flags[i * n_iov]), with at
+ * most n_iov descriptors recorded, as vq_getchain() does. Fetching
+ * stops early when the ring runs out of chains or an invalid one is
+ * met.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param chains Pointer to chains[] array filled in for each chain.
+ * @param nchains Size of chains[] array.
+ * @param iov Pointer to iov[] array of nchains * n_iov entries.
+ * @param n_iov Number of iov[] entries per chain.
+ * @param flags Pointer to an array of nchains * n_iov flags, or NULL.
+ *
+ * @return number of chains fetched, -1 if the first one is invalid.
+ */
+int vq_getchains_batch(struct virtio_vq_info *vq,
+		       struct virtio_vq_chain *chains, int nchains,
+		       struct iovec *iov, int n_iov, uint16_t *flags);
+
+/**
+ * @brief Return a batch of request chains to the guest.
+ *
+ * Equivalent to calling vq_relchain() on every chain with its len, but
+ * the guest-visible used index (or packed head flags) is only updated
+ * once, after all entries are written.
+ *
+ * @param vq Pointer to struct virtio_vq_info.
+ * @param chains Pointer to chains[] array, from vq_getchains_batch().
+ * @param nchains Number of chains to return.
+ *
+ * @return N/A
+ */
+void vq_relchains_batch(struct virtio_vq_info *vq,
+			struct virtio_vq_chain *chains, int nchains);
+
 /**
  * @brief Driver has finished processing "available" chains and calling
  * vq_relchain on each one.
@@ -847,6 +1029,22 @@ uint64_t virtio_pci_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 void virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		      int baridx, uint64_t offset, int size, uint64_t value);
 
+/**
+ * @brief Move the queue doorbells along with the BARs of the device.
+ *
+ * The vdev_bar_decode hook of virtio devices whose queues may be kicked
+ * through eventfds.
+ *
+ * @param ctx Pointer to struct vmctx representing VM context.
+ * @param dev Pointer to struct pci_vdev which emulates a PCI device.
+ * @param baridx The BAR that starts or stops decoding.
+ * @param enable Whether it starts decoding.
+ *
+ * @return N/A
+ */
+void virtio_pci_bar_decode(struct vmctx *ctx, struct pci_vdev *dev,
+			   int baridx, bool enable);
+
 /**
  * @brief Indicate the device has experienced an error.
  *
@@ -912,6 +1110,61 @@ int virtio_pci_modern_cfgwrite(struct vmctx *ctx, int vcpu,
 			       struct pci_vdev *dev, int coff, int bytes,
 			       uint32_t val);
 
+/**
+ * @brief Route guest kicks of a virtqueue to an eventfd.
+ *
+ * Create vq->kick_fd and have the hypervisor signal it on writes to the
+ * queue's notify register, for backends that consume kicks outside the
+ * device model's event loop.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return 0 on success and non-zero on fail.
+ */
+int virtio_vq_kick_assign(struct virtio_base *base, struct virtio_vq_info *vq);
+
+/**
+ * @brief Stop routing guest kicks of a virtqueue to its eventfd.
+ *
+ * @param base Pointer to struct virtio_base.
+ * @param vq Pointer to struct virtio_vq_info.
+ *
+ * @return N/A
+ */
+void virtio_vq_kick_release(struct virtio_base *base,
+			    struct virtio_vq_info *vq);
+
+/**
+ * @brief Get the guest physical addresses of a virtqueue's rings.
+ *
+ * @param vq Pointer to struct virtio_vq_info, which must be ready.
+ * @param desc Returns the address of the descriptor table.
+ * @param avail Returns the address of the available ring.
+ * @param used Returns the address of the used ring.
+ *
+ * @return N/A
+ */
+void virtio_vq_ring_gpa(struct virtio_vq_info *vq, uint64_t *desc,
+			uint64_t *avail, uint64_t *used);
+
+struct snapshot_meta;
+
+/**
+ * @brief Save or restore virtio transport state.
+ *
+ * Generic vdev_snapshot callback for virtio devices whose backend keeps
+ * no additional state across S3.
+ *
+ * @param ctx Pointer to struct vmctx representing VM context.
+ * @param dev Pointer to struct pci_vdev which emulates a PCI device.
+ * @param meta Pointer to struct snapshot_meta holding the state buffer.
+ *
+ * @return 0 on success and non-zero on fail.
+ */
+int virtio_pci_snapshot(struct vmctx *ctx, struct pci_vdev *dev,
+			struct snapshot_meta *meta);
+
 /**
  * @}
  */
@@ -0,0 +1,17 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef _VIRTIO_BALLOON_H_
+#define _VIRTIO_BALLOON_H_
+
+/*
+ * Set the balloon target to mb MB, or only query if mb < 0. Returns the
+ * current balloon size in MB, -1 if the VM has no balloon.
+ */
+int virtio_balloon_request(int mb);
+
+#endif	/* _VIRTIO_BALLOON_H_ */
@@ -39,4 +39,10 @@ int vbs_kernel_start(int fd, struct vbs_dev_info *dev,
 		     struct vbs_vqs_info *vqs);
 int vbs_kernel_stop(int fd);
 
+/* VBS-K data path offload of a virtio_base */
+struct virtio_base;
+int vbs_kernel_start_base(int fd, struct virtio_base *base,
+			  const struct vbs_backend *backend);
+int vbs_kernel_stop_base(int fd, struct virtio_base *base);
+
 #endif
@@ -45,6 +45,28 @@
 #define ALIGN_UP(x, align)	(((x) + ((align)-1)) & ~((align)-1))
 #define ALIGN_DOWN(x, align)	((x) & ~((align)-1))
 
+/*
+ * One guest RAM segment and its host mapping, see vm_gpa2hva().
+ */
+struct vm_gpa_seg {
+	uint64_t	gpa;	/* first guest physical address */
+	uint64_t	end;	/* first guest physical address past it */
+	char		*hva;	/* host virtual address of gpa */
+};
+
+#define	VM_MAX_GPA_SEGS	2	/* lowmem and highmem */
+
+/*
+ * Guest RAM backed by a file, see hugetlb_mem_regions().
+ */
+struct vm_mem_region {
+	uint64_t	gpa;
+	size_t		len;
+	char		*hva;	/* host virtual address of gpa */
+	int		fd;
+	uint64_t	offset;	/* of gpa in fd */
+};
+
 struct vmctx {
 	int     fd;
 	int     vmid;
@@ -54,6 +76,10 @@ struct vmctx {
 	size_t  lowmem;
 	size_t  highmem;
 	char    *baseaddr;
+	struct vm_gpa_seg gpa_segs[VM_MAX_GPA_SEGS];
+	int     nr_gpa_segs;
+	uint64_t *cow_bitmap;	/* clone: pages no longer shared, or NULL */
+	uint64_t *snapshot_dirty; /* pages the DM wrote since the last save */
 	char    *name;
 	uuid_t	vm_uuid;
 
@@ -111,12 +137,52 @@ void	vm_destroy(struct vmctx *ctx);
 int	vm_parse_memsize(const char *optarg, size_t *memsize);
 int	vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	uint64_t vma, int prot);
+int	vm_unmap_memseg(struct vmctx *ctx, size_t len, vm_paddr_t gpa);
 int	vm_setup_memory(struct vmctx *ctx, size_t len);
 void	vm_unsetup_memory(struct vmctx *ctx);
 bool	check_hugetlb_support(void);
 int	hugetlb_setup_memory(struct vmctx *ctx);
 void	hugetlb_unsetup_memory(struct vmctx *ctx);
+int	hugetlb_parse_prefault(const char *opt);
+void	hugetlb_set_prefault_cpus(const cpuset_t *cpus);
 void	*vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len);
+int	vm_clone_cow(struct vmctx *ctx, uint64_t gpa, size_t len);
+void	vm_snapshot_mark(struct vmctx *ctx, uint64_t gpa, size_t len);
+size_t	hugetlb_page_size(void);
+int	hugetlb_release(struct vmctx *ctx, uint64_t gpa, size_t len);
+int	hugetlb_populate(struct vmctx *ctx, uint64_t gpa, size_t len);
+int	hugetlb_shm_open(const char *name, size_t len);
+int	hugetlb_mem_regions(struct vmctx *ctx, struct vm_mem_region *regs,
+	int max);
+
+/*
+ * Inline flavour of vm_map_gpa() for data path users which translate
+ * guest buffers on every request: a walk over the segments computed by
+ * vm_setup_memory(), without any call.
+ */
+static inline void *
+vm_gpa2hva(struct vmctx *ctx, uint64_t gpa, size_t len)
+{
+	struct vm_gpa_seg *seg;
+	int i;
+
+	for (i = 0; i < ctx->nr_gpa_segs; i++) {
+		seg = &ctx->gpa_segs[i];
+		if (gpa - seg->gpa < seg->end - seg->gpa &&
+		    len <= seg->end - gpa) {
+			/* a clone gets private pages before we touch them */
+			if (ctx->cow_bitmap != NULL &&
+			    vm_clone_cow(ctx, gpa, len) != 0)
+				return NULL;
+			/* the next incremental snapshot saves our writes */
+			if (ctx->snapshot_dirty != NULL)
+				vm_snapshot_mark(ctx, gpa, len);
+			return seg->hva + (gpa - seg->gpa);
+		}
+	}
+
+	return NULL;
+}
 uint32_t vm_get_lowmem_limit(struct vmctx *ctx);
 void	vm_set_lowmem_limit(struct vmctx *ctx, uint32_t limit);
 void	vm_set_memflags(struct vmctx *ctx, int flags);
@@ -127,11 +193,18 @@ int	vm_run(struct vmctx *ctx);
 int	vm_suspend(struct vmctx *ctx, enum vm_suspend_how how);
 int	vm_apicid2vcpu(struct vmctx *ctx, int apicid);
 int	vm_lapic_msi(struct vmctx *ctx, uint64_t addr, uint64_t msg);
+int	vm_assign_irqfd(struct vmctx *ctx, int fd, uint64_t addr, uint64_t msg);
+int	vm_deassign_irqfd(struct vmctx *ctx, int fd);
 int	vm_ioapic_assert_irq(struct vmctx *ctx, int irq);
 int	vm_ioapic_deassert_irq(struct vmctx *ctx, int irq);
 int	vm_isa_assert_irq(struct vmctx *ctx, int atpic_irq, int ioapic_irq);
 int	vm_isa_deassert_irq(struct vmctx *ctx, int atpic_irq, int ioapic_irq);
 int	vm_isa_pulse_irq(struct vmctx *ctx, int atpic_irq, int ioapic_irq);
+int	vm_ioapic_notify_irq(struct vmctx *ctx, int irq);
+int	vm_set_irqline_page(struct vmctx *ctx, struct acrn_irqline_page *page);
+int	vm_assign_doorbell(struct vmctx *ctx, uint64_t addr, uint32_t len,
+		uint32_t flags, uint64_t data, int fd);
+int	vm_deassign_doorbell(struct vmctx *ctx, int fd);
 int	vm_assign_ptdev(struct vmctx *ctx, int bus, int slot, int func);
 int	vm_unassign_ptdev(struct vmctx *ctx, int bus, int slot, int func);
 int	vm_map_ptdev_mmio(struct vmctx *ctx, int bus, int slot, int func,
@@ -148,6 +221,9 @@ int	vm_reset_ptdev_intx_info(struct vmctx *ctx, int virt_pin, bool pic_pin);
 int	vm_create_vcpu(struct vmctx *ctx, uint16_t vcpu_id);
 
 int	vm_get_cpu_state(struct vmctx *ctx, void *state_buf);
+int	vm_set_dirty_log(struct vmctx *ctx, bool enable);
+int	vm_get_dirty_log(struct vmctx *ctx, vm_paddr_t gpa, size_t size,
+	uint64_t *bitmap);
 void	vm_stop_watchdog(struct vmctx *ctx);
 void	vm_reset_watchdog(struct vmctx *ctx);
 #endif	/* _VMMAPI_H_ */
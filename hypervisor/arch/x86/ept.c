@@ -10,6 +10,9 @@
 
 #define ACRN_DBG_EPT	6U
 
+/* Minimum number of extents the reverse map grows by */
+#define M2P_EXTENTS_GROW_NUM	64U
+
 static uint64_t find_next_table(uint32_t table_offset, void *table_base)
 {
 	uint64_t table_entry;
@@ -96,8 +99,12 @@ void destroy_ept(struct vm *vm)
 {
 	if (vm->arch_vm.nworld_eptp != NULL)
 		free_ept_mem(vm->arch_vm.nworld_eptp);
-	if (vm->arch_vm.m2p != NULL)
-		free_ept_mem(vm->arch_vm.m2p);
+	if (vm->arch_vm.m2p.extents != NULL) {
+		free(vm->arch_vm.m2p.extents);
+		vm->arch_vm.m2p.extents = NULL;
+		vm->arch_vm.m2p.num = 0U;
+		vm->arch_vm.m2p.capacity = 0U;
+	}
 
 	/*
 	 * If secure world is initialized, destroy Secure world ept.
@@ -142,19 +149,307 @@ uint64_t gpa2hpa(struct vm *vm, uint64_t gpa)
 	return local_gpa2hpa(vm, gpa, NULL);
 }
 
+/*
+ * Make sure the reverse map can hold at least num extents.
+ * The extents array is grown by doubling its capacity.
+ */
+static int m2p_reserve(struct m2p_map *m2p, uint32_t num)
+{
+	struct m2p_extent *extents;
+	uint32_t capacity;
+
+	if (num <= m2p->capacity) {
+		return 0;
+	}
+
+	capacity = m2p->capacity * 2U;
+	if (capacity < (m2p->capacity + M2P_EXTENTS_GROW_NUM)) {
+		capacity = m2p->capacity + M2P_EXTENTS_GROW_NUM;
+	}
+
+	extents = malloc(capacity * sizeof(struct m2p_extent));
+	if (extents == NULL) {
+		return -ENOMEM;
+	}
+
+	if (m2p->extents != NULL) {
+		(void)memcpy_s(extents, capacity * sizeof(struct m2p_extent),
+				m2p->extents,
+				m2p->num * sizeof(struct m2p_extent));
+		free(m2p->extents);
+	}
+	m2p->extents = extents;
+	m2p->capacity = capacity;
+
+	return 0;
+}
+
+/**
+ * @pre m2p->num < m2p->capacity
+ */
+static void m2p_insert_at(struct m2p_map *m2p, uint32_t idx,
+		uint64_t hpa, uint64_t gpa, uint64_t size)
+{
+	uint32_t i;
+
+	for (i = m2p->num; i > idx; i--) {
+		m2p->extents[i] = m2p->extents[i - 1U];
+	}
+	m2p->extents[idx].hpa = hpa;
+	m2p->extents[idx].gpa = gpa;
+	m2p->extents[idx].size = size;
+	m2p->num++;
+}
+
+static void m2p_remove_at(struct m2p_map *m2p, uint32_t idx)
+{
+	uint32_t i;
+
+	for (i = idx; (i + 1U) < m2p->num; i++) {
+		m2p->extents[i] = m2p->extents[i + 1U];
+	}
+	m2p->num--;
+}
+
+/*
+ * Remove [start, end) given as offsets inside extent idx.
+ *
+ * Return the number of extents left in place of the original one
+ * (0, 1 or 2), or -ENOMEM if the extent had to be split and the
+ * array could not be grown.
+ */
+static int m2p_clip(struct m2p_map *m2p, uint32_t idx,
+		uint64_t start, uint64_t end)
+{
+	struct m2p_extent *ext = &m2p->extents[idx];
+	uint64_t size = ext->size;
+
+	if ((start == 0UL) && (end == size)) {
+		m2p_remove_at(m2p, idx);
+		return 0;
+	}
+
+	if (start == 0UL) {
+		ext->hpa += end;
+		ext->gpa += end;
+		ext->size = size - end;
+		return 1;
+	}
+
+	if (end == size) {
+		ext->size = start;
+		return 1;
+	}
+
+	if (m2p_reserve(m2p, m2p->num + 1U) != 0) {
+		return -ENOMEM;
+	}
+	ext = &m2p->extents[idx];
+	m2p_insert_at(m2p, idx + 1U, ext->hpa + end, ext->gpa + end,
+			size - end);
+	ext->size = start;
+	return 2;
+}
+
+/* Return the index of the first extent whose hpa is above the given hpa */
+static uint32_t m2p_upper_bound(struct m2p_map *m2p, uint64_t hpa)
+{
+	uint32_t lo = 0U, hi = m2p->num, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) / 2U);
+		if (m2p->extents[mid].hpa <= hpa) {
+			lo = mid + 1U;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+static int m2p_del_hpa(struct m2p_map *m2p, uint64_t hpa, uint64_t size)
+{
+	uint64_t end = hpa + size, ext_end, start_off, end_off;
+	struct m2p_extent *ext;
+	uint32_t idx;
+	int ret;
+
+	idx = m2p_upper_bound(m2p, hpa);
+	if (idx > 0U) {
+		idx--;
+	}
+
+	while (idx < m2p->num) {
+		ext = &m2p->extents[idx];
+		if (ext->hpa >= end) {
+			break;
+		}
+		ext_end = ext->hpa + ext->size;
+		if (ext_end <= hpa) {
+			idx++;
+			continue;
+		}
+
+		start_off = (hpa > ext->hpa) ? (hpa - ext->hpa) : 0UL;
+		end_off = (end < ext_end) ? (end - ext->hpa) : ext->size;
+		ret = m2p_clip(m2p, idx, start_off, end_off);
+		if (ret < 0) {
+			return ret;
+		}
+		idx += (uint32_t)ret;
+	}
+
+	return 0;
+}
+
+/*
+ * The extents are sorted by hpa, so removing a gpa range needs a full
+ * scan. That is only done on unmap, which is not a hot path.
+ */
+static int m2p_del_gpa(struct m2p_map *m2p, uint64_t gpa, uint64_t size)
+{
+	uint64_t end = gpa + size, ext_end, start_off, end_off;
+	struct m2p_extent *ext;
+	uint32_t idx = 0U;
+	int ret;
+
+	while (idx < m2p->num) {
+		ext = &m2p->extents[idx];
+		ext_end = ext->gpa + ext->size;
+		if ((ext_end <= gpa) || (ext->gpa >= end)) {
+			idx++;
+			continue;
+		}
+
+		start_off = (gpa > ext->gpa) ? (gpa - ext->gpa) : 0UL;
+		end_off = (end < ext_end) ? (end - ext->gpa) : ext->size;
+		ret = m2p_clip(m2p, idx, start_off, end_off);
+		if (ret < 0) {
+			return ret;
+		}
+		idx += (uint32_t)ret;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Record hpa~hpa+size as mapped at gpa~gpa+size in the reverse map
+ *
+ * Any previous reverse mapping of the hpa range is replaced. The new
+ * extent is merged with its neighbours when both hpa and gpa are
+ * contiguous.
+ *
+ * @return 0 - on success, -ENOMEM - if the reverse map can't be grown
+ */
+int ept_m2p_add(struct vm *vm, uint64_t hpa, uint64_t gpa, uint64_t size)
+{
+	struct m2p_map *m2p = &vm->arch_vm.m2p;
+	struct m2p_extent *prev = NULL, *next = NULL;
+	uint32_t idx;
+	int ret;
+
+	if (size == 0UL) {
+		return 0;
+	}
+
+	spinlock_obtain(&m2p->lock);
+
+	ret = m2p_del_hpa(m2p, hpa, size);
+	if (ret == 0) {
+		ret = m2p_reserve(m2p, m2p->num + 1U);
+	}
+	if (ret != 0) {
+		spinlock_release(&m2p->lock);
+		pr_err("VM %d m2p: no memory for hpa 0x%llx",
+				vm->vm_id, hpa);
+		return ret;
+	}
+
+	idx = m2p_upper_bound(m2p, hpa);
+	if (idx > 0U) {
+		prev = &m2p->extents[idx - 1U];
+		if (((prev->hpa + prev->size) != hpa) ||
+				((prev->gpa + prev->size) != gpa)) {
+			prev = NULL;
+		}
+	}
+	if (idx < m2p->num) {
+		next = &m2p->extents[idx];
+		if (((hpa + size) != next->hpa) ||
+				((gpa + size) != next->gpa)) {
+			next = NULL;
+		}
+	}
+
+	if (prev != NULL) {
+		prev->size += size;
+		if (next != NULL) {
+			prev->size += next->size;
+			m2p_remove_at(m2p, idx);
+		}
+	} else if (next != NULL) {
+		next->hpa = hpa;
+		next->gpa = gpa;
+		next->size += size;
+	} else {
+		m2p_insert_at(m2p, idx, hpa, gpa, size);
+	}
+
+	spinlock_release(&m2p->lock);
+
+	return 0;
+}
+
+/**
+ * @brief Drop the reverse mappings of gpa~gpa+size
+ *
+ * @return 0 - on success, -ENOMEM - if an extent can't be split
+ */
+int ept_m2p_del(struct vm *vm, uint64_t gpa, uint64_t size)
+{
+	struct m2p_map *m2p = &vm->arch_vm.m2p;
+	int ret;
+
+	spinlock_obtain(&m2p->lock);
+	ret = m2p_del_gpa(m2p, gpa, size);
+	spinlock_release(&m2p->lock);
+
+	if (ret != 0) {
+		pr_err("VM %d m2p: no memory to unmap gpa 0x%llx",
+				vm->vm_id, gpa);
+	}
+
+	return ret;
+}
+
 uint64_t hpa2gpa(struct vm *vm, uint64_t hpa)
 {
-	uint64_t *pgentry, pg_size = 0UL;
+	struct m2p_map *m2p = &vm->arch_vm.m2p;
+	struct m2p_extent *ext;
+	uint64_t gpa = 0UL;
+	uint32_t idx;
+	bool found = false;
+
+	spinlock_obtain(&m2p->lock);
+	idx = m2p_upper_bound(m2p, hpa);
+	if (idx > 0U) {
+		ext = &m2p->extents[idx - 1U];
+		if (hpa < (ext->hpa + ext->size)) {
+			gpa = ext->gpa + (hpa - ext->hpa);
+			found = true;
+		}
+	}
+	spinlock_release(&m2p->lock);
 
-	pgentry = lookup_address((uint64_t *)vm->arch_vm.m2p,
-			hpa, &pg_size, PTT_EPT);
-	if (pgentry == NULL) {
+	if (!found) {
 		pr_err("VM %d hpa2gpa: failed for hpa 0x%llx",
 				vm->vm_id, hpa);
 		ASSERT(false, "hpa2gpa not found");
 	}
-	return ((*pgentry & (~(pg_size - 1UL)))
-			| (hpa & (pg_size - 1UL)));
+
+	return gpa;
 }
 
 bool is_ept_supported(void)
@@ -224,10 +519,27 @@ int ept_violation_vmexit_handler(struct vcpu *vcpu)
 
 	TRACE_2L(TRACE_VMEXIT_EPT_VIOLATION, exit_qual, gpa);
 
+	/* Write to a page write protected by dirty page logging */
+	if ((mmio_req->direction == REQUEST_WRITE) &&
+			dirty_log_handle_wp_fault(vcpu, gpa)) {
+		return 0;
+	}
+
 	/* Adjust IPA appropriately and OR page offset to get full IPA of abort
 	 */
 	mmio_req->address = gpa;
 
+	/*
+	 * Write to guest RAM the DM maps read only, e.g. a page a clone
+	 * still shares with its template. Nothing is decoded: the DM maps
+	 * the page writable and the instruction is restarted.
+	 */
+	if (io_req->type == REQ_WP) {
+		mmio_req->size = 0UL;
+		vcpu_retain_rip(vcpu);
+		return acrn_insert_request_wait(vcpu, io_req);
+	}
+
 	ret = decode_instruction(vcpu);
 	if (ret > 0) {
 		mmio_req->size = (uint64_t)ret;
@@ -297,12 +609,51 @@ int ept_misconfig_vmexit_handler(__unused struct vcpu *vcpu)
 	return status;
 }
 
-int ept_mr_add(struct vm *vm, uint64_t hpa_arg,
+/**
+ * @brief Request an EPT flush on every vCPU of the VM
+ *
+ * The flush is done by each vCPU before its next VM entry.
+ */
+void ept_request_flush(struct vm *vm)
+{
+	struct vcpu *vcpu;
+	uint16_t i;
+
+	foreach_vcpu(i, vm, vcpu) {
+		vcpu_make_request(vcpu, ACRN_REQUEST_EPT_FLUSH);
+	}
+}
+
+/**
+ * @brief Build the EPT pointer of one EPT hierarchy of the VM
+ *
+ * The EPT accessed and dirty flags are only turned on while the dirty
+ * pages of the VM are logged with PML.
+ */
+uint64_t ept_pointer(struct vm *vm, void *pml4_page)
+{
+	struct dirty_log *log = &vm->arch_vm.dirty_log;
+	uint64_t eptp;
+
+	eptp = HVA2HPA(pml4_page) | (3UL << 3U) | 6UL;
+	if (log->enabled && log->use_pml) {
+		eptp |= VMX_EPTP_AD_ENABLE;
+	}
+
+	return eptp;
+}
+
+/**
+ * @brief Map hpa~hpa+size at gpa in the normal world EPT of the VM
+ *
+ * No EPT flush is requested, the caller must call ept_request_flush()
+ * once it is done with its batch of EPT updates.
+ */
+int local_ept_mr_add(struct vm *vm, uint64_t hpa_arg,
 	uint64_t gpa_arg, uint64_t size, uint32_t prot_arg)
 {
 	struct mem_map_params map_params;
-	uint16_t i;
-	struct vcpu *vcpu;
+	int ret;
 	uint64_t hpa = hpa_arg;
 	uint64_t gpa = gpa_arg;
 	uint32_t prot = prot_arg;
@@ -310,7 +661,6 @@ int ept_mr_add(struct vm *vm, uint64_t hpa_arg,
 	/* Setup memory map parameters */
 	map_params.page_table_type = PTT_EPT;
 	map_params.pml4_base = vm->arch_vm.nworld_eptp;
-	map_params.pml4_inverted = vm->arch_vm.m2p;
 
 	/* EPT & VT-d share the same page tables, set SNP bit
 	 * to force snooping of PCIe devices if the page
@@ -325,42 +675,56 @@ int ept_mr_add(struct vm *vm, uint64_t hpa_arg,
 	map_mem(&map_params, (void *)hpa,
 			(void *)gpa, size, prot);
 
-	foreach_vcpu(i, vm, vcpu) {
-		vcpu_make_request(vcpu, ACRN_REQUEST_EPT_FLUSH);
+	/* map_mem() replaces a present mapping in place, without a window
+	 * where the guest faults on it: drop its reverse mapping too.
+	 */
+	ret = ept_m2p_del(vm, gpa, size);
+	if (ret == 0) {
+		ret = ept_m2p_add(vm, hpa, gpa, size);
 	}
 
 	dev_dbg(ACRN_DBG_EPT, "%s, hpa: 0x%016llx gpa: 0x%016llx ",
 			__func__, hpa, gpa);
 	dev_dbg(ACRN_DBG_EPT, "size: 0x%016llx prot: 0x%x\n", size, prot);
 
-	return 0;
+	return ret;
+}
+
+int ept_mr_add(struct vm *vm, uint64_t hpa_arg,
+	uint64_t gpa_arg, uint64_t size, uint32_t prot_arg)
+{
+	int ret;
+
+	ret = local_ept_mr_add(vm, hpa_arg, gpa_arg, size, prot_arg);
+	ept_request_flush(vm);
+
+	return ret;
 }
 
 int ept_mr_modify(struct vm *vm, uint64_t *pml4_page,
 		uint64_t gpa, uint64_t size,
 		uint64_t prot_set, uint64_t prot_clr)
 {
-	struct vcpu *vcpu;
-	uint16_t i;
 	int ret;
 
 	ret = mmu_modify_or_del(pml4_page, gpa, size,
 			prot_set, prot_clr, PTT_EPT, MR_MODIFY);
 
-	foreach_vcpu(i, vm, vcpu) {
-		vcpu_make_request(vcpu, ACRN_REQUEST_EPT_FLUSH);
-	}
+	ept_request_flush(vm);
 
 	return ret;
 }
 
-int ept_mr_del(struct vm *vm, uint64_t *pml4_page,
+/**
+ * @brief Unmap gpa~gpa+size from the given EPT of the VM
+ *
+ * No EPT flush is requested, the caller must call ept_request_flush()
+ * once it is done with its batch of EPT updates.
+ */
+int local_ept_mr_del(struct vm *vm, uint64_t *pml4_page,
 		uint64_t gpa, uint64_t size)
 {
-	struct vcpu *vcpu;
-	uint16_t i;
 	int ret;
-	uint64_t hpa = gpa2hpa(vm, gpa);
 
 	ret = mmu_modify_or_del(pml4_page, gpa, size,
 			0UL, 0UL, PTT_EPT, MR_DEL);
@@ -368,17 +732,25 @@ int ept_mr_del(struct vm *vm, uint64_t *pml4_page,
 		return ret;
 	}
 
-	if (hpa != 0UL) {
-		ret = mmu_modify_or_del((uint64_t *)vm->arch_vm.m2p,
-			hpa, size, 0UL, 0UL, PTT_EPT, MR_DEL);
-	}
-
-	foreach_vcpu(i, vm, vcpu) {
-		vcpu_make_request(vcpu, ACRN_REQUEST_EPT_FLUSH);
-	}
+	ret = ept_m2p_del(vm, gpa, size);
 
 	dev_dbg(ACRN_DBG_EPT, "%s, gpa 0x%llx size 0x%llx\n",
 			__func__, gpa, size);
 
-	return 0;
+	return ret;
+}
+
+int ept_mr_del(struct vm *vm, uint64_t *pml4_page,
+		uint64_t gpa, uint64_t size)
+{
+	int ret;
+
+	ret = local_ept_mr_del(vm, pml4_page, gpa, size);
+	if (ret < 0) {
+		return ret;
+	}
+
+	ept_request_flush(vm);
+
+	return ret;
 }
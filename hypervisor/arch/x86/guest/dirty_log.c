@@ -0,0 +1,800 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Dirty page logging of the normal world memory of a VM.
+ *
+ * The CPU tracks the writes per EPT leaf entry, so the large pages are
+ * split into 4K pages while the logging is on, and merged back when it
+ * is turned off. The page tables added are taken from the paging heap
+ * shared by all the VMs, at most DIRTY_LOG_MAX_SPLIT of them are used;
+ * the large pages left are logged as a whole.
+ *
+ * With Page Modification Logging, the CPU sets the EPT dirty flag of a
+ * leaf entry on the first write through it and appends the written gpa
+ * to the per vCPU PML buffer. The buffer is drained into the VM bitmap
+ * on every VM exit, and the dirty flag is cleared again when the bitmap
+ * is fetched.
+ *
+ * Without PML, the logged pages are write protected. The first write
+ * to such a page sets its bit and gives the write permission back,
+ * fetching the bitmap write protects the page again. A clear bit thus
+ * always means that the page is write protected by the dirty logging,
+ * pages write protected by the DM (HC_VM_WRITE_PROTECT_PAGE) are kept
+ * reported as dirty.
+ */
+
+#include <hypervisor.h>
+
+#define ACRN_DBG_DIRTY_LOG	6U
+
+/* Number of entries of a page modification log */
+#define PML_ENTITY_NUM		512U
+
+/* Guest physical space covered by one uint64_t of the bitmap */
+#define DIRTY_LOG_WORD_SPACE	(64UL * PTE_SIZE)
+
+/* Number of bitmap words in a bitmap page */
+#define DIRTY_LOG_PAGE_WORDS	(CPU_PAGE_SIZE / sizeof(uint64_t))
+
+/* Number of bitmap words copied to the SOS at a time */
+#define DIRTY_LOG_CHUNK_WORDS	64U
+
+/* Number of page tables a VM may add to split its large pages */
+#define DIRTY_LOG_MAX_SPLIT	(CONFIG_NUM_ALLOC_PAGES / 4U)
+
+/* Number of page tables merged before the vCPUs flush their EPT caches */
+#define DIRTY_LOG_MERGE_TABLES	64U
+
+static bool is_pml_supported(void)
+{
+	uint64_t ctls2, ept_cap;
+
+	ctls2 = msr_read(MSR_IA32_VMX_PROCBASED_CTLS2);
+	ept_cap = msr_read(MSR_IA32_VMX_EPT_VPID_CAP);
+
+	/* The allowed 1-settings are in the high 32 bits */
+	return (((ctls2 >> 32U) & VMX_PROCBASED_CTLS2_PML) != 0UL) &&
+		((ept_cap & VMX_EPT_AD) != 0UL);
+}
+
+/*
+ * The bitmap is made of pages allocated one by one, each covering
+ * 128M of guest physical space, rather than of one block sized by the
+ * logged space.
+ */
+static inline uint64_t *dirty_log_word(struct dirty_log *log, uint64_t idx)
+{
+	return &log->bitmap[idx / DIRTY_LOG_PAGE_WORDS]
+		[idx % DIRTY_LOG_PAGE_WORDS];
+}
+
+static inline bool dirty_log_test(struct dirty_log *log, uint64_t gpa)
+{
+	uint64_t pfn = gpa >> PTE_SHIFT;
+
+	return bitmap_test((uint16_t)(pfn & 0x3FUL),
+			dirty_log_word(log, pfn >> 6U));
+}
+
+/**
+ * @pre log->lock is held and log->enabled is true
+ */
+static void dirty_log_mark_range(struct dirty_log *log,
+		uint64_t gpa, uint64_t size)
+{
+	uint64_t pfn, end;
+
+	if (gpa >= log->size) {
+		return;
+	}
+
+	pfn = gpa >> PTE_SHIFT;
+	end = (size > (log->size - gpa)) ? log->size : (gpa + size);
+	end = INT_DIV_ROUNDUP(end, PTE_SIZE);
+
+	while (pfn < end) {
+		if (((pfn & 0x3FUL) == 0UL) && ((pfn + 64UL) <= end)) {
+			*dirty_log_word(log, pfn >> 6U) = ~0UL;
+			pfn += 64UL;
+		} else {
+			bitmap_set_nolock((uint16_t)(pfn & 0x3FUL),
+					dirty_log_word(log, pfn >> 6U));
+			pfn++;
+		}
+	}
+}
+
+/*
+ * The CPU only logs the first write through a leaf entry, so the whole
+ * page mapped by the entry is marked dirty.
+ *
+ * @pre log->lock is held and log->enabled is true
+ */
+static void dirty_log_mark_leaf(struct vm *vm, struct dirty_log *log,
+		uint64_t gpa)
+{
+	uint64_t pg_size;
+
+	if (lookup_address((uint64_t *)vm->arch_vm.nworld_eptp, gpa,
+			&pg_size, PTT_EPT) == NULL) {
+		pg_size = PTE_SIZE;
+	}
+
+	dirty_log_mark_range(log, gpa & ~(pg_size - 1UL), pg_size);
+}
+
+/*
+ * Split the large pages mapping gpa~gpa+size into 4K pages.
+ *
+ * @pre log->lock is held and log->enabled is true
+ */
+static void dirty_log_split(struct vm *vm, struct dirty_log *log,
+		uint64_t gpa_arg, uint64_t size)
+{
+	uint64_t *pml4_page = (uint64_t *)vm->arch_vm.nworld_eptp;
+	uint64_t gpa = gpa_arg & PDE_MASK;
+	uint64_t end, pg_size;
+	uint32_t nr_tables;
+
+	if (gpa_arg >= log->size) {
+		return;
+	}
+	end = (size > (log->size - gpa_arg)) ? log->size : (gpa_arg + size);
+
+	while (gpa < end) {
+		if ((lookup_address(pml4_page, gpa, &pg_size,
+				PTT_EPT) != NULL) && (pg_size != PTE_SIZE)) {
+			/* A 1G page needs a page directory and a page table */
+			nr_tables = (pg_size == PDPTE_SIZE) ? 2U : 1U;
+			if ((log->nr_split + nr_tables) > DIRTY_LOG_MAX_SPLIT) {
+				return;
+			}
+
+			/* Modifying a 4K page splits the pages above it */
+			if (mmu_modify_or_del(pml4_page, gpa, PTE_SIZE,
+					0UL, 0UL, PTT_EPT, MR_MODIFY) != 0) {
+				pr_warn("VM %d dirty log: can't split 0x%llx",
+						vm->vm_id, gpa);
+				return;
+			}
+			log->nr_split += nr_tables;
+		}
+
+		gpa += PDE_SIZE;
+	}
+}
+
+/*
+ * Reset the tracking of [0, size): clear the EPT dirty flags for PML,
+ * or write protect the writable pages. Read only pages can't be
+ * tracked by write protection, they are reported as dirty.
+ *
+ * @pre log->lock is held and log->enabled is true
+ */
+static void dirty_log_arm(struct vm *vm, struct dirty_log *log)
+{
+	uint64_t *pml4_page = (uint64_t *)vm->arch_vm.nworld_eptp;
+	uint64_t gpa = 0UL, end, pg_size;
+	uint64_t *leaf;
+
+	while (gpa < log->size) {
+		leaf = lookup_address(pml4_page, gpa, &pg_size, PTT_EPT);
+		if (leaf == NULL) {
+			pg_size = PTE_SIZE;
+		}
+		end = (gpa & ~(pg_size - 1UL)) + pg_size;
+		if (end > log->size) {
+			end = log->size;
+		}
+
+		if (leaf == NULL) {
+			/* not mapped */
+		} else if (log->use_pml) {
+			atomic_clear64(leaf, EPT_DIRTY);
+		} else if ((*leaf & EPT_WR) != 0UL) {
+			(void)mmu_modify_or_del(pml4_page, gpa, end - gpa,
+					0UL, EPT_WR, PTT_EPT, MR_MODIFY);
+		} else {
+			dirty_log_mark_range(log, gpa, end - gpa);
+		}
+
+		gpa = end;
+	}
+}
+
+/*
+ * Give the write permission back to the pages write protected by the
+ * dirty logging.
+ *
+ * @pre log->lock is held and log->use_pml is false
+ */
+static void dirty_log_disarm(struct vm *vm, struct dirty_log *log)
+{
+	uint64_t *pml4_page = (uint64_t *)vm->arch_vm.nworld_eptp;
+	uint64_t gpa = 0UL, end, pg_size;
+	uint64_t *leaf;
+
+	while (gpa < log->size) {
+		leaf = lookup_address(pml4_page, gpa, &pg_size, PTT_EPT);
+		if (leaf == NULL) {
+			pg_size = PTE_SIZE;
+		}
+		end = (gpa & ~(pg_size - 1UL)) + pg_size;
+		if (end > log->size) {
+			end = log->size;
+		}
+
+		if ((leaf != NULL) && ((*leaf & EPT_WR) == 0UL)) {
+			while (gpa < end) {
+				if (!dirty_log_test(log, gpa)) {
+					(void)mmu_modify_or_del(pml4_page, gpa,
+						PTE_SIZE, EPT_WR, 0UL,
+						PTT_EPT, MR_MODIFY);
+				}
+				gpa += PTE_SIZE;
+			}
+		}
+
+		gpa = end;
+	}
+}
+
+/*
+ * Make each vCPU of the VM handle the request eventid, and wait for the
+ * running ones to have done it. A running vCPU goes through a VM exit
+ * for the request, which drains its PML buffer. A vCPU which is not
+ * running handles the request before it enters the guest again.
+ */
+static void dirty_log_sync_vcpus(struct vm *vm, uint16_t eventid)
+{
+	struct vcpu *vcpu;
+	uint16_t i;
+
+	foreach_vcpu(i, vm, vcpu) {
+		vcpu_make_request(vcpu, eventid);
+	}
+
+	foreach_vcpu(i, vm, vcpu) {
+		while (bitmap_test(eventid, &vcpu->arch_vcpu.pending_req) &&
+				(atomic_load32(&vcpu->running) == 1U)) {
+			__asm__ __volatile("pause" ::: "memory");
+		}
+	}
+}
+
+/*
+ * Free the page tables merged into large pages, once all the vCPUs
+ * flushed their EPT caches which may still hold them.
+ */
+static void dirty_log_free_tables(struct vm *vm, void **tables, uint32_t n)
+{
+	uint32_t i;
+
+	dirty_log_sync_vcpus(vm, ACRN_REQUEST_EPT_FLUSH);
+	for (i = 0U; i < n; i++) {
+		free_paging_struct(tables[i]);
+	}
+}
+
+/*
+ * Merge the page tables mapping [0, size) of the VM into pg_size pages.
+ */
+static void dirty_log_merge_level(struct vm *vm, uint64_t size,
+		uint64_t pg_size)
+{
+	uint64_t *pml4_page = (uint64_t *)vm->arch_vm.nworld_eptp;
+	void *tables[DIRTY_LOG_MERGE_TABLES];
+	uint64_t gpa;
+	uint32_t n = 0U;
+
+	for (gpa = 0UL; gpa < size; gpa += pg_size) {
+		if (mmu_merge_large_page(pml4_page, gpa, pg_size,
+				PTT_EPT, &tables[n]) == 0) {
+			n++;
+		}
+
+		if (n == DIRTY_LOG_MERGE_TABLES) {
+			dirty_log_free_tables(vm, tables, n);
+			n = 0U;
+		}
+	}
+
+	if (n != 0U) {
+		dirty_log_free_tables(vm, tables, n);
+	}
+}
+
+/*
+ * Merge back the large pages split by dirty_log_split(), 4K pages into
+ * 2M pages first, then 2M pages into 1G pages.
+ *
+ * @pre the logging is off, so that the pages are not split again
+ */
+static void dirty_log_merge(struct vm *vm, uint64_t size)
+{
+	dirty_log_merge_level(vm, size, PDE_SIZE);
+	if (check_mmu_1gb_support(PTT_EPT)) {
+		dirty_log_merge_level(vm, size, PDPTE_SIZE);
+	}
+}
+
+/*
+ * Fetch and clear the bits of one bitmap word selected by mask, and
+ * reset the tracking of the pages which were dirty.
+ *
+ * @pre log->lock is held and log->enabled is true
+ */
+static uint64_t dirty_log_fetch_word(struct vm *vm, struct dirty_log *log,
+		uint64_t idx, uint64_t mask)
+{
+	uint64_t *pml4_page = (uint64_t *)vm->arch_vm.nworld_eptp;
+	uint64_t *word = dirty_log_word(log, idx);
+	uint64_t bits, todo, gpa, pg_size;
+	uint64_t *leaf;
+	uint16_t nr;
+
+	bits = *word & mask;
+	*word &= ~mask;
+
+	todo = bits;
+	while (todo != 0UL) {
+		nr = ffs64(todo);
+		gpa = ((idx << 6U) + nr) << PTE_SHIFT;
+
+		leaf = lookup_address(pml4_page, gpa, &pg_size, PTT_EPT);
+		if (leaf == NULL) {
+			pg_size = PTE_SIZE;
+		} else if (log->use_pml) {
+			atomic_clear64(leaf, EPT_DIRTY);
+		} else if ((*leaf & EPT_WR) != 0UL) {
+			(void)mmu_modify_or_del(pml4_page, gpa, PTE_SIZE,
+					0UL, EPT_WR, PTT_EPT, MR_MODIFY);
+			pg_size = PTE_SIZE;
+		} else {
+			/* write protected by the DM, keep reporting it */
+			bitmap_set_nolock(nr, word);
+			pg_size = PTE_SIZE;
+		}
+
+		/* A large page covers the whole word */
+		if (pg_size >= DIRTY_LOG_WORD_SPACE) {
+			todo = 0UL;
+		} else {
+			bitmap_clear_nolock(nr, &todo);
+		}
+	}
+
+	return bits;
+}
+
+static void dirty_log_free_bitmap(uint64_t **bitmap, uint32_t nr_pages)
+{
+	uint32_t i;
+
+	for (i = 0U; i < nr_pages; i++) {
+		if (bitmap[i] != NULL) {
+			free(bitmap[i]);
+		}
+	}
+	free(bitmap);
+}
+
+static uint64_t **dirty_log_alloc_bitmap(uint32_t nr_pages)
+{
+	uint64_t **bitmap;
+	uint32_t i;
+
+	bitmap = calloc(nr_pages, sizeof(uint64_t *));
+	if (bitmap == NULL) {
+		return NULL;
+	}
+
+	for (i = 0U; i < nr_pages; i++) {
+		bitmap[i] = alloc_page();
+		if (bitmap[i] == NULL) {
+			dirty_log_free_bitmap(bitmap, i);
+			return NULL;
+		}
+		(void)memset(bitmap[i], 0U, CPU_PAGE_SIZE);
+	}
+
+	return bitmap;
+}
+
+/**
+ * @brief Start logging the dirty pages of [0, size) of the VM
+ *
+ * PML is used if the CPU supports it, write protection otherwise.
+ * All the pages are clean when the function returns.
+ *
+ * @return 0 - on success, -EINVAL - invalid size, -EBUSY - already
+ * enabled, -ENOMEM - out of memory
+ */
+int dirty_log_enable(struct vm *vm, uint64_t size)
+{
+	struct dirty_log *log = &vm->arch_vm.dirty_log;
+	uint64_t **bitmap;
+	uint32_t nr_pages;
+	struct vcpu *vcpu;
+	uint16_t i;
+	bool use_pml;
+
+	if ((size == 0UL) || (size > DIRTY_LOG_MAX_SIZE) ||
+			((size & (CPU_PAGE_SIZE - 1UL)) != 0UL)) {
+		return -EINVAL;
+	}
+
+	use_pml = is_pml_supported();
+	if (use_pml) {
+		foreach_vcpu(i, vm, vcpu) {
+			if (vcpu->arch_vcpu.pml_buf == NULL) {
+				vcpu->arch_vcpu.pml_buf = alloc_page();
+			}
+			if (vcpu->arch_vcpu.pml_buf == NULL) {
+				return -ENOMEM;
+			}
+		}
+	}
+
+	nr_pages = (uint32_t)INT_DIV_ROUNDUP(size,
+			DIRTY_LOG_PAGE_WORDS * DIRTY_LOG_WORD_SPACE);
+	bitmap = dirty_log_alloc_bitmap(nr_pages);
+	if (bitmap == NULL) {
+		return -ENOMEM;
+	}
+
+	spinlock_obtain(&log->lock);
+	if (log->enabled) {
+		spinlock_release(&log->lock);
+		dirty_log_free_bitmap(bitmap, nr_pages);
+		return -EBUSY;
+	}
+
+	log->bitmap = bitmap;
+	log->nr_pages = nr_pages;
+	log->size = size;
+	log->use_pml = use_pml;
+	log->enabled = true;
+	dirty_log_split(vm, log, 0UL, size);
+	dirty_log_arm(vm, log);
+	spinlock_release(&log->lock);
+
+	dirty_log_sync_vcpus(vm, ACRN_REQUEST_DIRTY_LOG);
+
+	dev_dbg(ACRN_DBG_DIRTY_LOG, "VM %d dirty log on, size 0x%llx pml %d",
+			vm->vm_id, size, use_pml);
+
+	return 0;
+}
+
+/**
+ * @brief Stop logging the dirty pages of the VM
+ *
+ * @return 0
+ */
+int dirty_log_disable(struct vm *vm)
+{
+	struct dirty_log *log = &vm->arch_vm.dirty_log;
+	uint64_t **bitmap;
+	uint64_t size;
+	uint32_t nr_pages;
+
+	spinlock_obtain(&log->lock);
+	if (!log->enabled) {
+		spinlock_release(&log->lock);
+		return 0;
+	}
+
+	if (!log->use_pml) {
+		dirty_log_disarm(vm, log);
+	}
+
+	bitmap = log->bitmap;
+	nr_pages = log->nr_pages;
+	size = log->size;
+	log->bitmap = NULL;
+	log->nr_pages = 0U;
+	log->size = 0UL;
+	log->nr_split = 0U;
+	log->enabled = false;
+	spinlock_release(&log->lock);
+
+	dirty_log_free_bitmap(bitmap, nr_pages);
+
+	dirty_log_sync_vcpus(vm, ACRN_REQUEST_DIRTY_LOG);
+
+	dirty_log_merge(vm, size);
+
+	dev_dbg(ACRN_DBG_DIRTY_LOG, "VM %d dirty log off", vm->vm_id);
+
+	return 0;
+}
+
+/**
+ * @brief Fetch and clear the dirty bitmap of a range of the target VM
+ *
+ * The bitmap is copied to param->bitmap_gpa of vm. The pages reported
+ * dirty are tracked again when the function returns, so that the
+ * caller can copy them and fetch the bitmap again for the pages
+ * written in the meantime.
+ *
+ * @return 0 - on success, -EINVAL - invalid range or logging is off,
+ * -EFAULT - the bitmap can't be copied to vm
+ */
+int dirty_log_fetch(struct vm *vm, struct vm *target_vm,
+		const struct dirty_log_bitmap *param)
+{
+	struct dirty_log *log = &target_vm->arch_vm.dirty_log;
+	uint64_t chunk[DIRTY_LOG_CHUNK_WORDS];
+	uint64_t first, npages, nwords, idx, mask;
+	uint32_t n, i;
+	int ret = 0;
+
+	if (((param->gpa & (DIRTY_LOG_WORD_SPACE - 1UL)) != 0UL) ||
+			((param->size & (CPU_PAGE_SIZE - 1UL)) != 0UL) ||
+			(param->size == 0UL)) {
+		return -EINVAL;
+	}
+
+	/* Pull the PML buffers of the running vCPUs into the bitmap */
+	dirty_log_sync_vcpus(target_vm, ACRN_REQUEST_EPT_FLUSH);
+
+	spinlock_obtain(&log->lock);
+	if (!log->enabled || (param->gpa >= log->size) ||
+			(param->size > (log->size - param->gpa))) {
+		spinlock_release(&log->lock);
+		return -EINVAL;
+	}
+
+	first = param->gpa / DIRTY_LOG_WORD_SPACE;
+	npages = param->size >> PTE_SHIFT;
+	nwords = INT_DIV_ROUNDUP(npages, 64UL);
+
+	for (idx = 0UL; idx < nwords; idx += n) {
+		n = ((nwords - idx) > DIRTY_LOG_CHUNK_WORDS) ?
+			DIRTY_LOG_CHUNK_WORDS : (uint32_t)(nwords - idx);
+
+		for (i = 0U; i < n; i++) {
+			mask = ~0UL;
+			if (((idx + i + 1UL) * 64UL) > npages) {
+				mask = (1UL << (npages & 0x3FUL)) - 1UL;
+			}
+			chunk[i] = dirty_log_fetch_word(target_vm, log,
+					first + idx + i, mask);
+		}
+
+		if (copy_to_gpa(vm, chunk, param->bitmap_gpa +
+				(idx * sizeof(uint64_t)),
+				n * sizeof(uint64_t)) != 0) {
+			/* Keep the pages reported for the next fetch */
+			for (i = 0U; i < n; i++) {
+				*dirty_log_word(log, first + idx + i) |=
+					chunk[i];
+			}
+			pr_err("%s: Unable copy bitmap to vm", __func__);
+			ret = -EFAULT;
+			break;
+		}
+	}
+	spinlock_release(&log->lock);
+
+	/* The cleared dirty flags and write protections must be seen by
+	 * all the vCPUs before the caller copies the pages.
+	 */
+	dirty_log_sync_vcpus(target_vm, ACRN_REQUEST_EPT_FLUSH);
+
+	return ret;
+}
+
+/**
+ * @brief Mark gpa~gpa+size of the VM dirty if its dirty pages are logged
+ *
+ * Used when the EPT mapping or permission of the range is changed on
+ * behalf of the DM. The large pages of a new mapping are split.
+ */
+void dirty_log_mark(struct vm *vm, uint64_t gpa, uint64_t size)
+{
+	struct dirty_log *log = &vm->arch_vm.dirty_log;
+
+	spinlock_obtain(&log->lock);
+	if (log->enabled) {
+		dirty_log_split(vm, log, gpa, size);
+		dirty_log_mark_range(log, gpa, size);
+	}
+	spinlock_release(&log->lock);
+}
+
+/**
+ * @brief Free the dirty logging resources of a VM being destroyed
+ *
+ * @pre all the vCPUs of the VM are destroyed
+ */
+void dirty_log_free(struct vm *vm)
+{
+	struct dirty_log *log = &vm->arch_vm.dirty_log;
+
+	if (log->bitmap != NULL) {
+		dirty_log_free_bitmap(log->bitmap, log->nr_pages);
+		log->bitmap = NULL;
+		log->nr_pages = 0U;
+	}
+	log->nr_split = 0U;
+	log->enabled = false;
+}
+
+/*
+ * Turn PML on or off in the VMCS of the vCPU according to the dirty
+ * logging state of its VM.
+ *
+ * @pre vcpu is the current vCPU of this pCPU
+ */
+static void pml_update_vmcs(struct vcpu *vcpu)
+{
+	struct dirty_log *log = &vcpu->vm->arch_vm.dirty_log;
+	uint32_t value32;
+	bool pml;
+
+	pml = log->enabled && log->use_pml &&
+		(vcpu->arch_vcpu.pml_buf != NULL);
+	if (pml == vcpu->arch_vcpu.pml_enabled) {
+		return;
+	}
+
+	value32 = exec_vmread32(VMX_PROC_VM_EXEC_CONTROLS2);
+	if (pml) {
+		exec_vmwrite64(VMX_PML_ADDR_FULL,
+				HVA2HPA(vcpu->arch_vcpu.pml_buf));
+		exec_vmwrite16(VMX_GUEST_PML_INDEX,
+				(uint16_t)(PML_ENTITY_NUM - 1U));
+		value32 |= VMX_PROCBASED_CTLS2_PML;
+	} else {
+		dirty_log_flush_pml(vcpu);
+		value32 &= ~VMX_PROCBASED_CTLS2_PML;
+	}
+	exec_vmwrite32(VMX_PROC_VM_EXEC_CONTROLS2, value32);
+
+	vcpu->arch_vcpu.pml_enabled = pml;
+}
+
+/**
+ * @brief Set up PML in a newly initialized VMCS
+ *
+ * Dirty logging may already be on, e.g. when a vCPU is reset.
+ */
+void dirty_log_init_vmcs(struct vcpu *vcpu)
+{
+	vcpu->arch_vcpu.pml_enabled = false;
+	pml_update_vmcs(vcpu);
+}
+
+/**
+ * @brief Handle ACRN_REQUEST_DIRTY_LOG on the vCPU
+ */
+void dirty_log_handle_request(struct vcpu *vcpu)
+{
+	struct vm *vm = vcpu->vm;
+	void *pml4_page;
+
+	pml_update_vmcs(vcpu);
+
+	/* EPT A/D flags follow the PML state */
+	if (vcpu->arch_vcpu.cur_context == NORMAL_WORLD) {
+		pml4_page = vm->arch_vm.nworld_eptp;
+	} else {
+		pml4_page = vm->arch_vm.sworld_eptp;
+	}
+	exec_vmwrite64(VMX_EPT_POINTER_FULL, ept_pointer(vm, pml4_page));
+
+	/* The pages were just write protected or made clean */
+	invept(vcpu);
+}
+
+/**
+ * @brief Drain the PML buffer of the vCPU into the dirty bitmap
+ *
+ * Called on every VM exit while PML is on.
+ *
+ * @pre vcpu is the current vCPU of this pCPU
+ */
+void dirty_log_flush_pml(struct vcpu *vcpu)
+{
+	struct dirty_log *log = &vcpu->vm->arch_vm.dirty_log;
+	uint64_t *pml_buf = vcpu->arch_vcpu.pml_buf;
+	uint16_t pml_idx;
+	uint32_t i;
+
+	if (!vcpu->arch_vcpu.pml_enabled) {
+		return;
+	}
+
+	/* The index is decremented after each logged gpa, it wraps to
+	 * 0xFFFF once the last entry is used.
+	 */
+	pml_idx = exec_vmread16(VMX_GUEST_PML_INDEX);
+	if (pml_idx == (uint16_t)(PML_ENTITY_NUM - 1U)) {
+		return;
+	}
+	i = (pml_idx >= PML_ENTITY_NUM) ? 0U : ((uint32_t)pml_idx + 1U);
+
+	spinlock_obtain(&log->lock);
+	if (log->enabled) {
+		for (; i < PML_ENTITY_NUM; i++) {
+			dirty_log_mark_leaf(vcpu->vm, log,
+					pml_buf[i] & PTE_MASK);
+		}
+	}
+	spinlock_release(&log->lock);
+
+	exec_vmwrite16(VMX_GUEST_PML_INDEX, (uint16_t)(PML_ENTITY_NUM - 1U));
+}
+
+/**
+ * @brief Handle a write to a page write protected by the dirty logging
+ *
+ * The page is marked dirty and made writable again.
+ *
+ * @return true if the fault is handled and the instruction can be
+ * retried, false if it is a write to a page write protected by the DM.
+ */
+bool dirty_log_handle_wp_fault(struct vcpu *vcpu, uint64_t gpa)
+{
+	struct vm *vm = vcpu->vm;
+	struct dirty_log *log = &vm->arch_vm.dirty_log;
+	uint64_t *pml4_page = (uint64_t *)vm->arch_vm.nworld_eptp;
+	uint64_t *leaf, pg_size;
+	bool handled = false;
+
+	if (!log->enabled || log->use_pml) {
+		return false;
+	}
+
+	spinlock_obtain(&log->lock);
+	if (log->enabled && !log->use_pml && (gpa < log->size)) {
+		leaf = lookup_address(pml4_page, gpa, &pg_size, PTT_EPT);
+		if (leaf == NULL) {
+			/* not mapped, leave it to the MMIO emulation */
+		} else if ((*leaf & EPT_WR) != 0UL) {
+			/* made writable by another vCPU in the meantime */
+			handled = true;
+		} else if (!dirty_log_test(log, gpa)) {
+			dirty_log_mark_range(log, gpa & PTE_MASK, PTE_SIZE);
+			(void)mmu_modify_or_del(pml4_page, gpa & PTE_MASK,
+					PTE_SIZE, EPT_WR, 0UL,
+					PTT_EPT, MR_MODIFY);
+			handled = true;
+		} else {
+			/* write protected by the DM */
+		}
+	}
+	spinlock_release(&log->lock);
+
+	if (handled) {
+		vcpu_retain_rip(vcpu);
+	}
+
+	return handled;
+}
+
+/*
+ * The PML buffer is drained on every VM exit, the write which caused
+ * the exit is retried.
+ */
+int pml_full_vmexit_handler(struct vcpu *vcpu)
+{
+	uint32_t value32;
+
+	/* NMI unblocking due to IRET, SDM 27.2.3 */
+	if ((exec_vmread(VMX_EXIT_QUALIFICATION) & (1UL << 12U)) != 0UL) {
+		value32 = exec_vmread32(VMX_GUEST_INTERRUPTIBILITY_INFO);
+		value32 |= (1U << 3U);
+		exec_vmwrite32(VMX_GUEST_INTERRUPTIBILITY_INFO, value32);
+	}
+
+	vcpu_retain_rip(vcpu);
+
+	return 0;
+}
@@ -401,6 +401,9 @@ void destroy_vcpu(struct vcpu *vcpu)
 	vlapic_free(vcpu);
 	free(vcpu->arch_vcpu.vmcs);
 	free(vcpu->guest_msrs);
+	if (vcpu->arch_vcpu.pml_buf != NULL) {
+		free(vcpu->arch_vcpu.pml_buf);
+	}
 	per_cpu(ever_run_vcpu, vcpu->pcpu_id) = NULL;
 	free_pcpu(vcpu->pcpu_id);
 	free(vcpu);
@@ -47,6 +47,8 @@ struct vioapic {
 	union ioapic_rte rtbl[REDIR_ENTRIES_HW];
 	/* sum of pin asserts (+1) and deasserts (-1) */
 	int32_t acnt[REDIR_ENTRIES_HW];
+	/* line state shared with the device model, may be NULL */
+	struct acrn_irqline_page *line_page;
 };
 
 #define	VIOAPIC_LOCK(vioapic)	spinlock_obtain(&((vioapic)->mtx))
@@ -67,6 +69,47 @@ vm_ioapic(struct vm *vm)
 	return (struct vioapic *)vm->arch_vm.virt_ioapic;
 }
 
+/* Is the line level set by the device model in the shared page? */
+static inline bool
+vioapic_line_level(struct vioapic *vioapic, uint32_t pin)
+{
+	struct acrn_irqline_page *page = vioapic->line_page;
+
+	if ((page == NULL) || (pin >= ACRN_IRQLINE_PAGE_PINS)) {
+		return false;
+	}
+
+	return bitmap_test((uint16_t)(pin & 0x3fU), &page->level[pin >> 6U]);
+}
+
+static inline bool
+vioapic_pin_asserted(struct vioapic *vioapic, uint32_t pin)
+{
+	return (vioapic->acnt[pin] > 0) || vioapic_line_level(vioapic, pin);
+}
+
+/*
+ * Mirror the Remote IRR bit of a pin into the shared page. The locked
+ * update orders it against a following read of the line level, pairing
+ * with the device model setting the level before reading in_service.
+ */
+static void
+vioapic_sync_in_service(struct vioapic *vioapic, uint32_t pin)
+{
+	struct acrn_irqline_page *page = vioapic->line_page;
+	uint16_t nr = (uint16_t)(pin & 0x3fU);
+
+	if ((page == NULL) || (pin >= ACRN_IRQLINE_PAGE_PINS)) {
+		return;
+	}
+
+	if ((vioapic->rtbl[pin].full & IOAPIC_RTE_REM_IRR) != 0UL) {
+		bitmap_set_lock(nr, &page->in_service[pin >> 6U]);
+	} else {
+		bitmap_clear_lock(nr, &page->in_service[pin >> 6U]);
+	}
+}
+
 static void
 vioapic_send_intr(struct vioapic *vioapic, uint32_t pin)
 {
@@ -97,6 +140,7 @@ vioapic_send_intr(struct vioapic *vioapic, uint32_t pin)
 			return;
 		}
 		vioapic->rtbl[pin].full |= IOAPIC_RTE_REM_IRR;
+		vioapic_sync_in_service(vioapic, pin);
 	}
 
 	vector = rte.u.lo_32 & IOAPIC_RTE_LOW_INTVEC;
@@ -182,6 +226,61 @@ vioapic_set_irqstate(struct vm *vm, uint32_t irq, enum irqstate irqstate)
 	return 0;
 }
 
+/**
+ * @brief Deliver an interrupt for a line kept in the shared page
+ *
+ * A level-triggered pin raises an interrupt if its level is set and the
+ * previous one has been EOIed; EOI re-delivers it while the level stays
+ * set. An edge-triggered pin gets a pulse.
+ *
+ * @pre vm != NULL
+ */
+int
+vioapic_notify_irq(struct vm *vm, uint32_t irq)
+{
+	struct vioapic *vioapic;
+	uint32_t pin = irq;
+
+	if (pin >= vioapic_pincount(vm)) {
+		return -EINVAL;
+	}
+
+	vioapic = vm_ioapic(vm);
+
+	VIOAPIC_LOCK(vioapic);
+	if (vioapic->line_page == NULL) {
+		VIOAPIC_UNLOCK(vioapic);
+		return -ENODEV;
+	}
+
+	if (((vioapic->rtbl[pin].full & IOAPIC_RTE_TRGRLVL) == 0UL) ||
+		vioapic_line_level(vioapic, pin)) {
+		vioapic_send_intr(vioapic, pin);
+	}
+	VIOAPIC_UNLOCK(vioapic);
+
+	return 0;
+}
+
+/**
+ * @brief Set or clear the line state page shared with the device model
+ *
+ * @pre vm != NULL
+ */
+void
+vioapic_set_irqline_page(struct vm *vm, struct acrn_irqline_page *page)
+{
+	struct vioapic *vioapic = vm_ioapic(vm);
+	uint32_t pin, pincount = vioapic_pincount(vm);
+
+	VIOAPIC_LOCK(vioapic);
+	vioapic->line_page = page;
+	for (pin = 0U; pin < pincount; pin++) {
+		vioapic_sync_in_service(vioapic, pin);
+	}
+	VIOAPIC_UNLOCK(vioapic);
+}
+
 int
 vioapic_assert_irq(struct vm *vm, uint32_t irq)
 {
@@ -369,6 +468,7 @@ vioapic_indirect_write(struct vioapic *vioapic, uint32_t addr, uint32_t data)
 			}
 		}
 		vioapic->rtbl[pin] = new;
+		vioapic_sync_in_service(vioapic, pin);
 		dev_dbg(ACRN_DBG_IOAPIC, "ioapic pin%hhu: redir table entry %#lx",
 		    pin, vioapic->rtbl[pin].full);
 		/*
@@ -398,7 +498,7 @@ vioapic_indirect_write(struct vioapic *vioapic, uint32_t addr, uint32_t data)
 		if ((vioapic->rtbl[pin].full & IOAPIC_RTE_INTMASK) ==
 			IOAPIC_RTE_INTMCLR &&
 			(vioapic->rtbl[pin].full & IOAPIC_RTE_REM_IRR) == 0UL &&
-			(vioapic->acnt[pin] > 0)) {
+			vioapic_pin_asserted(vioapic, pin)) {
 			dev_dbg(ACRN_DBG_IOAPIC,
 				"ioapic pin%hhu: asserted at rtbl write, acnt %d",
 				pin, vioapic->acnt[pin]);
@@ -503,7 +603,8 @@ vioapic_process_eoi(struct vm *vm, uint32_t vector)
 		}
 
 		vioapic->rtbl[pin].full &= (~IOAPIC_RTE_REM_IRR);
-		if (vioapic->acnt[pin] > 0) {
+		vioapic_sync_in_service(vioapic, pin);
+		if (vioapic_pin_asserted(vioapic, pin)) {
 			dev_dbg(ACRN_DBG_IOAPIC,
 				"ioapic pin%hhu: asserted at eoi, acnt %d",
 				pin, vioapic->acnt[pin]);
@@ -522,6 +623,7 @@ vioapic_reset(struct vioapic *vioapic)
 	pincount = vioapic_pincount(vioapic->vm);
 	for (pin = 0U; pin < pincount; pin++) {
 		vioapic->rtbl[pin].full = MASK_ALL_INTERRUPTS;
+		vioapic_sync_in_service(vioapic, pin);
 	}
 	vioapic->id = 0U;
 	vioapic->ioregsel = 0U;
@@ -133,13 +133,14 @@ int create_vm(struct vm_description *vm_desc, struct vm **rtn_vm)
 	vm->hw.gpa_lowtop = 0UL;
 
 	vm->arch_vm.nworld_eptp = alloc_paging_struct();
-	vm->arch_vm.m2p = alloc_paging_struct();
-	if ((vm->arch_vm.nworld_eptp == NULL) ||
-			(vm->arch_vm.m2p == NULL)) {
+	if (vm->arch_vm.nworld_eptp == NULL) {
 		pr_fatal("%s, alloc memory for EPTP failed\n", __func__);
 		status = -ENOMEM;
 		goto err;
 	}
+	spinlock_init(&vm->arch_vm.m2p.lock);
+	spinlock_init(&vm->arch_vm.dirty_log.lock);
+	spinlock_init(&vm->sw.doorbells.lock);
 
 	/* Only for SOS: Configure VM software information */
 	/* For UOS: This VM software information is configure in DM */
@@ -218,8 +219,8 @@ err:
 		vpic_cleanup(vm);
 	}
 
-	if (vm->arch_vm.m2p != NULL) {
-		free(vm->arch_vm.m2p);
+	if (vm->arch_vm.m2p.extents != NULL) {
+		free(vm->arch_vm.m2p.extents);
 	}
 
 	if (vm->arch_vm.nworld_eptp != NULL) {
@@ -272,6 +273,9 @@ int shutdown_vm(struct vm *vm)
 	/* Free EPT allocated resources assigned to VM */
 	destroy_ept(vm);
 
+	/* Free dirty page logging bitmap */
+	dirty_log_free(vm);
+
 	/* Free MSR bitmap */
 	free(vm->arch_vm.msr_bitmap);
 
@@ -98,6 +98,16 @@ int vmcall_vmexit_handler(struct vcpu *vcpu)
 		ret = hcall_inject_msi(vm, (uint16_t)param1, param2);
 		break;
 
+	case HC_SET_IRQLINE_PAGE:
+		/* param1: vmid */
+		ret = hcall_set_irqline_page(vm, (uint16_t)param1, param2);
+		break;
+
+	case HC_NOTIFY_IRQLINE:
+		/* param1: vmid */
+		ret = hcall_notify_irqline(vm, (uint16_t)param1, param2);
+		break;
+
 	case HC_SET_IOREQ_BUFFER:
 		/* param1: vmid */
 		ret = hcall_set_ioreq_buffer(vm, (uint16_t)param1, param2);
@@ -110,6 +120,16 @@ int vmcall_vmexit_handler(struct vcpu *vcpu)
 			(uint16_t)param2);
 		break;
 
+	case HC_SET_DOORBELL_PAGE:
+		/* param1: vmid */
+		ret = hcall_set_doorbell_page(vm, (uint16_t)param1, param2);
+		break;
+
+	case HC_SET_DOORBELL:
+		/* param1: vmid */
+		ret = hcall_set_doorbell(vm, (uint16_t)param1, param2);
+		break;
+
 	case HC_VM_SET_MEMORY_REGION:
 		/* param1: vmid */
 		ret = hcall_set_vm_memory_region(vm, (uint16_t)param1, param2);
@@ -123,6 +143,16 @@ int vmcall_vmexit_handler(struct vcpu *vcpu)
 		ret = hcall_write_protect_page(vm, (uint16_t)param1, param2);
 		break;
 
+	case HC_VM_SET_DIRTY_LOG:
+		/* param1: vmid */
+		ret = hcall_set_dirty_log(vm, (uint16_t)param1, param2);
+		break;
+
+	case HC_VM_GET_DIRTY_LOG:
+		/* param1: vmid */
+		ret = hcall_get_dirty_log(vm, (uint16_t)param1, param2);
+		break;
+
 
 	case HC_VM_PCI_MSIX_REMAP:
 		/* param1: vmid */
@@ -149,8 +149,8 @@ void emulate_io_post(struct vcpu *vcpu)
 		break;
 
 	default:
-		/* REQ_WP can only be triggered on writes which do not need
-		 * post-work. Just mark the ioreq done. */
+		/* REQ_WP: the DM made the page writable, the write is
+		 * restarted without any post-work. Just mark the ioreq done. */
 		complete_ioreq(vhm_req);
 		break;
 	}
@@ -295,6 +295,13 @@ emulate_io(struct vcpu *vcpu, struct io_request *io_req)
 		break;
 	}
 
+	if (status == -ENODEV) {
+		/* Doorbell writes complete here and are delivered to the
+		 * service OS asynchronously.
+		 */
+		status = acrn_doorbell_write(vcpu, io_req);
+	}
+
 	if (status == -ENODEV) {
 		/*
 		 * No handler from HV side, search from VHM in Dom0
@@ -609,14 +609,13 @@ bool check_continuous_hpa(struct vm *vm, uint64_t gpa_arg, uint64_t size_arg)
 }
 
 int obtain_last_page_table_entry(struct mem_map_params *map_params,
-		struct entry_params *entry, void *addr, bool direct)
+		struct entry_params *entry, void *addr)
 {
 	uint64_t table_entry;
 	uint32_t entry_present = 0U;
 	int ret = 0;
 	/* Obtain the PML4 address */
-	void *table_addr = direct ? (map_params->pml4_base)
-				: (map_params->pml4_inverted);
+	void *table_addr = map_params->pml4_base;
 
 	/* Obtain page table entry from PML4 table*/
 	ret = get_table_entry(addr, table_addr, IA32E_PML4, &table_entry);
@@ -733,15 +732,13 @@ int obtain_last_page_table_entry(struct mem_map_params *map_params,
 }
 
 static uint64_t update_page_table_entry(struct mem_map_params *map_params,
-		void *paddr, void *vaddr, uint64_t size, uint64_t attr,
-		bool direct)
+		void *paddr, void *vaddr, uint64_t size, uint64_t attr)
 {
 	uint64_t remaining_size = size;
 	uint32_t adjustment_size;
 	int table_type = map_params->page_table_type;
 	/* Obtain the PML4 address */
-	void *table_addr = direct ? (map_params->pml4_base)
-				: (map_params->pml4_inverted);
+	void *table_addr = map_params->pml4_base;
 
 	/* Walk from the PML4 table to the PDPT table */
 	table_addr = walk_paging_struct(vaddr, table_addr, IA32E_PML4,
@@ -793,7 +790,7 @@ static uint64_t update_page_table_entry(struct mem_map_params *map_params,
 }
 
 static uint64_t break_page_table(struct mem_map_params *map_params, void *paddr,
-		void *vaddr, uint64_t page_size, bool direct)
+		void *vaddr, uint64_t page_size)
 {
 	uint32_t i = 0U;
 	uint64_t pa;
@@ -828,8 +825,8 @@ static uint64_t break_page_table(struct mem_map_params *map_params, void *paddr,
 	}
 
 	if (page_size != next_page_size) {
-		if (obtain_last_page_table_entry(map_params, &entry, vaddr,
-			direct) < 0) {
+		if (obtain_last_page_table_entry(map_params, &entry,
+				vaddr) < 0) {
 			pr_err("Fail to obtain last page table entry");
 			return 0;
 		}
@@ -890,7 +887,7 @@ static uint64_t break_page_table(struct mem_map_params *map_params, void *paddr,
 }
 
 static int modify_paging(struct mem_map_params *map_params, void *paddr_arg,
-		void *vaddr_arg, uint64_t size, uint32_t flags, bool direct)
+		void *vaddr_arg, uint64_t size, uint32_t flags)
 {
 	void *vaddr = vaddr_arg;
 	void *paddr = paddr_arg;
@@ -933,8 +930,8 @@ static int modify_paging(struct mem_map_params *map_params, void *paddr_arg,
 	 * MAP/UNMAP/MODIFY
 	 */
 	while (remaining_size > 0) {
-		if (obtain_last_page_table_entry(map_params, &entry, vaddr,
-			direct) < 0) {
+		if (obtain_last_page_table_entry(map_params, &entry,
+				vaddr) < 0) {
 			return -EINVAL;
 		}
 
@@ -955,7 +952,7 @@ static int modify_paging(struct mem_map_params *map_params, void *paddr_arg,
 				 * of next level page table
 				 */
 				page_size = break_page_table(map_params,
-					paddr, vaddr, page_size, direct);
+					paddr, vaddr, page_size);
 				if (page_size == 0UL) {
 					return -EINVAL;
 				}
@@ -966,7 +963,7 @@ static int modify_paging(struct mem_map_params *map_params, void *paddr_arg,
 		}
 		/* The function return the memory size that one entry can map */
 		adjust_size = update_page_table_entry(map_params, paddr, vaddr,
-				page_size, attr, direct);
+				page_size, attr);
 		if (adjust_size == 0UL) {
 			return -EINVAL;
 		}
@@ -981,17 +978,6 @@ static int modify_paging(struct mem_map_params *map_params, void *paddr_arg,
 int map_mem(struct mem_map_params *map_params, void *paddr, void *vaddr,
 		    uint64_t size, uint32_t flags)
 {
-	int ret = 0;
-
-	/* used for MMU and EPT*/
-	ret = modify_paging(map_params, paddr, vaddr, size, flags, true);
-	if (ret < 0) {
-		return ret;
-	}
-	/* only for EPT */
-	if (map_params->page_table_type == PTT_EPT) {
-		ret = modify_paging(map_params, vaddr, paddr, size, flags,
-				false);
-	}
-	return ret;
+	/* used for MMU and EPT, the EPT reverse map is kept by the caller */
+	return modify_paging(map_params, paddr, vaddr, size, flags);
 }
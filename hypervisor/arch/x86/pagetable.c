@@ -37,7 +37,10 @@ static int split_large_page(uint64_t *pte,
 
 	dev_dbg(ACRN_DBG_MMU, "%s, paddr: 0x%llx\n", __func__, ref_paddr);
 
-	pbase = (uint64_t *)alloc_paging_struct();
+	/* Not alloc_paging_struct(): a split may fail once the pages run
+	 * out, all the entries of the new table are set below.
+	 */
+	pbase = (uint64_t *)alloc_page();
 	if (pbase == NULL) {
 		return -ENOMEM;
 	}
@@ -453,6 +456,79 @@ int mmu_add(uint64_t *pml4_page, uint64_t paddr_base,
 	return 0;
 }
 
+/*
+ * Merge the page table which maps [vaddr, vaddr + page_size) back into
+ * a large page, page_size being PDE_SIZE or PDPTE_SIZE. The entries of
+ * the table must map an aligned and contiguous range with the same
+ * attributes, the EPT accessed and dirty flags put aside. To merge into
+ * a 1G page, the entries must be 2M pages already.
+ *
+ * The table is returned in table, it is to be freed by the caller once
+ * the TLBs which may cache it are flushed.
+ *
+ * Only EPT is supported.
+ *
+ * @return 0 - merged, -EINVAL - the table can't be merged
+ */
+int mmu_merge_large_page(uint64_t *pml4_page, uint64_t vaddr,
+		uint64_t page_size, enum _page_table_type ptt, void **table)
+{
+	uint64_t *pml4e, *pdpte, *pgentry, *sub_page;
+	uint64_t first, sub_size, i;
+
+	if ((ptt != PTT_EPT) || !MEM_ALIGNED_CHECK(vaddr, page_size)) {
+		return -EINVAL;
+	}
+
+	pml4e = pml4e_offset(pml4_page, vaddr);
+	if (pgentry_present(ptt, *pml4e) == 0UL) {
+		return -EINVAL;
+	}
+
+	pdpte = pdpte_offset(pml4e, vaddr);
+	if (page_size == PDPTE_SIZE) {
+		pgentry = pdpte;
+		sub_size = PDE_SIZE;
+	} else if (page_size == PDE_SIZE) {
+		if ((pgentry_present(ptt, *pdpte) == 0UL) ||
+				(pdpte_large(*pdpte) != 0UL)) {
+			return -EINVAL;
+		}
+		pgentry = pde_offset(pdpte, vaddr);
+		sub_size = PTE_SIZE;
+	} else {
+		return -EINVAL;
+	}
+
+	if ((pgentry_present(ptt, *pgentry) == 0UL) ||
+			(pde_large(*pgentry) != 0UL)) {
+		return -EINVAL;
+	}
+
+	sub_page = pde_page_vaddr(*pgentry);
+	first = sub_page[0] & ~(EPT_ACCESSED | EPT_DIRTY);
+	if ((pgentry_present(ptt, first) == 0UL) ||
+			!MEM_ALIGNED_CHECK(first & PDE_PFN_MASK, page_size) ||
+			((sub_size == PDE_SIZE) && (pde_large(first) == 0UL))) {
+		return -EINVAL;
+	}
+
+	for (i = 1UL; i < PTRS_PER_PTE; i++) {
+		if ((sub_page[i] & ~(EPT_ACCESSED | EPT_DIRTY)) !=
+				(first + (i * sub_size))) {
+			return -EINVAL;
+		}
+	}
+
+	dev_dbg(ACRN_DBG_MMU, "%s, vaddr: 0x%llx, size: 0x%llx\n",
+		__func__, vaddr, page_size);
+
+	set_pgentry(pgentry, first | PAGE_PSE);
+	*table = sub_page;
+
+	return 0;
+}
+
 uint64_t *lookup_address(uint64_t *pml4_page,
 		uint64_t addr, uint64_t *pg_size, enum _page_table_type ptt)
 {
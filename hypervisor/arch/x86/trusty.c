@@ -148,7 +148,6 @@ static void create_secure_world_ept(struct vm *vm, uint64_t gpa_orig,
 	 * to secure ept mapping
 	 */
 	map_params.page_table_type = PTT_EPT;
-	map_params.pml4_inverted = vm->arch_vm.m2p;
 	map_params.pml4_base = pml4_base;
 	map_mem(&map_params, (void *)hpa,
 			(void *)gpa_rebased, size,
@@ -156,6 +155,7 @@ static void create_secure_world_ept(struct vm *vm, uint64_t gpa_orig,
 			 IA32E_EPT_W_BIT |
 			 IA32E_EPT_X_BIT |
 			 IA32E_EPT_WB));
+	(void)ept_m2p_add(vm, hpa, gpa_rebased, size);
 
 	/* Get the gpa address in SOS */
 	gpa = hpa2gpa(vm0, hpa);
@@ -191,7 +191,6 @@ void  destroy_secure_world(struct vm *vm)
 	/* restore memory to SOS ept mapping */
 	map_params.page_table_type = PTT_EPT;
 	map_params.pml4_base = vm0->arch_vm.nworld_eptp;
-	map_params.pml4_inverted = vm0->arch_vm.m2p;
 
 	map_mem(&map_params, (void *)vm->sworld_control.sworld_memory.base_hpa,
 			(void *)vm->sworld_control.sworld_memory.base_gpa,
@@ -200,6 +199,9 @@ void  destroy_secure_world(struct vm *vm)
 			 IA32E_EPT_W_BIT |
 			 IA32E_EPT_X_BIT |
 			 IA32E_EPT_WB));
+	(void)ept_m2p_add(vm0, vm->sworld_control.sworld_memory.base_hpa,
+			vm->sworld_control.sworld_memory.base_gpa,
+			vm->sworld_control.sworld_memory.length);
 
 }
 
@@ -330,12 +332,10 @@ void switch_world(struct vcpu *vcpu, int next_world)
 	/* load EPTP for next world */
 	if (next_world == NORMAL_WORLD) {
 		exec_vmwrite64(VMX_EPT_POINTER_FULL,
-			HVA2HPA(vcpu->vm->arch_vm.nworld_eptp) |
-			(3UL<<3) | 6UL);
+			ept_pointer(vcpu->vm, vcpu->vm->arch_vm.nworld_eptp));
 	} else {
 		exec_vmwrite64(VMX_EPT_POINTER_FULL,
-			HVA2HPA(vcpu->vm->arch_vm.sworld_eptp) |
-			(3UL<<3) | 6UL);
+			ept_pointer(vcpu->vm, vcpu->vm->arch_vm.sworld_eptp));
 	}
 
 	/* Update world index */
@@ -455,7 +455,7 @@ bool initialize_trusty(struct vcpu *vcpu, uint64_t param)
 	trusty_base_hpa = vm->sworld_control.sworld_memory.base_hpa;
 
 	exec_vmwrite64(VMX_EPT_POINTER_FULL,
-			HVA2HPA(vm->arch_vm.sworld_eptp) | (3UL<<3) | 6UL);
+			ept_pointer(vm, vm->arch_vm.sworld_eptp));
 
 	/* save Normal World context */
 	save_world_ctx(vcpu, &vcpu->arch_vcpu.contexts[NORMAL_WORLD].ext_ctx);
@@ -372,6 +372,9 @@ int acrn_handle_pending_request(struct vcpu *vcpu)
 		return -EFAULT;
 	}
 
+	if (bitmap_test_and_clear_lock(ACRN_REQUEST_DIRTY_LOG, pending_req_bits))
+		dirty_log_handle_request(vcpu);
+
 	if (bitmap_test_and_clear_lock(ACRN_REQUEST_EPT_FLUSH, pending_req_bits))
 		invept(vcpu);
 
@@ -144,7 +144,7 @@ static const struct vm_exit_dispatch dispatch_table[NR_VMX_EXIT_REASONS] = {
 	[VMX_EXIT_REASON_RDSEED] = {
 		.handler = unhandled_vmexit_handler},
 	[VMX_EXIT_REASON_PAGE_MODIFICATION_LOG_FULL] = {
-		.handler = unhandled_vmexit_handler},
+		.handler = pml_full_vmexit_handler},
 	[VMX_EXIT_REASON_XSAVES] = {
 		.handler = unhandled_vmexit_handler},
 	[VMX_EXIT_REASON_XRSTORS] = {
@@ -162,6 +162,9 @@ int vmexit_handler(struct vcpu *vcpu)
 		return -EINVAL;
 	}
 
+	/* Log the pages dirtied by the guest since the last VM exit */
+	dirty_log_flush_pml(vcpu);
+
 	/* Obtain interrupt info */
 	vcpu->arch_vcpu.idt_vectoring_info =
 	    exec_vmread32(VMX_IDT_VEC_INFO_FIELD);
@@ -1289,6 +1289,9 @@ static void init_exec_ctrl(struct vcpu *vcpu)
 	exec_vmwrite32(VMX_PROC_VM_EXEC_CONTROLS2, value32);
 	pr_dbg("VMX_PROC_VM_EXEC_CONTROLS2: 0x%x ", value32);
 
+	/* Turn on PML if the dirty pages of the VM are logged */
+	dirty_log_init_vmcs(vcpu);
+
 	if (is_vapic_supported()) {
 		/*APIC-v, config APIC-access address*/
 		value64 = apicv_get_apic_access_addr(vcpu->vm);
@@ -1325,7 +1328,7 @@ static void init_exec_ctrl(struct vcpu *vcpu)
 	 * TODO: introduce API to make this data driven based
 	 * on VMX_EPT_VPID_CAP
 	 */
-	value64 = HVA2HPA(vm->arch_vm.nworld_eptp) | (3UL << 3U) | 6UL;
+	value64 = ept_pointer(vm, vm->arch_vm.nworld_eptp);
 	exec_vmwrite64(VMX_EPT_POINTER_FULL, value64);
 	pr_dbg("VMX_EPT_POINTER: 0x%016llx ", value64);
 
@@ -326,6 +326,65 @@ int32_t hcall_pulse_irqline(struct vm *vm, uint16_t vmid, uint64_t param)
 	return ret;
 }
 
+int32_t hcall_set_irqline_page(struct vm *vm, uint16_t vmid, uint64_t param)
+{
+	struct acrn_set_irqline_page lp;
+	struct acrn_irqline_page *page = NULL;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+	uint64_t hpa;
+
+	if ((target_vm == NULL) || is_vm0(target_vm)) {
+		return -EINVAL;
+	}
+
+	(void)memset((void *)&lp, 0U, sizeof(lp));
+	if (copy_from_gpa(vm, &lp, param, sizeof(lp)) != 0) {
+		pr_err("%s: Unable copy param to vm\n", __func__);
+		return -EFAULT;
+	}
+
+	if (lp.page != 0UL) {
+		if ((lp.page & (CPU_PAGE_SIZE - 1UL)) != 0UL) {
+			return -EINVAL;
+		}
+
+		hpa = gpa2hpa(vm, lp.page);
+		if (hpa == 0UL) {
+			pr_err("%s: invalid GPA.\n", __func__);
+			return -EINVAL;
+		}
+		page = HPA2HVA(hpa);
+	}
+
+	dev_dbg(ACRN_DBG_HYCALL, "[%d] SET IRQLINE PAGE=0x%llx",
+			vmid, lp.page);
+	vioapic_set_irqline_page(target_vm, page);
+
+	return 0;
+}
+
+int32_t hcall_notify_irqline(struct vm *vm, uint16_t vmid, uint64_t param)
+{
+	struct acrn_irqline irqline;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if (target_vm == NULL) {
+		return -EINVAL;
+	}
+
+	if (copy_from_gpa(vm, &irqline, param, sizeof(irqline)) != 0) {
+		pr_err("%s: Unable copy param to vm\n", __func__);
+		return -EFAULT;
+	}
+
+	/* the shared line state only covers IOAPIC pins */
+	if (irqline.intr_type != ACRN_INTR_TYPE_IOAPIC) {
+		return -EINVAL;
+	}
+
+	return vioapic_notify_irq(target_vm, irqline.ioapic_irq);
+}
+
 int32_t hcall_inject_msi(struct vm *vm, uint16_t vmid, uint64_t param)
 {
 	int32_t ret = 0;
@@ -412,11 +471,68 @@ int32_t hcall_notify_ioreq_finish(uint16_t vmid, uint16_t vcpu_id)
 	return 0;
 }
 
-static int32_t local_set_vm_memory_region(struct vm *vm,
+int32_t hcall_set_doorbell_page(struct vm *vm, uint16_t vmid, uint64_t param)
+{
+	struct acrn_set_doorbell_page dp;
+	struct acrn_doorbell_page *page = NULL;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+	uint64_t hpa;
+
+	if ((target_vm == NULL) || is_vm0(target_vm)) {
+		return -EINVAL;
+	}
+
+	(void)memset((void *)&dp, 0U, sizeof(dp));
+	if (copy_from_gpa(vm, &dp, param, sizeof(dp)) != 0) {
+		pr_err("%s: Unable copy param to vm\n", __func__);
+		return -EFAULT;
+	}
+
+	if (dp.page != 0UL) {
+		if ((dp.page & (CPU_PAGE_SIZE - 1UL)) != 0UL) {
+			return -EINVAL;
+		}
+
+		hpa = gpa2hpa(vm, dp.page);
+		if (hpa == 0UL) {
+			pr_err("%s: invalid GPA.\n", __func__);
+			return -EINVAL;
+		}
+		page = HPA2HVA(hpa);
+	}
+
+	dev_dbg(ACRN_DBG_HYCALL, "[%d] SET DOORBELL PAGE=0x%llx",
+			vmid, dp.page);
+	acrn_set_doorbell_page(target_vm, page);
+
+	return 0;
+}
+
+int32_t hcall_set_doorbell(struct vm *vm, uint16_t vmid, uint64_t param)
+{
+	struct acrn_doorbell db;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if ((target_vm == NULL) || is_vm0(target_vm)) {
+		return -EINVAL;
+	}
+
+	(void)memset((void *)&db, 0U, sizeof(db));
+	if (copy_from_gpa(vm, &db, param, sizeof(db)) != 0) {
+		pr_err("%s: Unable copy param to vm\n", __func__);
+		return -EFAULT;
+	}
+
+	dev_dbg(ACRN_DBG_HYCALL, "[%d] SET DOORBELL %d addr=0x%llx flags=0x%x",
+			vmid, db.id, db.addr, db.flags);
+
+	return acrn_set_doorbell(target_vm, &db);
+}
+
+static int32_t check_vm_memory_region(struct vm *vm,
 	struct vm *target_vm, struct vm_memory_region *region)
 {
 	uint64_t hpa, base_paddr;
-	uint64_t prot;
 
 	if ((region->size & (CPU_PAGE_SIZE - 1UL)) != 0UL) {
 		pr_err("%s: [vm%d] map size 0x%x is not page aligned",
@@ -424,6 +540,13 @@ static int32_t local_set_vm_memory_region(struct vm *vm,
 		return -EINVAL;
 	}
 
+	if ((region->type != MR_ADD) && (region->type != MR_DEL) &&
+			(region->type != MR_MODIFY)) {
+		pr_err("%s: [vm%d] invalid region type %d",
+			__func__, target_vm->vm_id, region->type);
+		return -EINVAL;
+	}
+
 	hpa = gpa2hpa(vm, region->vm0_gpa);
 	dev_dbg(ACRN_DBG_HYCALL, "[vm%d] gpa=0x%x hpa=0x%x size=0x%x",
 		target_vm->vm_id, region->gpa, hpa, region->size);
@@ -437,7 +560,24 @@ static int32_t local_set_vm_memory_region(struct vm *vm,
 		return -EFAULT;
 	}
 
+	return 0;
+}
+
+/**
+ * @pre check_vm_memory_region(vm, target_vm, region) == 0
+ *
+ * The EPT of target_vm is updated without any flush request, the
+ * caller must call ept_request_flush() when done.
+ */
+static int32_t apply_vm_memory_region(struct vm *vm,
+	struct vm *target_vm, struct vm_memory_region *region)
+{
+	uint64_t hpa;
+	uint64_t prot;
+	int32_t ret;
+
 	if (region->type != MR_DEL) {
+		hpa = gpa2hpa(vm, region->vm0_gpa);
 		prot = 0UL;
 		/* access right */
 		if ((region->prot & MEM_ACCESS_READ) != 0U) {
@@ -462,14 +602,32 @@ static int32_t local_set_vm_memory_region(struct vm *vm,
 			prot |= EPT_UNCACHED;
 		}
 		/* create gpa to hpa EPT mapping */
-		return ept_mr_add(target_vm, hpa,
+		ret = local_ept_mr_add(target_vm, hpa,
 				region->gpa, region->size, prot);
+		/* the new mapping is not tracked by the dirty logging yet */
+		dirty_log_mark(target_vm, region->gpa, region->size);
+		return ret;
 	} else {
-		return ept_mr_del(target_vm,
+		return local_ept_mr_del(target_vm,
 				(uint64_t *)target_vm->arch_vm.nworld_eptp,
 				region->gpa, region->size);
 	}
+}
+
+static int32_t local_set_vm_memory_region(struct vm *vm,
+	struct vm *target_vm, struct vm_memory_region *region)
+{
+	int32_t ret;
+
+	ret = check_vm_memory_region(vm, target_vm, region);
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = apply_vm_memory_region(vm, target_vm, region);
+	ept_request_flush(target_vm);
 
+	return ret;
 }
 
 int32_t hcall_set_vm_memory_region(struct vm *vm, uint16_t vmid, uint64_t param)
@@ -506,7 +664,8 @@ int32_t hcall_set_vm_memory_regions(struct vm *vm, uint64_t param)
 	struct set_regions set_regions;
 	struct vm_memory_region *regions;
 	struct vm *target_vm;
-	uint32_t idx;
+	uint32_t idx, size;
+	int32_t ret = 0;
 
 	if (!is_vm0(vm)) {
 		pr_err("%s: Not coming from service vm", __func__);
@@ -521,25 +680,62 @@ int32_t hcall_set_vm_memory_regions(struct vm *vm, uint64_t param)
 	}
 
 	target_vm = get_vm_from_vmid(set_regions.vmid);
+	if (target_vm == NULL) {
+		return -EINVAL;
+	}
+
 	if (is_vm0(target_vm)) {
 		pr_err("%s: Targeting to service vm", __func__);
 		return -EFAULT;
 	}
 
-	idx = 0U;
-	/*TODO: use copy_from_gpa for this buffer page */
-	regions = GPA2HVA(vm, set_regions.regions_gpa);
-	while (idx < set_regions.mr_num) {
-		/* the force pointer change below is for back compatible
-		 * to struct vm_memory_region, it will be removed in the future
-		 */
-		int ret = local_set_vm_memory_region(vm, target_vm, &regions[idx]);
-		if (ret < 0) {
+	if (set_regions.mr_num == 0U) {
+		return 0;
+	}
+
+	/* the regions buffer is at most one page */
+	if (set_regions.mr_num >
+		(CPU_PAGE_SIZE / sizeof(struct vm_memory_region))) {
+		pr_err("%s: too many regions %d", __func__,
+				set_regions.mr_num);
+		return -EINVAL;
+	}
+
+	/* Take a private copy so that the SOS can't change the regions
+	 * between the check and the EPT update.
+	 */
+	size = set_regions.mr_num * sizeof(struct vm_memory_region);
+	regions = malloc(size);
+	if (regions == NULL) {
+		return -ENOMEM;
+	}
+
+	if (copy_from_gpa(vm, regions, set_regions.regions_gpa, size) != 0) {
+		pr_err("%s: Unable copy regions from vm\n", __func__);
+		free(regions);
+		return -EFAULT;
+	}
+
+	/* Check all the regions before touching the EPT */
+	for (idx = 0U; idx < set_regions.mr_num; idx++) {
+		ret = check_vm_memory_region(vm, target_vm, &regions[idx]);
+		if (ret != 0) {
+			free(regions);
 			return ret;
 		}
-		idx++;
 	}
-	return 0;
+
+	/* Apply all the regions, then flush the EPT once */
+	for (idx = 0U; idx < set_regions.mr_num; idx++) {
+		ret = apply_vm_memory_region(vm, target_vm, &regions[idx]);
+		if (ret < 0) {
+			break;
+		}
+	}
+	ept_request_flush(target_vm);
+
+	free(regions);
+	return ret;
 }
 
 static int32_t write_protect_page(struct vm *vm, struct wp_data *wp)
@@ -563,6 +759,9 @@ static int32_t write_protect_page(struct vm *vm, struct wp_data *wp)
 	prot_set = (wp->set != 0U) ? 0UL : EPT_WR;
 	prot_clr = (wp->set != 0U) ? EPT_WR : 0UL;
 
+	/* The dirty logging can't track the page any more */
+	dirty_log_mark(vm, wp->gpa, CPU_PAGE_SIZE);
+
 	return ept_mr_modify(vm, (uint64_t *)vm->arch_vm.nworld_eptp,
 		wp->gpa, CPU_PAGE_SIZE, prot_set, prot_clr);
 }
@@ -596,6 +795,71 @@ int32_t hcall_write_protect_page(struct vm *vm, uint16_t vmid, uint64_t wp_gpa)
 	return write_protect_page(target_vm, &wp);
 }
 
+int32_t hcall_set_dirty_log(struct vm *vm, uint16_t vmid, uint64_t param)
+{
+	struct dirty_log_ctrl ctrl;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if ((vm == NULL) || (target_vm == NULL)) {
+		return -EINVAL;
+	}
+
+	if (!is_vm0(vm)) {
+		pr_err("%s: Not coming from service vm", __func__);
+		return -EPERM;
+	}
+
+	if (is_vm0(target_vm)) {
+		pr_err("%s: Targeting to service vm", __func__);
+		return -EINVAL;
+	}
+
+	(void)memset((void *)&ctrl, 0U, sizeof(ctrl));
+
+	if (copy_from_gpa(vm, &ctrl, param, sizeof(ctrl)) != 0) {
+		pr_err("%s: Unable copy param from vm\n", __func__);
+		return -EFAULT;
+	}
+
+	if (ctrl.op == DIRTY_LOG_ENABLE) {
+		return dirty_log_enable(target_vm, ctrl.size);
+	} else if (ctrl.op == DIRTY_LOG_DISABLE) {
+		return dirty_log_disable(target_vm);
+	} else {
+		pr_err("%s: invalid op %d", __func__, ctrl.op);
+		return -EINVAL;
+	}
+}
+
+int32_t hcall_get_dirty_log(struct vm *vm, uint16_t vmid, uint64_t param)
+{
+	struct dirty_log_bitmap log;
+	struct vm *target_vm = get_vm_from_vmid(vmid);
+
+	if ((vm == NULL) || (target_vm == NULL)) {
+		return -EINVAL;
+	}
+
+	if (!is_vm0(vm)) {
+		pr_err("%s: Not coming from service vm", __func__);
+		return -EPERM;
+	}
+
+	if (is_vm0(target_vm)) {
+		pr_err("%s: Targeting to service vm", __func__);
+		return -EINVAL;
+	}
+
+	(void)memset((void *)&log, 0U, sizeof(log));
+
+	if (copy_from_gpa(vm, &log, param, sizeof(log)) != 0) {
+		pr_err("%s: Unable copy param from vm\n", __func__);
+		return -EFAULT;
+	}
+
+	return dirty_log_fetch(vm, target_vm, &log);
+}
+
 int32_t hcall_remap_pci_msix(struct vm *vm, uint16_t vmid, uint64_t param)
 {
 	int32_t ret = 0;
@@ -105,6 +105,187 @@ acrn_insert_request_wait(struct vcpu *vcpu, struct io_request *io_req)
 	return 0;
 }
 
+static bool doorbell_match(const struct acrn_doorbell *db, uint32_t flags,
+		uint64_t addr, uint64_t size, uint64_t value)
+{
+	uint64_t mask;
+
+	if (((db->flags & ACRN_DOORBELL_PIO) != flags) || (db->addr != addr)) {
+		return false;
+	}
+
+	if ((db->len != 0U) && ((uint64_t)db->len != size)) {
+		return false;
+	}
+
+	if ((db->flags & ACRN_DOORBELL_DATAMATCH) != 0U) {
+		mask = (size >= 8UL) ? ~0UL : ((1UL << (size * 8UL)) - 1UL);
+		if ((db->data & mask) != (value & mask)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Complete a guest write to a registered doorbell: mark the doorbell rung
+ * in the VM's doorbell page and raise the VHM upcall, without pausing the
+ * vcpu for the service OS.
+ *
+ * @return 0       - The write hit a doorbell and is completed.
+ * @return -ENODEV - No doorbell matches the request.
+ */
+int32_t acrn_doorbell_write(struct vcpu *vcpu, struct io_request *io_req)
+{
+	struct vm_doorbells *dbs = &vcpu->vm->sw.doorbells;
+	struct acrn_doorbell *db;
+	uint64_t addr, size, value;
+	uint32_t flags, i;
+	bool hit = false;
+
+	/* Unlocked peek, most VMs never register a doorbell */
+	if (dbs->num == 0U) {
+		return -ENODEV;
+	}
+
+	if (io_req->type == REQ_PORTIO) {
+		if (io_req->reqs.pio.direction != REQUEST_WRITE) {
+			return -ENODEV;
+		}
+		flags = ACRN_DOORBELL_PIO;
+		addr = io_req->reqs.pio.address;
+		size = io_req->reqs.pio.size;
+		value = (uint64_t)io_req->reqs.pio.value;
+	} else if (io_req->type == REQ_MMIO) {
+		if (io_req->reqs.mmio.direction != REQUEST_WRITE) {
+			return -ENODEV;
+		}
+		flags = 0U;
+		addr = io_req->reqs.mmio.address;
+		size = io_req->reqs.mmio.size;
+		value = io_req->reqs.mmio.value;
+	} else {
+		return -ENODEV;
+	}
+
+	spinlock_obtain(&dbs->lock);
+	if (dbs->page != NULL) {
+		for (i = 0U; i < dbs->num; i++) {
+			db = &dbs->entries[i];
+			if (doorbell_match(db, flags, addr, size, value)) {
+				bitmap_set_lock((uint16_t)(db->id & 0x3FU),
+					&dbs->page->pending[db->id >> 6U]);
+				hit = true;
+				break;
+			}
+		}
+	}
+	spinlock_release(&dbs->lock);
+
+	if (!hit) {
+		return -ENODEV;
+	}
+
+	dev_dbg(ACRN_DBG_IOREQUEST, "[vcpu_id=%hu] doorbell 0x%lx rung",
+		vcpu->vcpu_id, addr);
+
+	/* signal VHM */
+	fire_vhm_interrupt();
+	io_req->processed = REQ_STATE_COMPLETE;
+
+	return 0;
+}
+
+/**
+ * Register or remove a doorbell of a VM.
+ *
+ * @return 0       - Success.
+ * @return -EINVAL - Invalid id, width or flags, or no such doorbell.
+ * @return -EEXIST - The id or the trigger condition is already registered.
+ * @return -ENOSPC - No free doorbell entry.
+ */
+int32_t acrn_set_doorbell(struct vm *vm, const struct acrn_doorbell *db)
+{
+	struct vm_doorbells *dbs = &vm->sw.doorbells;
+	struct acrn_doorbell *entry;
+	uint32_t flags, i;
+	int32_t ret = 0;
+
+	if (db->id >= ACRN_DOORBELL_MAX) {
+		return -EINVAL;
+	}
+
+	spinlock_obtain(&dbs->lock);
+	if ((db->flags & ACRN_DOORBELL_DEASSIGN) != 0U) {
+		for (i = 0U; i < dbs->num; i++) {
+			if (dbs->entries[i].id == db->id) {
+				break;
+			}
+		}
+		if (i == dbs->num) {
+			ret = -EINVAL;
+		} else {
+			/* keep the entries packed, the order does not matter */
+			dbs->num--;
+			dbs->entries[i] = dbs->entries[dbs->num];
+		}
+		spinlock_release(&dbs->lock);
+		return ret;
+	}
+
+	if ((db->len != 0U) && (db->len != 1U) && (db->len != 2U) &&
+			(db->len != 4U) && (db->len != 8U)) {
+		ret = -EINVAL;
+	} else if ((db->flags & ~(ACRN_DOORBELL_PIO |
+			ACRN_DOORBELL_DATAMATCH)) != 0U) {
+		ret = -EINVAL;
+	} else if (dbs->num >= ACRN_DOORBELL_MAX) {
+		ret = -ENOSPC;
+	} else {
+		for (i = 0U; i < dbs->num; i++) {
+			entry = &dbs->entries[i];
+			if (entry->id == db->id) {
+				ret = -EEXIST;
+				break;
+			}
+			/* writes to one address must not match two doorbells */
+			flags = entry->flags & db->flags;
+			if ((entry->addr == db->addr) &&
+				(((entry->flags ^ db->flags) &
+				  ACRN_DOORBELL_PIO) == 0U) &&
+				(((flags & ACRN_DOORBELL_DATAMATCH) == 0U) ||
+				 (entry->data == db->data))) {
+				ret = -EEXIST;
+				break;
+			}
+		}
+		if (ret == 0) {
+			dbs->entries[dbs->num] = *db;
+			dbs->num++;
+		}
+	}
+	spinlock_release(&dbs->lock);
+
+	return ret;
+}
+
+/**
+ * Set the page reporting rung doorbells of a VM, NULL stops doorbell
+ * delivery and drops all registered doorbells.
+ */
+void acrn_set_doorbell_page(struct vm *vm, struct acrn_doorbell_page *page)
+{
+	struct vm_doorbells *dbs = &vm->sw.doorbells;
+
+	spinlock_obtain(&dbs->lock);
+	dbs->page = page;
+	if (page == NULL) {
+		dbs->num = 0U;
+	}
+	spinlock_release(&dbs->lock);
+}
+
 #ifdef HV_DEBUG
 static void local_get_req_info_(struct vhm_request *req, int *id, char *type,
 	char *state, char *dir, uint64_t *addr, uint64_t *val)
@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2018 Intel Corporation. All rights reserved.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef DIRTY_LOG_H_
+#define DIRTY_LOG_H_
+
+/* Largest guest physical space that can be logged, one PML4 entry */
+#define DIRTY_LOG_MAX_SIZE	(1UL << 39U)
+
+int dirty_log_enable(struct vm *vm, uint64_t size);
+int dirty_log_disable(struct vm *vm);
+int dirty_log_fetch(struct vm *vm, struct vm *target_vm,
+		const struct dirty_log_bitmap *param);
+void dirty_log_mark(struct vm *vm, uint64_t gpa, uint64_t size);
+void dirty_log_free(struct vm *vm);
+
+void dirty_log_init_vmcs(struct vcpu *vcpu);
+void dirty_log_handle_request(struct vcpu *vcpu);
+void dirty_log_flush_pml(struct vcpu *vcpu);
+bool dirty_log_handle_wp_fault(struct vcpu *vcpu, uint64_t gpa);
+int pml_full_vmexit_handler(struct vcpu *vcpu);
+
+#endif /* DIRTY_LOG_H_ */
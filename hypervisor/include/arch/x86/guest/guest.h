@@ -43,6 +43,7 @@
 #define ACRN_REQUEST_EPT_FLUSH      5U
 #define ACRN_REQUEST_TRP_FAULT      6U
 #define ACRN_REQUEST_VPID_FLUSH    7U /* flush vpid tlb */
+#define ACRN_REQUEST_DIRTY_LOG     8U /* dirty page logging on/off */
 
 #define E820_MAX_ENTRIES    32U
 
@@ -226,6 +226,10 @@ struct vcpu_arch {
 
 	/* per vcpu lapic */
 	void *vlapic;
+
+	/* page modification log buffer, and whether PML is on in the VMCS */
+	uint64_t *pml_buf;
+	bool pml_enabled;
 };
 
 struct vm;
@@ -44,6 +44,8 @@ void	vioapic_reset(struct vioapic *vioapic);
 int	vioapic_assert_irq(struct vm *vm, uint32_t irq);
 int	vioapic_deassert_irq(struct vm *vm, uint32_t irq);
 int	vioapic_pulse_irq(struct vm *vm, uint32_t irq);
+int	vioapic_notify_irq(struct vm *vm, uint32_t irq);
+void	vioapic_set_irqline_page(struct vm *vm, struct acrn_irqline_page *page);
 void	vioapic_update_tmr(struct vcpu *vcpu);
 
 void	vioapic_mmio_write(struct vm *vm, uint64_t gpa, uint32_t wval);
@@ -55,6 +55,8 @@ struct vm_sw_info {
 	struct sw_linux linux_info;
 	/* HVA to IO shared page */
 	void *io_shared_page;
+	/* Doorbells rung without going through the IO shared page */
+	struct vm_doorbells doorbells;
 };
 
 struct vm_pm_info {
@@ -84,6 +86,35 @@ enum vm_state {
 	VM_STATE_UNKNOWN
 };
 
+/* One contiguous range of the HPA->GPA reverse map */
+struct m2p_extent {
+	uint64_t hpa;
+	uint64_t gpa;
+	uint64_t size;
+};
+
+/* Reverse map of a VM, extents sorted by hpa and never overlapping */
+struct m2p_map {
+	struct m2p_extent *extents;
+	uint32_t num;		/* Number of extents in use */
+	uint32_t capacity;	/* Number of extents allocated */
+	spinlock_t lock;	/* Protects the extents array */
+};
+
+/*
+ * Dirty page logging state of a VM, one bit per 4K page of [0, size).
+ * The bitmap is split in pages, see dirty_log_word().
+ */
+struct dirty_log {
+	uint64_t **bitmap;	/* Bitmap pages */
+	uint32_t nr_pages;	/* Number of bitmap pages */
+	uint64_t size;		/* Size of the logged guest physical space */
+	uint32_t nr_split;	/* Page tables added to split large pages */
+	bool enabled;
+	bool use_pml;		/* PML, or write protection if not supported */
+	spinlock_t lock;	/* Protects the bitmap and the state above */
+};
+
 struct vm_arch {
 	uint64_t guest_init_pml4;/* Guest init pml4 */
 	/* EPT hierarchy for Normal World */
@@ -93,7 +124,8 @@ struct vm_arch {
 	 * but Normal World can not access Secure World's memory.
 	 */
 	void *sworld_eptp;
-	void *m2p;		/* machine address to guest physical address */
+	struct m2p_map m2p;	/* machine address to guest physical address */
+	struct dirty_log dirty_log;	/* dirty pages of the normal world */
 	void *tmp_pg_array;	/* Page array for tmp guest paging struct */
 	void *iobitmap[2];/* IO bitmap page array base address for this VM */
 	void *msr_bitmap;	/* MSR bitmap page base address for this VM */
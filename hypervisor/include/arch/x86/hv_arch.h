@@ -37,6 +37,7 @@
 #include <vioapic.h>
 #include <guest.h>
 #include <vmexit.h>
+#include <dirty_log.h>
 #include <cpufeatures.h>
 
 #endif /* HV_ARCH_H */
@@ -90,6 +90,14 @@ struct vm_io_handler {
 	struct vm_io_handler_desc desc;
 };
 
+/* Doorbells of a VM, completed in the hypervisor without an I/O request */
+struct vm_doorbells {
+	struct acrn_doorbell entries[ACRN_DOORBELL_MAX];
+	uint32_t num;				/* Number of entries in use */
+	struct acrn_doorbell_page *page;	/* Rung doorbells, in SOS memory */
+	spinlock_t lock;			/* Protects the state above */
+};
+
 #define IO_ATTR_R               0U
 #define IO_ATTR_RW              1U
 #define IO_ATTR_NO_ACCESS       2U
@@ -129,5 +137,8 @@ int32_t emulate_io(struct vcpu *vcpu, struct io_request *io_req);
 void emulate_io_post(struct vcpu *vcpu);
 
 int32_t acrn_insert_request_wait(struct vcpu *vcpu, struct io_request *io_req);
+int32_t acrn_doorbell_write(struct vcpu *vcpu, struct io_request *io_req);
+int32_t acrn_set_doorbell(struct vm *vm, const struct acrn_doorbell *db);
+void acrn_set_doorbell_page(struct vm *vm, struct acrn_doorbell_page *page);
 
 #endif /* IOREQ_H */
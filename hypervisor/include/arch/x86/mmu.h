@@ -225,8 +225,6 @@ struct mem_map_params {
 	enum _page_table_type page_table_type;
 	/* used HVA->HPA for HOST, used GPA->HPA for EPT */
 	void *pml4_base;
-	/* used HPA->HVA for HOST, used HPA->GPA for EPT */
-	void *pml4_inverted;
 };
 struct entry_params {
 	uint32_t entry_level;
@@ -319,6 +317,8 @@ int mmu_modify_or_del(uint64_t *pml4_page,
 		uint64_t vaddr_base, uint64_t size,
 		uint64_t prot_set, uint64_t prot_clr,
 		enum _page_table_type ptt, uint32_t type);
+int mmu_merge_large_page(uint64_t *pml4_page, uint64_t vaddr,
+		uint64_t page_size, enum _page_table_type ptt, void **table);
 int check_vmx_mmu_cap(void);
 uint16_t allocate_vpid(void);
 void flush_vpid_single(uint16_t vpid);
@@ -326,7 +326,7 @@ void flush_vpid_global(void);
 void invept(struct vcpu *vcpu);
 bool check_continuous_hpa(struct vm *vm, uint64_t gpa_arg, uint64_t size_arg);
 int obtain_last_page_table_entry(struct mem_map_params *map_params,
-		struct entry_params *entry, void *addr, bool direct);
+		struct entry_params *entry, void *addr);
 uint64_t *lookup_address(uint64_t *pml4_page, uint64_t addr,
 		uint64_t *pg_size, enum _page_table_type ptt);
 
@@ -382,11 +382,19 @@ void    destroy_ept(struct vm *vm);
 uint64_t  gpa2hpa(struct vm *vm, uint64_t gpa);
 uint64_t  local_gpa2hpa(struct vm *vm, uint64_t gpa, uint32_t *size);
 uint64_t  hpa2gpa(struct vm *vm, uint64_t hpa);
+int ept_m2p_add(struct vm *vm, uint64_t hpa, uint64_t gpa, uint64_t size);
+int ept_m2p_del(struct vm *vm, uint64_t gpa, uint64_t size);
+void ept_request_flush(struct vm *vm);
+uint64_t ept_pointer(struct vm *vm, void *pml4_page);
+int local_ept_mr_add(struct vm *vm, uint64_t hpa_arg,
+	uint64_t gpa_arg, uint64_t size, uint32_t prot_arg);
 int ept_mr_add(struct vm *vm, uint64_t hpa_arg,
 	uint64_t gpa_arg, uint64_t size, uint32_t prot_arg);
 int ept_mr_modify(struct vm *vm, uint64_t *pml4_page,
 	uint64_t gpa, uint64_t size,
 	uint64_t prot_set, uint64_t prot_clr);
+int local_ept_mr_del(struct vm *vm, uint64_t *pml4_page,
+	uint64_t gpa, uint64_t size);
 int ept_mr_del(struct vm *vm, uint64_t *pml4_page,
 	uint64_t gpa, uint64_t size);
 
@@ -38,6 +38,8 @@
 #define EPT_WP			(5UL << EPT_MT_SHIFT)
 #define EPT_WB			(6UL << EPT_MT_SHIFT)
 #define EPT_MT_MASK		(7UL << EPT_MT_SHIFT)
+#define EPT_ACCESSED		(1UL << 8U)
+#define EPT_DIRTY		(1UL << 9U)
 #define EPT_SNOOP_CTRL		(1UL << 11U)
 #define EPT_VE			(1UL << 63U)
 
@@ -19,6 +19,7 @@
 #define VMX_GUEST_LDTR_SEL    0x0000080cU
 #define VMX_GUEST_TR_SEL    0x0000080eU
 #define VMX_GUEST_INTR_STATUS 0x00000810U
+#define VMX_GUEST_PML_INDEX   0x00000812U
 /* 16-bit host-state fields */
 #define VMX_HOST_ES_SEL     0x00000c00U
 #define VMX_HOST_CS_SEL     0x00000c02U
@@ -42,6 +43,8 @@
 #define VMX_ENTRY_MSR_LOAD_ADDR_HIGH 0x0000200bU
 #define VMX_EXECUTIVE_VMCS_PTR_FULL     0x0000200cU
 #define VMX_EXECUTIVE_VMCS_PTR_HIGH     0x0000200dU
+#define VMX_PML_ADDR_FULL      0x0000200eU
+#define VMX_PML_ADDR_HIGH      0x0000200fU
 #define VMX_TSC_OFFSET_FULL    0x00002010U
 #define VMX_TSC_OFFSET_HIGH    0x00002011U
 #define VMX_VIRTUAL_APIC_PAGE_ADDR_FULL 0x00002012U
@@ -306,6 +309,7 @@
 #define VMX_PROCBASED_CTLS2_VM_FUNCS   (1U<<13)
 #define VMX_PROCBASED_CTLS2_VMCS_SHADW (1U<<14)
 #define VMX_PROCBASED_CTLS2_RDSEED     (1U<<16)
+#define VMX_PROCBASED_CTLS2_PML        (1U<<17)
 #define VMX_PROCBASED_CTLS2_EPT_VE     (1U<<18)
 #define VMX_PROCBASED_CTLS2_XSVE_XRSTR (1U<<20)
 
@@ -322,6 +326,9 @@
 #define VMX_EPT_INVEPT_SINGLE_CONTEXT	(1U << 25)
 #define VMX_EPT_INVEPT_GLOBAL_CONTEXT	(1U << 26)
 
+/* EPTP: enable accessed and dirty flags in EPT entries */
+#define VMX_EPTP_AD_ENABLE		(1UL << 6U)
+
 #define VMX_MIN_NR_VPID			1U
 #define VMX_MAX_NR_VPID			(1U << 5)
 
@@ -177,6 +177,36 @@ int32_t hcall_deassert_irqline(struct vm *vm, uint16_t vmid, uint64_t param);
  */
 int32_t hcall_pulse_irqline(struct vm *vm, uint16_t vmid, uint64_t param);
 
+/**
+ * @brief set up the shared IRQ line state page
+ *
+ * Share a page holding the IOAPIC line levels of a UOS with the device model
+ * and the hypervisor, see struct acrn_irqline_page. Level-triggered lines
+ * kept in the page are re-delivered at EOI while they stay set.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_set_irqline_page
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_irqline_page(struct vm *vm, uint16_t vmid, uint64_t param);
+
+/**
+ * @brief notify a change of a shared IRQ line
+ *
+ * Deliver an interrupt for an IOAPIC line whose level is kept in the shared
+ * IRQ line state page, or pulse it if it is edge-triggered.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to struct acrn_irqline
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_notify_irqline(struct vm *vm, uint16_t vmid, uint64_t param);
+
 /**
  * @brief inject MSI interrupt
  *
@@ -219,6 +249,37 @@ int32_t hcall_set_ioreq_buffer(struct vm *vm, uint16_t vmid, uint64_t param);
  */
 int32_t hcall_notify_ioreq_finish(uint16_t vmid, uint16_t vcpu_id);
 
+/**
+ * @brief set the doorbell page of a VM
+ *
+ * Set the page where the hypervisor reports the doorbells rung by a VM.
+ * Setting it to 0 stops doorbell delivery and drops all doorbells.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_set_doorbell_page
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_doorbell_page(struct vm *vm, uint16_t vmid, uint64_t param);
+
+/**
+ * @brief register or remove a doorbell of a VM
+ *
+ * A guest write matching a doorbell is completed by the hypervisor
+ * without sending an ioreq. The doorbell id is set in the doorbell
+ * page and the VHM upcall is raised instead.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct acrn_doorbell
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_doorbell(struct vm *vm, uint16_t vmid, uint64_t param);
+
 /**
  * @brief setup ept memory mapping
  *
@@ -234,6 +295,9 @@ int32_t hcall_set_vm_memory_region(struct vm *vm, uint16_t vmid, uint64_t param)
 /**
  * @brief setup ept memory mapping for multi regions
  *
+ * All the regions are checked before any of them is applied, and a
+ * single EPT flush is requested once they are all applied.
+ *
  * @param vm Pointer to VM data structure
  * @param param guest physical address. This gpa points to
  *              struct set_memmaps
@@ -254,6 +318,35 @@ int32_t hcall_set_vm_memory_regions(struct vm *vm, uint64_t param);
  */
 int32_t hcall_write_protect_page(struct vm *vm, uint16_t vmid, uint64_t wp_gpa);
 
+/**
+ * @brief start or stop dirty page logging of a VM
+ *
+ * PML is used to log the dirty pages when the CPU supports it, write
+ * protection otherwise. All the pages are clean once logging is on.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct dirty_log_ctrl
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_dirty_log(struct vm *vm, uint16_t vmid, uint64_t param);
+
+/**
+ * @brief fetch and clear the dirty page bitmap of a VM
+ *
+ * The pages reported dirty are clean again when the hypercall returns.
+ *
+ * @param vm Pointer to VM data structure
+ * @param vmid ID of the VM
+ * @param param guest physical address. This gpa points to
+ *              struct dirty_log_bitmap
+ *
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_get_dirty_log(struct vm *vm, uint16_t vmid, uint64_t param);
+
 /**
  * @brief remap PCI MSI interrupt
  *
@@ -19,9 +19,13 @@
 #define EFAULT		14
 /** Indicates that target is busy. */
 #define EBUSY		16
+/** Indicates that the object already exists. */
+#define EEXIST		17
 /** Indicates that no such dev. */
 #define ENODEV		19
 /** Indicates that argument is not valid. */
 #define EINVAL		22
+/** Indicates that no space is left. */
+#define ENOSPC		28
 
 #endif /* ERRNO_H */
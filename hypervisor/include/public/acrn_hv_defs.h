@@ -43,11 +43,15 @@
 #define HC_DEASSERT_IRQLINE         BASE_HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x01UL)
 #define HC_PULSE_IRQLINE            BASE_HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x02UL)
 #define HC_INJECT_MSI               BASE_HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x03UL)
+#define HC_SET_IRQLINE_PAGE         BASE_HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x04UL)
+#define HC_NOTIFY_IRQLINE           BASE_HC_ID(HC_ID, HC_ID_IRQ_BASE + 0x05UL)
 
 /* DM ioreq management */
 #define HC_ID_IOREQ_BASE            0x30UL
 #define HC_SET_IOREQ_BUFFER         BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x00UL)
 #define HC_NOTIFY_REQUEST_FINISH    BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x01UL)
+#define HC_SET_DOORBELL_PAGE        BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x02UL)
+#define HC_SET_DOORBELL             BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x03UL)
 
 /* Guest memory management */
 #define HC_ID_MEM_BASE              0x40UL
@@ -55,6 +59,8 @@
 #define HC_VM_GPA2HPA               BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x01UL)
 #define HC_VM_SET_MEMORY_REGIONS    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x02UL)
 #define HC_VM_WRITE_PROTECT_PAGE    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x03UL)
+#define HC_VM_SET_DIRTY_LOG         BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x04UL)
+#define HC_VM_GET_DIRTY_LOG         BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x05UL)
 #define HC_VM_SET_MEMORY_REGION     BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x00UL)
 #define HC_VM_GPA2HPA               BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x01UL)
 #define HC_VM_SET_MEMORY_REGIONS    BASE_HC_ID(HC_ID, HC_ID_MEM_BASE + 0x02UL)
@@ -172,6 +178,45 @@ struct wp_data {
 	uint64_t gpa;
 } __aligned(8);
 
+/**
+ * @brief Info to start or stop dirty page logging of a VM
+ *
+ * the parameter for HC_VM_SET_DIRTY_LOG hypercall
+ */
+struct dirty_log_ctrl {
+#define DIRTY_LOG_DISABLE	0U
+#define DIRTY_LOG_ENABLE	1U
+	/** DIRTY_LOG_ENABLE or DIRTY_LOG_DISABLE */
+	uint32_t op;
+
+	/** Reserved */
+	uint32_t reserved;
+
+	/** size of the guest physical space logged from gpa 0, must be
+	 *  page aligned. Not used by DIRTY_LOG_DISABLE.
+	 */
+	uint64_t size;
+} __aligned(8);
+
+/**
+ * @brief Info to fetch and clear the dirty page bitmap of a VM
+ *
+ * the parameter for HC_VM_GET_DIRTY_LOG hypercall
+ */
+struct dirty_log_bitmap {
+	/** the first guest physical address, aligned to 64 pages */
+	uint64_t gpa;
+
+	/** size of the guest physical range, must be page aligned */
+	uint64_t size;
+
+	/** VM0's guest physical address of the bitmap buffer, one bit per
+	 *  page: bit n of the uint64_t at index m is page (m * 64 + n)
+	 *  from gpa.
+	 */
+	uint64_t bitmap_gpa;
+} __aligned(8);
+
 /**
  * Setup parameter for share buffer, used for HC_SETUP_SBUF hypercall
  */
@@ -23,7 +23,8 @@ struct mngr_msg {
 	unsigned long timestamp;
 	union {
 		/* ack of DM_STOP, DM_SUSPEND, DM_RESUME, DM_PAUSE, DM_CONTINUE,
-		   ACRND_TIMER, ACRND_STOP, ACRND_RESUME, RTC_TIMER */
+		   DM_BLKSTATS, DM_BALLOON, ACRND_TIMER, ACRND_STOP,
+		   ACRND_RESUME, RTC_TIMER */
 		int err;
 
 		/* ack of WAKEUP_REASON */
@@ -56,6 +57,17 @@ struct mngr_msg {
 			unsigned timeout;
 		} acrnd_resume;
 
+		/* req of DM_BLKSTATS */
+		struct req_dm_blkstats {
+			char disk[16];	/* empty for all disks */
+			int reset;	/* restart the counters */
+		} dm_blkstats;
+
+		/* req of DM_BALLOON */
+		struct req_dm_balloon {
+			int mb;		/* target size, < 0 to query */
+		} dm_balloon;
+
 		/* req of RTC_TIMER */
 		struct req_rtc_timer {
 			char vmname[VMNAME_LEN];
@@ -80,11 +92,20 @@ enum dm_msgid {
 	DM_PAUSE,		/* Freeze this virtual machine */
 	DM_CONTINUE,		/* Unfreeze this virtual machine */
 	DM_QUERY,		/* Ask power state of this UOS */
+	DM_BLKSTATS,		/* Dump block device statistics */
+	DM_BALLOON,		/* Set or get the memory balloon size */
 	DM_MAX,
 };
 
 /* DM handled message req/ack pairs */
 
+/* DM_BLKSTATS: the report is written here, ack.data.err is the number of
+ * disks reported or < 0 on error */
+#define DM_BLKSTATS_PATH	"/run/acrn/%s.blkstats"
+
+/* DM_BALLOON: ack.data.err is the balloon size in MB, or < 0 if the VM
+ * has no balloon */
+
 /* Acrnd handled message event types */
 enum acrnd_msgid {
 	/* DM -> Acrnd */
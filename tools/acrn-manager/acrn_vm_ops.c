@@ -392,6 +392,74 @@ int suspend_vm(char *vmname)
 	return ack.data.err;
 }
 
+int blkstats_vm(char *vmname, const char *disk, int reset)
+{
+	struct mngr_msg req;
+	struct mngr_msg ack;
+	char path[128];
+	char buf[256];
+	FILE *f;
+
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = DM_BLKSTATS;
+	req.timestamp = time(NULL);
+	memset(&req.data.dm_blkstats, 0, sizeof(req.data.dm_blkstats));
+	if (disk)
+		strncpy(req.data.dm_blkstats.disk, disk,
+			sizeof(req.data.dm_blkstats.disk) - 1);
+	req.data.dm_blkstats.reset = reset;
+
+	ack.data.err = -1;
+	send_msg(vmname, &req, &ack);
+	if (ack.data.err < 0) {
+		printf("Unable to get block stats of vm. errno(%d)\n",
+			ack.data.err);
+		return ack.data.err;
+	}
+	if (ack.data.err == 0) {
+		printf("%s: no such disk %s\n", vmname, disk ? disk : "");
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), DM_BLKSTATS_PATH, vmname);
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(buf, sizeof(buf), f))
+		fputs(buf, stdout);
+	fclose(f);
+
+	return 0;
+}
+
+int balloon_vm(char *vmname, int mb)
+{
+	struct mngr_msg req;
+	struct mngr_msg ack;
+
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = DM_BALLOON;
+	req.timestamp = time(NULL);
+	req.data.dm_balloon.mb = mb;
+
+	ack.data.err = -1;
+	send_msg(vmname, &req, &ack);
+	if (ack.data.err < 0) {
+		printf("%s has no memory balloon\n", vmname);
+		return ack.data.err;
+	}
+
+	if (mb >= 0)
+		printf("%s: balloon %d MB, target %d MB\n", vmname,
+			ack.data.err, mb);
+	else
+		printf("%s: balloon %d MB\n", vmname, ack.data.err);
+
+	return 0;
+}
+
 int resume_vm(char *vmname)
 {
 	struct mngr_msg req;
@@ -15,6 +15,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -37,6 +38,8 @@
 #define SUSPEND_DESC   "Switch virtual machine to suspend state"
 #define RESUME_DESC    "Resume virtual machine from suspend state"
 #define RESET_DESC     "Stop and then start virtual machine VM_NAME"
+#define BLKSTATS_DESC  "Show block I/O statistics of virtual machine VM_NAME"
+#define BALLOON_DESC   "Show or set the memory balloon size of VM_NAME"
 
 struct acrnctl_cmd {
 	const char *cmd;
@@ -517,6 +520,63 @@ static int acrnctl_do_reset(int argc, char *argv[])
 	return 0;
 }
 
+static int acrnctl_do_blkstats(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+	char *disk = NULL;
+	int i, reset = 0;
+
+	s = vmmngr_find(argv[1]);
+	if (!s) {
+		printf("Can't find vm %s\n", argv[1]);
+		return -1;
+	}
+
+	if (s->state != VM_STARTED && s->state != VM_PAUSED) {
+		printf("%s current state %s, no block stats\n",
+			argv[1], state_str[s->state]);
+		return -1;
+	}
+
+	for (i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "-r"))
+			reset = 1;
+		else
+			disk = argv[i];
+	}
+
+	return blkstats_vm(argv[1], disk, reset);
+}
+
+static int acrnctl_do_balloon(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+	char *end;
+	long mb = -1;
+
+	s = vmmngr_find(argv[1]);
+	if (!s) {
+		printf("Can't find vm %s\n", argv[1]);
+		return -1;
+	}
+
+	if (s->state != VM_STARTED && s->state != VM_PAUSED) {
+		printf("%s current state %s, no balloon\n",
+			argv[1], state_str[s->state]);
+		return -1;
+	}
+
+	if (argc > 2) {
+		mb = strtol(argv[2], &end, 10);
+		if (*end || mb < 0 || mb > INT_MAX) {
+			printf("Invalid balloon size %s\n", argv[2]);
+			return -1;
+		}
+	}
+
+	return balloon_vm(argv[1], mb);
+}
+
 /* Default args validation function */
 int df_valid_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 {
@@ -554,6 +614,34 @@ static int valid_start_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 	return 0;
 }
 
+static int valid_blkstats_args(struct acrnctl_cmd *cmd, int argc,
+			       char *argv[])
+{
+	char df_opt[32] = "VM_NAME [DISK] [-r]";
+
+	if (argc < 2 || argc > 4 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		printf("\tDISK is slot:func of the device, -r resets counters\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int valid_balloon_args(struct acrnctl_cmd *cmd, int argc,
+			      char *argv[])
+{
+	char df_opt[32] = "VM_NAME [SIZE_MB]";
+
+	if (argc < 2 || argc > 3 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		printf("\tSIZE_MB is the memory the VM should give back\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int valid_list_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 {
 	if (argc != 1) {
@@ -575,6 +663,9 @@ struct acrnctl_cmd acmds[] = {
 	ACMD("suspend", acrnctl_do_suspend, SUSPEND_DESC, df_valid_args),
 	ACMD("resume", acrnctl_do_resume, RESUME_DESC, df_valid_args),
 	ACMD("reset", acrnctl_do_reset, RESET_DESC, df_valid_args),
+	ACMD("blkstats", acrnctl_do_blkstats, BLKSTATS_DESC,
+	     valid_blkstats_args),
+	ACMD("balloon", acrnctl_do_balloon, BALLOON_DESC, valid_balloon_args),
 };
 
 #define NCMD	(sizeof(acmds)/sizeof(struct acrnctl_cmd))
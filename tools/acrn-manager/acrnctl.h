@@ -57,5 +57,7 @@ int pause_vm(char *vmname);
 int continue_vm(char *vmname);
 int suspend_vm(char *vmname);
 int resume_vm(char *vmname);
+int blkstats_vm(char *vmname, const char *disk, int reset);
+int balloon_vm(char *vmname, int mb);
 
 #endif				/* _ACRNCTL_H_ */